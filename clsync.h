@@ -61,9 +61,47 @@ enum eventinfo_flags {
 	EVIF_NONE		= 0x00000000,	// No modifier
 	EVIF_RECURSIVELY	= 0x00000001,	// Need to be synced recursively
 	EVIF_CONTENTRECURSIVELY	= 0x00000002,	// Affects recursively only on content of this dir
+	EVIF_SYNCFAILED		= 0x40000000,	// Set by the sync-handler: the record is failed to be synced (only it is retried)
 };
 typedef enum eventinfo_flags eventinfo_flags_t;
 
+/*
+ * The protocol of "--mode=coprocess". The sync-handler is started once and
+ * gets a bidirectional stream socket by number in the environment variable
+ * CLSYNC_COPROCESS_FD. Integers are in the host byte order.
+ *
+ * clsync -> handler: api_coprocess_batch followed by "n" records, every
+ *                    record is api_coprocess_record followed by "path_len"
+ *                    bytes of the path (without the terminating zero).
+ * handler -> clsync: api_coprocess_ack for every batch followed by "failed_n"
+ *                    uint32_t numbers (from zero) of records failed to be
+ *                    synced. Only they are retried on non-zero exitcode.
+ *
+ * EOF on the socket means clsync is exiting.
+ */
+#define CLSYNC_COPROCESS_FD_ENV	"CLSYNC_COPROCESS_FD"
+#define CLSYNC_COPROCESS_MAGIC	0x636c7331	/* "cls1" */
+
+struct api_coprocess_batch {
+	uint32_t	 magic;		// CLSYNC_COPROCESS_MAGIC
+	uint32_t	 seqid;		// to be returned in api_coprocess_ack
+	uint32_t	 n;		// number of records
+};
+
+struct api_coprocess_record {
+	uint32_t	 evmask;
+	uint32_t	 flags;
+	uint32_t	 objtype_old;
+	uint32_t	 objtype_new;
+	uint32_t	 path_len;
+};
+
+struct api_coprocess_ack {
+	uint32_t	 seqid;
+	uint32_t	 exitcode;	// like the exitcode of a sync-handler: 0 is success
+	uint32_t	 failed_n;	// 0 means the whole batch (if exitcode is non-zero)
+};
+
 /**
  * @brief 			Writes the list to list-file for "--include-from" option of rsync using array of api_eventinfo_t
  * 
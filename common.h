@@ -60,6 +60,7 @@
 #include <sys/wait.h>
 #include <fts.h>
 #include <sys/time.h>
+#include <time.h>
 #include <dirent.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
@@ -129,7 +130,22 @@
 #define TOSTR(a) # a
 #define XTOSTR(a) TOSTR(a)
 
-#define COLLECTDELAY_INSTANT ((unsigned int)~0)
+#define COLLECTDELAY_INSTANT ((unsigned long)~0)
+
+// Milliseconds since an arbitrary point (not affected by system time changes)
+static inline uint64_t clock_monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+// The same as sleep(), but in milliseconds. Interruptible by signals like sleep().
+static inline int sleep_ms(unsigned long ms) {
+	struct timespec ts;
+	ts.tv_sec  =  ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	return nanosleep(&ts, NULL);
+}
 
 
 #define MSG_SECURITY_PROBLEM(a) "Security problem: "a". Don't use this application until the bug will be fixed. Report about the problem to: "AUTHOR
@@ -204,6 +220,8 @@ struct eventinfo {
 	int		wd;
 	size_t		fsize;
 	uint32_t	flags;
+	char		statpending;	// lstat() is postponed till sync_prequeue_unload()
+	int		try_n;		// failed syncs of the event (see sync_retry())
 };
 typedef struct eventinfo eventinfo_t;
 
@@ -219,6 +237,7 @@ struct dosync_arg {
 	int evcount;
 	char excf_path[PATH_MAX+1];
 	char outf_path[PATH_MAX+1];
+	char failf_path[PATH_MAX+1];
 	FILE *outf;
 	ctx_t *ctx_p;
 	struct indexes *indexes_p;
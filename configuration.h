@@ -48,10 +48,10 @@
 #	endif
 #endif
 #define DEFAULT_RULES_PERM		RA_ALL
-#define DEFAULT_COLLECTDELAY		30
+#define DEFAULT_COLLECTDELAY		(30 * 1000)	/* in milliseconds */
 #define DEFAULT_SYNCDELAY		(DEFAULT_COLLECTDELAY)
 #define DEFAULT_BFILETHRESHOLD		(128 * 1024 * 1024)
-#define DEFAULT_BFILECOLLECTDELAY	1800
+#define DEFAULT_BFILECOLLECTDELAY	(1800 * 1000)	/* in milliseconds */
 #define DEFAULT_LABEL			"nolabel"
 #define DEFAULT_RSYNCINCLUDELINESLIMIT	20000
 #define DEFAULT_SYNCTIMEOUT		(3600 * 24)
@@ -63,16 +63,35 @@
 #define DEFAULT_CLUSTERSDLMAX		32
 #define DEFAULT_CONFIG_BLOCK		"default"
 #define DEFAULT_RETRIES			1
+#define DEFAULT_SYNCWORKERS		16
 #define DEFAULT_VERBOSE			3
 #define DEFAULT_DUMPDIR			"/tmp/clsync-dump-%label%"
 #define DEFAULT_DETACH_IPC		1
 
-#define FANOTIFY_FLAGS			(FAN_CLOEXEC|FAN_UNLIMITED_QUEUE|FAN_UNLIMITED_MARKS)
+#define FANOTIFY_FLAGS			(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK|FAN_REPORT_DFID_NAME|FAN_UNLIMITED_QUEUE|FAN_UNLIMITED_MARKS)
 #define FANOTIFY_EVFLAGS		(O_LARGEFILE|O_RDONLY|O_CLOEXEC)
 
-#define FANOTIFY_MARKMASK		(FAN_OPEN|FAN_MODIFY|FAN_CLOSE|FAN_ONDIR|FAN_EVENT_ON_CHILD)
+#define FANOTIFY_MARKMASK		(FAN_ATTRIB|FAN_CLOSE_WRITE|FAN_CREATE|FAN_DELETE|FAN_DELETE_SELF|FAN_MOVE_SELF|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_MODIFY|FAN_ONDIR)
+#define FANOTIFY_MARKMASK_MOUNT		(FAN_CLOSE_WRITE|FAN_MODIFY)	/* mount marks cannot report directory entry events */
 
-#define INOTIFY_FLAGS			(IN_CLOEXEC)
+#define FANOTIFY_BUFSIZE		(1<<18) /* 256 KiB */
+
+#define INOTIFY_FLAGS			(IN_CLOEXEC|IN_NONBLOCK)
+
+#define INOTIFY_BUFSIZE			(1<<18) /* 256 KiB */
+#define INOTIFY_STATS_INTERVAL		(10 * 1000) /* in milliseconds */
+#define INOTIFY_RINGSIZE		(1<<24) /* 16 MiB, must be a power of 2; see "--reader-thread" */
+
+#define IOURING_ENTRIES			256	/* submission queue size for batched statx() */
+
+#define RULES_CACHE_MAX			(1<<18)	/* directories with cached rule decisions, the cache is dropped on overflow */
+#define RULES_CACHE_SLOTS		4	/* (actions, file type) pairs cached per directory */
+#define RULES_CACHE_STATS_INTERVAL	(1<<20)	/* in lookups */
+
+#define WALKER_BUFSIZE			(1<<15)	/* per thread getdents() buffer, 32 KiB; see "--walk-threads" */
+#define WALKER_DEQUE_SIZE		64	/* initial size of per thread directory deques */
+#define WALKER_BATCH_SIZE		16	/* initial size of per directory batches of entries */
+#define WALKER_RESULTS_MAX		(1<<12)	/* batches waiting to be committed, walker threads are blocked above it */
 
 #define INOTIFY_MARKMASK		(IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO|IN_MODIFY|IN_DONT_FOLLOW)
 
@@ -133,6 +152,7 @@ expire-after:20M\n\
 #define DEFAULT_SYNCHANDLER_ARGS_RDIRECT_I	"-aH --delete --include-from \%INCLUDE-LIST-PATH\% --exclude=* \%watch-dir\%/ \%destination-dir\%/"
 #define DEFAULT_SYNCHANDLER_ARGS_RSHELL_E	"rsynclist \%label% \%INCLUDE-LIST-PATH\% %EXCLUDE-LIST-PATH%"
 #define DEFAULT_SYNCHANDLER_ARGS_RSHELL_I	"rsynclist \%label% \%INCLUDE-LIST-PATH\%"
+#define DEFAULT_SYNCHANDLER_ARGS_COPROCESS	"coprocess \%label\%"
 
 #define RSYNC_ARGS_E	{ 		\
 		"-aH", 			\
@@ -163,27 +183,40 @@ expire-after:20M\n\
 
 #define DEVZERO				"/dev/zero"
 
-// How long to wait on highloaded locks before fallback to mutexes
-// See: doc/devel/thread-splitting/highload-locks/clsync-graph-comma.odc
-// But optimal value can be very different on different systems
-#define HL_LOCK_TRIES_INITIAL		(1<<13)
-
-// Enable run-time auto-adjustment
-#define HL_LOCK_TRIES_AUTO
-// Iterations delay between adjustments (power of 2; 2^x)
-#define HL_LOCK_AUTO_INTERVAL		7	/* 128 */
-// Initial adjustment factor
-#define HL_LOCK_AUTO_K			1.1
-// Delay detection error threshold
-#define HL_LOCK_AUTO_THREADHOLD		0.2
-// Adjustment factor denominator
-#define HL_LOCK_AUTO_DECELERATION	1.1
-// Don't adjust if the factor is less than
-#define HL_LOCK_AUTO_K_FINISH		0.001
-// Upper limit
-#define HL_LOCK_AUTO_LIMIT_HIGH		(1<<20)
-
-//#define READWRITE_SIGNALLING
+// How many iterations to spin on highloaded locks before sleeping on a futex
+// The limit is adjusted at run-time within [HL_LOCK_SPIN_MIN; HL_LOCK_SPIN_MAX]
+#define HL_LOCK_SPIN_MIN		(1<<4)
+#define HL_LOCK_SPIN_INITIAL		(1<<10)
+#define HL_LOCK_SPIN_MAX		(1<<14)
+
+// How often (in seconds) a caller sleeping on a futex rechecks that the privileged thread/process is alive
+#define HL_LOCK_ALIVECHECK_INTERVAL	1
+
+// The buffer for fts entries read from the privileged thread/process by one request (up to a directory)
+#define PRIVILEGED_FTS_READ_N_BUFSIZE	(1<<19)	/* 512 KiB, a couple of thousands of entries */
+
+// How many requests to the privileged thread/process may be in flight at once (a slot is ~2.5 MiB)
+#define PRIVILEGED_RING_SLOTS		4
+
+// The shared memory arena for the split processes, pages are populated on demand (see shm_malloc())
+#define SHM_ARENA_SIZE			(1<<26)	/* 64 MiB */
+// Alignment of objects smaller than a page in the arena (a cache line)
+#define SHM_ARENA_ALIGN			64
+
+// The stack of a child between clone(CLONE_VM|CLONE_VFORK) and execvp() (see spawn_execvp())
+#define SPAWN_STACK_SIZE		(1<<16)	/* 64 KiB */
+
+// The adaptive limit of concurrent syncs (see "--adaptive-concurrency" and thread_concurrency_update()):
+// it's increased by one after the limit of succeeded syncs in a row and is divided on a failed or a slow sync
+#define CONCURRENCY_DECREASE_DIVISOR	2
+// A sync is slow if its runtime per event is the factor times the average (syncs shorter than the minimum are never slow)
+#define CONCURRENCY_SLOW_FACTOR		2
+#define CONCURRENCY_SLOW_RUNTIME_MIN	1000	/* in milliseconds */
+// The weight of a new value in the average runtime per event is 1/CONCURRENCY_AVG_WEIGHT
+#define CONCURRENCY_AVG_WEIGHT		8
+
+// The limit of the exponential back-off between retries of a failed sync (see sync_retry_schedule())
+#define RETRY_DELAY_MAX			(1800 * 1000)	/* in milliseconds */
 
 #define CG_DEV_CONSOLE	"c 5:1"
 #define CG_DEV_ZERO	"c 1:5"
@@ -33,6 +33,10 @@
 #include "sync.h"
 #include "control.h"
 #include "socket.h"
+#include "rules.h"
+#ifdef INOTIFY_SUPPORT
+#	include "mon_inotify.h"
+#endif
 
 static pthread_t pthread_control;
 
@@ -65,6 +69,39 @@ int control_procclsyncsock(socket_sockthreaddata_t *arg, sockcmd_t *sockcmd_p) {
 		case SOCKCMD_REQUEST_INFO:
 			rc = socket_reply(clsyncsock_p, sockcmd_p, SOCKCMD_REPLY_INFO, ctx_p->config_block, ctx_p->label, ctx_p->flags, ctx_p->flags_set);
 			break;
+		case SOCKCMD_REQUEST_CONCURRENCY: {
+			int running, queued, limit;
+			rc = thread_concurrency_get(ctx_p, &running, &queued, &limit);
+			if (rc) {
+				control_error(clsyncsock_p, sockcmd_p, "thread_concurrency_get", "");
+				break;
+			}
+			rc = socket_reply(clsyncsock_p, sockcmd_p, SOCKCMD_REPLY_CONCURRENCY, running, queued, limit, ctx_p->flags[SYNCWORKERS]);
+			break;
+		}
+		case SOCKCMD_REQUEST_RULESSTATS: {
+			rules_cache_report_t report;
+			rules_cache_stats_get(&report);
+			rc = socket_reply(clsyncsock_p, sockcmd_p, SOCKCMD_REPLY_RULESSTATS,
+				report.lookups, report.hits, report.analyzed, report.uniform, report.cached, report.dropped);
+			break;
+		}
+#ifdef INOTIFY_SUPPORT
+		case SOCKCMD_REQUEST_INOTIFYSTATS: {
+			inotify_stats_report_t report;
+			if (ctx_p->flags[MONITOR] != NE_INOTIFY) {
+				errno = ENOTSUP;
+				control_error(clsyncsock_p, sockcmd_p, "inotify_stats_get", "");
+				rc = 0;
+				break;
+			}
+			inotify_stats_get(&report);
+			rc = socket_reply(clsyncsock_p, sockcmd_p, SOCKCMD_REPLY_INOTIFYSTATS,
+				report.overflows, report.ring_fill, report.ring_size, report.ring_fill_max, report.ring_stalls,
+				report.events_per_sec, report.events, report.collapsed, report.drains, report.interval);
+			break;
+		}
+#endif
 		case SOCKCMD_REQUEST_SET: {
 			sockcmd_dat_set_t *dat = sockcmd_p->data;
 			rc = ctx_set(ctx_p, dat->key, dat->value);
@@ -0,0 +1,345 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "--mode=coprocess": the sync-handler is started once and gets batches of
+ * events over a socket (see the protocol in clsync.h). Batches are sent
+ * one by one. A co-process that died between batches is restarted before
+ * the next batch is sent; if it dies while handling a batch, the batch is
+ * retried like a failed sync-handler run.
+ */
+
+#include "common.h"
+
+#include <poll.h>
+
+#include "error.h"
+#include "malloc.h"
+#include "privileged.h"
+#include "sync.h"
+#include "coprocess.h"
+
+static ctx_t		*coprocess_ctx_p	= NULL;
+static pthread_mutex_t	 coprocess_mutex	= PTHREAD_MUTEX_INITIALIZER;
+static pid_t		 coprocess_pid		= 0;
+static int		 coprocess_fd		= -1;
+static uint32_t		 coprocess_seqid	= 0;
+static char		*coprocess_buf		= NULL;
+static size_t		 coprocess_buf_size	= 0;
+
+// The environment of clsync with the descriptor of the socket, for the co-process only
+static char **coprocess_envp(int fd) {
+	static const char prefix[] = CLSYNC_COPROCESS_FD_ENV"=";
+	char **envp;
+	int i, n;
+
+	n = 0;
+	while (environ[n] != NULL)
+		n++;
+
+	envp = xmalloc((n+2) * sizeof(*envp));
+	n = i = 0;
+	while (environ[i] != NULL) {
+		if (strncmp(environ[i], prefix, sizeof(prefix)-1))
+			envp[n++] = strdup(environ[i]);
+		i++;
+	}
+	envp[n] = xmalloc(sizeof(prefix) + sizeof("2147483647"));
+	sprintf(envp[n++], "%s%i", prefix, fd);
+	envp[n] = NULL;
+
+	return envp;
+}
+
+static int coprocess_start(ctx_t *ctx_p) {
+	struct dosync_arg *dosync_arg_p;
+	char **argv, **envp;
+	int fds[2], err = 0;
+
+	// Both ends are close-on-exec: the sync-handlers started meanwhile by other threads shouldn't get the socket
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds)) {
+		error("Cannot socketpair().");
+		return errno;
+	}
+
+	dosync_arg_p = xcalloc(1, sizeof(*dosync_arg_p));
+	dosync_arg_p->ctx_p         = ctx_p;
+	dosync_arg_p->list_type_str = "coprocess";
+	argv = sync_customargv(ctx_p, dosync_arg_p, &ctx_p->synchandler_args[SHARGS_PRIMARY]);
+	envp = coprocess_envp(fds[1]);
+
+	// Only the end of the co-process is inherited by it
+	coprocess_pid = privileged_fork_execvpe(ctx_p->handlerfpath, argv, envp, fds[1]);
+	if (coprocess_pid == -1) {
+		err = errno;
+		error("Cannot run the sync-handler \"%s\".", ctx_p->handlerfpath);
+		coprocess_pid = 0;
+		close(fds[0]);
+	}
+	close(fds[1]);
+
+	argv_free(envp);
+	argv_free(argv);
+	free(dosync_arg_p);
+	if (err)
+		return err;
+
+	coprocess_fd = fds[0];
+	debug(1, "The sync-handler co-process \"%s\" is started (pid %u).", ctx_p->handlerfpath, coprocess_pid);
+	return 0;
+}
+
+// Closes the socket and collects the co-process (kills it if it doesn't exit in SLEEP_SECONDS)
+static int coprocess_stop(int signal) {
+	int status = 0, i;
+
+	if (coprocess_fd != -1) {
+		close(coprocess_fd);
+		coprocess_fd = -1;
+	}
+
+	if (!coprocess_pid)
+		return 0;
+
+	if (signal)
+		privileged_kill_child(coprocess_pid, signal);
+
+	i = 0;
+	while (privileged_waitpid(coprocess_pid, &status, WNOHANG) == 0) {
+		if (i++ >= SLEEP_SECONDS*10) {
+			warning("The sync-handler co-process (pid %u) doesn't exit. Killing it.", coprocess_pid);
+			privileged_kill_child(coprocess_pid, SIGKILL);
+			privileged_waitpid(coprocess_pid, &status, 0);
+			break;
+		}
+		sleep_ms(100);
+	}
+
+	debug(1, "The sync-handler co-process (pid %u) is finished (status %i).", coprocess_pid, status);
+	coprocess_pid = 0;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Checks the co-process without blocking: it's finished or its end of the socket is closed
+static int coprocess_isalive() {
+	struct pollfd pfd;
+	int status;
+
+	if (privileged_waitpid(coprocess_pid, &status, WNOHANG) == coprocess_pid) {
+		warning("The sync-handler co-process (pid %u) is finished (status %i). Restarting it.", coprocess_pid, status);
+		coprocess_pid = 0;
+		return 0;
+	}
+
+	pfd.fd     = coprocess_fd;
+	pfd.events = 0;
+	if ((poll(&pfd, 1, 0) == 1) && (pfd.revents & (POLLHUP|POLLERR))) {
+		warning("The sync-handler co-process (pid %u) closed the socket. Restarting it.", coprocess_pid);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Waits for the socket to be ready, but gives up if clsync is exiting (the co-process may hang)
+static int coprocess_poll(ctx_t *ctx_p, short events) {
+	struct pollfd pfd;
+
+	pfd.fd     = coprocess_fd;
+	pfd.events = events;
+	while (1) {
+		switch (poll(&pfd, 1, SLEEP_SECONDS*1000)) {
+			case -1:
+				if (errno == EINTR)
+					continue;
+				return errno;
+			case 0:
+				if ((ctx_p->state == STATE_TERM) || (ctx_p->state == STATE_EXIT))
+					return ECANCELED;
+				continue;
+			default:
+				return 0;
+		}
+	}
+}
+
+static int coprocess_send(ctx_t *ctx_p, const char *buf, size_t size) {
+	while (size) {
+		int rc;
+		ssize_t w;
+
+		if ((rc = coprocess_poll(ctx_p, POLLOUT)))
+			return rc;
+
+		w = send(coprocess_fd, buf, size, MSG_NOSIGNAL|MSG_DONTWAIT);
+		if (w == -1) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			return errno;
+		}
+		buf  += w;
+		size -= w;
+	}
+
+	return 0;
+}
+
+static int coprocess_recv(ctx_t *ctx_p, char *buf, size_t size) {
+	while (size) {
+		int rc;
+		ssize_t r;
+
+		if ((rc = coprocess_poll(ctx_p, POLLIN)))
+			return rc;
+
+		r = recv(coprocess_fd, buf, size, MSG_DONTWAIT);
+		switch (r) {
+			case -1:
+				if ((errno == EINTR) || (errno == EAGAIN))
+					continue;
+				return errno;
+			case 0:
+				return ECONNRESET;
+		}
+		buf  += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+// The co-process is started on the first batch: privileged_fork_execvp() is not ready yet here
+int coprocess_init(ctx_t *ctx_p, struct indexes *indexes_p) {
+	coprocess_ctx_p = ctx_p;
+	return 0;
+}
+
+int coprocess_sync(int n, api_eventinfo_t *ei) {
+	ctx_t *ctx_p = coprocess_ctx_p;
+	struct api_coprocess_batch  *batch_p;
+	struct api_coprocess_ack     ack;
+	size_t size;
+	char *ptr;
+	int i, rc;
+
+	pthread_mutex_lock(&coprocess_mutex);
+
+	// The co-process could die between batches (e.g. have crashed on a previous one)
+	if (coprocess_pid && !coprocess_isalive())
+		coprocess_stop(0);
+
+	if (!coprocess_pid)
+		if ((rc = coprocess_start(ctx_p)))
+			goto l_coprocess_sync_end;
+
+	size = sizeof(*batch_p);
+	i = 0;
+	while (i < n)
+		size += sizeof(struct api_coprocess_record) + ei[i++].path_len;
+
+	if (size > coprocess_buf_size) {
+		coprocess_buf_size = size;
+		coprocess_buf      = xrealloc(coprocess_buf, coprocess_buf_size);
+	}
+
+	batch_p        = (void *)coprocess_buf;
+	batch_p->magic = CLSYNC_COPROCESS_MAGIC;
+	batch_p->seqid = ++coprocess_seqid;
+	batch_p->n     = n;
+
+	ptr = coprocess_buf + sizeof(*batch_p);
+	i = 0;
+	while (i < n) {
+		struct api_coprocess_record record;
+
+		record.evmask      = ei[i].evmask;
+		record.flags       = ei[i].flags;
+		record.objtype_old = ei[i].objtype_old;
+		record.objtype_new = ei[i].objtype_new;
+		record.path_len    = ei[i].path_len;
+
+		memcpy(ptr, &record, sizeof(record));
+		ptr += sizeof(record);
+		memcpy(ptr, ei[i].path, ei[i].path_len);
+		ptr += ei[i].path_len;
+		i++;
+	}
+
+	debug(3, "batch #%u: %i records, %zu bytes", coprocess_seqid, n, size);
+
+	if (!(rc = coprocess_send(ctx_p, coprocess_buf, size)))
+		rc = coprocess_recv(ctx_p, (char *)&ack, sizeof(ack));
+
+	if (!rc && (ack.seqid != coprocess_seqid)) {
+		error("Got acknowledgement for batch #%u instead of #%u from the sync-handler co-process.", ack.seqid, coprocess_seqid);
+		rc = EPROTO;
+	}
+
+	if (!rc && (ack.failed_n > n)) {
+		error("Got %u failed records of batch #%u of %i records from the sync-handler co-process.", ack.failed_n, coprocess_seqid, n);
+		rc = EPROTO;
+	}
+
+	// The numbers of failed records; the batch buffer is larger than them
+	if (!rc && ack.failed_n && !(rc = coprocess_recv(ctx_p, coprocess_buf, ack.failed_n * sizeof(uint32_t)))) {
+		uint32_t *failed = (uint32_t *)coprocess_buf;
+
+		i = 0;
+		while (i < ack.failed_n) {
+			if (failed[i] >= n) {
+				error("Got invalid failed record number %u of batch #%u from the sync-handler co-process.", failed[i], coprocess_seqid);
+				rc = EPROTO;
+				break;
+			}
+			ei[failed[i++]].flags |= EVIF_SYNCFAILED;
+		}
+	}
+
+	if (rc) {
+		// The co-process will be restarted on the next batch
+		pid_t pid = coprocess_pid;
+		int exitcode = coprocess_stop((rc == ECONNRESET) || (rc == EPIPE) ? 0 : SIGKILL);
+		errno = rc;
+		error("Lost the sync-handler co-process (pid %u), the exitcode: %i.", pid, exitcode);
+		goto l_coprocess_sync_end;
+	}
+
+	rc = ack.exitcode;
+	debug(3, "batch #%u: exitcode %i, failed records: %u", coprocess_seqid, rc, ack.failed_n);
+
+l_coprocess_sync_end:
+	pthread_mutex_unlock(&coprocess_mutex);
+	return rc;
+}
+
+int coprocess_deinit() {
+	int exitcode;
+
+	pthread_mutex_lock(&coprocess_mutex);
+	exitcode = coprocess_stop(0);
+	free(coprocess_buf);
+	coprocess_buf      = NULL;
+	coprocess_buf_size = 0;
+	pthread_mutex_unlock(&coprocess_mutex);
+
+	if (exitcode)
+		warning("The sync-handler co-process exited with exitcode %i.", exitcode);
+
+	return 0;
+}
@@ -128,6 +128,12 @@ enum flags_enum {
 	CANCEL_SYSCALLS		= 44|OPTION_LONGOPTONLY,
 	EXITONSYNCSKIP		= 45|OPTION_LONGOPTONLY,
 	DETACH_IPC		= 46|OPTION_LONGOPTONLY,
+	READERTHREAD		= 47|OPTION_LONGOPTONLY,
+	WALKTHREADS		= 48|OPTION_LONGOPTONLY,
+	PRIVILEGED_BENCHMARK	= 49|OPTION_LONGOPTONLY,
+	PASS_DIRFDS		= 50|OPTION_LONGOPTONLY,
+	SYNCWORKERS		= 51|OPTION_LONGOPTONLY,
+	ADAPTIVECONCURRENCY	= 52|OPTION_LONGOPTONLY,
 };
 typedef enum flags_enum flags_t;
 
@@ -163,6 +169,7 @@ enum mode_id {
 	MODE_RSYNCDIRECT,
 	MODE_RSYNCSO,
 	MODE_SO,
+	MODE_COPROCESS,
 };
 typedef enum mode_id mode_id_t;
 
@@ -171,6 +178,7 @@ enum queue_id {
 	QUEUE_BIGFILE,
 	QUEUE_INSTANT,
 	QUEUE_LOCKWAIT,
+	QUEUE_RETRY,
 
 	QUEUE_MAX,
 	QUEUE_AUTO
@@ -199,9 +207,11 @@ enum sigusr_enum {
 	SIGUSR_DUMP		= 29,
 };
 
+struct rulematch;
 struct rule {
 	int		num;
 	regex_t		expr;
+	struct rulematch *match;	// compiled "expr" (see rules.c), NULL if "expr" should be matched by regexec()
 	mode_t		objtype;
 	ruleaction_t	perm;
 	ruleaction_t	mask;
@@ -209,8 +219,8 @@ struct rule {
 typedef struct rule rule_t;
 
 struct queueinfo {
-	unsigned int 	collectdelay;
-	time_t		stime;
+	unsigned long	collectdelay;	// in milliseconds
+	uint64_t	stime;		// CLOCK_MONOTONIC, in milliseconds
 };
 typedef struct queueinfo queueinfo_t;
 
@@ -234,6 +244,7 @@ enum shflags {
 	SHFL_INCLUDE_LIST	= 0x02,
 	SHFL_INCLUDE_LIST_PATH	= 0x04,
 	SHFL_EXCLUDE_LIST_PATH	= 0x08,
+	SHFL_FAILED_LIST_PATH	= 0x10,
 };
 typedef enum shflags shflags_t;
 
@@ -309,6 +320,7 @@ struct ctx {
 	uint32_t iteration_num;
 	rule_t rules[MAXRULES];
 	size_t rules_count;
+	char   stat_deferred;	// lstat() of events is postponed until the prequeue is unloaded
 	dev_t st_dev;
 #endif
 	char *flags_values_raw[OPTION_FLAGS];
@@ -365,10 +377,10 @@ struct ctx {
 	struct notifyenginefuncts notifyenginefunct;
 	int retries;
 	size_t bfilethreshold;
-	unsigned int syncdelay;
+	unsigned long syncdelay;	// in milliseconds
 	queueinfo_t _queues[QUEUE_MAX];	// TODO: remove this from here
 	unsigned int rsyncinclimit;
-	time_t synctime;
+	uint64_t synctime;		// CLOCK_MONOTONIC, in milliseconds
 	unsigned int synctimeout;
 	sigset_t *sigset;
 	char isignoredexitcode[(1<<8)];
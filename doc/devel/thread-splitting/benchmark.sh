@@ -20,29 +20,9 @@ run() {
 
 benchmark() {
 	make clean all
-	HL_INITIAL=$(awk '{if ($2 == "HL_LOCK_TRIES_INITIAL") print $3}' < configuration.h)
-	HL_AUTO=$(gcc -x c - -o /tmp/hl_auto.bin.$$ << 'EOF'
-#include <stdio.h>
-#include "configuration.h"
-int main() {
-#ifdef HL_LOCK_TRIES_AUTO
-	printf("auto\n");
-#else
-	printf("noauto\n");
-#endif
-	return 0;
-}
-EOF
-/tmp/hl_auto.bin.$$
-rm -f /tmp/hl_auto.bin.$$
-)
+	HL_INITIAL=$(awk '{if ($2 == "HL_LOCK_SPIN_INITIAL") print $3}' < configuration.h)
 	CONFIGURE=$(awk '{if ($2 == "./configure") {$1=""; $2="";print $0; exit}}' < config.log)
-	hash="$@|$CONFIGURE"
-	if [[ "$HL_AUTO" == "auto" ]]; then
-		hash="$hash|$HL_AUTO"
-	else
-		hash="$hash|$HL_INITIAL"
-	fi
+	hash="$@|$CONFIGURE|$HL_INITIAL"
 	rm -f /tmp/benchmark.{,err}log-"$hash"
 	i=0
 	while [[ "$i" -lt "$RUN_TIMES" ]]; do
@@ -71,9 +51,9 @@ configure --enable-highload-locks --enable-debug=yes
 
 benchmark
 
-interval=1;
-while [[ "$interval" -le "2147483648" ]]; do
-	configuration 's|SLEEP_SECONDS.*$|SLEEP_SECONDS 0|g' 's|#define HL_LOCK_TRIES_AUTO|//#define HL_LOCK_TRIES_AUTO|g' "s|HL_LOCK_TRIES_INITIAL.*$|HL_LOCK_TRIES_INITIAL $interval|g"
+interval=16;
+while [[ "$interval" -le "16384" ]]; do
+	configuration 's|SLEEP_SECONDS.*$|SLEEP_SECONDS 0|g' "s|HL_LOCK_SPIN_INITIAL.*$|HL_LOCK_SPIN_INITIAL $interval|g"
 	benchmark --thread-splitting
 	interval=$[ $interval * 2 ]
 done
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+mkdir -m 700 -p testdir/from testdir/to
+
+cat > rules <<EOF
+-d^[Dd]ont[Ss]ync\$
++*.*
+EOF
+
+cc -ggdb3 -o clsync-synchandler-coprocess clsync-synchandler-coprocess.c &&
+
+clsync -K example-coprocess -M coprocess -w2 -t5 -W ./testdir/from -S ./clsync-synchandler-coprocess -R rules $@
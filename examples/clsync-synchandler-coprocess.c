@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Required header:
+#include <clsync/clsync.h>
+
+// Reads exactly "size" bytes, returns 0 on EOF (clsync is exiting)
+static int readall(int fd, void *buf, size_t size) {
+	char *ptr = buf;
+
+	while (size) {
+		ssize_t r = read(fd, ptr, size);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		ptr  += r;
+		size -= r;
+	}
+
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	const char *fd_str = getenv(CLSYNC_COPROCESS_FD_ENV);
+	char *path = NULL;
+	size_t path_size = 0;
+	int fd;
+
+	if (fd_str == NULL) {
+		fprintf(stderr, "This sync-handler should be run by clsync with \"--mode=coprocess\".\n");
+		return EINVAL;
+	}
+	fd = atoi(fd_str);
+
+	while (1) {
+		struct api_coprocess_batch batch;
+		struct api_coprocess_ack   ack;
+		uint32_t i;
+
+		if (!readall(fd, &batch, sizeof(batch)))
+			break;
+
+		if (batch.magic != CLSYNC_COPROCESS_MAGIC) {
+			fprintf(stderr, "Wrong magic: %x.\n", batch.magic);
+			return EPROTO;
+		}
+
+		printf("%s: batch #%u, %u records\n", argv[2], batch.seqid, batch.n);
+		i = 0;
+		while (i < batch.n) {
+			struct api_coprocess_record record;
+
+			if (!readall(fd, &record, sizeof(record)))
+				return ECONNRESET;
+
+			if (record.path_len + 1 > path_size) {
+				path_size = record.path_len + 1;
+				path      = realloc(path, path_size);
+			}
+			if (!readall(fd, path, record.path_len))
+				return ECONNRESET;
+			path[record.path_len] = 0;
+
+			printf("\t\"%s\" (evmask 0x%x, flags 0x%x, type %u -> %u)\n",
+				path, record.evmask, record.flags, record.objtype_old, record.objtype_new);
+			i++;
+		}
+		fflush(stdout);
+
+		// Here the files should be synced. Non-zero exitcode makes clsync retry the batch
+		// or only the records which numbers are sent after the ack (see "failed_n").
+		ack.seqid    = batch.seqid;
+		ack.exitcode = 0;
+		ack.failed_n = 0;
+		if (write(fd, &ack, sizeof(ack)) != sizeof(ack))
+			return errno;
+	}
+
+	free(path);
+	return 0;
+}
@@ -19,6 +19,10 @@
 
 #include "common.h"
 
+#ifdef STATX_BASIC_STATS
+#	include <sys/sysmacros.h>	// makedev()
+#endif
+
 #include "error.h"
 #include "malloc.h"
 
@@ -238,3 +242,104 @@ uint32_t stat_diff(stat64_t *a, stat64_t *b) {
 	return difference;
 }
 
+
+#ifdef STATX_BASIC_STATS
+/**
+ * @brief 			Converts STAT_FIELD_* bitmask to the statx() request mask
+ *
+ * @param[in]	stat_fields	Bitmask of required fields (see STAT_FIELD_*)
+ *
+ * @retval	mask		STATX_* mask (STATX_TYPE|STATX_SIZE are always requested)
+ *
+ */
+unsigned int stat_fields2statxmask(uint32_t stat_fields) {
+	unsigned int mask = STATX_TYPE|STATX_SIZE;
+
+	if (stat_fields & STAT_FIELD_MODE)
+		mask |= STATX_MODE;
+	if (stat_fields & STAT_FIELD_NLINK)
+		mask |= STATX_NLINK;
+	if (stat_fields & STAT_FIELD_UID)
+		mask |= STATX_UID;
+	if (stat_fields & STAT_FIELD_GID)
+		mask |= STATX_GID;
+	if (stat_fields & STAT_FIELD_INO)
+		mask |= STATX_INO;
+	if (stat_fields & STAT_FIELD_BLOCKS)
+		mask |= STATX_BLOCKS;
+	if (stat_fields & STAT_FIELD_ATIME)
+		mask |= STATX_ATIME;
+	if (stat_fields & STAT_FIELD_MTIME)
+		mask |= STATX_MTIME;
+	if (stat_fields & STAT_FIELD_CTIME)
+		mask |= STATX_CTIME;
+
+	return mask;
+}
+
+void statx2stat64(stat64_t *st_p, const struct statx *stx_p) {
+	memset(st_p, 0, sizeof(*st_p));
+
+	st_p->st_dev     = makedev(stx_p->stx_dev_major,  stx_p->stx_dev_minor);
+	st_p->st_ino     = stx_p->stx_ino;
+	st_p->st_mode    = stx_p->stx_mode;
+	st_p->st_nlink   = stx_p->stx_nlink;
+	st_p->st_uid     = stx_p->stx_uid;
+	st_p->st_gid     = stx_p->stx_gid;
+	st_p->st_rdev    = makedev(stx_p->stx_rdev_major, stx_p->stx_rdev_minor);
+	st_p->st_size    = stx_p->stx_size;
+	st_p->st_blksize = stx_p->stx_blksize;
+	st_p->st_blocks  = stx_p->stx_blocks;
+	st_p->st_atime   = stx_p->stx_atime.tv_sec;
+	st_p->st_mtime   = stx_p->stx_mtime.tv_sec;
+	st_p->st_ctime   = stx_p->stx_ctime.tv_sec;
+
+	return;
+}
+#endif
+
+/**
+ * @brief 			lstat64() that asks the kernel only for required fields (via statx() if available)
+ *
+ * @param[in]	path		Path to the object
+ * @param[out]	st_p		Pointer to the result
+ * @param[in]	stat_fields	Bitmask of required fields (see STAT_FIELD_*)
+ *
+ * @retval	zero		On success
+ * @retval	-1		On error (see errno)
+ *
+ */
+int lstat64_fields(const char *path, stat64_t *st_p, uint32_t stat_fields) {
+#ifdef STATX_BASIC_STATS
+	struct statx stx;
+
+	if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC, stat_fields2statxmask(stat_fields), &stx))
+		return -1;
+
+	statx2stat64(st_p, &stx);
+	return 0;
+#else
+	return lstat64(path, st_p);
+#endif
+}
+
+// Converts "struct stat" (e.g. from fts_read()) to stat64_t
+void stat2stat64(stat64_t *st64_p, const struct stat *st_p) {
+	memset(st64_p, 0, sizeof(*st64_p));
+
+	st64_p->st_dev     = st_p->st_dev;
+	st64_p->st_ino     = st_p->st_ino;
+	st64_p->st_mode    = st_p->st_mode;
+	st64_p->st_nlink   = st_p->st_nlink;
+	st64_p->st_uid     = st_p->st_uid;
+	st64_p->st_gid     = st_p->st_gid;
+	st64_p->st_rdev    = st_p->st_rdev;
+	st64_p->st_size    = st_p->st_size;
+	st64_p->st_blksize = st_p->st_blksize;
+	st64_p->st_blocks  = st_p->st_blocks;
+	st64_p->st_atime   = st_p->st_atime;
+	st64_p->st_mtime   = st_p->st_mtime;
+	st64_p->st_ctime   = st_p->st_ctime;
+
+	return;
+}
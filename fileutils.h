@@ -24,3 +24,9 @@ extern short int fileutils_calcdirlevel(const char *path);
 extern int mkdirat_open(const char *const dir_path, int dirfd_parent, mode_t dir_mode);
 extern uint32_t stat_diff(stat64_t *a, stat64_t *b);
 
+#ifdef STATX_BASIC_STATS
+extern unsigned int stat_fields2statxmask(uint32_t stat_fields);
+extern void statx2stat64(stat64_t *st_p, const struct statx *stx_p);
+#endif
+extern int lstat64_fields(const char *path, stat64_t *st_p, uint32_t stat_fields);
+extern void stat2stat64(stat64_t *st64_p, const struct stat *st_p);
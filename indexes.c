@@ -20,3 +20,578 @@
 #include "common.h"
 #include "error.h"
 
+#include "malloc.h"
+#include "indexes.h"
+
+/* === PATH TREE === */
+
+static guint fpathtree_node_hash(gconstpointer key) {
+	const fpathtree_node_t *node_p = key;
+	const unsigned char *ptr = (const unsigned char *)node_p->name, *end = &ptr[node_p->name_len];
+	guint hash = 2166136261U ^ (guint)((uintptr_t)node_p->parent >> 4);
+
+	while (ptr < end)
+		hash = (hash ^ *(ptr++)) * 16777619U;
+
+	return hash;
+}
+
+static gboolean fpathtree_node_equal(gconstpointer a, gconstpointer b) {
+	const fpathtree_node_t *a_p = a, *b_p = b;
+
+	return a_p->parent == b_p->parent && a_p->name_len == b_p->name_len && !memcmp(a_p->name, b_p->name, a_p->name_len);
+}
+
+static fpathtree_node_t *fpathtree_node_new(fpathtree_t *tree_p, fpathtree_node_t *parent_p, const char *name, size_t name_len) {
+	// The name is stored right after the node (one allocation per node)
+	fpathtree_node_t *node_p = xmalloc(sizeof(*node_p) + name_len + 1);
+	char *name_buf = (char *)&node_p[1];
+
+	memcpy(name_buf, name, name_len);
+	name_buf[name_len] = 0;
+
+	node_p->parent   = parent_p;
+	node_p->child    = NULL;
+	node_p->prev     = NULL;
+	node_p->value    = NULL;
+	node_p->hasvalue = 0;
+	node_p->name     = name_buf;
+	node_p->name_len = name_len;
+
+	if (parent_p != NULL) {
+		node_p->next = parent_p->child;
+		if (node_p->next != NULL)
+			node_p->next->prev = node_p;
+		parent_p->child = node_p;
+		g_hash_table_insert(tree_p->node_ht, node_p, node_p);
+	} else
+		node_p->next = NULL;
+
+	tree_p->nodes++;
+	return node_p;
+}
+
+static void fpathtree_node_unsetvalue(fpathtree_t *tree_p, fpathtree_node_t *node_p) {
+	if (!node_p->hasvalue)
+		return;
+
+	if (tree_p->value_destroy_funct != NULL && node_p->value != NULL)
+		tree_p->value_destroy_funct(node_p->value);
+
+	node_p->value    = NULL;
+	node_p->hasvalue = 0;
+	tree_p->size--;
+}
+
+// Frees the node with all it's descendants (but doesn't unlink the node from the parent)
+
+static void fpathtree_node_free(fpathtree_t *tree_p, fpathtree_node_t *node_p) {
+	fpathtree_node_t *child_p = node_p->child;
+
+	while (child_p != NULL) {
+		fpathtree_node_t *next_p = child_p->next;
+		fpathtree_node_free(tree_p, child_p);
+		child_p = next_p;
+	}
+
+	fpathtree_node_unsetvalue(tree_p, node_p);
+
+	if (node_p->parent != NULL)
+		g_hash_table_remove(tree_p->node_ht, node_p);
+
+	tree_p->nodes--;
+	free(node_p);
+}
+
+// Removes nodes that has no value and no children (from the node up to the root)
+
+static void fpathtree_prune(fpathtree_t *tree_p, fpathtree_node_t *node_p) {
+	while (node_p != tree_p->root && !node_p->hasvalue && node_p->child == NULL) {
+		fpathtree_node_t *parent_p = node_p->parent;
+
+		if (node_p->prev != NULL)
+			node_p->prev->next = node_p->next;
+		else
+			parent_p->child    = node_p->next;
+		if (node_p->next != NULL)
+			node_p->next->prev = node_p->prev;
+
+		fpathtree_node_free(tree_p, node_p);
+		node_p = parent_p;
+	}
+
+	return;
+}
+
+static inline fpathtree_node_t *fpathtree_child(fpathtree_t *tree_p, fpathtree_node_t *parent_p, const char *name, size_t name_len) {
+	fpathtree_node_t key;
+
+	key.parent   = parent_p;
+	key.name     = name;
+	key.name_len = name_len;
+
+	return g_hash_table_lookup(tree_p->node_ht, &key);
+}
+
+static inline const char *fpathtree_component_end(const char *ptr) {
+	while (*ptr && *ptr != '/')
+		ptr++;
+
+	return ptr;
+}
+
+// Walks through path components. Creates missing nodes if "create" is set
+// Return: the node of "fpath" on success, NULL if there's no such node
+
+fpathtree_node_t *fpathtree_node_get(fpathtree_t *tree_p, const char *fpath, int create) {
+	fpathtree_node_t *node_p = tree_p->root;
+	const char *ptr = fpath;
+
+	if (!*fpath)
+		return node_p;
+
+	while (1) {
+		const char *end = fpathtree_component_end(ptr);
+		fpathtree_node_t *child_p = fpathtree_child(tree_p, node_p, ptr, end - ptr);
+
+		if (child_p == NULL) {
+			if (!create)
+				return NULL;
+			child_p = fpathtree_node_new(tree_p, node_p, ptr, end - ptr);
+		}
+
+		node_p = child_p;
+		if (!*end)
+			break;
+		ptr = &end[1];
+	}
+
+	return node_p;
+}
+
+fpathtree_t *fpathtree_new(GDestroyNotify value_destroy_funct) {
+	fpathtree_t *tree_p = xcalloc(1, sizeof(*tree_p));
+
+	tree_p->node_ht             = g_hash_table_new(fpathtree_node_hash, fpathtree_node_equal);
+	tree_p->value_destroy_funct = value_destroy_funct;
+	tree_p->root                = fpathtree_node_new(tree_p, NULL, "", 0);
+
+	return tree_p;
+}
+
+static void _fpathtree_new_fromht_item(gpointer fpath_gp, gpointer value_gp, gpointer arg_gp) {
+	fpathtree_t *tree_p = ((void **)arg_gp)[0];
+	GDupFunc value_dup_funct = (GDupFunc)((void **)arg_gp)[1];
+
+	fpathtree_insert(tree_p, fpath_gp, value_dup_funct == NULL ? value_gp : value_dup_funct(value_gp));
+
+	return;
+}
+
+fpathtree_t *fpathtree_new_fromht(GHashTable *ht, GDupFunc value_dup_funct, GDestroyNotify value_destroy_funct) {
+	fpathtree_t *tree_p = fpathtree_new(value_destroy_funct);
+	void *arg[2] = { tree_p, (void *)value_dup_funct };
+
+	g_hash_table_foreach(ht, _fpathtree_new_fromht_item, arg);
+
+	return tree_p;
+}
+
+void fpathtree_free(fpathtree_t *tree_p) {
+	fpathtree_node_free(tree_p, tree_p->root);
+	g_hash_table_destroy(tree_p->node_ht);
+	free(tree_p);
+
+	return;
+}
+
+gpointer fpathtree_lookup(fpathtree_t *tree_p, const char *fpath) {
+	fpathtree_node_t *node_p = fpathtree_node_get(tree_p, fpath, 0);
+
+	return node_p == NULL ? NULL : node_p->value;
+}
+
+void fpathtree_node_set(fpathtree_t *tree_p, fpathtree_node_t *node_p, gpointer value) {
+	fpathtree_node_unsetvalue(tree_p, node_p);
+
+	node_p->value    = value;
+	node_p->hasvalue = 1;
+	tree_p->size++;
+
+	return;
+}
+
+// Removes the value of the node. The node is freed if it has no children.
+
+void fpathtree_node_remove(fpathtree_t *tree_p, fpathtree_node_t *node_p) {
+	fpathtree_node_unsetvalue(tree_p, node_p);
+	fpathtree_prune(tree_p, node_p);
+
+	return;
+}
+
+/**
+ * @brief 			Writes the path of the node by walking up to the root
+ *
+ * @param[in] 	node_p		Pointer to the node
+ * @param[in,out] buf_p		Pointer to the buffer (reallocated if it's too short)
+ * @param[in,out] size_p	Pointer to the size of the buffer
+ *
+ * @retval	len		The length of the path
+ *
+ */
+size_t fpathtree_node_path(fpathtree_node_t *node_p, char **buf_p, size_t *size_p) {
+	fpathtree_node_t *ptr_p;
+	size_t len = 0;
+	char *end;
+
+	if (node_p->parent == NULL) {
+		len = 0;
+	} else {
+		ptr_p = node_p;
+		while (ptr_p->parent != NULL) {
+			len += ptr_p->name_len + 1;
+			ptr_p = ptr_p->parent;
+		}
+		len--;		// There's no "/" before the first component
+	}
+
+	if (*size_p < len + 1) {
+		*size_p = len + 1 + ALLOC_PORTION;
+		*buf_p  = xrealloc(*buf_p, *size_p);
+	}
+
+	end  = &(*buf_p)[len];
+	*end = 0;
+	ptr_p = node_p;
+	while (ptr_p->parent != NULL) {
+		end -= ptr_p->name_len;
+		memcpy(end, ptr_p->name, ptr_p->name_len);
+		ptr_p = ptr_p->parent;
+		if (ptr_p->parent != NULL)
+			*(--end) = '/';
+	}
+
+	return len;
+}
+
+/**
+ * @brief 			Moves the path with all paths inside it to a new place (the nodes inside are not reallocated)
+ *
+ * @param[in] 	tree_p		Pointer to the path tree
+ * @param[in] 	fpath_old	The path to move
+ * @param[in] 	fpath_new	The new path (should not exist in the tree)
+ *
+ * @retval	node_p		The node of the new path (with the value of the old one)
+ * @retval	NULL		There's no such path in the tree, the new path exists or is inside the old one (errno is set)
+ *
+ */
+fpathtree_node_t *fpathtree_move(fpathtree_t *tree_p, const char *fpath_old, const char *fpath_new) {
+	fpathtree_node_t *src_p, *dst_p, *child_p;
+
+	src_p = fpathtree_node_get(tree_p, fpath_old, 0);
+	if (src_p == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	dst_p = fpathtree_node_get(tree_p, fpath_new, 0);
+	if (dst_p == src_p)
+		return dst_p;
+
+	if (dst_p != NULL && (dst_p->hasvalue || dst_p->child != NULL)) {
+		errno = EEXIST;
+		return NULL;
+	}
+
+	if (dst_p == NULL)
+		dst_p = fpathtree_node_get(tree_p, fpath_new, 1);
+
+	// Cannot move a path inside itself
+	child_p = dst_p->parent;
+	while (child_p != NULL) {
+		if (child_p == src_p) {
+			fpathtree_prune(tree_p, dst_p);
+			errno = EINVAL;
+			return NULL;
+		}
+		child_p = child_p->parent;
+	}
+
+	// Re-parenting the children (they're indexed by the parent node, so they're rehashed)
+	child_p = src_p->child;
+	while (child_p != NULL) {
+		g_hash_table_remove(tree_p->node_ht, child_p);
+		child_p->parent = dst_p;
+		g_hash_table_insert(tree_p->node_ht, child_p, child_p);
+		child_p = child_p->next;
+	}
+	dst_p->child = src_p->child;
+	src_p->child = NULL;
+
+	dst_p->value    = src_p->value;
+	dst_p->hasvalue = src_p->hasvalue;
+	src_p->value    = NULL;
+	src_p->hasvalue = 0;
+
+	fpathtree_prune(tree_p, src_p);
+
+	return dst_p;
+}
+
+/**
+ * @brief 			Sets the value of the path (the old value is destroyed)
+ *
+ * @param[in] 	tree_p		Pointer to the path tree
+ * @param[in] 	fpath		File path (the components are copied, the string is not retained)
+ * @param[in] 	value		The value
+ *
+ * @retval	zero		Successful
+ *
+ */
+int fpathtree_insert(fpathtree_t *tree_p, const char *fpath, gpointer value) {
+	fpathtree_node_set(tree_p, fpathtree_node_get(tree_p, fpath, 1), value);
+
+	return 0;
+}
+
+int fpathtree_remove(fpathtree_t *tree_p, const char *fpath) {
+	fpathtree_node_t *node_p = fpathtree_node_get(tree_p, fpath, 0);
+
+	if (node_p == NULL)
+		return ENOENT;
+
+	fpathtree_node_remove(tree_p, node_p);
+
+	return 0;
+}
+
+/**
+ * @brief 			Removes the path with all paths inside it
+ *
+ * @param[in] 	tree_p		Pointer to the path tree
+ * @param[in] 	fpath		File path
+ *
+ * @retval	zero		Successful
+ * @retval	ENOENT		There's no such path in the tree
+ *
+ */
+int fpathtree_remove_subtree(fpathtree_t *tree_p, const char *fpath) {
+	fpathtree_node_t *node_p = fpathtree_node_get(tree_p, fpath, 0);
+
+	if (node_p == NULL)
+		return ENOENT;
+
+	fpathtree_node_t *child_p = node_p->child;
+	while (child_p != NULL) {
+		fpathtree_node_t *next_p = child_p->next;
+		fpathtree_node_free(tree_p, child_p);
+		child_p = next_p;
+	}
+	node_p->child = NULL;
+
+	fpathtree_node_unsetvalue(tree_p, node_p);
+	fpathtree_prune(tree_p, node_p);
+
+	return 0;
+}
+
+/**
+ * @brief 			Calls "funct" for every ancestor of the path that has a value (from the root to the parent)
+ *
+ * @param[in] 	tree_p		Pointer to the path tree
+ * @param[in] 	fpath		File path
+ * @param[in] 	funct		The function, gets the length of the ancestor's path (a prefix of "fpath"), it's value and "arg"
+ * @param[in] 	arg		The argument for "funct"
+ *
+ * @retval	zero		"funct" returned zero for every ancestor
+ * @retval	non-zero	The first non-zero value returned by "funct"
+ *
+ */
+int fpathtree_foreach_ancestor(fpathtree_t *tree_p, const char *fpath, fpathtree_ancestorfunct_t funct, gpointer arg) {
+	fpathtree_node_t *node_p = tree_p->root;
+	const char *ptr = fpath;
+	size_t prefix_len = 0;
+
+	if (!*fpath)
+		return 0;
+
+	while (node_p != NULL) {
+		int rc;
+		const char *end;
+
+		if (node_p->hasvalue && (rc = funct(prefix_len, node_p->value, arg)))
+			return rc;
+
+		end = fpathtree_component_end(ptr);
+		if (!*end)
+			break;		// The next node is "fpath" itself
+
+		node_p     = fpathtree_child(tree_p, node_p, ptr, end - ptr);
+		prefix_len = end - fpath;
+		ptr        = &end[1];
+	}
+
+	return 0;
+}
+
+static void _fpathtree_foreach(fpathtree_node_t *node_p, char *fpath, size_t fpath_len, GHFunc funct, gpointer arg) {
+	fpathtree_node_t *child_p;
+
+	if (node_p->hasvalue)
+		funct(fpath, node_p->value, arg);
+
+	child_p = node_p->child;
+	while (child_p != NULL) {
+		int    sep       = (node_p->parent != NULL);
+		size_t child_len = fpath_len + sep + child_p->name_len;
+
+		if (child_len <= PATH_MAX) {
+			char *ptr = &fpath[fpath_len];
+			if (sep)
+				*(ptr++) = '/';
+			memcpy(ptr, child_p->name, child_p->name_len + 1);
+
+			_fpathtree_foreach(child_p, fpath, child_len, funct, arg);
+			fpath[fpath_len] = 0;
+		} else
+			error("Too long path inside \"%s\", skipping.", fpath);
+
+		child_p = child_p->next;
+	}
+
+	return;
+}
+
+/**
+ * @brief 			Calls "funct" for every path with a value inside "fpath" (including "fpath" itself)
+ *
+ * @param[in] 	tree_p		Pointer to the path tree
+ * @param[in] 	fpath		File path ("" for the whole tree)
+ * @param[in] 	funct		The function, gets the path, it's value and "arg"
+ * @param[in] 	arg		The argument for "funct"
+ *
+ * @retval	zero		Successful
+ * @retval	ENOENT		There's no such path in the tree
+ *
+ */
+int fpathtree_foreach(fpathtree_t *tree_p, const char *fpath, GHFunc funct, gpointer arg) {
+	char buf[PATH_MAX+1];
+	size_t fpath_len = strlen(fpath);
+	fpathtree_node_t *node_p = fpathtree_node_get(tree_p, fpath, 0);
+
+	if (node_p == NULL)
+		return ENOENT;
+
+	if (fpath_len > PATH_MAX)
+		return ENAMETOOLONG;
+
+	memcpy(buf, fpath, fpath_len+1);
+	_fpathtree_foreach(node_p, buf, fpath_len, funct, arg);
+
+	return 0;
+}
+
+/* === WATCHING DESCRIPTORS === */
+
+static inline void indexes_wd2node_set(indexes_t *indexes_p, int wd, fpathtree_node_t *node_p) {
+	if (wd >= indexes_p->wd2node_size) {
+		int size = indexes_p->wd2node_size ? indexes_p->wd2node_size : ALLOC_PORTION;
+		while (size <= wd)
+			size <<= 1;
+
+		indexes_p->wd2node = xrealloc(indexes_p->wd2node, size * sizeof(*indexes_p->wd2node));
+		memset(&indexes_p->wd2node[indexes_p->wd2node_size], 0, (size - indexes_p->wd2node_size) * sizeof(*indexes_p->wd2node));
+		indexes_p->wd2node_size = size;
+	}
+
+	indexes_p->wd2node[wd] = node_p;
+	return;
+}
+
+// Adds necessary rows to indexes if some watching descriptor opened
+// Return: 0 on success, non-zero on fail
+
+int indexes_add_wd(indexes_t *indexes_p, int wd, const char *fpath, size_t fpathlen) {
+	fpathtree_node_t *node_p;
+	debug(4, "indexes_add_wd(indexes_p, %i, \"%s\", %i)", wd, fpath, fpathlen);
+
+	if (wd < 0) {
+		error("Invalid watching descriptor %i of \"%s\".", wd, fpath);
+		return EINVAL;
+	}
+
+	// The same watching descriptor is returned for the same inode, so it could be already indexed by the old path
+	node_p = indexes_wd2node(indexes_p, wd);
+	if (node_p != NULL)
+		fpathtree_node_remove(indexes_p->wd_tree, node_p);
+
+	node_p = fpathtree_node_get(indexes_p->wd_tree, fpath, 1);
+	if (node_p->hasvalue)
+		indexes_wd2node_set(indexes_p, GPOINTER_TO_INT(node_p->value), NULL);
+
+	fpathtree_node_set(indexes_p->wd_tree, node_p, GINT_TO_POINTER(wd));
+	indexes_wd2node_set(indexes_p, wd, node_p);
+
+	return 0;
+}
+
+// Removes necessary rows from indexes if some watching descriptor closed
+// Return: 0 on success, non-zero on fail
+
+int indexes_remove_bywd(indexes_t *indexes_p, int wd) {
+	fpathtree_node_t *node_p = indexes_wd2node(indexes_p, wd);
+
+	// The wd could be already dropped by indexes_wd_forget() when its directory was replaced by a move
+	if (node_p == NULL) {
+		debug(2, "There's no wd %i in index \"wd2node\" (already forgotten).", wd);
+		return 0;
+	}
+
+	indexes_p->wd2node[wd] = NULL;
+	fpathtree_node_remove(indexes_p->wd_tree, node_p);
+
+	return 0;
+}
+
+static void indexes_wd_forget(gpointer fpath_gp, gpointer wd_gp, gpointer indexes_gp) {
+	indexes_t *indexes_p = indexes_gp;
+	int wd = GPOINTER_TO_INT(wd_gp);
+
+	debug(4, "Dropping stale wd %i of \"%s\"", wd, (char *)fpath_gp);
+	if (indexes_wd2node(indexes_p, wd) != NULL)
+		indexes_p->wd2node[wd] = NULL;
+
+	return;
+}
+
+/**
+ * @brief 			Relabels watching descriptors of a moved directory subtree in place
+ *
+ * @param[in] 	indexes_p	Pointer to indexes
+ * @param[in] 	fpath_old	Path of the directory before the move
+ * @param[in] 	fpath_new	Path of the directory after the move
+ *
+ * @retval	zero		Successful
+ * @retval	non-zero	If got error (errno)
+ *
+ */
+int indexes_rename_wd_subtree(indexes_t *indexes_p, const char *fpath_old, const char *fpath_new) {
+	fpathtree_node_t *node_p;
+
+	debug(3, "(indexes_p, \"%s\", \"%s\")", fpath_old, fpath_new);
+
+	// The destination could be still indexed by stale watching descriptors
+	if (fpathtree_foreach(indexes_p->wd_tree, fpath_new, indexes_wd_forget, indexes_p) == 0)
+		fpathtree_remove_subtree(indexes_p->wd_tree, fpath_new);
+
+	// Only the top node is replaced, the nodes inside are just re-parented, so their wd-s point to the right place
+	node_p = fpathtree_move(indexes_p->wd_tree, fpath_old, fpath_new);
+	if (node_p == NULL)
+		return errno;
+
+	if (node_p->hasvalue)
+		indexes_wd2node_set(indexes_p, GPOINTER_TO_INT(node_p->value), node_p);
+
+	return 0;
+}
@@ -25,78 +25,113 @@
 #include "common.h"
 #include "error.h"
 #include "malloc.h"
+#include "glibex.h"
 
 struct fileinfo {
 	stat64_t lstat;
 };
 typedef struct fileinfo fileinfo_t;
 
+// Path tree: a node per path component (instead of a full path string per row)
+
+struct fpathtree_node {
+	struct fpathtree_node	*parent;
+	struct fpathtree_node	*child;		// the first child
+	struct fpathtree_node	*next;		// the next sibling
+	struct fpathtree_node	*prev;		// the previous sibling
+	gpointer		 value;
+	char			 hasvalue;
+	size_t			 name_len;
+	const char		*name;		// not NULL-terminated for looking up keys
+};
+typedef struct fpathtree_node fpathtree_node_t;
+
+struct fpathtree {
+	GHashTable		*node_ht;	// (parent node, component name) -> node
+	fpathtree_node_t	*root;		// the node of path ""
+	GDestroyNotify		 value_destroy_funct;
+	guint			 size;		// count of nodes with a value
+	guint			 nodes;		// count of all nodes
+};
+typedef struct fpathtree fpathtree_t;
+
+typedef int (*fpathtree_ancestorfunct_t)(size_t prefix_len, gpointer value, gpointer arg);
+
+extern fpathtree_t *fpathtree_new(GDestroyNotify value_destroy_funct);
+extern fpathtree_t *fpathtree_new_fromht(GHashTable *ht, GDupFunc value_dup_funct, GDestroyNotify value_destroy_funct);
+extern void fpathtree_free(fpathtree_t *tree_p);
+extern gpointer fpathtree_lookup(fpathtree_t *tree_p, const char *fpath);
+extern int fpathtree_insert(fpathtree_t *tree_p, const char *fpath, gpointer value);
+extern int fpathtree_remove(fpathtree_t *tree_p, const char *fpath);
+extern int fpathtree_remove_subtree(fpathtree_t *tree_p, const char *fpath);
+extern int fpathtree_foreach_ancestor(fpathtree_t *tree_p, const char *fpath, fpathtree_ancestorfunct_t funct, gpointer arg);
+extern int fpathtree_foreach(fpathtree_t *tree_p, const char *fpath, GHFunc funct, gpointer arg);
+extern fpathtree_node_t *fpathtree_node_get(fpathtree_t *tree_p, const char *fpath, int create);
+extern void fpathtree_node_set(fpathtree_t *tree_p, fpathtree_node_t *node_p, gpointer value);
+extern void fpathtree_node_remove(fpathtree_t *tree_p, fpathtree_node_t *node_p);
+extern size_t fpathtree_node_path(fpathtree_node_t *node_p, char **buf_p, size_t *size_p);
+extern fpathtree_node_t *fpathtree_move(fpathtree_t *tree_p, const char *fpath_old, const char *fpath_new);
+
+static inline guint fpathtree_size(fpathtree_t *tree_p) {
+	return tree_p->size;
+}
+
+// fpathtree_t is used only where subtrees are moved or removed: it takes
+// ~1.6 times more memory per path and is slower on exact lookups than a
+// string-keyed GHashTable. The queue tables are only inserted into,
+// iterated and flushed, so they stay GHashTable-s.
+
 struct indexes {
-	GHashTable *wd2fpath_ht;			// watching descriptor -> file path
-	GHashTable *fpath2wd_ht;			// file path -> watching descriptor
+	fpathtree_t *wd_tree;				// file path -> watching descriptor
+	fpathtree_node_t **wd2node;			// watching descriptor -> node of "wd_tree" (a flat array, wd-s are small integers)
+	int wd2node_size;
+	char *wd2fpath_buf;				// the buffer for indexes_wd2fpath()
+	size_t wd2fpath_size;
 	GHashTable *fpath2ei_ht;			// file path -> event information
 	GHashTable *exc_fpath_ht;			// excluded file path
 	GHashTable *exc_fpath_coll_ht[QUEUE_MAX];	// excluded file path aggregation hashtable for every queue
 	GHashTable *fpath2ei_coll_ht[QUEUE_MAX];	// "file path -> event information" aggregation hashtable for every queue
 	GHashTable *out_lines_aggr_ht;			// output lines aggregation hashtable
 	GHashTable *nonthreaded_syncing_fpath2ei_ht;	// events that are synchronized in signle-mode (non threaded)
-	GHashTable *fileinfo_ht;			// to search "fileinfo" structures (that contains secondary sorts of things about any files/dirs)
+	fpathtree_t *fileinfo_tree;			// to search "fileinfo" structures (that contains secondary sorts of things about any files/dirs)
 #ifdef CLUSTER_SUPPORT
 	GHashTable *nodenames_ht;			// node_name -> node_id
 #endif
 };
 typedef struct indexes indexes_t;
 
-// Removes necessary rows from hash_tables if some watching descriptor closed
-// Return: 0 on success, non-zero on fail
+static inline fpathtree_node_t *indexes_wd2node(indexes_t *indexes_p, int wd) {
+	if (wd < 0 || wd >= indexes_p->wd2node_size)
+		return NULL;
 
-static inline int indexes_remove_bywd(indexes_t *indexes_p, int wd) {
-	int ret=0;
-
-	char *fpath = g_hash_table_lookup(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd));
-
-	ret |= g_hash_table_remove(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd));
-	if(fpath == NULL) {
-		error("Cannot remove from index \"fpath2wd\" by wd %i.", wd);
-		return -1;
-	}
-	ret |= g_hash_table_remove(indexes_p->fpath2wd_ht, fpath);
-
-	return ret;
+	return indexes_p->wd2node[wd];
 }
 
-// Lookups file path by watching descriptor from hash_tables
-// Return: file path on success, NULL on fail
+// Lookups file path by watching descriptor
+// Return: file path on success (valid until the next call), NULL on fail
 
 static inline char *indexes_wd2fpath(indexes_t *indexes_p, int wd) {
-	return g_hash_table_lookup(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd));
+	fpathtree_node_t *node_p = indexes_wd2node(indexes_p, wd);
+	if (node_p == NULL)
+		return NULL;
+
+	fpathtree_node_path(node_p, &indexes_p->wd2fpath_buf, &indexes_p->wd2fpath_size);
+	return indexes_p->wd2fpath_buf;
 }
 
-// Lookups watching descriptor by file path from hash_tables
+// Lookups watching descriptor by file path
 // Return: watching descriptor on success, -1 on fail
 
 static inline int indexes_fpath2wd(indexes_t *indexes_p, const char *fpath) {
-	gpointer gint_p = g_hash_table_lookup(indexes_p->fpath2wd_ht, fpath);
-	if(gint_p == NULL)
+	fpathtree_node_t *node_p = fpathtree_node_get(indexes_p->wd_tree, fpath, 0);
+	if (node_p == NULL || !node_p->hasvalue)
 		return -1;
 
-	return GPOINTER_TO_INT(gint_p);
+	return GPOINTER_TO_INT(node_p->value);
 }
 
-// Adds necessary rows to hash_tables if some watching descriptor opened
-// Return: 0 on success, non-zero on fail
-
-static inline int indexes_add_wd(indexes_t *indexes_p, int wd, const char *fpath_const, size_t fpathlen) {
-	debug(4, "indexes_add_wd(indexes_p, %i, \"%s\", %i)", wd, fpath_const, fpathlen);
-
-	char *fpath = xmalloc(fpathlen+1);
-	memcpy(fpath, fpath_const, fpathlen+1);
-
-	g_hash_table_insert(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd), fpath);
-	g_hash_table_insert(indexes_p->fpath2wd_ht, fpath, GINT_TO_POINTER(wd));
-
-	return 0;
-}
+extern int indexes_add_wd(indexes_t *indexes_p, int wd, const char *fpath, size_t fpathlen);
+extern int indexes_remove_bywd(indexes_t *indexes_p, int wd);
 
 static inline eventinfo_t *indexes_fpath2ei(indexes_t *indexes_p, const char *fpath) {
 	return (eventinfo_t *)g_hash_table_lookup(indexes_p->fpath2ei_ht, fpath);
@@ -174,20 +209,24 @@ static inline int indexes_outaggr_add(indexes_t *indexes_p, char *outline, event
 }
 
 static inline fileinfo_t *indexes_fileinfo(indexes_t *indexes_p, const char *fpath) {
-	return (fileinfo_t *)g_hash_table_lookup(indexes_p->fileinfo_ht, fpath);
+	return (fileinfo_t *)fpathtree_lookup(indexes_p->fileinfo_tree, fpath);
 }
 
-static inline int indexes_fileinfo_add(indexes_t *indexes_p, const char *fpath_const, fileinfo_t *fi) {
-	size_t fpathlen = strlen(fpath_const);
-	debug(4, "indexes_add_wd(indexes_p, \"%s\", %p)", fpath_const, fpathlen);
+static inline int indexes_fileinfo_add(indexes_t *indexes_p, const char *fpath, fileinfo_t *fi) {
+	debug(4, "indexes_fileinfo_add(indexes_p, \"%s\", %p)", fpath, fi);
 
-	char *fpath = xmalloc(fpathlen+1);
-	memcpy(fpath, fpath_const, fpathlen+1);
+	return fpathtree_insert(indexes_p->fileinfo_tree, fpath, fi);
+}
 
-	g_hash_table_insert(indexes_p->fileinfo_ht, fpath, fi);
+// Forgets the file/dir and everything inside it
 
-	return 0;
+static inline int indexes_fileinfo_remove(indexes_t *indexes_p, const char *fpath) {
+	debug(4, "indexes_fileinfo_remove(indexes_p, \"%s\")", fpath);
+
+	return fpathtree_remove_subtree(indexes_p->fileinfo_tree, fpath);
 }
 
+extern int indexes_rename_wd_subtree(indexes_t *indexes_p, const char *fpath_old, const char *fpath_new);
+
 #endif
 
@@ -103,6 +103,8 @@ static const struct option long_options[] =
 	{"forget-privthread-info",optional_argument,	NULL,	FORGET_PRIVTHREAD_INFO},
 	{"permit-mprotect",	optional_argument,	NULL,	PERMIT_MPROTECT},
 	{"shm-mprotect",	optional_argument,	NULL,	SHM_MPROTECT},
+	{"privileged-benchmark",required_argument,	NULL,	PRIVILEGED_BENCHMARK},
+	{"pass-dirfds",		optional_argument,	NULL,	PASS_DIRFDS},
 #endif
 #ifdef GETMNTENT_SUPPORT
 	{"mountpoints",		required_argument,	NULL,	MOUNTPOINTS},
@@ -116,6 +118,8 @@ static const struct option long_options[] =
 	{"cgroup-group-name",	required_argument,	NULL,	CG_GROUPNAME},
 #endif
 	{"threading",		required_argument,	NULL,	THREADING},
+	{"sync-workers",	required_argument,	NULL,	SYNCWORKERS},
+	{"adaptive-concurrency",optional_argument,	NULL,	ADAPTIVECONCURRENCY},
 	{"retries",		optional_argument,	NULL,	RETRIES},
 	{"ignore-failures",	optional_argument,	NULL,	IGNOREFAILURES},
 	{"exit-on-sync-skipping",optional_argument,	NULL,	EXITONSYNCSKIP},
@@ -161,6 +165,10 @@ static const struct option long_options[] =
 	{"dump-dir",		required_argument,	NULL,	DUMPDIR},
 	{"quiet",		optional_argument,	NULL,	QUIET},
 	{"monitor",		required_argument,	NULL,	MONITOR},
+#ifdef INOTIFY_SUPPORT
+	{"reader-thread",	optional_argument,	NULL,	READERTHREAD},
+#endif
+	{"walk-threads",	required_argument,	NULL,	WALKTHREADS},
 	{"label",		required_argument,	NULL,	LABEL},
 	{"help",		optional_argument,	NULL,	HELP},
 	{"version",		optional_argument,	NULL,	SHOW_VERSION},
@@ -345,6 +353,7 @@ static char *const modes[] = {
 	[MODE_RSYNCDIRECT]	= "rsyncdirect",
 	[MODE_RSYNCSO]		= "rsyncso",
 	[MODE_SO]		= "so",
+	[MODE_COPROCESS]	= "coprocess",
 	NULL
 };
 
@@ -525,6 +534,9 @@ int version() {
 #ifdef CGROUP_SUPPORT
 		" -DCGROUP_SUPPORT"
 #endif
+#ifdef IOURING_SUPPORT
+		" -DIOURING_SUPPORT"
+#endif
 #ifdef TRE_SUPPORT
 		" -DTRE_SUPPORT"
 #endif
@@ -614,6 +626,11 @@ const char *parameter_get_wmacro(const char *variable_name, void *_ctx_p) {
 		return NULL;
 	}
 
+	if (r == dosync_arg.failf_path) {
+		ctx_p->synchandler_argf |= SHFL_FAILED_LIST_PATH;
+		return NULL;
+	}
+
 	errno = ENOENT;
 	return NULL;
 }
@@ -808,6 +825,40 @@ static int synchandler_arg1(char *arg, size_t arg_len, void *_ctx_p) {
 	return synchandler_arg(arg, arg_len, _ctx_p, SHARGS_INITIAL);
 }
 
+/**
+ * @brief 			Parses a delay value: "30" and "0.05" are seconds, "50ms" is milliseconds
+ * 
+ * @param[in]	arg		The value
+ * @param[out]	delay_p		Pointer to the result (in milliseconds)
+ * 
+ * @retval	zero		Successful
+ * @retval	non-zero	If got error, the error-code
+ * 
+ */
+int parse_delay(const char *arg, unsigned long *delay_p) {
+	char *end;
+	double value;
+
+	errno = 0;
+	value = strtod(arg, &end);
+	if (errno || (end == arg) || (value < 0))
+		goto l_parse_delay_einval;
+
+	if (!*end || !strcmp(end, "s"))
+		value *= 1000;
+	else
+	if (strcmp(end, "ms"))
+		goto l_parse_delay_einval;
+
+	*delay_p = (unsigned long)(value + 0.5);
+	return 0;
+
+l_parse_delay_einval:
+	errno = EINVAL;
+	error("Invalid delay value: \"%s\" (expected seconds like \"30\" or \"0.05\", or milliseconds like \"50ms\")", arg);
+	return errno;
+}
+
 int parse_customsignals(ctx_t *ctx_p, char *arg) {
 	char *ptr = arg, *start = arg;
 	unsigned int signal;
@@ -1334,13 +1385,16 @@ int parse_parameter(ctx_t *ctx_p, uint16_t param_id, char *arg, paramsource_t pa
 			break;
 		}
 		case SYNCDELAY: 
-			ctx_p->syncdelay		= (unsigned int)atol(arg);
+			if (parse_delay(arg, &ctx_p->syncdelay))
+				return errno;
 			break;
 		case DELAY:
-			ctx_p->_queues[QUEUE_NORMAL].collectdelay  = (unsigned int)atol(arg);
+			if (parse_delay(arg, &ctx_p->_queues[QUEUE_NORMAL].collectdelay))
+				return errno;
 			break;
 		case BFILEDELAY:
-			ctx_p->_queues[QUEUE_BIGFILE].collectdelay = (unsigned int)atol(arg);
+			if (parse_delay(arg, &ctx_p->_queues[QUEUE_BIGFILE].collectdelay))
+				return errno;
 			break;
 		case BFILETHRESHOLD:
 			ctx_p->bfilethreshold = (unsigned long)atol(arg);
@@ -2021,10 +2075,69 @@ int ctx_check(ctx_t *ctx_p) {
 	}
 
 #ifdef FANOTIFY_SUPPORT
-	if (ctx_p->flags[MONITOR] == NE_FANOTIFY)
-		critical("fanotify is not supported, now!");
-	else
+	// fanotify_handle() resolves directory file handles with open_by_handle_at(), it requires CAP_DAC_READ_SEARCH
+	if (ctx_p->flags[MONITOR] == NE_FANOTIFY) {
+		if (ctx_p->flags[SPLITTING] != SM_OFF) {
+			ret = errno = EINVAL;
+			error("\"--monitor=fanotify\" cannot be used with \"--splitting\" (CAP_DAC_READ_SEARCH is required to resolve paths).");
+		}
+# ifdef CAPABILITIES_SUPPORT
+		if (!(ctx_p->caps & CAP_TO_MASK(CAP_DAC_READ_SEARCH))) {
+			ret = errno = EINVAL;
+			error("\"--monitor=fanotify\" requires CAP_DAC_READ_SEARCH to be preserved (see \"--preserve-capabilities\").");
+		}
+# endif
+	}
+#endif
+
+#ifdef INOTIFY_SUPPORT
+	if (ctx_p->flags[READERTHREAD] && ctx_p->flags[MONITOR] != NE_INOTIFY) {
+		ret = errno = EINVAL;
+		error("Option \"--reader-thread\" is supported only with \"--monitor=inotify\".");
+	}
+#endif
+
+	if (ctx_p->flags[SYNCWORKERS] < 1) {
+		ret = errno = EINVAL;
+		error("Option \"--sync-workers\" should be positive.");
+	}
+
+	if (ctx_p->flags[ADAPTIVECONCURRENCY] && !ctx_p->flags[THREADING])
+		warning("Option \"--adaptive-concurrency\" is useless without \"--threading\".");
+
+	if (ctx_p->flags[WALKTHREADS] < 0) {
+		ret = errno = EINVAL;
+		error("Option \"--walk-threads\" cannot be negative.");
+	}
+#ifdef CAPABILITIES_SUPPORT
+	if (ctx_p->flags[WALKTHREADS] > 1 && ctx_p->flags[SPLITTING] != SM_OFF && !ctx_p->flags[PASS_DIRFDS]) {
+		ret = errno = EINVAL;
+		error("Option \"--walk-threads\" cannot be used with \"--splitting\" without \"--pass-dirfds\" (directories are read by the privileged process).");
+	}
+	if (ctx_p->flags[MODE] == MODE_COPROCESS && ctx_p->flags[SPLITTING] == SM_PROCESS) {
+		ret = errno = EINVAL;
+		error("\"--mode=coprocess\" cannot be used with \"--splitting=process\" (the socket to the co-process cannot be inherited from the privileged process).");
+	}
+	if (ctx_p->flags[PASS_DIRFDS] && ctx_p->flags[SPLITTING] == SM_OFF) {
+		ret = errno = EINVAL;
+		error("Option \"--pass-dirfds\" requires \"--splitting\".");
+	}
+# ifdef SECCOMP_SUPPORT
+	if (ctx_p->flags[PASS_DIRFDS] && ctx_p->flags[SECCOMP_FILTER]) {
+		ret = errno = EINVAL;
+		error("Option \"--pass-dirfds\" cannot be used with \"--seccomp-filter\" (the directories are read by threads).");
+	}
+# endif
+	if (ctx_p->flags[PRIVILEGED_BENCHMARK] < 0) {
+		ret = errno = EINVAL;
+		error("Option \"--privileged-benchmark\" cannot be negative.");
+	}
+	if (ctx_p->flags[PRIVILEGED_BENCHMARK] && ctx_p->flags[SPLITTING] == SM_OFF) {
+		ret = errno = EINVAL;
+		error("Option \"--privileged-benchmark\" requires \"--splitting\".");
+	}
 #endif
+
 	switch (ctx_p->flags[MONITOR]) {
 #ifdef INOTIFY_SUPPORT
 		case NE_INOTIFY:
@@ -2184,8 +2297,12 @@ int becomedaemon() {
 
 int main_cleanup(ctx_t *ctx_p) {
 	int i=0;
-	while((i < MAXRULES) && (ctx_p->rules[i].mask != RA_NONE))
-		regfree(&ctx_p->rules[i++].expr);
+	while((i < MAXRULES) && (ctx_p->rules[i].mask != RA_NONE)) {
+		regfree(&ctx_p->rules[i].expr);
+		free(ctx_p->rules[i].match);
+		ctx_p->rules[i++].match = NULL;
+	}
+	rules_cache_invalidate();
 
 	debug(3, "%i %i %i %i", ctx_p->watchdirsize, ctx_p->watchdirwslashsize, ctx_p->destdirsize, ctx_p->destdirwslashsize);
 
@@ -2288,6 +2405,7 @@ int main(int _argc, char *_argv[]) {
 #endif
 	ctx_p->config_block			 = DEFAULT_CONFIG_BLOCK;
 	ctx_p->retries				 = DEFAULT_RETRIES;
+	ctx_p->flags[SYNCWORKERS]		 = DEFAULT_SYNCWORKERS;
 	ctx_p->flags[VERBOSE]			 = DEFAULT_VERBOSE;
 #ifdef PIVOTROOT_OPT_SUPPORT
 	ctx_p->flags[PIVOT_ROOT]		 = DEFAULT_PIVOT_MODE;
@@ -2360,6 +2478,9 @@ int main(int _argc, char *_argv[]) {
 			case MODE_RSYNCSHELL:
 				args_line0 = (ctx_p->flags[RSYNCPREFERINCLUDE]) ? DEFAULT_SYNCHANDLER_ARGS_RSHELL_I  : DEFAULT_SYNCHANDLER_ARGS_RSHELL_E;
 				break;
+			case MODE_COPROCESS:
+				args_line0 = DEFAULT_SYNCHANDLER_ARGS_COPROCESS;
+				break;
 			default:
 				break;
 		}
@@ -2817,7 +2938,8 @@ int main(int _argc, char *_argv[]) {
 			ctx_p->synchandler_argf & 
 			(
 				SHFL_INCLUDE_LIST_PATH |
-				SHFL_EXCLUDE_LIST_PATH
+				SHFL_EXCLUDE_LIST_PATH |
+				SHFL_FAILED_LIST_PATH
 			)
 		)
 	) {
@@ -32,6 +32,7 @@
 
 #include <sys/ipc.h>			// shmget()
 #include <sys/shm.h>			// shmget()
+#include <sys/mman.h>			// mmap()
 
 #include "malloc.h"
 #include "error.h"
@@ -180,11 +181,9 @@ int memory_init() {
 	return 0;
 }
 
-void *shm_malloc_try(size_t size) {
+// A separate SysV segment, is used if the arena is exhausted
+static void *shm_malloc_segment(size_t size) {
 	void *ret;
-#ifdef PARANOID
-	size++;
-#endif
 	int privileged_shmid = shmget(0, size, IPC_PRIVATE|IPC_CREAT|0600);
 	struct shmid_ds shmid_ds;
 	if (privileged_shmid == -1) return NULL;
@@ -209,6 +208,100 @@ void *shm_malloc_try(size_t size) {
 	return ret;
 }
 
+/*
+ * Shared memory is allocated from one arena: an anonymous shared mapping that
+ * is inherited by the privileged process on fork(). Objects are placed by an
+ * atomic bump of the offset. Objects of a page or bigger are page-aligned and
+ * don't share pages (to be mprotect()-able, see "--shm-mprotect"). The arena
+ * is rewound when all the objects are freed.
+ */
+struct shm_arena {
+	size_t		size;
+	size_t		pagesize;
+	size_t		offset;		/* from the beginning of the arena */
+	long		count;		/* of allocated objects */
+};
+static struct shm_arena *shm_arena_p = NULL;
+
+static struct shm_arena *shm_arena_get() {
+	struct shm_arena *arena_p = __atomic_load_n(&shm_arena_p, __ATOMIC_ACQUIRE), *expected = NULL;
+
+	if (arena_p != NULL)
+		return arena_p;
+
+	arena_p = mmap(NULL, SHM_ARENA_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (arena_p == MAP_FAILED) {
+		error("Cannot mmap() the shared memory arena (%u bytes).", SHM_ARENA_SIZE);
+		return NULL;
+	}
+	arena_p->size     = SHM_ARENA_SIZE;
+	arena_p->pagesize = sysconf(_SC_PAGE_SIZE);
+	arena_p->offset   = sizeof(*arena_p);
+	arena_p->count    = 0;
+
+	if (!__atomic_compare_exchange_n(&shm_arena_p, &expected, arena_p, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		munmap(arena_p, SHM_ARENA_SIZE);
+		return expected;
+	}
+
+	debug(3, "The shared memory arena is at %p", arena_p);
+	return arena_p;
+}
+
+static inline int shm_arena_contains(struct shm_arena *arena_p, void *ptr) {
+	return arena_p != NULL && (char *)ptr >= (char *)arena_p && (char *)ptr < (char *)arena_p + arena_p->size;
+}
+
+static void *shm_arena_alloc(struct shm_arena *arena_p, size_t size) {
+	size_t align = (size >= arena_p->pagesize) ? arena_p->pagesize : SHM_ARENA_ALIGN;
+	size_t offset, start, end;
+
+	size = (size + align-1) & ~(align-1);
+
+	__atomic_add_fetch(&arena_p->count, 1, __ATOMIC_ACQ_REL);
+	offset = __atomic_load_n(&arena_p->offset, __ATOMIC_ACQUIRE);
+	do {
+		start = (offset + align-1) & ~(align-1);
+		end   = start + size;
+		if (end > arena_p->size || end < start) {
+			__atomic_sub_fetch(&arena_p->count, 1, __ATOMIC_ACQ_REL);
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&arena_p->offset, &offset, end, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	debug(15, "ret == %p (%zu bytes)", (char *)arena_p + start, size);
+	return (char *)arena_p + start;
+}
+
+static void shm_arena_free(struct shm_arena *arena_p, void *ptr) {
+	size_t offset = __atomic_load_n(&arena_p->offset, __ATOMIC_ACQUIRE);
+
+	if (__atomic_sub_fetch(&arena_p->count, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	// It was the last object; fails if somebody has just allocated something
+	__atomic_compare_exchange_n(&arena_p->offset, &offset, sizeof(*arena_p), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	return;
+}
+
+void *shm_malloc_try(size_t size) {
+	struct shm_arena *arena_p;
+	void *ret;
+#ifdef PARANOID
+	size++;
+#endif
+
+	arena_p = shm_arena_get();
+	if (arena_p != NULL) {
+		ret = shm_arena_alloc(arena_p, size);
+		if (ret != NULL)
+			return ret;
+		debug(1, "The shared memory arena is exhausted, falling back to a separate segment (%zu bytes)", size);
+	}
+
+	return shm_malloc_segment(size);
+}
+
 void *shm_malloc(size_t size) {
 	void *ret;
 
@@ -236,7 +329,14 @@ void *shm_calloc(size_t nmemb, size_t size) {
 }
 
 void shm_free(void *ptr) {
+	struct shm_arena *arena_p = __atomic_load_n(&shm_arena_p, __ATOMIC_ACQUIRE);
 	debug(25, "(%p)", ptr);
+
+	if (shm_arena_contains(arena_p, ptr)) {
+		shm_arena_free(arena_p, ptr);
+		return;
+	}
+
 	shmdt(ptr);
 }
 
@@ -811,7 +811,7 @@ int bsm_add_watch_dir(struct ctx *ctx_p, struct indexes *indexes_p, const char *
 		id = (int)((unsigned int)~0 >> 2);
 
 	// TODO: optimize this line out:
-	while (indexes_wd2fpath(indexes_p, id) != NULL)
+	while (indexes_wd2node(indexes_p, id) != NULL)
 		id++;
 
 	return id++;
@@ -1,62 +1,469 @@
 /*
     clsync - file tree sync utility based on inotify/kqueue
-    
+
     Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
-    
+
     This program is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
     the Free Software Foundation, either version 3 of the License, or
     (at your option) any later version.
-    
+
     This program is distributed in the hope that it will be useful,
     but WITHOUT ANY WARRANTY; without even the implied warranty of
     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
     GNU General Public License for more details.
-    
+
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#if 0
+#include "common.h"
+#include "error.h"
+#include "malloc.h"
+#include "sync.h"
+#include "indexes.h"
+#include "rules.h"
+#include "mon_fanotify.h"
+
+/*
+ * The whole filesystem (or mount) is marked at once, so there's no
+ * per-directory marks. Events are reported with the file handle of the
+ * parent directory and the name of the object (FAN_REPORT_DFID_NAME).
+ * The handles are resolved to paths with open_by_handle_at() (requires
+ * CAP_DAC_READ_SEARCH) and cached until the directory or any of it's
+ * parents is moved/removed.
+ */
+
+struct fanotify_dir {
+	char		*path;
+	size_t		 path_len;
+	ruleaction_t	 perm;		// RA_WALK if the directory and all it's parents are not excluded
+};
+typedef struct fanotify_dir fanotify_dir_t;
+
+static int fanotify_mount_d = -1;	// any descriptor on the filesystem, for open_by_handle_at()
+static int fanotify_wd      = -1;	// pseudo watch descriptor of the watch dir
 
-int fanotify_add_watch_dir(int fanotify_d, struct ctx *ctx_p, const char *const accpath) {
-	return fanotify_mark(fanotify_d, FAN_MARK_ADD | FAN_MARK_DONT_FOLLOW,
-		FANOTIFY_MARKMASK, AT_FDCWD, accpath);
+static GHashTable *fanotify_handle2dir_ht = NULL;
+
+// The buffer is reused for every drain (to do not allocate anything per event)
+static char fanotify_buf[FANOTIFY_BUFSIZE] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+
+static char   *path_rel		= NULL;
+static size_t  path_rel_len	= 0;
+static char   *path_full	= NULL;
+static size_t  path_full_size	= 0;
+static time_t  fanotify_emptied_at = 0;	// when the queue was last drained to empty
+
+static guint fanotify_handle_hash(gconstpointer key) {
+	const struct file_handle *fh = key;
+	const unsigned char *ptr = fh->f_handle, *end = &fh->f_handle[fh->handle_bytes];
+	guint hash = 2166136261U ^ fh->handle_type;
+
+	while (ptr < end)
+		hash = (hash ^ *(ptr++)) * 16777619U;
+
+	return hash;
 }
 
-int fanotify_loop(int fanotify_d, ctx_t *ctx_p, indexes_t *indexes_p) {
-	struct fanotify_event_metadata buf[BUFSIZ/sizeof(struct fanotify_event_metadata) + 1];
-	int state = STATE_RUNNING;
-	state_p = &state;
+static gboolean fanotify_handle_equal(gconstpointer a, gconstpointer b) {
+	const struct file_handle *fh_a = a, *fh_b = b;
 
-	while(state != STATE_EXIT) {
-		struct fanotify_event_metadata *metadata;
-		size_t len = read(fanotify_d, (void *)buf, sizeof(buf)-sizeof(*buf));
-		metadata=buf;
-		if(len == -1) {
-			error("cannot read(%i, &metadata, sizeof(metadata)).", fanotify_d);
-			return errno;
+	if (fh_a->handle_bytes != fh_b->handle_bytes || fh_a->handle_type != fh_b->handle_type)
+		return FALSE;
+
+	return !memcmp(fh_a->f_handle, fh_b->f_handle, fh_a->handle_bytes);
+}
+
+static void fanotify_dir_free(gpointer dir_gp) {
+	fanotify_dir_t *dir_p = dir_gp;
+	free(dir_p->path);
+	free(dir_p);
+	return;
+}
+
+int fanotify_init_engine(ctx_t *ctx_p) {
+	int fanotify_d;
+	debug(3, "");
+
+	fanotify_d = fanotify_init(FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
+	if (fanotify_d == -1) {
+		error("cannot fanotify_init(%i, %i).", FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
+		return -1;
+	}
+
+	fanotify_mount_d = open(ctx_p->watchdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fanotify_mount_d == -1) {
+		error("Cannot open(\"%s\").", ctx_p->watchdir);
+		close(fanotify_d);
+		return -1;
+	}
+
+	// Marking the whole filesystem. It's done here (not in fanotify_add_watch_dir())
+	// because CAP_SYS_ADMIN is not available after privileged_init().
+
+	if (fanotify_mark(fanotify_d, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FANOTIFY_MARKMASK, AT_FDCWD, ctx_p->watchdir)) {
+		debug(1, "Cannot fanotify_mark(..., FAN_MARK_FILESYSTEM, ...) on \"%s\": %s. Trying FAN_MARK_MOUNT.", ctx_p->watchdir, strerror(errno));
+
+		if (fanotify_mark(fanotify_d, FAN_MARK_ADD|FAN_MARK_MOUNT, FANOTIFY_MARKMASK_MOUNT, AT_FDCWD, ctx_p->watchdir)) {
+			error("Cannot fanotify_mark() on \"%s\".", ctx_p->watchdir);
+			close(fanotify_mount_d);
+			close(fanotify_d);
+			return -1;
 		}
-		while(FAN_EVENT_OK(metadata, len)) {
-			debug(2, "metadata->pid: %i; metadata->fd: %i", metadata->pid, metadata->fd);
-			if (metadata->fd != FAN_NOFD) {
-				if (metadata->fd >= 0) {
-					char *fpath = fd2fpath_malloc(metadata->fd);
-					sync_queuesync(fpath_rel, 0, ctx_p, indexes_p, QUEUE_AUTO);
-					debug(2, "Event %i on \"%s\".", metadata->mask, fpath);
-					free(fpath);
-				}
-			}
-			close(metadata->fd);
-			metadata = FAN_EVENT_NEXT(metadata, len);
+
+		warning("Only file modifications are being monitored (the mount mark doesn't report directory entry events).");
+	}
+
+	fanotify_handle2dir_ht = g_hash_table_new_full(fanotify_handle_hash, fanotify_handle_equal, free, fanotify_dir_free);
+
+	ctx_p->fsmondata = (void *)(long)fanotify_d;
+	return fanotify_d;
+}
+
+int fanotify_add_watch_dir(ctx_t *ctx_p, indexes_t *indexes_p, const char *const accpath) {
+	// The filesystem is already marked by fanotify_init_engine(), just returning a pseudo watch descriptor
+	fanotify_wd = (int)(long)ctx_p->fsmondata;
+	return fanotify_wd;
+}
+
+int fanotify_wait(ctx_t *ctx_p, struct indexes *indexes_p, struct timeval *tv_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+	int done_fd    = ctx_p->flags[THREADING] ? thread_done_fd_watch() : -1;
+	int nfds       = (done_fd > fanotify_d ? done_fd : fanotify_d) + 1;
+
+	debug(3, "select with timeout %li.%06li secs (fd == %u).", tv_p->tv_sec, tv_p->tv_usec, fanotify_d);
+	fd_set rfds;
+	FD_ZERO(&rfds);
+	FD_SET(fanotify_d, &rfds);
+	if (done_fd != -1)
+		FD_SET(done_fd, &rfds);
+	int ret = select(nfds, &rfds, NULL, NULL, tv_p);
+
+	// A sync is finished: returning "no events" to get thread_gc() called
+	if (ret > 0 && !FD_ISSET(fanotify_d, &rfds))
+		return 0;
+
+	return ret;
+}
+
+// Checks the directory and all it's parents by rules (like sync_mark_walk() does while walking)
+
+static inline ruleaction_t fanotify_dir_getperm(ctx_t *ctx_p, char *path_rel) {
+	char *ptr;
+
+	if (!*path_rel)
+		return RA_WALK;
+
+	ptr = path_rel;
+	while (1) {
+		char *end = strchr(ptr, '/');
+
+		if (end != NULL)
+			*end = 0;
+
+		ruleaction_t perm = rules_search_getperm(path_rel, S_IFDIR, ctx_p->rules, RA_WALK, NULL);
+
+		if (end == NULL)
+			return perm & RA_WALK;
+
+		*end = '/';
+		if (!(perm & RA_WALK))
+			return 0;
+
+		ptr = &end[1];
+	}
+}
+
+static fanotify_dir_t *fanotify_handle2dir(ctx_t *ctx_p, struct file_handle *fh) {
+	static char fdpath[sizeof("/proc/self/fd/") + 3*sizeof(int)];
+	static char dirpath[PATH_MAX + 1];
+	fanotify_dir_t *dir_p;
+	ssize_t dirpath_len;
+	size_t watchdirlen;
+	int fd;
+
+	dir_p = g_hash_table_lookup(fanotify_handle2dir_ht, fh);
+	if (dir_p != NULL)
+		return dir_p;
+
+	fd = open_by_handle_at(fanotify_mount_d, fh, O_PATH|O_CLOEXEC);
+	if (fd == -1) {
+		debug(2, "Cannot open_by_handle_at(): %s. Seems, that the directory had been deleted.", strerror(errno));
+		return NULL;
+	}
+
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%i", fd);
+	dirpath_len = readlink(fdpath, dirpath, PATH_MAX);
+	close(fd);
+	if (dirpath_len == -1) {
+		error("Cannot readlink(\"%s\").", fdpath);
+		return NULL;
+	}
+	dirpath[dirpath_len] = 0;
+
+	dir_p = xmalloc(sizeof(*dir_p));
+	dir_p->path     = xmalloc(dirpath_len+1);
+	dir_p->path_len = dirpath_len;
+	memcpy(dir_p->path, dirpath, dirpath_len+1);
+
+	// Skipping everything outside of the watch dir and in excluded directories
+
+	watchdirlen = (ctx_p->watchdir == ctx_p->watchdirwslash) ? 0 : ctx_p->watchdirlen;
+	if (
+		(dirpath_len == ctx_p->watchdirlen && !memcmp(dirpath, ctx_p->watchdir, dirpath_len)) ||
+		(dirpath_len >  watchdirlen && dirpath[watchdirlen] == '/' && !memcmp(dirpath, ctx_p->watchdir, watchdirlen))
+	)
+		dir_p->perm = fanotify_dir_getperm(ctx_p, dirpath_len > watchdirlen ? &dirpath[watchdirlen+1] : "");
+	else
+		dir_p->perm = 0;
+
+	debug(3, "\"%s\" -> perm 0x%x", dir_p->path, dir_p->perm);
+
+	size_t fh_size = sizeof(*fh) + fh->handle_bytes;
+	struct file_handle *fh_dup = xmalloc(fh_size);
+	memcpy(fh_dup, fh, fh_size);
+	g_hash_table_insert(fanotify_handle2dir_ht, fh_dup, dir_p);
+
+	return dir_p;
+}
+
+struct fanotify_forget_arg {
+	const char	*path;
+	size_t		 path_len;
+	fanotify_dir_t	*dir_p;
+	int		 dir_forgotten;
+};
+
+static gboolean fanotify_dir_forget_cb(gpointer fh_gp, gpointer dir_gp, gpointer arg_gp) {
+	fanotify_dir_t *dir_p = dir_gp;
+	struct fanotify_forget_arg *arg_p = arg_gp;
+
+	if (dir_p->path_len < arg_p->path_len || memcmp(dir_p->path, arg_p->path, arg_p->path_len))
+		return FALSE;
+	if (dir_p->path_len > arg_p->path_len && dir_p->path[arg_p->path_len] != '/')
+		return FALSE;
+
+	if (dir_p == arg_p->dir_p)
+		arg_p->dir_forgotten = 1;
+
+	return TRUE;
+}
+
+/*
+ * Drops the cached paths of the directory "name" in "dir_p" (or of "dir_p"
+ * itself if "name" is empty) and of all it's subdirectories.
+ * Returns non-zero if "dir_p" is dropped as well.
+ */
+static int fanotify_dir_forget(fanotify_dir_t *dir_p, const char *name, size_t name_len) {
+	struct fanotify_forget_arg arg;
+	size_t path_full_memreq = dir_p->path_len + name_len + 2;
+	guint count;
+
+	if (path_full_size < path_full_memreq) {
+		path_full      = xrealloc(path_full, path_full_memreq + ALLOC_PORTION);
+		path_full_size = path_full_memreq + ALLOC_PORTION;
+	}
+
+	memcpy(path_full, dir_p->path, dir_p->path_len);
+	arg.path_len = dir_p->path_len;
+	if (name_len) {
+		path_full[arg.path_len++] = '/';
+		memcpy(&path_full[arg.path_len], name, name_len);
+		arg.path_len += name_len;
+	}
+	path_full[arg.path_len] = 0;
+
+	arg.path          = path_full;
+	arg.dir_p         = dir_p;
+	arg.dir_forgotten = 0;
+
+	count = g_hash_table_foreach_remove(fanotify_handle2dir_ht, fanotify_dir_forget_cb, &arg);
+	debug(3, "Forgot %u cached path(s) of \"%s\".", count, path_full);
+
+	return arg.dir_forgotten;
+}
+
+static inline void recognize_event(eventobjtype_t *objtype_old_p, eventobjtype_t *objtype_new_p, uint64_t mask) {
+	eventobjtype_t type = (mask & FAN_ONDIR ? EOT_DIR : EOT_FILE);
+	int is_created = mask & (FAN_CREATE|FAN_MOVED_TO);
+	int is_deleted = mask & (FAN_DELETE|FAN_DELETE_SELF|FAN_MOVED_FROM);
+
+	// The kernel merges events on the same object, so both could be set.
+	// In this case the current state is to be checked with lstat().
+	*objtype_old_p = (is_created && !is_deleted ? EOT_DOESNTEXIST : type);
+	*objtype_new_p = (is_deleted && !is_created ? EOT_DOESNTEXIST : type);
+
+	return;
+}
+
+int fanotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+	int count = 0;
+
+#ifdef PARANOID
+	g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+#endif
+
+	// The queue was empty at "since", so if it overflows the events are lost only after that moment
+	time_t since = fanotify_emptied_at;
+	int rescan = 0;
+
+	// Draining the fanotify queue until EAGAIN (the descriptor is non-blocking, see FANOTIFY_FLAGS)
+	while (1) {
+		struct fanotify_event_metadata *metadata;
+		ssize_t len = read(fanotify_d, fanotify_buf, FANOTIFY_BUFSIZE);
+		if (len <= 0) {
+			if (len == -1 && errno == EINTR)
+				continue;
+			if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				fanotify_emptied_at = time(NULL);
+				errno = 0;
+				break;
+			}
+
+			error("Got error while reading events from fanotify with read().");
+			count = -1;
+			goto l_fanotify_handle_end;
 		}
-		int ret;
-		if((ret=sync_idle(fanotify_d, ctx_p, indexes_p))) {
-			error("got error while sync_idle().");
-			return ret;
+
+		metadata = (struct fanotify_event_metadata *)fanotify_buf;
+		for (; FAN_EVENT_OK(metadata, len); metadata = FAN_EVENT_NEXT(metadata, len), count++) {
+			struct fanotify_event_info_fid *fid;
+			struct file_handle *fh;
+			fanotify_dir_t *dir_p;
+			const char *name;
+			size_t name_len;
+
+			if (metadata->vers != FANOTIFY_METADATA_VERSION) {
+				error("Unsupported fanotify metadata version: %u (expected: %u).", metadata->vers, FANOTIFY_METADATA_VERSION);
+				count = -1;
+				goto l_fanotify_handle_end;
+			}
+
+			if (metadata->mask & FAN_Q_OVERFLOW) {
+				warning("The fanotify queue overflowed, some events are lost.");
+				rescan = 1;
+				continue;
+			}
+
+			fid = (struct fanotify_event_info_fid *)((char *)metadata + metadata->metadata_len);
+			if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+				debug(2, "Skipping event 0x%llx with info type %u.", (unsigned long long)metadata->mask, fid->hdr.info_type);
+				continue;
+			}
+
+			fh    = (struct file_handle *)fid->handle;
+			name  = (const char *)&fh->f_handle[fh->handle_bytes];
+			dir_p = fanotify_handle2dir(ctx_p, fh);
+
+			if (name[0] == '.' && name[1] == 0)
+				name_len = 0;
+			else
+				name_len = strlen(name);
+
+			// Moved or removed directories make cached paths of their subtrees stale
+			if ((metadata->mask & FAN_ONDIR) && (metadata->mask & (FAN_MOVED_FROM|FAN_MOVED_TO|FAN_DELETE|FAN_DELETE_SELF|FAN_MOVE_SELF))) {
+				if (dir_p == NULL)
+					g_hash_table_remove_all(fanotify_handle2dir_ht);
+				else
+				if (fanotify_dir_forget(dir_p, name, name_len))
+					dir_p = fanotify_handle2dir(ctx_p, fh);
+			}
+
+			if (dir_p == NULL || !(dir_p->perm & RA_WALK)) {
+				debug(4, "Skipping event 0x%llx on \"%s\" (dir: \"%s\").", (unsigned long long)metadata->mask, name, dir_p == NULL ? "" : dir_p->path);
+				continue;
+			}
+
+			// Getting full path
+
+			size_t path_full_memreq = dir_p->path_len + name_len + 2;
+			if (path_full_size < path_full_memreq) {
+				path_full      = xrealloc(path_full, path_full_memreq + ALLOC_PORTION);
+				path_full_size = path_full_memreq + ALLOC_PORTION;
+			}
+
+			memcpy(path_full, dir_p->path, dir_p->path_len);
+			if (name_len) {
+				path_full[dir_p->path_len] = '/';
+				memcpy(&path_full[dir_p->path_len+1], name, name_len+1);
+			} else
+				path_full[dir_p->path_len] = 0;
+
+			debug(2, "Event 0x%llx on \"%s\".", (unsigned long long)metadata->mask, path_full);
+
+			// Getting infomation about file/dir/etc
+
+			eventobjtype_t objtype_old, objtype_new;
+			recognize_event(&objtype_old, &objtype_new, metadata->mask);
+
+			// Non-directories are lstat()-ed once per path on sync_prequeue_unload() if it's possible
+			int stat_deferred = ctx_p->stat_deferred && (objtype_new == EOT_FILE) && !(metadata->mask & (FAN_DELETE|FAN_DELETE_SELF|FAN_MOVED_FROM));
+
+			stat64_t lstat, *lstat_p;
+			mode_t st_mode;
+			size_t st_size;
+			if (stat_deferred || (objtype_new == EOT_DOESNTEXIST) || (ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT) || lstat64(path_full, &lstat)) {
+				if (!stat_deferred)
+					debug(2, "Cannot lstat64(\"%s\", lstat). Seems, that the object had been deleted (%i) or option \"--cancel-syscalls mon_stat\" (%i) is set.", path_full, objtype_new == EOT_DOESNTEXIST, ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT);
+				st_mode = (metadata->mask & FAN_ONDIR ? S_IFDIR : S_IFREG);
+				st_size = 0;
+				lstat_p = NULL;
+				if (!stat_deferred && objtype_old != EOT_DOESNTEXIST && (metadata->mask & (FAN_DELETE|FAN_DELETE_SELF|FAN_MOVED_FROM)))
+					objtype_new = EOT_DOESNTEXIST;
+			} else {
+				st_mode = lstat.st_mode;
+				st_size = lstat.st_size;
+				lstat_p = &lstat;
+			}
+
+			if (sync_prequeue_loadmark(1, ctx_p, indexes_p, path_full, NULL, lstat_p, objtype_old, objtype_new, metadata->mask, fanotify_wd, st_mode, st_size, &path_rel, &path_rel_len, NULL)) {
+				count = -1;
+				goto l_fanotify_handle_end;
+			}
 		}
 	}
-	return 0;
+
+	// Recovering lost events
+	if (rescan && sync_rescan(ctx_p, indexes_p, since - 1)) {
+		count = -1;
+		goto l_fanotify_handle_end;
+	}
+
+	// Globally queueing captured events:
+	// Moving events from local queue to global ones (once per drain)
+	sync_prequeue_unload(ctx_p, indexes_p);
+
+l_fanotify_handle_end:
+	return count;
 }
-#endif
 
+int fanotify_deinit(ctx_t *ctx_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+
+	if (fanotify_handle2dir_ht != NULL) {
+		g_hash_table_destroy(fanotify_handle2dir_ht);
+		fanotify_handle2dir_ht = NULL;
+	}
+
+	if (path_full != NULL) {
+		free(path_full);
+		path_full      = NULL;
+		path_full_size = 0;
+	}
+
+	if (path_rel != NULL) {
+		free(path_rel);
+		path_rel       = NULL;
+		path_rel_len   = 0;
+	}
+
+	if (fanotify_mount_d != -1) {
+		close(fanotify_mount_d);
+		fanotify_mount_d = -1;
+	}
+
+	debug(3, "Closing fanotify_d");
+	return close(fanotify_d);
+}
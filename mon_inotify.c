@@ -21,9 +21,12 @@
 #include "error.h"
 #include "sync.h"
 #include "indexes.h"
+#include "rules.h"
 #include "privileged.h"
 #include "mon_inotify.h"
 
+#include <sys/eventfd.h>
+
 enum event_bits {
 	UEM_DIR		= 0x01,
 	UEM_CREATED	= 0x02,
@@ -54,99 +57,626 @@ static inline void recognize_event(struct recognize_event_return *r, uint32_t ev
 
 int inotify_add_watch_dir(ctx_t *ctx_p, indexes_t *indexes_p, const char *const accpath) {
 	int inotify_d = (int)(long)ctx_p->fsmondata;
-	return privileged_inotify_add_watch(inotify_d, accpath, INOTIFY_MARKMASK, PC_INOTIFY_ADD_WATCH_DIR);
+	return privileged_inotify_add_watch(inotify_d, accpath, INOTIFY_MARKMASK);
+}
+
+#define INOTIFY_HANDLE_CONTINUE {\
+	ptr += sizeof(struct inotify_event) + event->len;\
+	count++;\
+	continue;\
+}
+
+// The buffer is reused for every drain (to do not allocate anything per event)
+static char inotify_buf[INOTIFY_BUFSIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+// === READER THREAD === {
+
+// "--reader-thread": a dedicated thread drains the inotify descriptor into a
+// single-producer/single-consumer ring of raw inotify records, so the kernel
+// queue is unloaded even while sync_loop() is busy with sync_idle().
+//
+// Records are stored contiguously; if a record doesn't fit till the end of
+// the buffer, the rest of the buffer is filled with a padding record (mask == 0).
+
+static struct inotify_ring {
+	char		*buf;
+	size_t		 size;		// power of 2
+	size_t		 head;		// bytes written ever; changed by the reader thread only
+	size_t		 tail;		// bytes consumed ever; changed by inotify_handle() only
+	size_t		 fill_max;	// the maximal fill level since the last stats output
+	unsigned long	 stalls;	// how many times the reader waited for free space
+	int		 waiting;	// the reader is waiting for free space
+	int		 running;
+	int		 wakeup_fd;	// eventfd: there's something new in the ring
+	int		 stop_fd;	// eventfd: the reader should exit
+	pthread_t	 thread;
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond;
+} ring = {
+	.wakeup_fd	= -1,
+	.stop_fd	= -1,
+	.mutex		= PTHREAD_MUTEX_INITIALIZER,
+	.cond		= PTHREAD_COND_INITIALIZER,
+};
+
+// The reader's own buffer
+static char inotify_reader_buf[INOTIFY_BUFSIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+static inline void inotify_ring_publish(size_t head) {
+	uint64_t one = 1;
+
+	__atomic_store_n(&ring.head, head, __ATOMIC_RELEASE);
+	if (write(ring.wakeup_fd, &one, sizeof(one)) == -1)
+		debug(1, "Cannot write() to the wakeup eventfd.");
+
+	return;
+}
+
+// Waits (if required) till there's "need" bytes free in the ring. Returns non-zero if the reader should exit.
+static inline int inotify_ring_waitspace(size_t head, size_t need) {
+	if (ring.size - (head - __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST)) >= need)
+		return 0;
+
+	inotify_ring_publish(head);
+
+	pthread_mutex_lock(&ring.mutex);
+	__atomic_store_n(&ring.waiting, 1, __ATOMIC_SEQ_CST);
+	while (ring.running && ring.size - (head - __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST)) < need)
+		pthread_cond_wait(&ring.cond, &ring.mutex);
+	__atomic_store_n(&ring.waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ring.mutex);
+
+	__atomic_add_fetch(&ring.stalls, 1, __ATOMIC_RELAXED);
+	return !ring.running;
+}
+
+static int inotify_ring_put(char *buf, size_t len, time_t emptied_at) {
+	size_t head = ring.head;
+	char *ptr =  buf;
+	char *end = &buf[len];
+
+	while (ptr < end) {
+		struct inotify_event *event = (struct inotify_event *)ptr;
+		size_t need = sizeof(*event) + event->len;
+		size_t off  = head & (ring.size-1);
+		size_t pad  = (off + need > ring.size) ? ring.size - off : 0;
+
+		if (inotify_ring_waitspace(head, pad + need))
+			return -1;
+
+		if (pad) {
+			struct inotify_event *padding = (struct inotify_event *)&ring.buf[off];
+			padding->wd     = -1;
+			padding->mask   = 0;
+			padding->cookie = 0;
+			padding->len    = pad - sizeof(*padding);
+			head += pad;
+			off   = 0;
+		}
+
+		memcpy(&ring.buf[off], ptr, need);
+		// The reader knows when the kernel queue was empty last time, passing it to inotify_handle() with the overflow
+		if (event->mask & IN_Q_OVERFLOW)
+			((struct inotify_event *)&ring.buf[off])->cookie = (uint32_t)emptied_at;
+		head += need;
+		ptr  += need;
+	}
+
+	inotify_ring_publish(head);
+	return 0;
+}
+
+static void *inotify_reader(void *_ctx_p) {
+	ctx_t *ctx_p  = _ctx_p;
+	int inotify_d = (int)(long)ctx_p->fsmondata;
+	int nfds      = MAX(inotify_d, ring.stop_fd) + 1;
+	time_t emptied_at = time(NULL);
+
+	debug(1, "Started the inotify reader thread.");
+
+	while (ring.running) {
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(inotify_d,    &rfds);
+		FD_SET(ring.stop_fd, &rfds);
+
+		if (select(nfds, &rfds, NULL, NULL, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Got error from select() in the inotify reader thread.");
+			break;
+		}
+
+		if (FD_ISSET(ring.stop_fd, &rfds))
+			break;
+
+		while (1) {
+			ssize_t r = read(inotify_d, inotify_reader_buf, INOTIFY_BUFSIZE);
+			if (r <= 0) {
+				if (r == -1 && errno == EINTR)
+					continue;
+				if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					emptied_at = time(NULL);
+					break;
+				}
+
+				error("Got error while reading events from inotify with read() in the reader thread.");
+				goto l_inotify_reader_end;
+			}
+
+			if (inotify_ring_put(inotify_reader_buf, r, emptied_at))
+				goto l_inotify_reader_end;
+		}
+	}
+
+l_inotify_reader_end:
+	debug(1, "The inotify reader thread is finished.");
+	return NULL;
+}
+
+int inotify_reader_start(ctx_t *ctx_p) {
+	ring.size = INOTIFY_RINGSIZE;
+	ring.buf  = xmalloc(ring.size);
+	ring.head = ring.tail = 0;
+
+	ring.wakeup_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ring.stop_fd   = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ring.wakeup_fd == -1 || ring.stop_fd == -1) {
+		error("Cannot eventfd().");
+		return errno;
+	}
+
+	ring.running = 1;
+	if ((errno = pthread_create(&ring.thread, NULL, inotify_reader, ctx_p))) {
+		ring.running = 0;
+		error("Cannot start the inotify reader thread.");
+		return errno;
+	}
+
+	return 0;
 }
 
+static void inotify_reader_stop() {
+	uint64_t one = 1;
+
+	if (ring.running) {
+		pthread_mutex_lock(&ring.mutex);
+		ring.running = 0;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.mutex);
+
+		if (write(ring.stop_fd, &one, sizeof(one)) == -1)
+			error("Cannot write() to the stop eventfd.");
+		pthread_join(ring.thread, NULL);
+	}
+
+	if (ring.wakeup_fd != -1)
+		close(ring.wakeup_fd);
+	if (ring.stop_fd   != -1)
+		close(ring.stop_fd);
+	ring.wakeup_fd = ring.stop_fd = -1;
+
+	free(ring.buf);
+	ring.buf = NULL;
+	return;
+}
+
+static inline size_t inotify_ring_fill() {
+	return __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) - ring.tail;
+}
+
+// Returns a contiguous chunk of records from the ring (or from the inotify descriptor directly if there's no reader thread)
+static inline ssize_t inotify_read(int inotify_d, char **buf_p) {
+	if (ring.buf == NULL) {
+		*buf_p = inotify_buf;
+		return read(inotify_d, inotify_buf, INOTIFY_BUFSIZE);
+	}
+
+	size_t fill = inotify_ring_fill();
+	if (!fill) {
+		errno = EAGAIN;
+		return -1;
+	}
+	ring.fill_max = MAX(ring.fill_max, fill);
+
+	size_t off = ring.tail & (ring.size-1);
+	*buf_p = &ring.buf[off];
+	return MIN(fill, ring.size - off);
+}
+
+static inline void inotify_read_done(size_t len) {
+	if (ring.buf == NULL)
+		return;
+
+	__atomic_store_n(&ring.tail, ring.tail + len, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring.waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ring.mutex);
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.mutex);
+	}
+	return;
+}
+
+// } === READER THREAD ===
+
 int inotify_wait(ctx_t *ctx_p, struct indexes *indexes_p, struct timeval *tv_p) {
 	int inotify_d = (int)(long)ctx_p->fsmondata;
+	int fd        = (ring.buf == NULL) ? inotify_d : ring.wakeup_fd;
+	int done_fd   = ctx_p->flags[THREADING] ? thread_done_fd_watch() : -1;
+	int nfds      = (done_fd > fd ? done_fd : fd) + 1;
+
+	while (1) {
+		if (ring.buf != NULL && inotify_ring_fill())
+			return 1;
+
+		debug(3, "select with timeout %li.%06li secs (fd == %u).", tv_p->tv_sec, tv_p->tv_usec, fd);
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		if (done_fd != -1)
+			FD_SET(done_fd, &rfds);
+		int ret = select(nfds, &rfds, NULL, NULL, tv_p);
+
+		// A sync is finished: returning "no events" to get thread_gc() called
+		if (ret > 0 && !FD_ISSET(fd, &rfds))
+			return 0;
+
+		if (ret <= 0 || ring.buf == NULL)
+			return ret;
+
+		// Resetting the eventfd counter; the ring could be already drained by the previous inotify_handle()
+		uint64_t value;
+		if (read(ring.wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+			return -1;
+	}
+}
+
+static char   *path_rel		= NULL;
+static size_t  path_rel_len	= 0;
+static char   *path_full	= NULL;
+static size_t  path_full_size	= 0;
+static time_t  inotify_emptied_at = 0;	// when the queue was last drained to empty
+
+// The last directory moved from (to be paired with IN_MOVED_TO by cookie)
+static uint32_t movedfrom_cookie	= 0;
+static char    *movedfrom_path		= NULL;
+static size_t   movedfrom_path_size	= 0;
+
+static struct inotify_stats {
+	uint64_t	since;		// CLOCK_MONOTONIC, in milliseconds
+	unsigned long	events;
+	unsigned long	collapsed;
+	unsigned long	drains;
+	unsigned long	overflows;	// IN_Q_OVERFLOW-s (since start)
+} stats = {0};
+
+// The results of the last completed stats interval, for inotify_stats_get() (called by the control thread)
+static struct {
+	pthread_mutex_t	mutex;
+	unsigned long	ring_fill_max;
+	unsigned long	events;
+	unsigned long	collapsed;
+	unsigned long	drains;
+	unsigned long	interval;
+} stats_last = {
+	.mutex		= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline void inotify_stats_update(unsigned long events, unsigned long collapsed) {
+	uint64_t now = clock_monotonic_ms();
+
+	if (!stats.since)
+		stats.since = now;
+
+	stats.events	+= events;
+	stats.collapsed	+= collapsed;
+	stats.drains++;
+
+	if (now - stats.since < INOTIFY_STATS_INTERVAL)
+		return;
+
+	debug(1, "%lu events/sec (%lu events, %lu collapsed duplicates, %lu drains per %lu ms); %lu kernel queue overflows.",
+		stats.events*1000 / (now - stats.since), stats.events, stats.collapsed, stats.drains, (unsigned long)(now - stats.since), stats.overflows);
+
+	pthread_mutex_lock(&stats_last.mutex);
+	stats_last.ring_fill_max = ring.fill_max;
+	stats_last.events        = stats.events;
+	stats_last.collapsed     = stats.collapsed;
+	stats_last.drains        = stats.drains;
+	stats_last.interval      = now - stats.since;
+	pthread_mutex_unlock(&stats_last.mutex);
 
-	debug(3, "select with timeout %li secs (fd == %u).", tv_p->tv_sec, inotify_d);
-	fd_set rfds;
-	FD_ZERO(&rfds);
-	FD_SET(inotify_d, &rfds);
-	return select(inotify_d+1, &rfds, NULL, NULL, tv_p);
+	if (ring.buf != NULL) {
+		debug(1, "Reader ring: %lu/%lu bytes filled (max %lu since the last report); the reader waited for free space %lu times.",
+			(unsigned long)inotify_ring_fill(), (unsigned long)ring.size, (unsigned long)ring.fill_max, __atomic_load_n(&ring.stalls, __ATOMIC_RELAXED));
+		ring.fill_max = 0;
+	}
+
+	stats.since	= now;
+	stats.events	= 0;
+	stats.collapsed	= 0;
+	stats.drains	= 0;
+	return;
 }
 
-#define INOTIFY_HANDLE_CONTINUE {\
-	ptr += sizeof(struct inotify_event) + event->len;\
-	count++;\
-	continue;\
+void inotify_stats_get(inotify_stats_report_t *report_p) {
+	memset(report_p, 0, sizeof(*report_p));
+
+	report_p->overflows = __atomic_load_n(&stats.overflows, __ATOMIC_RELAXED);
+
+	if (ring.buf != NULL) {
+		report_p->ring_fill   = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+		report_p->ring_size   = ring.size;
+		report_p->ring_stalls = __atomic_load_n(&ring.stalls, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&stats_last.mutex);
+	report_p->ring_fill_max = stats_last.ring_fill_max;
+	report_p->events        = stats_last.events;
+	report_p->collapsed     = stats_last.collapsed;
+	report_p->drains        = stats_last.drains;
+	report_p->interval      = stats_last.interval;
+	pthread_mutex_unlock(&stats_last.mutex);
+
+	if (report_p->interval)
+		report_p->events_per_sec = report_p->events*1000 / report_p->interval;
+
+	return;
+}
+
+// === DIRECTORY MOVES === {
+
+// Checks the directory and it's parents up to the moved one (of length "root_len") by
+// the walk rules, like sync_mark_walk_filter() does while walking
+
+static int inotify_dir_iswalkable(ctx_t *ctx_p, char *path_rel, size_t root_len) {
+	size_t len = root_len;
+
+	while (1) {
+		char c = path_rel[len];
+		char *end;
+
+		path_rel[len] = 0;
+		ruleaction_t perm = rules_search_getperm(path_rel, S_IFDIR, ctx_p->rules, RA_WALK, NULL);
+		path_rel[len] = c;
+
+		if (!(perm & RA_WALK))
+			return 0;
+		if (!c)
+			return 1;
+
+		end = strchr(&path_rel[len+1], '/');
+		len = (end == NULL) ? strlen(path_rel) : (size_t)(end - path_rel);
+	}
+}
+
+// Return: non-zero if the move cannot change which directories inside the moved one are to be watched
+
+static int inotify_move_keepsmarks(ctx_t *ctx_p, const char *path_rel_old, const char *path_rel_new) {
+	size_t len_old = strlen(path_rel_old), len_new = strlen(path_rel_new);
+	char *prefix_old = alloca(len_old + 2), *prefix_new = alloca(len_new + 2);
+	ruleaction_t perm, perm_old, perm_new;
+
+	perm = rules_search_getperm(path_rel_new, S_IFDIR, ctx_p->rules, RA_WALK, NULL);
+	if (!(perm & RA_WALK))
+		return 0;
+
+	memcpy(prefix_old, path_rel_old, len_old);
+	prefix_old[len_old] = '/';
+	prefix_old[len_old+1] = 0;
+	memcpy(prefix_new, path_rel_new, len_new);
+	prefix_new[len_new] = '/';
+	prefix_new[len_new+1] = 0;
+
+	if (rules_subtree_getperm(prefix_old, len_old + 1, S_IFDIR, ctx_p->rules, RA_WALK, &perm_old))
+		return 0;
+	if (rules_subtree_getperm(prefix_new, len_new + 1, S_IFDIR, ctx_p->rules, RA_WALK, &perm_new))
+		return 0;
+
+	return (perm_old & RA_WALK) == (perm_new & RA_WALK);
+}
+
+struct inotify_unmark_arg {
+	ctx_t	*ctx_p;
+	size_t	 path_rel_off;
+	size_t	 root_len;
+};
+
+static void inotify_unmark_excluded(gpointer fpath_gp, gpointer wd_gp, gpointer arg_gp) {
+	struct inotify_unmark_arg *arg_p = arg_gp;
+	char *path_rel = &((char *)fpath_gp)[arg_p->path_rel_off];
+	int wd = GPOINTER_TO_INT(wd_gp);
+
+	if (inotify_dir_iswalkable(arg_p->ctx_p, path_rel, arg_p->root_len))
+		return;
+
+	// The index is cleaned up on IN_IGNORED
+	debug(2, "\"%s\" is excluded after the move, removing it's watch (wd: %i).", (char *)fpath_gp, wd);
+	if (privileged_inotify_rm_watch((int)(long)arg_p->ctx_p->fsmondata, wd) == -1)
+		debug(2, "Cannot inotify_rm_watch(..., %i): %s.", wd, strerror(errno));
+
+	return;
+}
+
+/*
+ * Relabels the watches of the moved directory (to keep the paths of their
+ * wd-s valid) and removes the watches of directories excluded under the new
+ * path.
+ *
+ * Return: non-zero if the watches are already right, zero if the directory
+ * should be marked again (the rules may give different decisions after the move)
+ */
+static int inotify_move_marks(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_old, const char *path_new) {
+	struct inotify_unmark_arg arg;
+	size_t watchdirlen = (ctx_p->watchdir == ctx_p->watchdirwslash) ? 0 : ctx_p->watchdirlen;
+
+	if (indexes_rename_wd_subtree(indexes_p, path_old, path_new)) {
+		warning("Cannot relabel the watches of \"%s\", marking \"%s\" again.", path_old, path_new);
+		return 0;
+	}
+
+	if (inotify_move_keepsmarks(ctx_p, &path_old[watchdirlen+1], &path_new[watchdirlen+1]))
+		return 1;
+
+	debug(2, "The rules may differ for \"%s\" and \"%s\", marking it again.", path_old, path_new);
+
+	arg.ctx_p        = ctx_p;
+	arg.path_rel_off = watchdirlen + 1;
+	arg.root_len     = strlen(path_new) - arg.path_rel_off;
+	fpathtree_foreach(indexes_p->wd_tree, path_new, inotify_unmark_excluded, &arg);
+
+	return 0;
+}
+
+// } === DIRECTORY MOVES ===
+
+static inline int inotify_event_isduplicate(struct inotify_event *event, struct inotify_event *prev) {
+	if (prev == NULL)
+		return 0;
+
+	if (event->wd != prev->wd || event->mask != prev->mask || event->len != prev->len)
+		return 0;
+
+	return !memcmp(event->name, prev->name, event->len);
 }
 
 int inotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
-	static struct timeval tv={0};
 	int inotify_d = (int)(long)ctx_p->fsmondata;
 
-	int count = 0;
+	int count = 0, collapsed = 0;
 
-	fd_set rfds;
-	FD_ZERO(&rfds);
-	FD_SET(inotify_d, &rfds);
+	// The watch path already copied to "path_full" (to do not copy it again for every event on the same watch)
+	int    fpath_wd  = -1;
+	size_t fpath_len =  0;
 
-	char   *path_rel	= NULL;
-	size_t  path_rel_len	= 0;
-	char   *path_full	= NULL;
-	size_t  path_full_size	= 0;
-	while (select(FD_SETSIZE, &rfds, NULL, NULL, &tv)) {
+	// The queue was empty at "since", so if it overflows the events are lost only after that moment
+	time_t since = inotify_emptied_at;
+	int rescan = 0;
 
-		char buf[BUFSIZ + 1];
-		size_t r = read(inotify_d, buf, BUFSIZ);
+#ifdef PARANOID
+	g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+#endif
+
+	// Draining the inotify queue until EAGAIN (the descriptor is non-blocking, see INOTIFY_FLAGS)
+	while (1) {
+		char *buf;
+		ssize_t r = inotify_read(inotify_d, &buf);
 		if (r <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				inotify_emptied_at = time(NULL);
+				errno = 0;
+				break;
+			}
+
 			error("Got error while reading events from inotify with read().");
 			count = -1;
 			goto l_inotify_handle_end;
 		}
 
-#ifdef PARANOID
-		g_hash_table_remove_all(indexes_p->fpath2ei_ht);
-#endif
-
+		struct inotify_event *prev = NULL;
 		char *ptr =  buf;
 		char *end = &buf[r];
 		while (ptr < end) {
 			struct inotify_event *event = (struct inotify_event *)ptr;
 
+			// Skipping the padding record at the end of the reader ring
+			if (!event->mask) {
+				ptr += sizeof(struct inotify_event) + event->len;
+				continue;
+			}
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				stats.overflows++;
+				warning("The inotify kernel queue is overflowed, some events are lost (%lu overflows since start). Rescanning.", stats.overflows);
+				if (ring.buf != NULL && (time_t)event->cookie < since)
+					since = (time_t)event->cookie;
+				rescan = 1;
+				INOTIFY_HANDLE_CONTINUE;
+			}
+
+			// Skipping the same event as the previous one: the result would be the same
+
+			if (inotify_event_isduplicate(event, prev)) {
+				collapsed++;
+				INOTIFY_HANDLE_CONTINUE;
+			}
+			prev = event;
+
 			// Removing stale wd-s
 
 			if (event->mask & IN_IGNORED) {
 				debug(2, "Cleaning up info about watch descriptor %i.", event->wd);
 				indexes_remove_bywd(indexes_p, event->wd);
+				fpath_wd = -1;
 				INOTIFY_HANDLE_CONTINUE;
 			}
 
-			// Getting path
+			// Getting full path
 
-			char *fpath = indexes_wd2fpath(indexes_p, event->wd);
+			if (event->wd != fpath_wd) {
+				fpathtree_node_t *node_p = indexes_wd2node(indexes_p, event->wd);
 
-			if (fpath == NULL) {
-				debug(2, "Event %p on stale watch (wd: %i).", (void *)(long)event->mask, event->wd);
-				INOTIFY_HANDLE_CONTINUE;
-			}
-			debug(2, "Event %p on \"%s\" (wd: %i; fpath: \"%s\").", (void *)(long)event->mask, event->len>0?event->name:"", event->wd, fpath);
+				if (node_p == NULL) {
+					debug(2, "Event %p on stale watch (wd: %i).", (void *)(long)event->mask, event->wd);
+					INOTIFY_HANDLE_CONTINUE;
+				}
 
-			// Getting full path
+				fpath_len = fpathtree_node_path(node_p, &path_full, &path_full_size);
+				fpath_wd  = event->wd;
+			}
+			debug(2, "Event %p on \"%s\" (wd: %i; fpath: \"%.*s\").", (void *)(long)event->mask, event->len>0?event->name:"", event->wd, (int)fpath_len, path_full);
 
-			size_t path_full_memreq = strlen(fpath) + event->len + 2;
+			size_t path_full_memreq = fpath_len + event->len + 2;
 			if (path_full_size < path_full_memreq) {
-				path_full      = xrealloc(path_full, path_full_memreq);
-				path_full_size = path_full_memreq;
+				path_full      = xrealloc(path_full, path_full_memreq + ALLOC_PORTION);
+				path_full_size = path_full_memreq + ALLOC_PORTION;
 			}
 
-			if (event->len>0)
-				sprintf(path_full, "%s/%s", fpath, event->name);
-			else
-				sprintf(path_full, "%s", fpath);
+			// event->name is padded by zeros and event->len includes the terminating zero
+			if (event->len>0) {
+				path_full[fpath_len] = '/';
+				memcpy(&path_full[fpath_len+1], event->name, event->len);
+			} else
+				path_full[fpath_len] = 0;
 
 			// Getting infomation about file/dir/etc
 
 			struct  recognize_event_return r = {0};
 			recognize_event(&r, event->mask);
 
+			// Directory renames inside the watched tree: relabeling existing watches instead of re-marking
+			// the subtree (if the rules give the same decisions to it under the new path)
+
+			int monitored = 1;
+			if ((event->mask & (IN_ISDIR|IN_MOVED_FROM)) == (IN_ISDIR|IN_MOVED_FROM)) {
+				size_t path_full_len = strlen(path_full);
+				if (movedfrom_path_size < path_full_len + 1) {
+					movedfrom_path      = xrealloc(movedfrom_path, path_full_len + 1 + ALLOC_PORTION);
+					movedfrom_path_size = path_full_len + 1 + ALLOC_PORTION;
+				}
+				memcpy(movedfrom_path, path_full, path_full_len + 1);
+				movedfrom_cookie = event->cookie;
+			} else
+			if ((event->mask & (IN_ISDIR|IN_MOVED_TO)) == (IN_ISDIR|IN_MOVED_TO) && movedfrom_path != NULL && *movedfrom_path && movedfrom_cookie == event->cookie) {
+				debug(2, "Directory \"%s\" is moved to \"%s\": relabeling the watches.", movedfrom_path, path_full);
+				if (inotify_move_marks(ctx_p, indexes_p, movedfrom_path, path_full))
+					monitored = 0;	// Already marked
+				*movedfrom_path = 0;
+				fpath_wd = -1;	// The path of the watch could be changed
+			}
+
+			// Non-directories are lstat()-ed once per path on sync_prequeue_unload() if it's possible
+			int stat_deferred = ctx_p->stat_deferred && (r.objtype_new == EOT_FILE);
+
 			stat64_t lstat, *lstat_p;
 			mode_t st_mode;
 			size_t st_size;
-			if ((r.objtype_new == EOT_DOESNTEXIST) || (ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT) || lstat64(path_full, &lstat)) {
-				debug(2, "Cannot lstat64(\"%s\", lstat). Seems, that the object had been deleted (%i) or option \"--cancel-syscalls mon_stat\" (%i) is set.", path_full, r.objtype_new == EOT_DOESNTEXIST, ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT);
+			if (stat_deferred || (r.objtype_new == EOT_DOESNTEXIST) || (ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT) || lstat64(path_full, &lstat)) {
+				if (!stat_deferred)
+					debug(2, "Cannot lstat64(\"%s\", lstat). Seems, that the object had been deleted (%i) or option \"--cancel-syscalls mon_stat\" (%i) is set.", path_full, r.objtype_new == EOT_DOESNTEXIST, ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT);
 				st_mode = (event->mask & IN_ISDIR ? S_IFDIR : S_IFREG);
 				st_size = 0;
 				lstat_p = NULL;
@@ -156,31 +686,60 @@ int inotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
 				lstat_p = &lstat;
 			}
 
-			if (sync_prequeue_loadmark(1, ctx_p, indexes_p, path_full, NULL, lstat_p, r.objtype_old, r.objtype_new, event->mask, event->wd, st_mode, st_size, &path_rel, &path_rel_len, NULL)) {
+			if (sync_prequeue_loadmark(monitored, ctx_p, indexes_p, path_full, NULL, lstat_p, r.objtype_old, r.objtype_new, event->mask, event->wd, st_mode, st_size, &path_rel, &path_rel_len, NULL)) {
 				count = -1;
 				goto l_inotify_handle_end;
 			}
 
+			// New watches may be added while handling a directory event, so the cached watch path may be stale
+			if (event->mask & IN_ISDIR)
+				fpath_wd = -1;
+
 			INOTIFY_HANDLE_CONTINUE;
 		}
 
-		// Globally queueing captured events:
-		// Moving events from local queue to global ones
-		sync_prequeue_unload(ctx_p, indexes_p);
+		inotify_read_done(r);
 	}
 
-l_inotify_handle_end:
-	if (path_full != NULL)
-		free(path_full);
+	// Recovering lost events
+	if (rescan && sync_rescan(ctx_p, indexes_p, since - 1)) {
+		count = -1;
+		goto l_inotify_handle_end;
+	}
 
-	if (path_rel != NULL)
-		free(path_rel);
+	// Globally queueing captured events:
+	// Moving events from local queue to global ones (once per drain)
+	sync_prequeue_unload(ctx_p, indexes_p);
 
+	inotify_stats_update(count, collapsed);
+
+l_inotify_handle_end:
 	return count;
 }
 
 int inotify_deinit(ctx_t *ctx_p) {
 	int inotify_d = (int)(long)ctx_p->fsmondata;
+
+	inotify_reader_stop();
+
+	if (path_full != NULL) {
+		free(path_full);
+		path_full      = NULL;
+		path_full_size = 0;
+	}
+
+	if (path_rel != NULL) {
+		free(path_rel);
+		path_rel       = NULL;
+		path_rel_len   = 0;
+	}
+
+	if (movedfrom_path != NULL) {
+		free(movedfrom_path);
+		movedfrom_path      = NULL;
+		movedfrom_path_size = 0;
+	}
+
 	debug(3, "Closing inotify_d");
 	return close(inotify_d);
 }
@@ -20,5 +20,22 @@
 extern int inotify_wait(struct ctx *ctx_p, struct indexes *indexes_p, struct timeval *tv_p);
 extern int inotify_handle(struct ctx *ctx_p, struct indexes *indexes_p);
 extern int inotify_add_watch_dir(struct ctx *ctx_p, struct indexes *indexes_p, const char *const accpath);
+extern int inotify_reader_start(ctx_t *ctx_p);
 extern int inotify_deinit(ctx_t *ctx_p);
 
+struct inotify_stats_report {
+	unsigned long	overflows;	// IN_Q_OVERFLOW-s (since start)
+	unsigned long	ring_fill;	// bytes in the reader ring (now)
+	unsigned long	ring_size;	// 0 if there's no reader thread
+	unsigned long	ring_fill_max;	// the maximal fill level during the last stats interval
+	unsigned long	ring_stalls;	// how many times the reader waited for free space (since start)
+	unsigned long	events_per_sec;	// the rest is about the last stats interval
+	unsigned long	events;
+	unsigned long	collapsed;	// duplicate events collapsed into one
+	unsigned long	drains;
+	unsigned long	interval;	// in milliseconds
+};
+typedef struct inotify_stats_report inotify_stats_report_t;
+
+extern void inotify_stats_get(inotify_stats_report_t *report_p);
+
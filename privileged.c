@@ -20,7 +20,7 @@
 #include "common.h"			// ctx.h
 #include "ctx.h"			// ctx_t
 #include "error.h"			// debug()
-#include "syscalls.h"			// read_inf()/write_inf()
+#include "syscalls.h"			// futex()
 #include "main.h"			// ncpus
 #include "pthreadex.h"			// pthread_*_shared()
 #include "malloc.h"			// xmalloc()
@@ -33,27 +33,31 @@
 # include <fts.h>			// fts_open()
 # include <errno.h>			// errno
 # include <sys/capability.h>		// capset()
+# include <time.h>			// clock_gettime()
 # ifdef CGROUP_SUPPORT
 #  include "cgroup.h"			// clsync_cgroup_deinit()
 # endif
 #endif
 
 #include <unistd.h>			// execvp()
-#include <glib.h>			// g_atomic_int_set()
+#include <grp.h>			// setgroups()
+#include <glib.h>			// g_atomic_int_get()
 
 #ifdef UNSHARE_SUPPORT
 # include <sched.h>			// unshare()
 #endif
 
-#ifndef HL_LOCKS
-# ifdef HL_LOCK_TRIES_AUTO
-#  undef HL_LOCK_TRIES_AUTO
-# endif
+#ifdef __linux__
+# include <sched.h>			// clone()
+# include <signal.h>			// sigaction()
+# include <sys/mman.h>			// mmap(), mprotect()
+# include <sys/syscall.h>		// SYS_setuid
 #endif
 
-#ifdef HL_LOCK_TRIES_AUTO
-# include <time.h>			// time()
-# include <math.h>			// fabs()
+#ifdef HL_LOCKS
+# ifndef __linux__
+#  error Highload locks are based on futex() that is available only on Linux
+# endif
 #endif
 
 #include "privileged.h"
@@ -80,7 +84,21 @@
 	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, __NR_##syscall, 0, 1),	\
 	SECCOMP_ALLOW
 
+# ifdef __NR_statx
+#  define SECCOMP_ALLOW_STATX SECCOMP_ALLOW_ACCUM_SYSCALL(statx),
+# else
+#  define SECCOMP_ALLOW_STATX
+# endif
+
+# ifdef IOURING_SUPPORT
+#  define SECCOMP_ALLOW_IOURING SECCOMP_ALLOW_ACCUM_SYSCALL(io_uring_enter),
+# else
+#  define SECCOMP_ALLOW_IOURING
+# endif
+
 # define FILTER_TABLE_NONPRIV						\
+	SECCOMP_ALLOW_STATX						\
+	SECCOMP_ALLOW_IOURING						\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(futex),				\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(inotify_init1),			\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(alarm),				\
@@ -142,25 +160,161 @@ int nonprivileged_seccomp_init(ctx_t *ctx_p) {
 #endif
 
 int (*privileged_fork_execvp)(const char *file, char *const argv[]);
+int (*privileged_fork_execvpe)(const char *file, char *const argv[], char *const envp[], int keep_fd);
 int (*privileged_kill_child)(pid_t pid, int sig);
 
+#ifdef __linux__
+# ifdef SYS_setuid32
+#  define SYS_SETUID SYS_setuid32
+#  define SYS_SETGID SYS_setgid32
+#  define SYS_SETGROUPS SYS_setgroups32
+# else
+#  define SYS_SETUID SYS_setuid
+#  define SYS_SETGID SYS_setgid
+#  define SYS_SETGROUPS SYS_setgroups
+# endif
+
+struct spawn_arg {
+	const char	 *file;
+	char *const	 *argv;
+	char *const	 *envp;
+	int		  keep_fd;
+	uid_t		  uid;
+	gid_t		  gid;
+	sigset_t	 *sigset_p;
+};
+
+// Is run in the memory of the parent (CLONE_VM): no malloc(), locks or atexit() here
+static int spawn_child(void *_arg_p) {
+	struct spawn_arg *arg_p = _arg_p;
+	int signum;
+
+	// The handlers of the parent shouldn't be called on this stack
+	signum = 1;
+	while (signum < NSIG) {
+		struct sigaction sa;
+
+		if (!sigaction(signum, NULL, &sa) && (sa.sa_handler != SIG_IGN) && (sa.sa_handler != SIG_DFL)) {
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = SIG_DFL;
+			sigaction(signum, &sa, NULL);
+		}
+		signum++;
+	}
+	sigprocmask(SIG_SETMASK, arg_p->sigset_p, NULL);
+
+	// setgroups()/setgid()/setuid() of glibc would signal all the threads of the parent
+	if (!geteuid() && syscall(SYS_SETGROUPS, 0, NULL))
+		_exit(errno);
+	if (syscall(SYS_SETGID, arg_p->gid))
+		_exit(errno);
+	if (syscall(SYS_SETUID, arg_p->uid))
+		_exit(errno);
+
+	// The descriptor is close-on-exec in the parent to not leak to other children
+	if ((arg_p->keep_fd != -1) && fcntl(arg_p->keep_fd, F_SETFD, 0))
+		_exit(errno);
+
+	if (arg_p->envp != NULL)
+		execvpe(arg_p->file, arg_p->argv, arg_p->envp);
+	else
+		execvp(arg_p->file, arg_p->argv);
+	_exit(errno);
+}
+#endif
+
+/*
+ * Runs the file as the uid/gid. On Linux the caller is suspended until the
+ * child calls execvp() (CLONE_VM|CLONE_VFORK), so the page tables of a big
+ * process are not copied like on fork().
+ *
+ * If "envp" is not NULL, it's used instead of the environment of clsync.
+ * If "keep_fd" is not -1, the descriptor is inherited by the child even if
+ * it's close-on-exec.
+ */
+static pid_t spawn_execvp(const char *file, char *const argv[], char *const envp[], int keep_fd, uid_t uid, gid_t gid) {
+	pid_t pid;
+#ifdef __linux__
+	struct spawn_arg arg;
+	sigset_t sigset_all, sigset_old;
+	size_t argc, pagesize, stack_size, guard_size;
+	char *stack;
+
+	// execvp() copies the argv to the stack to run a script without "#!", so
+	// the stack is sized by the argv (like posix_spawn() of glibc does)
+	argc = 0;
+	while (argv[argc] != NULL)
+		argc++;
+	pagesize   = sysconf(_SC_PAGESIZE);
+	guard_size = pagesize;
+	stack_size = SPAWN_STACK_SIZE + (((argc + 2) * sizeof(*argv) + pagesize - 1) & ~(pagesize - 1));
+
+	// The child runs in the memory of the parent, so an overflow of the stack must fault instead of corrupting it
+	stack = mmap(NULL, guard_size + stack_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		error("Cannot mmap() a stack for a child.");
+		return -1;
+	}
+	if (mprotect(stack, guard_size, PROT_NONE)) {
+		error("Cannot mprotect() the guard page of the stack for a child.");
+		munmap(stack, guard_size + stack_size);
+		return -1;
+	}
+
+	arg.file     = file;
+	arg.argv     = argv;
+	arg.envp     = envp;
+	arg.keep_fd  = keep_fd;
+	arg.uid      = uid;
+	arg.gid      = gid;
+	arg.sigset_p = &sigset_old;
+
+	// No signals till the child resets the handlers
+	sigfillset(&sigset_all);
+	pthread_sigmask(SIG_SETMASK, &sigset_all, &sigset_old);
+	pid = clone(spawn_child, stack + guard_size + stack_size, CLONE_VM|CLONE_VFORK|SIGCHLD, &arg);
+	if (pid == -1)
+		error("Cannot clone().");
+	pthread_sigmask(SIG_SETMASK, &sigset_old, NULL);
+
+	munmap(stack, guard_size + stack_size);
+#else
+	pid = fork();
+	switch (pid) {
+		case -1: 
+			error("Cannot fork().");
+			break;
+		case  0:
+			if (!geteuid() && setgroups(0, NULL))
+				_exit(errno);
+			if (setgid(gid))
+				_exit(errno);
+			if (setuid(uid))
+				_exit(errno);
+			if ((keep_fd != -1) && fcntl(keep_fd, F_SETFD, 0))
+				_exit(errno);
+			if (envp != NULL)
+				environ = (char **)envp;
+			errno = 0;
+			execvp(file, argv);
+			exit(errno);
+	}
+#endif
+
+	return pid;
+}
+
 #ifdef CAPABILITIES_SUPPORT
 pid_t		helper_pid = 0;
 pthread_t	privileged_thread;
 pthread_mutex_t	*pthread_mutex_privileged_p;
-pthread_mutex_t	*pthread_mutex_action_signal_p;
-pthread_mutex_t	*pthread_mutex_action_entrance_p;
 pthread_mutex_t	*pthread_mutex_runner_p;
+# ifndef HL_LOCKS
 pthread_cond_t	*pthread_cond_privileged_p;
-pthread_cond_t	*pthread_cond_action_p;
-pthread_cond_t	*pthread_cond_runner_p;
-
-# ifdef READWRITE_SIGNALLING
-int priv_read_fd;
-int priv_write_fd;
-int nonp_read_fd;
-int nonp_write_fd;
+pthread_cond_t	*pthread_cond_slotfree_p;
+pthread_cond_t	*pthread_cond_slot_p[PRIVILEGED_RING_SLOTS];
 # endif
+pthread_cond_t	*pthread_cond_runner_p;
 
 enum privileged_action {
 	PA_UNKNOWN = 0,
@@ -170,7 +324,7 @@ enum privileged_action {
 	PA_DIE,
 
 	PA_FTS_OPEN,
-	PA_FTS_READ,
+	PA_FTS_READ_N,
 	PA_FTS_CLOSE,
 
 	PA_INOTIFY_INIT,
@@ -185,6 +339,11 @@ enum privileged_action {
 	PA_CLSYNC_CGROUP_DEINIT,
 
 	PA_WAITPID,
+
+	PA_NOP,
+
+	PA_OPENDIR,
+	PA_LSTAT,
 };
 
 struct pa_fts_open_arg {
@@ -195,6 +354,14 @@ struct pa_fts_open_arg {
 	int (*compar)(const FTSENT **, const FTSENT **);
 };
 
+struct pa_fts_read_n_arg {
+	FTS		*ftsp;
+	int		 skip_last;	/* fts_set(FTS_SKIP) on the last entry of the previous batch */
+	int		 unused_wd;	/* the premark of the previous batch that wasn't claimed */
+	int		 premark_fd;
+	uint32_t	 premark_mask;	/* inotify_add_watch() every directory before reading it if not zero */
+};
+
 struct pa_inotify_add_watch_arg {
 	int fd;
 	char		 pathname[PATH_MAX];
@@ -213,6 +380,8 @@ struct pa_fork_execvp_arg {
 	char		_argv[MAXARGUMENTS+1][BUFSIZ];
 	char		*argv[MAXARGUMENTS+1];
 	char *const	*argv_p;
+	char *const	*envp_p;	// thread splitting only
+	int		 keep_fd;	// thread splitting only
 };
 
 struct pa_kill_child_arg {
@@ -226,100 +395,123 @@ struct pa_waitpid_arg {
 	int    options;
 };
 
-struct pa_arg {
+struct pa_path_arg {
+	char		 path[PATH_MAX];
+};
+
+union pa_arg {
 	struct pa_fts_open_arg		 fts_open;
+	struct pa_fts_read_n_arg	 fts_read_n;
 	struct pa_inotify_add_watch_arg	 inotify_add_watch;
 	struct pa_inotify_rm_watch_arg	 inotify_rm_watch;
 	struct pa_fork_execvp_arg	 fork_execvp;
 	struct pa_kill_child_arg	 kill_child;
 	struct pa_waitpid_arg		 waitpid;
+	struct pa_path_arg		 path;
 	void				*void_v;
 	ctx_t				*ctx_p;
 	uint32_t			 uint32_v;
 };
 
 # ifdef HL_LOCKS
-enum highload_lock_id {
-	HLLOCK_HANDLER = 0,
+/* Waiting on futexes with a bounded adaptive spin before sleeping */
+enum hl_lock_side {
+	HLS_HELPER = 0,		/* the privileged thread/process waits for requests */
+	HLS_CALLER,		/* the callers wait for answers and free slots */
 
-	HLLOCK_MAX
+	HLS_MAX
 };
-typedef enum highlock_lock_id hllockid_t;
-
-enum highlock_lock_state {
-	HLLS_UNREADY	= 0x00,
-	HLLS_READY	= 0x01,
-	HLLS_FALLBACK	= 0x02,
-	HLLS_SIGNAL	= 0x04,
-	HLLS_GOTSIGNAL	= 0x08,
-	HLLS_WORKING	= 0x10,
+struct hl_lock {
+	volatile int			enabled;	/* spinning makes sense (there're more than one CPU) */
+	volatile int			spin[HLS_MAX];	/* the current limit of spin iterations */
 };
-typedef enum highlock_lock_state hllock_state_t;
 
-struct hl_lock {
-	volatile int			locallock_hl_setstate_ifstate;
-	volatile int			enabled;
-	volatile int			count_wait[HLLOCK_MAX];
-	volatile int			count_signal[HLLOCK_MAX];
-	volatile hllock_state_t		state[HLLOCK_MAX];
-#  ifdef HL_LOCK_TRIES_AUTO
-	volatile unsigned long		tries[PC_MAX];
-	volatile unsigned long		count[PC_MAX];
-	volatile unsigned long		delay[PC_MAX];
-	volatile double			tries_step[PC_MAX];
-
-#   define				tries_cur tries[callid]
+#  if defined(__i386__) || defined(__x86_64__)
+#   define hl_cpu_relax() __asm__ __volatile__ ("pause")
 #  else
-	volatile unsigned long		tries;
-#   define				tries_cur tries
+#   define hl_cpu_relax() {}
 #  endif
-};
 # endif
 
-struct pa_fts_read_ret {
-	FTSENT		ftsent;
-	char		fts_accpath[PATH_MAX];
-	char		fts_path[PATH_MAX];
-	char		fts_name[PATH_MAX];
+/* A compact FTSENT, records are packed one after another */
+struct pa_fts_read_n_ent {
+	size_t		size;		/* of the whole record, aligned */
+	int		fts_info;
+	int		fts_errno;
+	short		fts_level;
+	int		hasstat;
+	int		wd;		/* see "premark_mask" */
+	struct stat	stat;
+	size_t		fts_pathlen;
+	char		fts_path[];
+};
+struct pa_fts_read_n_ret {
+	int		count;
+	int		eof;
+	size_t		size;
+	char		buf[PRIVILEGED_FTS_READ_N_BUFSIZE] __attribute__ ((aligned(__alignof__(struct pa_fts_read_n_ent))));
 };
 struct pa_ret {
-	struct stat		stat;
-	struct pa_fts_read_ret	fts_read;
+	struct stat			stat;
+	struct pa_fts_read_n_ret	fts_read_n;
 };
 struct cmd {
-	volatile struct pa_arg		 arg;
+	volatile union pa_arg		 arg;
 	volatile enum privileged_action	 action;
-# ifdef HL_LOCKS
-	volatile unsigned long		 hl_lock_tries;
-# endif
 };
 struct cmd_ret {
 	volatile struct pa_ret		 ret_buf;
 	volatile void			*ret;
 	volatile int			 _errno;
 };
-volatile struct cmd		*cmd_p;
-volatile struct cmd_ret		*cmd_ret_p;
+
+/*
+ * The requests are passed through a ring of slots, so several threads may
+ * have their requests in flight at once. A slot is taken by a caller
+ * (PRS_FILLING), queued for the privileged thread/process (PRS_QUEUED) and
+ * answered by it (PRS_DONE). The privileged thread/process takes the queued
+ * slots one by one without sleeping until the queue is empty.
+ *
+ * Everything is protected by pthread_mutex_privileged_p. The waits are done
+ * on condition variables or (with HL_LOCKS) on futexes: "queue_len" for the
+ * privileged thread/process, "state[slot]" for the callers.
+ */
+enum pa_ring_slot_state {
+	PRS_FREE = 0,
+	PRS_FILLING,
+	PRS_QUEUED,
+	PRS_DONE,
+};
+struct pa_ring {
+	volatile int			 state[PRIVILEGED_RING_SLOTS];	/* enum pa_ring_slot_state */
+	volatile int			 queue[PRIVILEGED_RING_SLOTS];
+	volatile int			 queue_head;
+	volatile int			 queue_len;
+# ifdef HL_LOCKS
+	volatile int			 slotfree_seq;	/* is incremented on every slot freeing */
+	volatile int			 waiters_helper;
+	volatile int			 waiters_slot[PRIVILEGED_RING_SLOTS];
+	volatile int			 waiters_slotfree;
+# endif
+};
+volatile struct pa_ring		*ring_p;
+volatile struct cmd		*cmd_slot_p[PRIVILEGED_RING_SLOTS];
+volatile struct cmd_ret		*cmd_ret_slot_p[PRIVILEGED_RING_SLOTS];
 # ifdef HL_LOCKS
 volatile struct hl_lock		*hl_lock_p;
 # endif
 
 # ifdef HL_LOCKS
 static inline void hl_lock_init(volatile struct hl_lock *hl_lock_p) {
+	int side;
 	debug(10, "");
-	hl_lock_p->enabled = 1;
-#  ifdef HL_LOCK_TRIES_AUTO
-	int i;
-	i = 0;
-	while (i < PC_MAX) {
-		hl_lock_p->tries[i]		= HL_LOCK_TRIES_INITIAL;
-		hl_lock_p->delay[i]		= ((unsigned long)~0)>>2;
-		hl_lock_p->tries_step[i]	= HL_LOCK_AUTO_K;
-		i++;
-	}
-#  else
-	hl_lock_p->tries	= HL_LOCK_TRIES_INITIAL;
-#  endif
+
+	hl_lock_p->enabled = (ncpus > 1);
+
+	side = 0;
+	while (side < HLS_MAX)
+		hl_lock_p->spin[side++] = HL_LOCK_SPIN_INITIAL;
+
 	return;
 }
 # endif
@@ -339,25 +531,19 @@ FTS *(*_privileged_fts_open)		(
 		char * const *path_argv,
 		int options,
 		int (*compar)(const FTSENT **, const FTSENT **)
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
 FTSENT *(*_privileged_fts_read)		(
 		FTS *ftsp
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
 int (*_privileged_fts_close)		(
 		FTS *ftsp
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
+int (*_privileged_fts_set)		(FTS *ftsp, FTSENT *f, int options);
+int (*_privileged_fts_premark)		(FTS *ftsp, int fd, uint32_t mask);
+
 int (*_privileged_inotify_init)		();
 int (*_privileged_inotify_init1)	(int flags);
 
@@ -365,9 +551,6 @@ int (*_privileged_inotify_add_watch)	(
 		int fd,
 		const char *pathname,
 		uint32_t mask
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
 int (*_privileged_inotify_rm_watch)	(
@@ -379,6 +562,64 @@ int (*_privileged_clsync_cgroup_deinit)	(ctx_t *ctx_p);
 
 pid_t (*_privileged_waitpid)		(pid_t pid, int *status, int options);
 
+int (*_privileged_opendir)		(const char *path);
+int (*_privileged_lstat)		(const char *path, struct stat *buf);
+
+/*
+ * "--pass-dirfds": directories are opened by the privileged thread/process
+ * and read here. In the process splitting mode the descriptors are passed
+ * through the socket pair (SCM_RIGHTS), one at a time.
+ */
+int		dirfd_sock[2] = {-1, -1};
+pthread_mutex_t	dirfd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int dirfd_send(int sock, int fd) {
+	char		 byte = 0;
+	struct iovec	 iov = {&byte, 1};
+	char		 cmsg_buf[CMSG_SPACE(sizeof(int))] = {0};
+	struct msghdr	 msg = {0};
+	struct cmsghdr	*cmsg_p;
+
+	msg.msg_iov		= &iov;
+	msg.msg_iovlen		= 1;
+	msg.msg_control		= cmsg_buf;
+	msg.msg_controllen	= sizeof(cmsg_buf);
+
+	cmsg_p = CMSG_FIRSTHDR(&msg);
+	cmsg_p->cmsg_level	= SOL_SOCKET;
+	cmsg_p->cmsg_type	= SCM_RIGHTS;
+	cmsg_p->cmsg_len	= CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg_p), &fd, sizeof(int));
+
+	return (sendmsg(sock, &msg, 0) == 1) ? 0 : -1;
+}
+
+static int dirfd_recv(int sock) {
+	char		 byte;
+	struct iovec	 iov = {&byte, 1};
+	char		 cmsg_buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr	 msg = {0};
+	struct cmsghdr	*cmsg_p;
+	int		 fd;
+
+	msg.msg_iov		= &iov;
+	msg.msg_iovlen		= 1;
+	msg.msg_control		= cmsg_buf;
+	msg.msg_controllen	= sizeof(cmsg_buf);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+
+	cmsg_p = CMSG_FIRSTHDR(&msg);
+	if (cmsg_p == NULL || cmsg_p->cmsg_level != SOL_SOCKET || cmsg_p->cmsg_type != SCM_RIGHTS) {
+		errno = EBADMSG;
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg_p), sizeof(int));
+
+	return fd;
+}
+
 int cap_enable(__u32 caps) {
 	debug(1, "Enabling Linux capabilities 0x%x", caps);
 	struct __user_cap_header_struct	cap_hdr = {0};
@@ -670,106 +911,63 @@ int pa_unsetup(struct pa_options *opts) {
 
 # ifdef HL_LOCKS
 
-static inline int hl_isanswered(int lockid) {
-	return hl_lock_p->count_wait[lockid] == hl_lock_p->count_signal[lockid]+1;
-}
-
-static inline int hl_isready(int lockid) {
-	return hl_lock_p->count_wait[lockid] == hl_lock_p->count_signal[lockid];
-}
-
-static inline void hl_setstate(int lockid, hllock_state_t stateid) {
-	g_atomic_int_set(&hl_lock_p->state[lockid], stateid);
-}
+static inline int helper_isalive();
 
-int hl_setstate_ifstate(int lockid, hllock_state_t stateid_new, hllock_state_t stateid_old_mask) {
-	volatile int *local_lock_p = &hl_lock_p->locallock_hl_setstate_ifstate;
-	debug(90, "%i, 0x%o, 0x%o", lockid, stateid_new, stateid_old_mask);
-
-	if (*local_lock_p)
-		return 0;
-
-	debug(92, "%i", *local_lock_p);
-	g_atomic_int_inc(local_lock_p);
-	debug(92, "%i", *local_lock_p);
-	if (*local_lock_p != 1) {
-		g_atomic_int_dec_and_test(local_lock_p);
-		return 0;
-	}
-
-	if (!(hl_lock_p->state[lockid]&stateid_old_mask)) {
-		g_atomic_int_dec_and_test(local_lock_p);
-		return 0;
-	}
-
-	debug(50, "success");
-	g_atomic_int_set(&hl_lock_p->state[lockid], stateid_new);
-	g_atomic_int_dec_and_test(local_lock_p);
-#undef local_lock
-	return 1;
-}
-
-static inline int hl_wait(
-		int lockid
-#  ifdef HL_LOCK_TRIES_AUTO
-		, unsigned long hl_lock_tries
-#  endif
-) {
-	volatile long try = 0;
-
-	debug(15, "");
-
-	while (hl_lock_p->state[lockid] == HLLS_GOTSIGNAL);
-	while (!hl_isready(lockid));
-	hl_setstate(lockid, HLLS_READY);
-	hl_lock_p->count_wait[lockid]++;
-
-	while (try++ < hl_lock_tries)
-		if (hl_lock_p->state[lockid] == HLLS_SIGNAL) {
-			hl_setstate(lockid, HLLS_GOTSIGNAL);
-			debug(15, "got signal");
-			return 1;
+/*
+ * Waits while *word_p == value. Spins first: the limit is moved towards
+ * the doubled spin that was enough last time, or towards HL_LOCK_SPIN_MIN
+ * if spinning didn't help.
+ *
+ * The callers wake up periodically to make sure the privileged
+ * thread/process is still alive, otherwise they would sleep forever.
+ */
+static inline void hl_wait(int side, volatile int *word_p, int value, volatile int *waiters_p) {
+	volatile int *spin_p = &hl_lock_p->spin[side];
+	int spin = hl_lock_p->enabled ? *spin_p : 0;
+	int try  = 0;
+
+	while (try < spin) {
+		if (g_atomic_int_get(word_p) != value) {
+			int target = 2*try;
+			if (target > HL_LOCK_SPIN_MAX)
+				target = HL_LOCK_SPIN_MAX;
+			if (target < HL_LOCK_SPIN_MIN)
+				target = HL_LOCK_SPIN_MIN;
+			*spin_p = spin + (target - spin)/8;
+			return;
 		}
+		hl_cpu_relax();
+		try++;
+	}
+	if (spin)
+		*spin_p = spin - (spin - HL_LOCK_SPIN_MIN)/8;
+
+	g_atomic_int_inc(waiters_p);
+	if (side == HLS_CALLER) {
+		struct timespec timeout = { HL_LOCK_ALIVECHECK_INTERVAL, 0 };
+		while (g_atomic_int_get(word_p) == value)
+			if (futex_timed(word_p, FUTEX_WAIT, value, &timeout) == -1 && errno == ETIMEDOUT)
+				critical_on (!helper_isalive());
+	} else
+		while (g_atomic_int_get(word_p) == value)
+			futex(word_p, FUTEX_WAIT, value);
+	g_atomic_int_add(waiters_p, -1);
 
-	while (!hl_setstate_ifstate(lockid, HLLS_FALLBACK, HLLS_READY|HLLS_SIGNAL));
-	debug(14, "fallback: hl_lock_p->count_wait[%u] == %u; hl_lock_p->count_signal[%u] = %u", lockid, hl_lock_p->count_wait[lockid], lockid, hl_lock_p->count_signal[lockid]);
-	return 0;
+	return;
 }
 
-static inline int hl_signal(int lockid) {
-	debug(15, "%u", lockid);
-	hl_lock_p->count_signal[lockid]++;
-
-	if (hl_setstate_ifstate(lockid, HLLS_SIGNAL, HLLS_READY)) {
-		while (hl_lock_p->state[lockid] != HLLS_GOTSIGNAL) {
-			if (hl_lock_p->state[lockid] == HLLS_FALLBACK) {
-				debug(15, "fallback");
-				return 0;
-			}
-			debug(95, "state == %i != %i, %i", hl_lock_p->state[lockid], HLLS_GOTSIGNAL, HLLS_FALLBACK);
-		}
-		debug(15, "the signal is sent");
-		hl_setstate(lockid, HLLS_WORKING);
-		return 1;
-	}
+// Should be called after *word_p is changed by g_atomic_int_*()
+static inline void hl_wake(volatile int *word_p, volatile int *waiters_p) {
+	if (g_atomic_int_get(waiters_p))
+		futex(word_p, FUTEX_WAKE, INT_MAX);
 
-	debug(15, "not ready");
-	return 0;
+	return;
 }
 
-void hl_shutdown(int lockid) {
+void hl_shutdown() {
 	debug(1, "");
 
-#  ifdef PARANOID
-	critical_on (HLLOCK_MAX != 1);	// TODO: do this on compile time (not on running time)
-#   ifdef HL_LOCK_TRIES_AUTO
-	memset((void *)hl_lock_p->tries, 0, sizeof(hl_lock_p->tries));
-#   else
-	hl_lock_p->tries = 0;
-#   endif
-#  endif
-	hl_lock_p->state[lockid]	 = HLLS_FALLBACK;
-	hl_lock_p->enabled 	 = 0;
+	hl_lock_p->enabled = 0;
 
 	return;
 }
@@ -811,9 +1009,6 @@ int privileged_check() {
 
 int privileged_handler(ctx_t *ctx_p)
 {
-# ifdef READWRITE_SIGNALLING
-	char buf[1] = {0};
-# endif
 	int setup = 0;
 	uid_t exec_uid = 65535;
 	gid_t exec_gid = 65535;
@@ -822,6 +1017,10 @@ int privileged_handler(ctx_t *ctx_p)
 	int use_args_check = 0;
 	int helper_isrunning = 1;
 
+	// The last entry returned by PA_FTS_READ_N, the only one that may be fts_set()
+	FTS	*fts_read_n_ftsp = NULL;
+	FTSENT	*fts_read_n_last = NULL;
+
 	opts  = calloc_align(1, sizeof(*opts));
 	opts->isprocsplitting = (ctx_p->flags[SPLITTING] == SM_PROCESS);
 	opts->shm_mprotect    =  ctx_p->flags[SHM_MPROTECT];
@@ -870,38 +1069,37 @@ int privileged_handler(ctx_t *ctx_p)
 	// The loop
 	debug(2, "Running the loop");
 	while (helper_isrunning) {
+		volatile struct cmd	*cmd_p;
+		volatile struct cmd_ret	*cmd_ret_p;
+		int slot;
+
 		errno = 0;
 
 		// Waiting for command
 		debug(10, "Waiting for command");
-		if (opts->shm_mprotect) {
-			mprotect((void *)cmd_p,		sizeof(*cmd_p),		PROT_WRITE);
-			mprotect((void *)cmd_ret_p,	sizeof(*cmd_ret_p),	PROT_READ);
-		}
-# ifdef HL_LOCKS
-		debug(25, "hl_lock_p->enabled == %i", hl_lock_p->enabled);
-		if (!hl_lock_p->enabled || !hl_wait(
-			HLLOCK_HANDLER
-#  ifdef HL_LOCK_TRIES_AUTO
-			, (long)hl_lock_p->tries
-#  endif
-		)) {
+		while (!g_atomic_int_get(&ring_p->queue_len)) {
 			if (opts->isprocsplitting)
 				critical_on(!parent_isalive());
-# endif
-# ifdef READWRITE_SIGNALLING
-			read_inf(priv_read_fd, buf, 1);
+# ifdef HL_LOCKS
+			pthread_mutex_unlock(pthread_mutex_privileged_p);
+			hl_wait(HLS_HELPER, &ring_p->queue_len, 0, &ring_p->waiters_helper);
+			pthread_mutex_lock(pthread_mutex_privileged_p);
 # else
 			critical_on (pthread_cond_wait(pthread_cond_privileged_p, pthread_mutex_privileged_p));
 # endif
-# ifdef HL_LOCKS
-			if (hl_lock_p->enabled)
-				hl_setstate(HLLOCK_HANDLER, HLLS_WORKING);
 		}
-# endif
+
+		slot = ring_p->queue[ring_p->queue_head];
+		ring_p->queue_head = (ring_p->queue_head + 1) % PRIVILEGED_RING_SLOTS;
+		g_atomic_int_add(&ring_p->queue_len, -1);
+		pthread_mutex_unlock(pthread_mutex_privileged_p);
+
+		cmd_p     = cmd_slot_p[slot];
+		cmd_ret_p = cmd_ret_slot_p[slot];
+
 		if (opts->shm_mprotect) {
 			mprotect((void *)cmd_p,		sizeof(*cmd_p),		PROT_READ);
-			mprotect((void *)cmd_ret_p,	sizeof(*cmd_ret_p),	PROT_WRITE);
+			mprotect((void *)cmd_ret_p,	sizeof(*cmd_ret_p),	PROT_READ|PROT_WRITE);
 		}
 
 		debug(10, "Got command %u", cmd_p->action);
@@ -926,6 +1124,8 @@ int privileged_handler(ctx_t *ctx_p)
 				debug(20, "PA_DIE");
 				helper_isrunning = 0;
 				break;
+			case PA_NOP:
+				break;
 			case PA_FTS_OPEN: {
 				volatile struct pa_fts_open_arg *arg_p = &cmd_p->arg.fts_open;
 				char *const *path_argv_p =(void *)(
@@ -942,33 +1142,70 @@ int privileged_handler(ctx_t *ctx_p)
 				debug(21, "/PA_FTS_OPEN => %p", cmd_ret_p->ret);
 				break;
 			}
-			case PA_FTS_READ: {
-				debug(20, "PA_FTS_READ(%p)", cmd_p->arg.void_v);
-				FTSENT *ret = fts_read(cmd_p->arg.void_v);
-				if (ret == NULL) {
-					cmd_ret_p->ret = NULL;
-					debug(10, "cmd_ret_p->ret == NULL");
-					break;
-				}
-				if (!opts->isprocsplitting) {	// Is the thread-splitting?
-					cmd_ret_p->ret = ret;
-					break;
+			case PA_FTS_READ_N: {
+				struct pa_fts_read_n_arg *arg_p = (void *)&cmd_p->arg.fts_read_n;
+				struct pa_fts_read_n_ret *ret_p = (void *)&cmd_ret_p->ret_buf.fts_read_n;
+				FTS *ftsp = arg_p->ftsp;
+				debug(20, "PA_FTS_READ_N(%p, %i, %i, %i, 0x%o)", ftsp, arg_p->skip_last, arg_p->unused_wd, arg_p->premark_fd, arg_p->premark_mask);
+
+				if (fts_read_n_ftsp == ftsp && fts_read_n_last != NULL) {
+					if (arg_p->unused_wd != -1)
+						inotify_rm_watch(arg_p->premark_fd, arg_p->unused_wd);
+					if (arg_p->skip_last)
+						fts_set(ftsp, fts_read_n_last, FTS_SKIP);
 				}
+				fts_read_n_ftsp = ftsp;
+				fts_read_n_last = NULL;
+
+				ret_p->count = 0;
+				ret_p->eof   = 0;
+				ret_p->size  = 0;
+				// Stopping on every directory: the caller may want to skip it
+				while (ret_p->size + sizeof(struct pa_fts_read_n_ent) + PATH_MAX + sizeof(size_t) <= sizeof(ret_p->buf)) {
+					errno = 0;
+					FTSENT *ent = fts_read(ftsp);
+					if (ent == NULL) {
+						ret_p->eof = 1;
+						break;
+					}
 
-				{	// Is the process splitting?
-					struct pa_fts_read_ret *ret_buf = (void *)&cmd_ret_p->ret_buf.fts_read;
-					memcpy(&ret_buf->ftsent, ret, sizeof(ret_buf->ftsent));
-					cmd_ret_p->ret = &ret_buf->ftsent;
-					debug(25, "fts_path == <%s>", ret_buf->fts_path);
-					strncpy(ret_buf->fts_accpath, ret->fts_accpath, sizeof(ret_buf->fts_accpath));
-					strncpy(ret_buf->fts_path,    ret->fts_path,    sizeof(ret_buf->fts_path));
-					ret_buf->ftsent.fts_accpath = ret_buf->fts_accpath;
-					ret_buf->ftsent.fts_path    = ret_buf->fts_path;
+					struct pa_fts_read_n_ent *rec_p = (void *)&ret_p->buf[ret_p->size];
+					size_t pathlen = strnlen(ent->fts_path, PATH_MAX-1);
+
+					rec_p->fts_info    = ent->fts_info;
+					rec_p->fts_errno   = ent->fts_errno;
+					rec_p->fts_level   = ent->fts_level;
+					rec_p->hasstat     = (ent->fts_statp != NULL) && (ent->fts_info != FTS_NSOK) && (ent->fts_info != FTS_NS);
+					rec_p->fts_pathlen = pathlen;
+					if (rec_p->hasstat)
+						memcpy(&rec_p->stat, ent->fts_statp, sizeof(rec_p->stat));
+					memcpy(rec_p->fts_path, ent->fts_path, pathlen);
+					rec_p->fts_path[pathlen] = 0;
+
+					rec_p->wd = -1;
+					if (ent->fts_info == FTS_D && arg_p->premark_mask)
+						rec_p->wd = inotify_add_watch(arg_p->premark_fd, ent->fts_accpath, arg_p->premark_mask);
+
+					rec_p->size  = (sizeof(*rec_p) + pathlen + 1 + sizeof(size_t)-1) & ~(sizeof(size_t)-1);
+					ret_p->size += rec_p->size;
+					ret_p->count++;
+
+					fts_read_n_last = ent;
+					if (ent->fts_info == FTS_D)
+						break;
 				}
+				if (!ret_p->eof)
+					errno = 0;
+
+				cmd_ret_p->ret = (void *)(long)ret_p->count;
 				break;
 			}
 			case PA_FTS_CLOSE:
 				debug(20, "PA_FTS_CLOSE");
+				if (fts_read_n_ftsp == cmd_p->arg.void_v) {
+					fts_read_n_ftsp = NULL;
+					fts_read_n_last = NULL;
+				}
 				cmd_ret_p->ret = (void *)(long)fts_close(cmd_p->arg.void_v);
 				break;
 			case PA_INOTIFY_INIT:
@@ -994,12 +1231,21 @@ int privileged_handler(ctx_t *ctx_p)
 			}
 			case PA_FORK_EXECVP: {
 				struct pa_fork_execvp_arg *arg_p = (void *)&cmd_p->arg.fork_execvp;
+				char *argv_copy[MAXARGUMENTS+2];
 				const char *file;
 				char *const *argv;
+				int i;
 
 				if (opts->isprocsplitting) {
-					file = arg_p->file;
-					argv = arg_p->argv;
+					// The slot (shared with the child) may be refilled right after the answer
+					file = argv_copy[0] = strdup(arg_p->file);
+					argv = &argv_copy[1];
+					i = 0;
+					while (arg_p->argv[i] != NULL) {
+						argv_copy[i+1] = strdup(arg_p->argv[i]);
+						i++;
+					}
+					argv_copy[i+1] = NULL;
 				} else {
 					file = arg_p->file_p;
 					argv = arg_p->argv_p;
@@ -1010,16 +1256,12 @@ int privileged_handler(ctx_t *ctx_p)
 				if (use_args_check)
 					privileged_execvp_check_arguments(opts, file, argv);
 
-				pid_t pid = fork();
-				switch (pid) {
-					case -1: 
-						error("Cannot fork().");
-						break;
-					case  0:
-						debug(4, "setgid(%u) == %i", exec_gid, setgid(exec_gid));
-						debug(4, "setuid(%u) == %i", exec_uid, setuid(exec_uid));
-						debug(3, "execvp(\"%s\", argv)", file);
-						exit(execvp(file, argv));
+				debug(3, "execvp(\"%s\", argv) as %u:%u", file, exec_uid, exec_gid);
+				pid_t pid = spawn_execvp(file, argv, arg_p->envp_p, arg_p->keep_fd, exec_uid, exec_gid);
+				if (opts->isprocsplitting) {
+					i = 0;
+					while (argv_copy[i] != NULL)
+						free(argv_copy[i++]);
 				}
 				cmd_ret_p->ret = (void *)(long)pid;
 				debug(21, "/PA_FORK_EXECVP");
@@ -1081,210 +1323,170 @@ int privileged_handler(ctx_t *ctx_p)
 				cmd_ret_p->ret = (void *)(long)waitpid(arg_p->pid, &arg_p->status, arg_p->options);
 				break;
 			}
+			case PA_OPENDIR: {
+				struct pa_path_arg *arg_p = (void *)&cmd_p->arg.path;
+				debug(20, "PA_OPENDIR(<%s>)", arg_p->path);
+				int fd = open(arg_p->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+				if (fd != -1 && opts->isprocsplitting) {
+					int rc = dirfd_send(dirfd_sock[1], fd);
+					close(fd);
+					fd = rc;
+				}
+				cmd_ret_p->ret = (void *)(long)fd;
+				break;
+			}
+			case PA_LSTAT: {
+				struct pa_path_arg *arg_p = (void *)&cmd_p->arg.path;
+				debug(20, "PA_LSTAT(<%s>)", arg_p->path);
+				cmd_ret_p->ret = (void *)(long)lstat(arg_p->path, (struct stat *)&cmd_ret_p->ret_buf.stat);
+				break;
+			}
 			default:
 				critical("Unknown command type \"%u\". It's a buffer overflow (which means a security problem) or just an internal error.");
 		}
 
 		cmd_ret_p->_errno = errno;
-		debug(10, "Result: %p, errno: %u. Sending the signal to non-privileged thread/process.", cmd_ret_p->ret, cmd_ret_p->_errno);
-# ifdef HL_LOCKS
-		if (!hl_lock_p->enabled) {
-# endif
+		debug(10, "Result: %p, errno: %u. Sending the signal to non-privileged thread/process (slot #%i).", cmd_ret_p->ret, cmd_ret_p->_errno, slot);
+
+		if (opts->shm_mprotect) {
+			mprotect((void *)cmd_p,		sizeof(*cmd_p),		PROT_READ|PROT_WRITE);
+			mprotect((void *)cmd_ret_p,	sizeof(*cmd_ret_p),	PROT_READ);
+		}
 # ifndef __linux__
-			critical_on(!parent_isalive());
-# endif
-# ifdef READWRITE_SIGNALLING
-			write_inf(nonp_write_fd, buf, 1);
-# else
-			critical_on (pthread_mutex_lock(pthread_mutex_action_signal_p));
-			critical_on (pthread_mutex_unlock(pthread_mutex_action_signal_p));
-			critical_on (pthread_cond_signal(pthread_cond_action_p));
+		critical_on(!parent_isalive());
 # endif
 # ifdef HL_LOCKS
-		}
+		g_atomic_int_set(&ring_p->state[slot], PRS_DONE);
+		hl_wake(&ring_p->state[slot], &ring_p->waiters_slot[slot]);
+		critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
+# else
+		critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
+		ring_p->state[slot] = PRS_DONE;
+		critical_on (pthread_cond_signal(pthread_cond_slot_p[slot]));
 # endif
 	}
 
 	pa_unsetup(opts);
 # ifdef HL_LOCKS
-	hl_shutdown(HLLOCK_HANDLER);
+	hl_shutdown();
 # endif
 	pthread_mutex_unlock(pthread_mutex_privileged_p);
 	debug(2, "Finished");
 	return 0;
 }
 
-static inline int privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-		int callid,
-# endif
-		enum privileged_action action,
-		void **ret_p
-	)
-{
-	int rc = 0;
+// Takes a free slot of the ring (waits for it if all of them are busy)
+static inline int privileged_slot_get() {
+	int slot;
 
-# ifdef READWRITE_SIGNALLING
-	char buf[1] = {0};
-# endif
-# ifdef HL_LOCK_TRIES_AUTO
-	clock_t start_ticks;
+	critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
+	while (1) {
+		slot = 0;
+		while (slot < PRIVILEGED_RING_SLOTS && ring_p->state[slot] != PRS_FREE)
+			slot++;
 
-	int isadjusting;
-# endif
+		if (slot < PRIVILEGED_RING_SLOTS)
+			break;
+
+		debug(10, "All the slots are busy. Waiting.");
 # ifdef HL_LOCKS
-	debug(10, "(%u, %p): %i", action, ret_p, hl_lock_p->enabled);
+		{
+			int seq = ring_p->slotfree_seq;
+			critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
+			hl_wait(HLS_CALLER, &ring_p->slotfree_seq, seq, &ring_p->waiters_slotfree);
+			critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
+		}
 # else
-	debug(10, "(%u, %p)",     action, ret_p);
+		critical_on (pthread_cond_wait(pthread_cond_slotfree_p, pthread_mutex_privileged_p));
 # endif
-
-	pthread_mutex_lock(pthread_mutex_action_entrance_p);
-# ifndef READWRITE_SIGNALLING
-	debug(10, "Waiting the privileged thread/process to get prepared for signal");
-#  ifdef HL_LOCKS
-	if (hl_lock_p->enabled) {
-		while (!hl_isanswered(HLLOCK_HANDLER))
-			if (!helper_isalive_cache) {
-				debug(1, "The privileged thread/process is dead (#0). Ignoring the command.");
-				rc = ENOENT;
-				goto privileged_action_end;
-			}
-	} else {
-#  endif
-		critical_on(!helper_isalive_cache);
-		pthread_mutex_lock(pthread_mutex_privileged_p);
-		pthread_mutex_unlock(pthread_mutex_privileged_p);
-#  ifdef HL_LOCKS
-	}
-#  endif
-# endif
-	if (!helper_isalive_cache) {
-		debug(1, "The privileged thread/process is dead (#1). Ignoring the command.");
-		rc = ENOENT;
-		goto privileged_action_end;
 	}
+	ring_p->state[slot] = PRS_FILLING;
+	critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
 
-	cmd_p->action = action;
-	debug(10, "Sending information (action == %i) to the privileged thread/process", action);
-# ifdef HL_LOCK_TRIES_AUTO
-	cmd_p->hl_lock_tries = hl_lock_p->tries[callid];
-
-	if ((isadjusting = hl_lock_p->enabled)) {
-		isadjusting = hl_lock_p->tries[callid];
-		if (isadjusting) {
-			isadjusting = ((double)fabs(hl_lock_p->tries_step[callid]-1) > (double)HL_LOCK_AUTO_K_FINISH);
-			if (isadjusting) {
-				isadjusting = !((++hl_lock_p->count[callid]) << (sizeof(hl_lock_p->count[callid])*CHAR_BIT - HL_LOCK_AUTO_INTERVAL));
-				debug(11, "isadjusting == %u; hl_lock_p->tries_step[%i] == %lf; hl_lock_p->count[%i] == %lu", isadjusting, callid, hl_lock_p->tries_step[callid], callid, hl_lock_p->count[callid]);
-				if (isadjusting)
-					start_ticks = clock();
-			}
-		}
-	}
+	debug(15, "slot #%i", slot);
+	return slot;
+}
 
-# endif
-# ifdef HL_LOCKS
-	if (action == PA_DIE)
-		hl_lock_p->enabled = 0;
+static inline void privileged_slot_put(int slot) {
+	debug(15, "slot #%i", slot);
 
-	if (!hl_lock_p->enabled || !hl_signal(HLLOCK_HANDLER)) {
-# endif
-		critical_on(!helper_isalive_cache);
-# ifdef READWRITE_SIGNALLING
-		write_inf(priv_write_fd, buf, 1);
-# else
-#  ifdef HL_LOCKS
-		if (hl_lock_p->enabled) {
-			debug(10, "Waiting the privileged thread/process to get prepared for signal (by fallback)");
-			critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
-			critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
-		} else
-#  endif
-		critical_on (pthread_mutex_lock(pthread_mutex_action_signal_p));
-		critical_on (pthread_cond_signal(pthread_cond_privileged_p));
-# endif
+	critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
+	ring_p->state[slot] = PRS_FREE;
 # ifdef HL_LOCKS
-	}
+	g_atomic_int_inc(&ring_p->slotfree_seq);
+	critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
+	hl_wake(&ring_p->slotfree_seq, &ring_p->waiters_slotfree);
+# else
+	critical_on (pthread_cond_signal(pthread_cond_slotfree_p));
+	critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
 # endif
 
-	if (action == PA_DIE)
-		goto privileged_action_end;
-	debug(10, "Waiting for the answer");
+	return;
+}
 
+// Queues the filled slot and waits for the answer. The slot is still owned by the caller after that.
+static inline int privileged_action(int slot, enum privileged_action action, void **ret_p)
+{
+	volatile struct cmd_ret *cmd_ret_p = cmd_ret_slot_p[slot];
 # ifdef HL_LOCKS
-	if (hl_lock_p->enabled) {
-		while (!hl_isanswered(HLLOCK_HANDLER))
-			if (!helper_isalive_cache) {
-				debug(1, "The privileged thread/process is dead (#2). Ignoring the command.");
-				rc = ENOENT;
-				goto privileged_action_end;
-			}
-
-#  ifdef HL_LOCK_TRIES_AUTO
-		if (isadjusting) {
-			unsigned long delay = (long)clock() - (long)start_ticks;
-			long diff  = delay - hl_lock_p->delay[callid];
-
-			debug(13, "diff == %li; hl_lock_p->delay[%i] == %lu; delay == %lu; delay*HL_LOCK_AUTO_THREADHOLD == %lu", diff, callid, hl_lock_p->delay[callid], delay, delay*HL_LOCK_AUTO_THREADHOLD)
+	debug(10, "(%u, %i, %p): %i", action, slot, ret_p, hl_lock_p->enabled);
+# else
+	debug(10, "(%u, %i, %p)",     action, slot, ret_p);
+# endif
 
-			if (diff && ((unsigned long)labs(diff) > (unsigned long)delay*HL_LOCK_AUTO_THREADHOLD)) {
+	if (!helper_isalive_cache) {
+		debug(1, "The privileged thread/process is dead. Ignoring the command.");
+		return ENOENT;
+	}
 
-				if (diff > 0)
-					hl_lock_p->tries_step[callid] = 1/((hl_lock_p->tries_step[callid]-1)/HL_LOCK_AUTO_DECELERATION+1);
+	cmd_slot_p[slot]->action = action;
+	debug(10, "Sending information (action == %i) to the privileged thread/process", action);
+	critical_on (pthread_mutex_lock(pthread_mutex_privileged_p));
+	ring_p->queue[(ring_p->queue_head + ring_p->queue_len) % PRIVILEGED_RING_SLOTS] = slot;
+	g_atomic_int_set(&ring_p->state[slot], PRS_QUEUED);
+	g_atomic_int_inc(&ring_p->queue_len);
+# ifdef HL_LOCKS
+	critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
+	hl_wake(&ring_p->queue_len, &ring_p->waiters_helper);
 
-				hl_lock_p->delay[callid]  = delay;
+	if (action == PA_DIE)
+		return 0;
 
-				debug(12, "diff == %li; hl_lock_p->tries_step[%i] == %lf; hl_lock_p->delay[%i] == %lu", diff, callid, hl_lock_p->tries_step[callid], callid, hl_lock_p->delay[callid]);
-			}
-			hl_lock_p->tries[callid] *= hl_lock_p->tries_step[callid];
+	debug(10, "Waiting for the answer");
+	hl_wait(HLS_CALLER, &ring_p->state[slot], PRS_QUEUED, &ring_p->waiters_slot[slot]);
+# else
+	critical_on (pthread_cond_signal(pthread_cond_privileged_p));
 
-			if (hl_lock_p->tries[callid] > HL_LOCK_AUTO_LIMIT_HIGH)
-				hl_lock_p->tries[callid] = HL_LOCK_AUTO_LIMIT_HIGH;
+	if (action == PA_DIE) {
+		critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
+		return 0;
+	}
 
-			debug(14, "hl_lock_p->tries[%i] == %lu", callid, hl_lock_p->tries[callid]);
-		}
-#  endif
-	} else {
-# endif
+	debug(10, "Waiting for the answer");
+	while (ring_p->state[slot] != PRS_DONE) {
 		critical_on(!helper_isalive_cache);
-# ifdef READWRITE_SIGNALLING
-		read_inf(nonp_read_fd, buf, 1);
-# else
-		critical_on (pthread_cond_wait(pthread_cond_action_p, pthread_mutex_action_signal_p));
-# endif
-# ifdef HL_LOCKS
+		critical_on (pthread_cond_wait(pthread_cond_slot_p[slot], pthread_mutex_privileged_p));
 	}
+	critical_on (pthread_mutex_unlock(pthread_mutex_privileged_p));
 # endif
 
 	if (ret_p != NULL)
 		*ret_p = (void *)cmd_ret_p->ret;
 	errno = cmd_ret_p->_errno;
 
-privileged_action_end:
-	debug(10, "Unlocking pthread_mutex_action_*");
-# ifndef READWRITE_SIGNALLING
-#  ifdef HL_LOCKS
-	if (!hl_lock_p->enabled)
-#  endif
-		pthread_mutex_unlock(pthread_mutex_action_signal_p);
-# endif
-
-	pthread_mutex_unlock(pthread_mutex_action_entrance_p);
-
-	return rc;
+	return 0;
 }
 
 FTS *__privileged_fts_open_procsplit(
 		char *const *path_argv,
 		int options,
 		int (*compar)(const FTSENT **, const FTSENT **)
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	)
 {
 	void *ret = NULL;
 	int i;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	i = 0;
 	while (path_argv[i] != NULL) {
@@ -1299,12 +1501,11 @@ FTS *__privileged_fts_open_procsplit(
 	cmd_p->arg.fts_open.compar		= compar;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			callid,
-# endif
+			slot,
 			PA_FTS_OPEN,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return ret;
 }
@@ -1313,88 +1514,265 @@ FTS *__privileged_fts_open_threadsplit(
 		char *const *path_argv,
 		int options,
 		int (*compar)(const FTSENT **, const FTSENT **)
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	)
 {
 	void *ret = NULL;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	cmd_p->arg.fts_open.path_argv_p		= path_argv;
 	cmd_p->arg.fts_open.options		= options;
 	cmd_p->arg.fts_open.compar		= compar;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			callid,
-# endif
+			slot,
 			PA_FTS_OPEN,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return ret;
 }
 
+/*
+ * Entries are read from the privileged thread/process by batches (one round
+ * trip per directory instead of one per entry), the batch is kept here until
+ * it's consumed by privileged_fts_read() calls.
+ */
+struct privileged_fts {
+	struct privileged_fts	*next;
+	FTS			*ftsp;
+
+	char			*buf;
+	size_t			 buf_size;
+	size_t			 size;
+	size_t			 pos;
+	int			 eof;
+	int			 eof_errno;
+
+	FTSENT			 ent;
+	int			 skip_last;
+
+	int			 premark_fd;
+	uint32_t		 premark_mask;
+	int			 premark_wd;	/* of the last entry (if it's a directory) until it's claimed */
+	const char		*premark_path;
+};
+static struct privileged_fts *privileged_fts_list = NULL;
+
+static struct privileged_fts *privileged_fts_get(FTS *ftsp, int create) {
+	struct privileged_fts *fts_p = privileged_fts_list;
+
+	while (fts_p != NULL) {
+		if (fts_p->ftsp == ftsp)
+			return fts_p;
+		fts_p = fts_p->next;
+	}
+
+	if (!create)
+		return NULL;
+
+	fts_p = xcalloc(1, sizeof(*fts_p));
+	fts_p->ftsp		= ftsp;
+	fts_p->premark_wd	= -1;
+	fts_p->next		= privileged_fts_list;
+	privileged_fts_list	= fts_p;
+
+	return fts_p;
+}
+
+static void privileged_fts_forget(FTS *ftsp) {
+	struct privileged_fts **fts_pp = &privileged_fts_list;
+
+	while (*fts_pp != NULL) {
+		struct privileged_fts *fts_p = *fts_pp;
+		if (fts_p->ftsp == ftsp) {
+			if (fts_p->premark_wd != -1)
+				privileged_inotify_rm_watch(fts_p->premark_fd, fts_p->premark_wd);
+			*fts_pp = fts_p->next;
+			free(fts_p->buf);
+			free(fts_p);
+			return;
+		}
+		fts_pp = &fts_p->next;
+	}
+
+	return;
+}
+
 FTSENT *__privileged_fts_read(
 		FTS *ftsp
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	)
 {
-	void *ret = NULL;
-	cmd_p->arg.void_v = ftsp;
-	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			callid,
+	struct privileged_fts *fts_p = privileged_fts_get(ftsp, 1);
+
+	if (fts_p->pos >= fts_p->size) {
+		if (fts_p->eof) {
+			errno = fts_p->eof_errno;
+			return NULL;
+		}
+
+		int slot = privileged_slot_get();
+		struct pa_fts_read_n_arg *arg_p = (void *)&cmd_slot_p[slot]->arg.fts_read_n;
+		struct pa_fts_read_n_ret *ret_p = (void *)&cmd_ret_slot_p[slot]->ret_buf.fts_read_n;
+
+		arg_p->ftsp		= ftsp;
+		arg_p->skip_last	= fts_p->skip_last;
+		arg_p->unused_wd	= fts_p->premark_wd;
+		arg_p->premark_fd	= fts_p->premark_fd;
+		arg_p->premark_mask	= fts_p->premark_mask;
+
+		if (privileged_action(
+				slot,
+				PA_FTS_READ_N,
+				NULL
+			)) {
+			privileged_slot_put(slot);
+			errno = ENOENT;
+			return NULL;
+		}
+
+		fts_p->skip_last	= 0;
+		fts_p->premark_wd	= -1;
+		fts_p->eof		= ret_p->eof;
+		fts_p->eof_errno	= errno;
+		fts_p->size		= ret_p->size;
+		fts_p->pos		= 0;
+
+		if (fts_p->buf_size < fts_p->size) {
+			fts_p->buf_size = fts_p->size;
+			fts_p->buf      = xrealloc(fts_p->buf, fts_p->buf_size);
+		}
+		memcpy(fts_p->buf, (void *)ret_p->buf, fts_p->size);
+
+		debug(10, "Got %i entries (%zu bytes)%s", ret_p->count, fts_p->size, fts_p->eof ? ", the end" : "");
+		privileged_slot_put(slot);
+
+		if (!fts_p->size) {
+			errno = fts_p->eof_errno;
+			return NULL;
+		}
+	}
+
+	struct pa_fts_read_n_ent *rec_p = (void *)&fts_p->buf[fts_p->pos];
+	FTSENT *ent_p = &fts_p->ent;
+	fts_p->pos += rec_p->size;
+
+	memset(ent_p, 0, sizeof(*ent_p));
+	ent_p->fts_info		= rec_p->fts_info;
+	ent_p->fts_errno	= rec_p->fts_errno;
+	ent_p->fts_level	= rec_p->fts_level;
+	ent_p->fts_path		= rec_p->fts_path;
+	ent_p->fts_accpath	= rec_p->fts_path;
+	ent_p->fts_pathlen	= rec_p->fts_pathlen;
+	ent_p->fts_statp	= rec_p->hasstat ? &rec_p->stat : NULL;
+
+	if (fts_p->pos >= fts_p->size && rec_p->wd != -1) {
+		fts_p->premark_wd   = rec_p->wd;
+		fts_p->premark_path = rec_p->fts_path;
+	}
+
+	errno = 0;
+	return ent_p;
+}
+
+int __privileged_fts_set(FTS *ftsp, FTSENT *f, int options) {
+	struct privileged_fts *fts_p = privileged_fts_get(ftsp, 0);
+
+	// Only the last entry of a batch may be a directory that is not read yet
+	if (fts_p == NULL || f != &fts_p->ent || fts_p->pos < fts_p->size)
+		return 0;
+
+	if (options & FTS_SKIP)
+		fts_p->skip_last = 1;
+
+	return 0;
+}
+
+int __privileged_fts_premark(FTS *ftsp, int fd, uint32_t mask) {
+# ifdef IN_MASK_CREATE
+	struct privileged_fts *fts_p = privileged_fts_get(ftsp, 1);
+
+	// IN_MASK_CREATE: an already watched directory is not premarked, so an unclaimed premark may be safely removed
+	fts_p->premark_fd	= fd;
+	fts_p->premark_mask	= mask | IN_MASK_CREATE;
 # endif
-			PA_FTS_READ,
-			&ret
-		);
-	return ret;
+	return 0;
+}
+
+static int privileged_fts_premark_nop(FTS *ftsp, int fd, uint32_t mask) {
+	return 0;
+}
+
+// Returns the watch descriptor set by PA_FTS_READ_N (if any)
+static inline int privileged_fts_premark_claim(int fd, const char *pathname, uint32_t mask) {
+# ifdef IN_MASK_CREATE
+	struct privileged_fts *fts_p = privileged_fts_list;
+
+	while (fts_p != NULL) {
+		if (
+			fts_p->premark_wd != -1					&&
+			fts_p->premark_fd == fd					&&
+			fts_p->premark_mask == (mask | IN_MASK_CREATE)		&&
+			!strcmp(fts_p->premark_path, pathname)
+		) {
+			int wd = fts_p->premark_wd;
+			fts_p->premark_wd = -1;
+			debug(10, "Claimed premarked \"%s\" (wd: %i)", pathname, wd);
+			return wd;
+		}
+		fts_p = fts_p->next;
+	}
+# endif
+
+	return -1;
 }
 
 int __privileged_fts_close(
 		FTS *ftsp
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	)
 {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
+	privileged_fts_forget(ftsp);
 	cmd_p->arg.void_v = ftsp;
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			callid,
-# endif
+			slot,
 			PA_FTS_CLOSE,
 			&ret
 		);
+	privileged_slot_put(slot);
+
 	return (long)ret;
 }
 
 int __privileged_inotify_init() {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_INOTIFY_INIT,
 			&ret
 		);
+	privileged_slot_put(slot);
+
 	return (long)ret;
 }
 
 int __privileged_inotify_init1(int flags) {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 	cmd_p->arg.uint32_v = flags;
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_INOTIFY_INIT1,
 			&ret
 		);
+	privileged_slot_put(slot);
+
 	return (long)ret;
 }
 
@@ -1402,25 +1780,28 @@ int __privileged_inotify_add_watch_threadsplit(
 		int fd,
 		const char *pathname,
 		uint32_t mask
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	)
 {
 	debug(25, "(%i, <%s>, o%o, ?)", fd, pathname, mask);
 	void *ret = (void *)(long)-1;
 
+	int wd = privileged_fts_premark_claim(fd, pathname, mask);
+	if (wd != -1)
+		return wd;
+
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
+
 	cmd_p->arg.inotify_add_watch.pathname_p	= pathname;
 	cmd_p->arg.inotify_add_watch.fd		= fd;
 	cmd_p->arg.inotify_add_watch.mask	= mask;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			callid,
-# endif
+			slot,
 			PA_INOTIFY_ADD_WATCH,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
@@ -1429,25 +1810,28 @@ int __privileged_inotify_add_watch_procsplit(
 		int fd,
 		const char *pathname,
 		uint32_t mask
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	)
 {
 	debug(25, "(%i, <%s>, o%o, ?)", fd, pathname, mask);
 	void *ret = (void *)(long)-1;
 
+	int wd = privileged_fts_premark_claim(fd, pathname, mask);
+	if (wd != -1)
+		return wd;
+
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
+
 	strncpy((void *)cmd_p->arg.inotify_add_watch.pathname, pathname, sizeof(cmd_p->arg.inotify_add_watch.pathname));
 	cmd_p->arg.inotify_add_watch.fd		= fd;
 	cmd_p->arg.inotify_add_watch.mask	= mask;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			callid,
-# endif
+			slot,
 			PA_INOTIFY_ADD_WATCH,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
@@ -1458,17 +1842,18 @@ int __privileged_inotify_rm_watch(
 	)
 {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	cmd_p->arg.inotify_rm_watch.fd	= fd;
 	cmd_p->arg.inotify_rm_watch.wd	= wd;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_INOTIFY_RM_WATCH,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
@@ -1477,16 +1862,17 @@ int __privileged_inotify_rm_watch(
 int __privileged_clsync_cgroup_deinit(ctx_t *ctx_p)
 {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	cmd_p->arg.ctx_p = ctx_p;
 
 	privileged_action(
-#  ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-#  endif
+			slot,
 			PA_CLSYNC_CGROUP_DEINIT,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
@@ -1499,6 +1885,8 @@ int __privileged_fork_setuid_execvp_procsplit(
 {
 	int i;
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	strncpy((void *)cmd_p->arg.fork_execvp.file, file, sizeof(cmd_p->arg.fork_execvp.file));
 
@@ -1510,52 +1898,79 @@ int __privileged_fork_setuid_execvp_procsplit(
 		critical_on(i >= MAXARGUMENTS);
 	}
 	cmd_p->arg.fork_execvp.argv[i] = NULL;
+	cmd_p->arg.fork_execvp.envp_p  = NULL;
+	cmd_p->arg.fork_execvp.keep_fd = -1;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_FORK_EXECVP,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
 
-int __privileged_fork_setuid_execvp_threadsplit(
+// The environment and descriptors of this process cannot be passed to the helper process
+int __privileged_fork_setuid_execvpe_procsplit(
 		const char *file,
-		char *const argv[]
+		char *const argv[],
+		char *const envp[],
+		int keep_fd
+	)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int __privileged_fork_setuid_execvpe_threadsplit(
+		const char *file,
+		char *const argv[],
+		char *const envp[],
+		int keep_fd
 	)
 {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
-	cmd_p->arg.fork_execvp.file_p = file;
-	cmd_p->arg.fork_execvp.argv_p = argv;
+	cmd_p->arg.fork_execvp.file_p  = file;
+	cmd_p->arg.fork_execvp.argv_p  = argv;
+	cmd_p->arg.fork_execvp.envp_p  = envp;
+	cmd_p->arg.fork_execvp.keep_fd = keep_fd;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_FORK_EXECVP,
 			&ret
 		);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
 
+int __privileged_fork_setuid_execvp_threadsplit(
+		const char *file,
+		char *const argv[]
+	)
+{
+	return __privileged_fork_setuid_execvpe_threadsplit(file, argv, NULL, -1);
+}
+
 int __privileged_kill_child_wrapper(pid_t pid, int signal)
 {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	cmd_p->arg.kill_child.pid    = pid;
 	cmd_p->arg.kill_child.signal = signal;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_KILL_CHILD,
 			&ret);
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
@@ -1563,19 +1978,81 @@ int __privileged_kill_child_wrapper(pid_t pid, int signal)
 pid_t __privileged_waitpid(pid_t pid, int *status, int options)
 {
 	void *ret = (void *)(long)-1;
+	int slot = privileged_slot_get();
+	volatile struct cmd *cmd_p = cmd_slot_p[slot];
 
 	cmd_p->arg.waitpid.pid     = pid;
 	cmd_p->arg.waitpid.options = options;
 
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_WAITPID,
 			&ret);
 
 	if (status != NULL)
 		*status = cmd_p->arg.waitpid.status;
+	privileged_slot_put(slot);
+
+	return (long)ret;
+}
+
+static int privileged_opendir_local(const char *path) {
+	return open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+}
+
+int __privileged_opendir(const char *path)
+{
+	void *ret = (void *)(long)-1;
+	int slot, fd;
+
+	if (strlen(path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (dirfd_sock[0] != -1)
+		critical_on (pthread_mutex_lock(&dirfd_mutex));
+
+	slot = privileged_slot_get();
+	strcpy((char *)cmd_slot_p[slot]->arg.path.path, path);
+	privileged_action(
+			slot,
+			PA_OPENDIR,
+			&ret);
+	privileged_slot_put(slot);
+
+	fd = (long)ret;
+	if (fd != -1 && dirfd_sock[0] != -1) {
+		fd = dirfd_recv(dirfd_sock[0]);
+		if (fd == -1)
+			error("Cannot receive the descriptor of \"%s\" from the privileged process.", path);
+	}
+
+	if (dirfd_sock[0] != -1)
+		critical_on (pthread_mutex_unlock(&dirfd_mutex));
+
+	return fd;
+}
+
+int __privileged_lstat(const char *path, struct stat *buf)
+{
+	void *ret = (void *)(long)-1;
+	int slot;
+
+	if (strlen(path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	slot = privileged_slot_get();
+	strcpy((char *)cmd_slot_p[slot]->arg.path.path, path);
+	privileged_action(
+			slot,
+			PA_LSTAT,
+			&ret);
+	if (!(long)ret)
+		memcpy(buf, (void *)&cmd_ret_slot_p[slot]->ret_buf.stat, sizeof(*buf));
+	privileged_slot_put(slot);
 
 	return (long)ret;
 }
@@ -1584,23 +2061,15 @@ pid_t __privileged_waitpid(pid_t pid, int *status, int options)
 
 uid_t __privileged_fork_execvp_uid;
 gid_t __privileged_fork_execvp_gid;
-int __privileged_fork_execvp(const char *file, char *const argv[])
+int __privileged_fork_execvpe(const char *file, char *const argv[], char *const envp[], int keep_fd)
 {
 	debug(4, "");
-	pid_t pid = fork();
-	switch (pid) {
-		case -1: 
-			error("Cannot fork().");
-			return -1;
-		case  0:
-			debug(4, "setgid(%u) == %i", __privileged_fork_execvp_gid, setgid(__privileged_fork_execvp_gid));
-			debug(4, "setuid(%u) == %i", __privileged_fork_execvp_uid, setuid(__privileged_fork_execvp_uid));
-			errno = 0;
-			execvp(file, argv);
-			exit(errno);
-	}
+	return spawn_execvp(file, argv, envp, keep_fd, __privileged_fork_execvp_uid, __privileged_fork_execvp_gid);
+}
 
-	return pid;
+int __privileged_fork_execvp(const char *file, char *const argv[])
+{
+	return __privileged_fork_execvpe(file, argv, NULL, -1);
 }
 
 #ifdef CAPABILITIES_SUPPORT
@@ -1671,24 +2140,66 @@ static inline int _pthread_cond_destroy_smart(int isshared, pthread_cond_t *cond
 
 	return 0;
 }
-#endif
 
-int privileged_init(ctx_t *ctx_p)
-{
-#ifdef READWRITE_SIGNALLING
-	int pipefds[2];
-#endif
+// The slots are allocated separately to be page-aligned for mprotect() (see "--shm-mprotect")
+static int privileged_ring_init(ctx_t *ctx_p) {
+	int slot;
+	void *(*alloc)(size_t nmemb, size_t size) = (ctx_p->flags[SPLITTING] == SM_PROCESS ? shm_calloc : calloc_align);
+
+	ring_p = alloc(1, sizeof(*ring_p));
+
+	slot = 0;
+	while (slot < PRIVILEGED_RING_SLOTS) {
+		cmd_slot_p[slot]     = alloc(1, sizeof(*cmd_slot_p[slot]));
+		cmd_ret_slot_p[slot] = alloc(1, sizeof(*cmd_ret_slot_p[slot]));
+# ifndef HL_LOCKS
+		SAFE ( pthread_cond_init_smart(&pthread_cond_slot_p[slot]),	return errno;);
+# endif
+		slot++;
+	}
 
-#ifdef CAPABILITIES_SUPPORT
 # ifdef HL_LOCKS
+	hl_lock_p = alloc(1, sizeof(*hl_lock_p));
+	hl_lock_init(hl_lock_p);
 	if (ncpus == 1)
-		hl_shutdown(HLLOCK_HANDLER);
+		hl_shutdown();
+# else
+	SAFE ( pthread_cond_init_smart(&pthread_cond_slotfree_p),		return errno;);
+	SAFE ( pthread_cond_init_smart(&pthread_cond_privileged_p),		return errno;);
 # endif
 
+	return 0;
+}
+
+static void privileged_ring_free(ctx_t *ctx_p) {
+	int slot;
+	void (*dealloc)(void *ptr) = (ctx_p->flags[SPLITTING] == SM_PROCESS ? shm_free : free);
+
+	slot = 0;
+	while (slot < PRIVILEGED_RING_SLOTS) {
+		dealloc((void *)cmd_slot_p[slot]);
+		dealloc((void *)cmd_ret_slot_p[slot]);
+		slot++;
+	}
+	dealloc((void *)ring_p);
+# ifdef HL_LOCKS
+	dealloc((void *)hl_lock_p);
+# endif
+
+	return;
+}
+#endif
+
+int privileged_init(ctx_t *ctx_p)
+{
+#ifdef CAPABILITIES_SUPPORT
+	int slot;
+
 	if (ctx_p->flags[SPLITTING] == SM_OFF) {
 #endif
 
 		_privileged_fork_execvp		= __privileged_fork_execvp;
+		_privileged_fork_execvpe	= __privileged_fork_execvpe;
 
 		__privileged_fork_execvp_uid	= ctx_p->synchandler_uid;
 		__privileged_fork_execvp_gid	= ctx_p->synchandler_gid;
@@ -1699,6 +2210,8 @@ int privileged_init(ctx_t *ctx_p)
 		_privileged_fts_open		= (typeof(_privileged_fts_open))		fts_open;
 		_privileged_fts_read		= (typeof(_privileged_fts_read))		fts_read;
 		_privileged_fts_close		= (typeof(_privileged_fts_close))		fts_close;
+		_privileged_fts_set		= (typeof(_privileged_fts_set))			fts_set;
+		_privileged_fts_premark		= privileged_fts_premark_nop;
 		_privileged_inotify_init	= (typeof(_privileged_inotify_init))		inotify_init;
 		_privileged_inotify_init1	= (typeof(_privileged_inotify_init1))		inotify_init1;
 		_privileged_inotify_add_watch	= (typeof(_privileged_inotify_add_watch))	inotify_add_watch;
@@ -1707,6 +2220,8 @@ int privileged_init(ctx_t *ctx_p)
 		_privileged_clsync_cgroup_deinit= (typeof(_privileged_clsync_cgroup_deinit))	clsync_cgroup_deinit;
 # endif
 		_privileged_waitpid		= (typeof(_privileged_waitpid))			waitpid;
+		_privileged_opendir		= privileged_opendir_local;
+		_privileged_lstat		= (typeof(_privileged_lstat))			lstat;
 
 		cap_drop(ctx_p, ctx_p->caps);
 #endif
@@ -1718,6 +2233,8 @@ int privileged_init(ctx_t *ctx_p)
 
 	_privileged_fts_read		= __privileged_fts_read;
 	_privileged_fts_close		= __privileged_fts_close;
+	_privileged_fts_set		= __privileged_fts_set;
+	_privileged_fts_premark		= __privileged_fts_premark;
 	_privileged_inotify_init	= __privileged_inotify_init;
 	_privileged_inotify_init1	= __privileged_inotify_init1;
 	_privileged_inotify_rm_watch	= __privileged_inotify_rm_watch;
@@ -1726,25 +2243,18 @@ int privileged_init(ctx_t *ctx_p)
 	_privileged_clsync_cgroup_deinit= __privileged_clsync_cgroup_deinit;
 # endif
 	_privileged_waitpid		= __privileged_waitpid;
+	if (ctx_p->flags[PASS_DIRFDS]) {
+		_privileged_opendir	= __privileged_opendir;
+		_privileged_lstat	= __privileged_lstat;
+	} else {
+		_privileged_opendir	= privileged_opendir_local;
+		_privileged_lstat	= (typeof(_privileged_lstat))			lstat;
+	}
 
 	SAFE ( pthread_mutex_init_smart(&pthread_mutex_privileged_p),		return errno;);
-	SAFE ( pthread_mutex_init_smart(&pthread_mutex_action_entrance_p),	return errno;);
-	SAFE ( pthread_mutex_init_smart(&pthread_mutex_action_signal_p),	return errno;);
 	SAFE ( pthread_mutex_init_smart(&pthread_mutex_runner_p),		return errno;);
-	SAFE ( pthread_cond_init_smart (&pthread_cond_privileged_p),		return errno;);
-	SAFE ( pthread_cond_init_smart (&pthread_cond_action_p),		return errno;);
 	SAFE ( pthread_cond_init_smart (&pthread_cond_runner_p),		return errno;);
 
-# ifdef READWRITE_SIGNALLING
-	SAFE ( pipe2(pipefds, O_CLOEXEC), 				return errno;);
-	priv_read_fd  = pipefds[0];
-	priv_write_fd = pipefds[1];
-
-	SAFE ( pipe2(pipefds, O_CLOEXEC), 				return errno;);
-	nonp_read_fd  = pipefds[0];
-	nonp_write_fd = pipefds[1];
-# endif
-
 	SAFE ( pthread_mutex_lock(pthread_mutex_runner_p),		return errno;);
 
 # ifdef UNSHARE_SUPPORT
@@ -1756,13 +2266,9 @@ int privileged_init(ctx_t *ctx_p)
 			_privileged_fts_open		= __privileged_fts_open_threadsplit;
 			_privileged_inotify_add_watch	= __privileged_inotify_add_watch_threadsplit;
 			_privileged_fork_execvp		= __privileged_fork_setuid_execvp_threadsplit;
+			_privileged_fork_execvpe	= __privileged_fork_setuid_execvpe_threadsplit;
 
-			cmd_p     = calloc_align(1, sizeof(*cmd_p));
-			cmd_ret_p = calloc_align(1, sizeof(*cmd_ret_p));
-# ifdef HL_LOCKS
-			hl_lock_p = calloc_align(1, sizeof(*hl_lock_p));
-			hl_lock_init(hl_lock_p);
-# endif
+			SAFE ( privileged_ring_init(ctx_p),	return errno;);
 
 			// Running the privileged thread
 			SAFE ( pthread_create(&privileged_thread, NULL, (void *(*)(void *))privileged_handler, ctx_p), return errno);
@@ -1775,18 +2281,24 @@ int privileged_init(ctx_t *ctx_p)
 			_privileged_fts_open		= __privileged_fts_open_procsplit;
 			_privileged_inotify_add_watch	= __privileged_inotify_add_watch_procsplit;
 			_privileged_fork_execvp		= __privileged_fork_setuid_execvp_procsplit;
+			_privileged_fork_execvpe	= __privileged_fork_setuid_execvpe_procsplit;
 
-			cmd_p     = shm_calloc(1, sizeof(*cmd_p));
-			cmd_ret_p = shm_calloc(1, sizeof(*cmd_ret_p));
-# ifdef HL_LOCKS
-			hl_lock_p = shm_calloc(1, sizeof(*hl_lock_p));
-			hl_lock_init(hl_lock_p);
-# endif
+			SAFE ( privileged_ring_init(ctx_p),	return errno;);
+
+			if (ctx_p->flags[PASS_DIRFDS])
+				SAFE ( socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, dirfd_sock),	return errno);
 
 			// Running the privileged helper
 			SAFE ( (helper_pid = fork_helper()) == -1,	return errno);
-			if (!helper_pid)
+			if (!helper_pid) {
+				if (dirfd_sock[0] != -1)
+					close(dirfd_sock[0]);
 				exit(privileged_handler(ctx_p));
+			}
+			if (dirfd_sock[1] != -1) {
+				close(dirfd_sock[1]);
+				dirfd_sock[1] = -1;
+			}
 			break;
 		}
 		default:
@@ -1808,14 +2320,14 @@ int privileged_init(ctx_t *ctx_p)
 	pthread_mutex_unlock(pthread_mutex_runner_p);
 
 	debug(4, "Sending the settings (exec_uid == %u; exec_gid == %u)", ctx_p->synchandler_uid, ctx_p->synchandler_gid);
-	cmd_p->arg.ctx_p = ctx_p;
+	slot = privileged_slot_get();
+	cmd_slot_p[slot]->arg.ctx_p = ctx_p;
 	privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_SETUP,
 			NULL
 		);
+	privileged_slot_put(slot);
 
 	SAFE (pthread_mutex_destroy_smart(pthread_mutex_runner_p),	return errno;);
 	SAFE (pthread_cond_destroy_smart(pthread_cond_runner_p),	return errno;);
@@ -1839,28 +2351,19 @@ int privileged_deinit(ctx_t *ctx_p)
 	if (ctx_p->flags[SPLITTING] == SM_OFF)
 		return 0;
 
+	// The slot is not freed: nobody answers after that
+	int slot = privileged_slot_get();
 	SAFE ( privileged_action(
-# ifdef HL_LOCK_TRIES_AUTO
-			PC_DEFAULT,
-# endif
+			slot,
 			PA_DIE,
 			NULL
 		),
 		ret = errno
 	);
 
-# ifdef HL_LOCK_TRIES_AUTO
-{
-	int i=0;
-	while (i < PC_MAX) {
-		debug(1, "hl_lock_p->tries[%i] == %lu", i, hl_lock_p->tries[i]);
-		i++;
-	}
-}
-# endif
-
 # ifdef HL_LOCKS
-	hl_shutdown(HLLOCK_HANDLER);
+	debug(1, "hl_lock_p->spin[] == {%i, %i}", hl_lock_p->spin[HLS_HELPER], hl_lock_p->spin[HLS_CALLER]);
+	hl_shutdown();
 # endif
 
 	switch (ctx_p->flags[SPLITTING]) {
@@ -1871,11 +2374,7 @@ int privileged_deinit(ctx_t *ctx_p)
 			} else {
 				SAFE ( pthread_join(privileged_thread, NULL),  ret = errno );
 			}
-			free((void *)cmd_p);
-			free((void *)cmd_ret_p);
-# ifdef HL_LOCKS
-			free((void *)hl_lock_p);
-# endif
+			privileged_ring_free(ctx_p);
 			break;
 		}
 		case SM_PROCESS: {
@@ -1883,20 +2382,18 @@ int privileged_deinit(ctx_t *ctx_p)
 			__privileged_kill_child_itself(helper_pid, SIGKILL);
 			debug(9, "waitpid(%u, ...)", helper_pid);
 			waitpid(helper_pid, &status, 0);
-			shm_free((void *)cmd_p);
-			shm_free((void *)cmd_ret_p);
-# ifdef HL_LOCKS
-			shm_free((void *)hl_lock_p);
-# endif
+			privileged_ring_free(ctx_p);
+			if (dirfd_sock[0] != -1) {
+				close(dirfd_sock[0]);
+				dirfd_sock[0] = -1;
+			}
 			break;
 		}
 	}
 /*
 	SAFE ( pthread_mutex_destroy_smart(pthread_mutex_privileged_p),		ret = errno );
-	SAFE ( pthread_mutex_destroy_smart(pthread_mutex_action_entrance_p),	ret = errno );
-	SAFE ( pthread_mutex_destroy_smart(pthread_mutex_action_signal_p),	ret = errno );
 	SAFE ( pthread_cond_destroy_smart(pthread_cond_privileged_p),		ret = errno );
-	SAFE ( pthread_cond_destroy_smart(pthread_cond_action_p),		ret = errno );
+	SAFE ( pthread_cond_destroy_smart(pthread_cond_slotfree_p),		ret = errno );
 */
 #endif
 
@@ -1905,3 +2402,128 @@ int privileged_deinit(ctx_t *ctx_p)
 }
 
 
+
+#ifdef CAPABILITIES_SUPPORT
+struct privileged_benchmark_arg {
+	int		 rounds;
+	unsigned long	*latency;	/* nanoseconds */
+};
+
+static void *privileged_benchmark_thread(void *_arg_p) {
+	struct privileged_benchmark_arg *arg_p = _arg_p;
+	struct timespec start, end;
+	int i;
+
+	i = 0;
+	while (i < arg_p->rounds) {
+		int slot;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		slot = privileged_slot_get();
+		privileged_action(slot, PA_NOP, NULL);
+		privileged_slot_put(slot);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		arg_p->latency[i++] = (end.tv_sec - start.tv_sec)*1000000000UL + end.tv_nsec - start.tv_nsec;
+	}
+
+	return NULL;
+}
+
+static int privileged_benchmark_cmp(const void *_a_p, const void *_b_p) {
+	const unsigned long *a_p = _a_p, *b_p = _b_p;
+
+	return (*a_p > *b_p) - (*a_p < *b_p);
+}
+
+// Measures round trips of empty requests to the privileged thread/process
+int privileged_benchmark(ctx_t *ctx_p, int rounds)
+{
+	static const int threads_count[] = {1, PRIVILEGED_RING_SLOTS};
+	int test;
+
+	if (ctx_p->flags[SPLITTING] == SM_OFF)
+		return errno = EINVAL;
+
+	test = 0;
+	while (test < sizeof(threads_count)/sizeof(*threads_count)) {
+		pthread_t			 threads[PRIVILEGED_RING_SLOTS];
+		struct privileged_benchmark_arg	 args[PRIVILEGED_RING_SLOTS];
+		struct timespec			 start, end;
+		unsigned long			*latency, sum;
+		double				 elapsed;
+		int				 count = threads_count[test], i;
+		size_t				 total = (size_t)rounds * count, n;
+
+		latency = xmalloc(total * sizeof(*latency));
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		i = 0;
+		while (i < count) {
+			args[i].rounds  = rounds;
+			args[i].latency = &latency[i * rounds];
+			critical_on (pthread_create(&threads[i], NULL, privileged_benchmark_thread, &args[i]));
+			i++;
+		}
+		while (i--)
+			pthread_join(threads[i], NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = (end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec)/1000000000;
+
+		qsort(latency, total, sizeof(*latency), privileged_benchmark_cmp);
+		sum = 0;
+		n   = 0;
+		while (n < total)
+			sum += latency[n++];
+
+		info("Privileged round trips (%s splitting, %i thread(s), %i rounds each): "
+			"min %lu ns, avg %lu ns, p50 %lu ns, p99 %lu ns, max %lu ns; %.0f requests/s",
+			ctx_p->flags[SPLITTING] == SM_PROCESS ? "process" : "thread", count, rounds,
+			latency[0], sum/total, latency[total/2], latency[total*99/100], latency[total-1],
+			total/elapsed);
+
+		free(latency);
+		test++;
+	}
+
+	// Spawning of a sync handler (it depends on the size of the process with fork())
+	if (!ctx_p->flags[CHECK_EXECVP_ARGS]) {
+		char *const		 argv[] = {"true", NULL};
+		struct timespec		 start, end;
+		unsigned long		 latency, sum = 0, max = 0, rss = 0;
+		int			 i, spawns = rounds/10 + 1;
+		FILE			*statm;
+
+		statm = fopen("/proc/self/statm", "r");
+		if (statm != NULL) {
+			if (fscanf(statm, "%*u %lu", &rss) != 1)
+				rss = 0;
+			fclose(statm);
+		}
+
+		i = 0;
+		while (i < spawns) {
+			pid_t pid;
+			int status;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			pid = privileged_fork_execvp(argv[0], argv);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (pid == -1)
+				return errno;
+			privileged_waitpid(pid, &status, 0);
+
+			latency = (end.tv_sec - start.tv_sec)*1000000000UL + end.tv_nsec - start.tv_nsec;
+			sum += latency;
+			if (latency > max)
+				max = latency;
+			i++;
+		}
+
+		info("Spawning of \"true\" (%i times, RSS %lu KiB): avg %lu ns, max %lu ns",
+			spawns, rss * (sysconf(_SC_PAGESIZE) / 1024), sum/spawns, max);
+	}
+
+	return 0;
+}
+#endif
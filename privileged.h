@@ -17,50 +17,25 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifdef HL_LOCK_TRIES_AUTO
-# define IF_HL_LOCK_TRIES_AUTO(a) a
-#else
-# define IF_HL_LOCK_TRIES_AUTO(a) {}
-#endif
-
 #ifdef CAPABILITIES_SUPPORT
 
-enum priv_callid {
-	PC_DEFAULT = 0,
-	PC_SYNC_INIIALSYNC_WALK_FTS_OPEN,
-	PC_SYNC_INIIALSYNC_WALK_FTS_READ,
-	PC_SYNC_INIIALSYNC_WALK_FTS_CLOSE,
-	PC_SYNC_MARK_WALK_FTS_OPEN,
-	PC_SYNC_MARK_WALK_FTS_READ,
-	PC_SYNC_MARK_WALK_FTS_CLOSE,
-	PC_INOTIFY_ADD_WATCH_DIR,
-
-	PC_MAX
-};
-
 extern FTS *(*_privileged_fts_open)		(
 		char * const *path_argv,
 		int options,
 		int (*compar)(const FTSENT **, const FTSENT **)
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
 extern FTSENT *(*_privileged_fts_read)		(
 		FTS *ftsp
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
 extern int (*_privileged_fts_close)		(
 		FTS *ftsp
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
+extern int (*_privileged_fts_set)		(FTS *ftsp, FTSENT *f, int options);
+extern int (*_privileged_fts_premark)		(FTS *ftsp, int fd, uint32_t mask);
+
 extern int (*_privileged_inotify_init)		();
 extern int (*_privileged_inotify_init1)		(int flags);
 
@@ -68,9 +43,6 @@ extern int (*_privileged_inotify_add_watch)	(
 		int fd,
 		const char *pathname,
 		uint32_t mask
-# ifdef HL_LOCK_TRIES_AUTO
-		, int callid
-# endif
 	);
 
 extern int (*_privileged_inotify_rm_watch)	(
@@ -84,41 +56,45 @@ extern int (*_privileged_clsync_cgroup_deinit)	(ctx_t *ctx_p);
 
 extern pid_t (*_privileged_waitpid)		(pid_t pid, int *status, int options);
 
-extern int privileged_check();
-
-# ifdef HL_LOCK_TRIES_AUTO
-#  define privileged_fts_open(a,b,c,d)		_privileged_fts_open(a,b,c,d)
-#  define privileged_fts_read(a,b)		_privileged_fts_read(a,b)
-#  define privileged_fts_close(a,b)		_privileged_fts_close(a,b)
-#  define privileged_inotify_add_watch(a,b,c,d)	_privileged_inotify_add_watch(a,b,c,d)
-# else
-#  define privileged_fts_open(a,b,c,d)		_privileged_fts_open(a,b,c)
-#  define privileged_fts_read(a,b)		_privileged_fts_read(a)
-#  define privileged_fts_close(a,b)		_privileged_fts_close(a)
-#  define privileged_inotify_add_watch(a,b,c,d)	_privileged_inotify_add_watch(a,b,c)
-# endif
+extern int (*_privileged_opendir)		(const char *path);
+extern int (*_privileged_lstat)			(const char *path, struct stat *buf);
 
+extern int privileged_check();
+extern int privileged_benchmark(ctx_t *ctx_p, int rounds);
+
+# define privileged_fts_open			_privileged_fts_open
+# define privileged_fts_read			_privileged_fts_read
+# define privileged_fts_close			_privileged_fts_close
+# define privileged_inotify_add_watch		_privileged_inotify_add_watch
+# define privileged_fts_set			_privileged_fts_set
+# define privileged_fts_premark			_privileged_fts_premark
 # define privileged_inotify_init		_privileged_inotify_init
 # define privileged_inotify_init1		_privileged_inotify_init1
 # define privileged_inotify_rm_watch		_privileged_inotify_rm_watch
 # define privileged_clsync_cgroup_deinit	_privileged_clsync_cgroup_deinit
 # define privileged_waitpid			_privileged_waitpid
+# define privileged_opendir			_privileged_opendir
+# define privileged_lstat			_privileged_lstat
 
 #else
 
 # define privileged_check(...)			{}
 
-# define privileged_fts_open(a,b,c,d)		fts_open(a,b,c)
-# define privileged_fts_read(a,b)		fts_read(a)
-# define privileged_fts_close(a,b)		fts_close(a)
+# define privileged_fts_open			fts_open
+# define privileged_fts_read			fts_read
+# define privileged_fts_close			fts_close
+# define privileged_fts_set			fts_set
+static inline int privileged_fts_premark(FTS *ftsp, int fd, uint32_t mask) { return 0; }
 # define privileged_inotify_init		inotify_init
 # define privileged_inotify_init1		inotify_init1
-# define privileged_inotify_add_watch(a,b,c,d)	inotify_add_watch(a,b,c)
+# define privileged_inotify_add_watch		inotify_add_watch
 # define privileged_inotify_rm_watch		inotify_rm_watch
 # ifdef CGROUP_SUPPORT
 #  define privileged_clsync_cgroup_deinit	clsync_cgroup_deinit
 # endif
 # define privileged_waitpid			waitpid
+# define privileged_opendir(path)		open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)
+# define privileged_lstat			lstat
 #endif
 
 extern int (*_privileged_kill_child)(
@@ -131,8 +107,16 @@ extern int (*_privileged_fork_execvp)(
 		char *const argv[]
 	);
 
+extern int (*_privileged_fork_execvpe)(
+		const char *file,
+		char *const argv[],
+		char *const envp[],
+		int keep_fd
+	);
+
 #define privileged_kill_child			_privileged_kill_child
 #define privileged_fork_execvp			_privileged_fork_execvp
+#define privileged_fork_execvpe			_privileged_fork_execvpe
 
 extern int privileged_init(struct ctx *ctx_p);
 extern int privileged_deinit(struct ctx *ctx_p);
@@ -21,8 +21,485 @@
 
 #include <glib.h>	// g_hash_table_*
 
+#include "malloc.h"
 #include "rules.h"
 #include "error.h"
+#include "indexes.h"
+
+/* === COMPILED EXPRESSIONS === */
+
+// Most of rules are just paths with ".*" and anchors. Such expressions are
+// compiled to a sequence of literals and wildcards and matched without
+// regexec(). Everything else is matched by regexec().
+
+enum rulematch_opcode {
+	RMO_END = 0,
+	RMO_LITERAL,	// a string
+	RMO_ANYCHAR,	// "."
+	RMO_ANYSEQ,	// ".*"
+};
+
+struct rulematch_op {
+	enum rulematch_opcode	 op;
+	size_t			 len;
+	char			*str;
+};
+
+// The shapes that are matched by literal indexes (see "LITERAL INDEXES")
+enum rulematch_shape {
+	RMS_OTHER = 0,
+	RMS_EXACT,	// "^literal$"
+	RMS_PREFIX,	// "^literal"
+	RMS_SUFFIX,	// "literal$"
+};
+
+struct rulematch {
+	char			 hasanychar;
+	enum rulematch_shape	 shape;
+	struct rulematch_op	 ops[];		// the literals are stored after the terminating RMO_END
+};
+typedef struct rulematch rulematch_t;
+
+static inline int rule_match_isquantifier(char c) {
+	return c == '*' || c == '+' || c == '?' || c == '{';
+}
+
+static inline struct rulematch_op *rule_match_addop(struct rulematch_op *ops, int *ops_count_p, enum rulematch_opcode op) {
+	// Collapsing ".*.*"
+	if (op == RMO_ANYSEQ && *ops_count_p && ops[*ops_count_p - 1].op == RMO_ANYSEQ)
+		return &ops[*ops_count_p - 1];
+
+	struct rulematch_op *op_p = &ops[(*ops_count_p)++];
+	op_p->op  = op;
+	op_p->len = 0;
+	op_p->str = NULL;
+
+	return op_p;
+}
+
+/**
+ * @brief 			Compiles a POSIX extended regular expression that consists of literals, ".", ".*", leading "^" and trailing "$"
+ *
+ * @param[in] 	expr		The expression
+ *
+ * @retval	match_p		Pointer to the compiled expression
+ * @retval	NULL		The expression has other constructs
+ *
+ */
+static rulematch_t *rule_match_compile(const char *expr) {
+	size_t expr_len = strlen(expr);
+	// Every character is an op in the worst case, plus leading and trailing ".*" and the terminator
+	struct rulematch_op *ops = alloca(sizeof(*ops) * (expr_len + 3));
+	// Every literal is NULL-terminated (to be searched by strstr())
+	char *lits = alloca(expr_len * 2 + 1), *lits_end = lits;
+	int ops_count = 0, hasanychar = 0, anchored_end = 0;
+	const char *ptr = expr, *end = &expr[expr_len];
+	struct rulematch_op *lit_p = NULL;
+
+	if (*ptr == '^')
+		ptr++;
+	else
+		rule_match_addop(ops, &ops_count, RMO_ANYSEQ);	// regexec() searches for the expression anywhere in the string
+
+	while (ptr < end) {
+		char c = *(ptr++);
+
+		switch (c) {
+			case '.':
+				lit_p = NULL;
+				if (*ptr == '*') {
+					ptr++;
+					if (rule_match_isquantifier(*ptr))
+						return NULL;
+					rule_match_addop(ops, &ops_count, RMO_ANYSEQ);
+					continue;
+				}
+				if (rule_match_isquantifier(*ptr))
+					return NULL;
+				rule_match_addop(ops, &ops_count, RMO_ANYCHAR);
+				hasanychar = 1;
+				continue;
+			case '$':
+				if (ptr != end)
+					return NULL;
+				anchored_end = 1;
+				continue;
+			case '\\':
+				if (ptr == end || !strchr("^.[]$()|*+?{}\\/", *ptr))
+					return NULL;	// GNU extensions like "\w" or "\b"
+				c = *(ptr++);
+				break;
+			case '^':
+			case '[':
+			case ']':
+			case '(':
+			case ')':
+			case '|':
+			case '*':
+			case '+':
+			case '?':
+			case '{':
+			case '}':
+				return NULL;
+		}
+
+		if (rule_match_isquantifier(*ptr))
+			return NULL;
+
+		if (lit_p == NULL) {
+			lit_p = rule_match_addop(ops, &ops_count, RMO_LITERAL);
+			lit_p->str = lits_end;
+		}
+		lit_p->str[lit_p->len++] = c;
+		lit_p->str[lit_p->len]   = 0;
+		lits_end = &lit_p->str[lit_p->len + 1];
+	}
+
+	if (!anchored_end)
+		rule_match_addop(ops, &ops_count, RMO_ANYSEQ);
+	rule_match_addop(ops, &ops_count, RMO_END);
+
+	// One allocation: the ops and then the literals
+	rulematch_t *match_p = xmalloc(sizeof(*match_p) + sizeof(*ops) * ops_count + (lits_end - lits));
+	char *lits_dst = (char *)&match_p->ops[ops_count];
+	int i = 0;
+
+	memcpy(match_p->ops, ops, sizeof(*ops) * ops_count);
+	memcpy(lits_dst, lits, lits_end - lits);
+	match_p->hasanychar = hasanychar;
+
+	match_p->shape = RMS_OTHER;
+	if (ops[0].op == RMO_LITERAL) {
+		if (ops[1].op == RMO_END)
+			match_p->shape = RMS_EXACT;
+		else
+		if (ops[1].op == RMO_ANYSEQ && ops[2].op == RMO_END)
+			match_p->shape = RMS_PREFIX;
+	} else
+	if (ops[0].op == RMO_ANYSEQ && ops[1].op == RMO_LITERAL && ops[2].op == RMO_END)
+		match_p->shape = RMS_SUFFIX;
+
+	while (i < ops_count) {
+		if (match_p->ops[i].op == RMO_LITERAL)
+			match_p->ops[i].str = &lits_dst[match_p->ops[i].str - lits];
+		i++;
+	}
+
+	return match_p;
+}
+
+// Matches the whole string against a sequence of literals and wildcards (backtracking to the last ".*" only)
+
+static int rule_match(const rulematch_t *match_p, const char *str) {
+	const struct rulematch_op *op_p = match_p->ops, *star_op_p = NULL;
+	const char *s = str, *star_s = NULL;
+
+	while (1) {
+		switch (op_p->op) {
+			case RMO_LITERAL:
+				if (!strncmp(s, op_p->str, op_p->len)) {
+					s += op_p->len;
+					op_p++;
+					continue;
+				}
+				break;
+			case RMO_ANYCHAR:
+				if (*s) {
+					s++;
+					op_p++;
+					continue;
+				}
+				break;
+			case RMO_ANYSEQ:
+				if (op_p[1].op == RMO_END)
+					return 1;
+				star_op_p = op_p++;
+				star_s    = s;
+				// Skipping positions where the next literal cannot match
+				if (op_p->op == RMO_LITERAL) {
+					star_s = s = strstr(s, op_p->str);
+					if (s == NULL)
+						return 0;
+				}
+				continue;
+			case RMO_END:
+				if (!*s)
+					return 1;
+				break;
+		}
+
+		// Mismatch: retrying from the next position of the last ".*"
+		if (star_op_p == NULL || !*star_s)
+			return 0;
+
+		star_s++;
+		if (star_op_p[1].op == RMO_LITERAL) {
+			star_s = strstr(star_s, star_op_p[1].str);
+			if (star_s == NULL)
+				return 0;
+		}
+		s    = star_s;
+		op_p = &star_op_p[1];
+	}
+
+	return 0;
+}
+
+static inline int rule_expr_match(rule_t *rule_p, const char *fpath) {
+	// "." matches a character (not a byte) in multibyte locales
+	if (rule_p->match != NULL && !(rule_p->match->hasanychar && MB_CUR_MAX > 1))
+		return rule_match(rule_p->match, fpath);
+
+	return !regexec(&rule_p->expr, fpath, 0, NULL, 0);
+}
+
+/* === LITERAL INDEXES === */
+
+// Rules of shapes "^literal", "literal$" and "^literal$" are not matched one
+// by one. A path is checked against all of them at once: by a prefix trie,
+// a suffix hashtable and an exact path hashtable. The result is a bitmap of
+// matched rules that is used by the ordinary scan through the rules, so the
+// rules order and the actions masks are not affected.
+
+typedef struct {
+	uint64_t	w[(MAXRULES+63)/64];
+} rules_bitmap_t;
+
+static inline void rules_bitmap_set(rules_bitmap_t *bitmap_p, int n) {
+	bitmap_p->w[n >> 6] |= (uint64_t)1 << (n & 63);
+}
+
+static inline int rules_bitmap_test(const rules_bitmap_t *bitmap_p, int n) {
+	return (bitmap_p->w[n >> 6] >> (n & 63)) & 1;
+}
+
+static inline void rules_bitmap_or(rules_bitmap_t *dst_p, const rules_bitmap_t *src_p) {
+	int i = 0;
+	while (i < (int)(sizeof(dst_p->w)/sizeof(*dst_p->w))) {
+		dst_p->w[i] |= src_p->w[i];
+		i++;
+	}
+}
+
+struct rules_trie_node {
+	int		child;		// index of the first child, 0 if there's no children
+	int		next;		// index of the next sibling, 0 if it's the last one
+	unsigned char	c;
+	char		hasrules;
+	rules_bitmap_t	rules;		// rules with the prefix that ends here
+};
+
+static struct rules_literals {
+	rule_t			*rules_p;	// the rules the indexes are built for
+	struct rules_trie_node	*trie;		// prefixes, the node #0 is the root
+	int			 trie_count;
+	int			 trie_size;
+	GHashTable		*suffix_ht;	// suffix -> rules_bitmap_t
+	size_t			 suffix_lens[MAXRULES];	// distinct lengths of suffixes
+	int			 suffix_lens_count;
+	GHashTable		*exact_ht;	// path -> rules_bitmap_t
+} rules_literals;
+
+struct rules_literals_match {
+	char		done;
+	rules_bitmap_t	matched;
+};
+
+static int rules_trie_child(int node, unsigned char c, int create) {
+	int child = rules_literals.trie[node].child;
+
+	while (child) {
+		if (rules_literals.trie[child].c == c)
+			return child;
+		child = rules_literals.trie[child].next;
+	}
+
+	if (!create)
+		return 0;
+
+	if (rules_literals.trie_count >= rules_literals.trie_size) {
+		rules_literals.trie_size += ALLOC_PORTION;
+		rules_literals.trie = xrealloc(rules_literals.trie, sizeof(*rules_literals.trie) * rules_literals.trie_size);
+	}
+
+	child = rules_literals.trie_count++;
+	memset(&rules_literals.trie[child], 0, sizeof(*rules_literals.trie));
+	rules_literals.trie[child].c    = c;
+	rules_literals.trie[child].next = rules_literals.trie[node].child;
+	rules_literals.trie[node].child = child;
+
+	return child;
+}
+
+static void rules_literals_add_ht(GHashTable *ht, const char *literal, int n) {
+	rules_bitmap_t *bitmap_p = g_hash_table_lookup(ht, literal);
+
+	if (bitmap_p == NULL) {
+		bitmap_p = xcalloc(1, sizeof(*bitmap_p));
+		g_hash_table_insert(ht, strdup(literal), bitmap_p);
+	}
+
+	rules_bitmap_set(bitmap_p, n);
+	return;
+}
+
+static void rules_literals_free() {
+	if (rules_literals.rules_p == NULL)
+		return;
+
+	free(rules_literals.trie);
+	g_hash_table_destroy(rules_literals.suffix_ht);
+	g_hash_table_destroy(rules_literals.exact_ht);
+	memset(&rules_literals, 0, sizeof(rules_literals));
+
+	return;
+}
+
+static void rules_literals_build(rule_t *rules_p) {
+	rule_t *rule_p = rules_p;
+	int indexed = 0;
+
+	rules_literals_free();
+
+	rules_literals.rules_p    = rules_p;
+	rules_literals.trie_size  = ALLOC_PORTION;
+	rules_literals.trie_count = 1;
+	rules_literals.trie       = xcalloc(rules_literals.trie_size, sizeof(*rules_literals.trie));
+	rules_literals.suffix_ht  = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	rules_literals.exact_ht   = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+
+	while (rule_p->mask != RA_NONE) {
+		rulematch_t *match_p = rule_p->match;
+		int n = rule_p - rules_p;
+
+		if (match_p == NULL || match_p->shape == RMS_OTHER) {
+			rule_p++;
+			continue;
+		}
+
+		switch (match_p->shape) {
+			case RMS_EXACT:
+				rules_literals_add_ht(rules_literals.exact_ht, match_p->ops[0].str, n);
+				break;
+			case RMS_PREFIX: {
+				const unsigned char *ptr = (const unsigned char *)match_p->ops[0].str;
+				int node = 0;
+				while (*ptr)
+					node = rules_trie_child(node, *(ptr++), 1);
+				rules_literals.trie[node].hasrules = 1;
+				rules_bitmap_set(&rules_literals.trie[node].rules, n);
+				break;
+			}
+			case RMS_SUFFIX: {
+				size_t len = match_p->ops[1].len;
+				int i = 0;
+				rules_literals_add_ht(rules_literals.suffix_ht, match_p->ops[1].str, n);
+				while (i < rules_literals.suffix_lens_count && rules_literals.suffix_lens[i] != len)
+					i++;
+				if (i == rules_literals.suffix_lens_count)
+					rules_literals.suffix_lens[rules_literals.suffix_lens_count++] = len;
+				break;
+			}
+			default:
+				break;
+		}
+
+		indexed++;
+		rule_p++;
+	}
+
+	debug(1, "%i of %i rules are matched by literal indexes (%i prefix trie nodes, %u suffixes, %u exact paths).",
+		indexed, (int)(rule_p - rules_p), rules_literals.trie_count - 1,
+		g_hash_table_size(rules_literals.suffix_ht), g_hash_table_size(rules_literals.exact_ht));
+
+	return;
+}
+
+static void rules_literals_match(const char *fpath, struct rules_literals_match *lm_p) {
+	const unsigned char *ptr = (const unsigned char *)fpath;
+	size_t fpath_len = strlen(fpath);
+	rules_bitmap_t *bitmap_p;
+	int node = 0, i = 0;
+
+	memset(&lm_p->matched, 0, sizeof(lm_p->matched));
+	lm_p->done = 1;
+
+	if ((bitmap_p = g_hash_table_lookup(rules_literals.exact_ht, fpath)) != NULL)
+		rules_bitmap_or(&lm_p->matched, bitmap_p);
+
+	while (i < rules_literals.suffix_lens_count) {
+		size_t len = rules_literals.suffix_lens[i++];
+		if (len <= fpath_len)
+			if ((bitmap_p = g_hash_table_lookup(rules_literals.suffix_ht, &fpath[fpath_len - len])) != NULL)
+				rules_bitmap_or(&lm_p->matched, bitmap_p);
+	}
+
+	while (*ptr && (node = rules_trie_child(node, *(ptr++), 0))) {
+		if (rules_literals.trie[node].hasrules)
+			rules_bitmap_or(&lm_p->matched, &rules_literals.trie[node].rules);
+	}
+
+	return;
+}
+
+/**
+ * @brief 			Checks if the rule's expression matches every path that starts with the prefix
+ *
+ * @param[in] 	rule_p		Pointer to the rule
+ * @param[in] 	prefix		The prefix (a directory path with the trailing "/", or "" for the root)
+ * @param[in] 	prefix_len	Length of the prefix
+ *
+ * @retval	1		Matches every longer path
+ * @retval	0		Matches no longer path
+ * @retval	-1		Cannot prove any of this
+ *
+ */
+static int rule_match_prefix(rule_t *rule_p, const char *prefix, size_t prefix_len) {
+	const rulematch_t *match_p = rule_p->match;
+	const struct rulematch_op *op_p;
+	const char *s = prefix, *end = &prefix[prefix_len];
+
+	if (match_p == NULL || (match_p->hasanychar && MB_CUR_MAX > 1))
+		return -1;
+
+	// If the expression is not anchored at the end and matches the prefix,
+	// then the trailing ".*" matches any continuation
+	op_p = match_p->ops;
+	while (op_p->op != RMO_END)
+		op_p++;
+	if (op_p != match_p->ops && op_p[-1].op == RMO_ANYSEQ && rule_match(match_p, prefix))
+		return 1;
+
+	// If the expression is anchored at the start and it's leading part doesn't fit the prefix,
+	// then nothing inside the prefix matches
+	op_p = match_p->ops;
+	while (1) {
+		switch (op_p->op) {
+			case RMO_LITERAL:
+				if (op_p->len > (size_t)(end - s)) {
+					if (memcmp(s, op_p->str, end - s))
+						return 0;
+					return -1;
+				}
+				if (memcmp(s, op_p->str, op_p->len))
+					return 0;
+				s += op_p->len;
+				break;
+			case RMO_ANYCHAR:
+				if (s == end)
+					return -1;
+				s++;
+				break;
+			case RMO_ANYSEQ:
+				return -1;
+			case RMO_END:
+				return 0;	// Matches only paths that are not longer than the prefix
+		}
+		op_p++;
+	}
+
+	return -1;
+}
 
 int rule_complete(rule_t *rule_p, char *expr, size_t *rules_count_p) {
 	debug(3, "<%s>.", expr);
@@ -47,6 +524,10 @@ int rule_complete(rule_t *rule_p, char *expr, size_t *rules_count_p) {
 		return ret;
 	}
 
+	// The regex is compiled anyway: it's validation of the expression and the fallback
+	rule_p->match = rule_match_compile(expr);
+	debug(3, "<%s> is matched by %s.", expr, rule_p->match == NULL ? "regexec()" : "a compiled expression");
+
 	(*rules_count_p)++;
 	return ret;
 }
@@ -57,6 +538,8 @@ int parse_rules_fromfile(ctx_t *ctx_p) {
 	rule_t *rules  = ctx_p->rules;
 	size_t *rules_count_p = &ctx_p->rules_count;
 
+	rules_cache_invalidate();
+
 	char *line_buf=NULL;
 	FILE *f = fopen(rulfpath, "r");
 	
@@ -268,6 +751,8 @@ l_parse_rules_fromfile_end:
 	rules[i].mask   = RA_NONE;		// Terminator. End of rules' chain.
 	rules[i].perm   = DEFAULT_RULES_PERM;
 
+	rules_literals_build(rules);
+
 	g_hash_table_destroy(autowrules_ht);
 #ifdef _DEBUG_FORCE
 	debug(3, "Total (p == %p):", rules);
@@ -280,6 +765,27 @@ l_parse_rules_fromfile_end:
 	return ret;
 }
 
+/**
+ * @brief 			Checks if any rule needs the exact object type (not just "directory or not")
+ *
+ * @param[in] 	rules_p		Pointer to start of rules array
+ *
+ * @retval	1		If there's a rule for sockets, symlinks, devices, FIFOs or regular files only
+ * @retval	0		Otherwise
+ *
+ */
+int rules_needftype(rule_t *rules_p) {
+	rule_t *rule_p = rules_p;
+
+	while (rule_p->mask != RA_NONE) {
+		if (rule_p->objtype && rule_p->objtype != S_IFDIR)
+			return 1;
+		rule_p++;
+	}
+
+	return 0;
+}
+
 /**
  * @brief 			Checks file path by rules' expressions (parsed from file)
  * 
@@ -295,7 +801,7 @@ l_parse_rules_fromfile_end:
 // Checks file path by rules' expressions (parsed from file)
 // Return: RS_PERMIT or RS_REJECT for the "file path" and specified ruleaction
 
-ruleaction_t rules_search_getperm(const char *fpath, mode_t st_mode, rule_t *rules_p, const ruleaction_t ruleaction, rule_t **rule_pp) {
+static ruleaction_t _rules_search_getperm(const char *fpath, mode_t st_mode, rule_t *rules_p, const ruleaction_t ruleaction, rule_t **rule_pp, struct rules_literals_match *lm_p) {
 	debug(3, "rules_search_getperm(\"%s\", %p, %p, %p, %p)", 
 			fpath, (void *)(unsigned long)st_mode, rules_p,
 			(void *)(long)ruleaction, (void *)(long)rule_pp
@@ -347,7 +853,21 @@ ruleaction_t rules_search_getperm(const char *fpath, mode_t st_mode, rule_t *rul
 			continue;
 		}
 
-		if(!regexec(&rule_p->expr, fpath, 0, NULL, 0))
+		int matched;
+		if (rule_p->match != NULL && rule_p->match->shape != RMS_OTHER && rules_literals.rules_p == rules_p) {
+			if (!lm_p->done)
+				rules_literals_match(fpath, lm_p);
+			matched = rules_bitmap_test(&lm_p->matched, rule_p - rules_p);
+		} else
+			matched = rule_expr_match(rule_p, fpath);
+
+#ifdef VERYPARANOID
+		// The literal indexes and the compiled expressions must agree with regexec()
+		if (matched != !regexec(&rule_p->expr, fpath, 0, NULL, 0))
+			critical("Rule #%i matched \"%s\" with result %i, but regexec() disagrees.", rule_p->num, fpath, matched);
+#endif
+
+		if (matched)
 			break;
 
 		debug(3, "doesn't match regex. Skipping.");
@@ -366,15 +886,278 @@ ruleaction_t rules_search_getperm(const char *fpath, mode_t st_mode, rule_t *rul
 	return rule_p->perm;
 }
 
+/* === DECISION CACHE === */
+
+// Decisions are cached per directory for all paths inside it: for every
+// (actions, file type) pair it's either a permission bitmask that is proven
+// to be the same for every path inside, or a mark that it's not proven.
+
+struct rules_cache_slot {
+	ruleaction_t	ruleactions;
+	mode_t		ftype;
+	char		uniform;
+	ruleaction_t	perm;
+};
+
+struct rules_cache_entry {
+	int			count;
+	struct rules_cache_slot	slot[RULES_CACHE_SLOTS];
+};
+
+// The cache is read by the walker threads in parallel: lookups take the lock
+// for reading only, the subtree analysis is done without the lock and the
+// lock is taken for writing just to store the result.
+
+static struct rules_cache {
+	pthread_rwlock_t lock;
+	rule_t		*rules_p;	// the rules the cache is filled for
+	fpathtree_t	*tree;		// directory path -> struct rules_cache_entry
+	unsigned long	 lookups;
+	unsigned long	 hits;
+	unsigned long	 analyzed;	// directories checked for uniform decisions
+	unsigned long	 uniform;	// of them proven to be uniform
+	unsigned long	 dropped;	// times the cache is dropped due to RULES_CACHE_MAX
+} rules_cache = { PTHREAD_RWLOCK_INITIALIZER };
+
+static void rules_cache_stats() {
+	debug(1, "Rules decision cache: %lu hits of %lu lookups; %lu/%lu directories are uniform; %lu directories cached (dropped %lu times).",
+		__atomic_load_n(&rules_cache.hits, __ATOMIC_RELAXED), __atomic_load_n(&rules_cache.lookups, __ATOMIC_RELAXED),
+		rules_cache.uniform, rules_cache.analyzed,
+		rules_cache.tree == NULL ? 0 : (unsigned long)fpathtree_size(rules_cache.tree), rules_cache.dropped);
+	return;
+}
+
+void rules_cache_stats_get(rules_cache_report_t *report_p) {
+	pthread_rwlock_rdlock(&rules_cache.lock);
+	report_p->lookups  = __atomic_load_n(&rules_cache.lookups, __ATOMIC_RELAXED);
+	report_p->hits     = __atomic_load_n(&rules_cache.hits,    __ATOMIC_RELAXED);
+	report_p->analyzed = rules_cache.analyzed;
+	report_p->uniform  = rules_cache.uniform;
+	report_p->cached   = rules_cache.tree == NULL ? 0 : fpathtree_size(rules_cache.tree);
+	report_p->dropped  = rules_cache.dropped;
+	pthread_rwlock_unlock(&rules_cache.lock);
+	return;
+}
+
+// Drops all cached decisions and literal indexes. Should be called if the rules are changed (e.g. on rehash).
+
+void rules_cache_invalidate() {
+	rules_literals_free();
+
+	pthread_rwlock_wrlock(&rules_cache.lock);
+
+	if (rules_cache.tree != NULL) {
+		rules_cache_stats();
+		fpathtree_free(rules_cache.tree);
+		rules_cache.tree = NULL;
+	}
+	rules_cache.rules_p = NULL;
+
+	pthread_rwlock_unlock(&rules_cache.lock);
+	return;
+}
+
+// rules_getperm() for every path inside the prefix (a directory path with the trailing "/", or "" for the root) at once
+// Return: 0 if the permission is the same for all of them, -1 if it's not proven
+
+int rules_subtree_getperm(const char *prefix, size_t prefix_len, mode_t ftype, rule_t *rules_p, ruleaction_t ruleactions, ruleaction_t *perm_p) {
+	rule_t *rule_p = rules_p;
+	ruleaction_t gotpermto  = 0;
+	ruleaction_t resultperm = 0;
+
+	while ((gotpermto&ruleactions) != ruleactions) {
+		while (rule_p->mask != RA_NONE) {
+			if ((rule_p->mask & ruleactions) && !(rule_p->objtype && (rule_p->objtype != ftype))) {
+				int match = rule_match_prefix(rule_p, prefix, prefix_len);
+				if (match == -1)
+					return -1;
+				if (match)
+					break;
+			}
+			rule_p++;
+		}
+
+		if (rule_p->mask == RA_NONE) {
+			resultperm |= rule_p->perm & (gotpermto^RA_ALL);
+			break;
+		}
+		resultperm |= rule_p->perm & ((gotpermto^rule_p->mask)&rule_p->mask);
+		gotpermto  |= rule_p->mask;
+		rule_p++;
+	}
+
+	*perm_p = resultperm;
+	return 0;
+}
+
+static inline struct rules_cache_slot *rules_cache_slot(struct rules_cache_entry *entry_p, mode_t ftype, ruleaction_t ruleactions) {
+	int i = 0;
+
+	while (i < entry_p->count && i < RULES_CACHE_SLOTS) {
+		struct rules_cache_slot *slot_p = &entry_p->slot[i++];
+		if (slot_p->ftype == ftype && slot_p->ruleactions == ruleactions)
+			return slot_p;
+	}
+
+	return NULL;
+}
+
+struct rules_cache_lookup_arg {
+	mode_t		 ftype;
+	ruleaction_t	 ruleactions;
+	ruleaction_t	 perm;
+	size_t		 parent_len;
+	char		 parent_known;
+};
+
+static int _rules_cache_lookup(size_t prefix_len, gpointer entry_gp, gpointer arg_gp) {
+	struct rules_cache_lookup_arg *arg_p = arg_gp;
+	struct rules_cache_slot *slot_p = rules_cache_slot(entry_gp, arg_p->ftype, arg_p->ruleactions);
+
+	if (slot_p == NULL)
+		return 0;
+
+	if (slot_p->uniform) {
+		arg_p->perm = slot_p->perm;
+		return 1;
+	}
+
+	if (prefix_len == arg_p->parent_len)
+		arg_p->parent_known = 1;
+
+	return 0;
+}
+
+// Stores the result of rules_subtree_getperm() for paths inside "prefix" (a directory path with the trailing "/")
+
+static void rules_cache_store(char *prefix, size_t prefix_len, mode_t ftype, rule_t *rules_p, ruleaction_t ruleactions, int uniform, ruleaction_t perm) {
+	struct rules_cache_entry *entry_p;
+	struct rules_cache_slot  *slot_p;
+	fpathtree_node_t *node_p;
+
+	// The node path is without the trailing slash
+	if (prefix_len)
+		prefix[prefix_len - 1] = 0;
+
+	pthread_rwlock_wrlock(&rules_cache.lock);
+
+	if (rules_cache.rules_p != rules_p || rules_cache.tree == NULL || fpathtree_size(rules_cache.tree) >= RULES_CACHE_MAX) {
+		if (rules_cache.tree != NULL) {
+			if (rules_cache.rules_p == rules_p)
+				rules_cache.dropped++;
+			fpathtree_free(rules_cache.tree);
+		}
+		rules_cache.tree    = fpathtree_new(free);
+		rules_cache.rules_p = rules_p;
+	}
+
+	rules_cache.analyzed++;
+	if (uniform)
+		rules_cache.uniform++;
+
+	node_p = fpathtree_node_get(rules_cache.tree, prefix, 1);
+	if (!node_p->hasvalue)
+		fpathtree_node_set(rules_cache.tree, node_p, xcalloc(1, sizeof(*entry_p)));
+	entry_p = node_p->value;
+
+	// Another thread could analyze the same directory meanwhile
+	if (rules_cache_slot(entry_p, ftype, ruleactions) == NULL) {
+		slot_p = &entry_p->slot[entry_p->count++ % RULES_CACHE_SLOTS];
+		slot_p->ftype       = ftype;
+		slot_p->ruleactions = ruleactions;
+		slot_p->uniform     = uniform;
+		slot_p->perm        = perm;
+	}
+
+	pthread_rwlock_unlock(&rules_cache.lock);
+	return;
+}
+
+// Return: 0 and the permission if it's known from the cache, -1 otherwise
+
+static int rules_cache_lookup(const char *fpath, mode_t ftype, rule_t *rules_p, ruleaction_t ruleactions, ruleaction_t *perm_p) {
+	struct rules_cache_lookup_arg arg;
+	const char *parent_end;
+	int found = 0;
+
+	if (!*fpath)
+		return -1;	// The root is not inside of any directory
+
+	if (!(__atomic_add_fetch(&rules_cache.lookups, 1, __ATOMIC_RELAXED) % RULES_CACHE_STATS_INTERVAL)) {
+		pthread_rwlock_rdlock(&rules_cache.lock);
+		rules_cache_stats();
+		pthread_rwlock_unlock(&rules_cache.lock);
+	}
+
+	parent_end = strrchr(fpath, '/');
+
+	arg.ftype        = ftype;
+	arg.ruleactions  = ruleactions;
+	arg.parent_len   = parent_end == NULL ? 0 : parent_end - fpath;
+	arg.parent_known = 0;
+
+	pthread_rwlock_rdlock(&rules_cache.lock);
+	if (rules_cache.rules_p == rules_p && rules_cache.tree != NULL)
+		found = fpathtree_foreach_ancestor(rules_cache.tree, fpath, _rules_cache_lookup, &arg);
+	pthread_rwlock_unlock(&rules_cache.lock);
+
+	if (found) {
+		__atomic_add_fetch(&rules_cache.hits, 1, __ATOMIC_RELAXED);
+		*perm_p = arg.perm;
+		return 0;
+	}
+
+	if (arg.parent_known)
+		return -1;
+
+	// Checking the parent directory (the rules are not changed while they are used, so no lock is required)
+	{
+		size_t prefix_len = parent_end == NULL ? 0 : arg.parent_len + 1;
+		char *prefix = alloca(prefix_len + 1);
+		ruleaction_t perm = 0;
+
+		memcpy(prefix, fpath, prefix_len);
+		prefix[prefix_len] = 0;
+
+		int uniform = !rules_subtree_getperm(prefix, prefix_len, ftype, rules_p, ruleactions, &perm);
+		debug(4, "Paths inside \"%s\" (type 0%o, actions %p): %s", prefix, ftype, (void *)(long)ruleactions, uniform ? "uniform" : "not uniform");
+
+		rules_cache_store(prefix, prefix_len, ftype, rules_p, ruleactions, uniform, perm);
+
+		if (uniform) {
+			*perm_p = perm;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+ruleaction_t rules_search_getperm(const char *fpath, mode_t st_mode, rule_t *rules_p, const ruleaction_t ruleaction, rule_t **rule_pp) {
+	struct rules_literals_match lm;
+	lm.done = 0;
+
+	return _rules_search_getperm(fpath, st_mode, rules_p, ruleaction, rule_pp, &lm);
+}
+
 ruleaction_t rules_getperm(const char *fpath, mode_t st_mode, rule_t *rules_p, ruleaction_t ruleactions) {
+	struct rules_literals_match lm;
 	rule_t *rule_p = NULL;
 	ruleaction_t gotpermto  = 0;
 	ruleaction_t resultperm = 0;
 	debug(3, "rules_getperm(\"%s\", %p, %p (#%u), %p)", 
 		fpath, (void *)(long)st_mode, rules_p, rules_p->num, (void *)(long)ruleactions);
 
+	if (!rules_cache_lookup(fpath, st_mode & S_IFMT, rules_p, ruleactions, &resultperm)) {
+		debug(3, "rules_getperm(\"%s\", %p, rules_p, %p): cached perm is %p",
+			fpath, (void *)(long)st_mode, (void *)(long)ruleactions, (void *)(long)resultperm);
+		return resultperm;
+	}
+
+	// The literal indexes are checked once for all the rules
+	lm.done = 0;
 	while((gotpermto&ruleactions) != ruleactions) {
-		rules_search_getperm(fpath, st_mode, rules_p, ruleactions, &rule_p);
+		_rules_search_getperm(fpath, st_mode, rules_p, ruleactions, &rule_p, &lm);
 		if(rule_p->mask == RA_NONE) { // End of rules' list 
 			resultperm |= rule_p->perm & (gotpermto^RA_ALL);
 			break;
@@ -20,4 +20,19 @@
 extern int parse_rules_fromfile(struct ctx *ctx_p);
 extern ruleaction_t rules_search_getperm(const char *fpath, mode_t st_mode, rule_t *rules_p, const ruleaction_t ruleaction, rule_t **rule_pp);
 extern ruleaction_t rules_getperm(const char *fpath, mode_t st_mode, struct rule *rules_p, ruleaction_t ruleactions);
+extern int rules_subtree_getperm(const char *prefix, size_t prefix_len, mode_t ftype, rule_t *rules_p, ruleaction_t ruleactions, ruleaction_t *perm_p);
 
+extern int rules_needftype(rule_t *rules_p);
+extern void rules_cache_invalidate();
+
+struct rules_cache_report {
+	unsigned long	lookups;
+	unsigned long	hits;
+	unsigned long	analyzed;	// directories checked for uniform decisions
+	unsigned long	uniform;	// of them proven to be uniform
+	unsigned long	cached;		// directories in the cache now
+	unsigned long	dropped;	// times the cache is dropped due to RULES_CACHE_MAX
+};
+typedef struct rules_cache_report rules_cache_report_t;
+
+extern void rules_cache_stats_get(rules_cache_report_t *report_p);
@@ -76,6 +76,9 @@ const char *const textmessage_args[SOCKCMD_MAXID] = {
 	[SOCKCMD_REPLY_EINVAL]		= "%u %lu",
 	[SOCKCMD_REPLY_VERSION]		= "%u %u %s",
 	[SOCKCMD_REPLY_INFO]		= "%s\003/ %s\003/ %x %x",
+	[SOCKCMD_REPLY_CONCURRENCY]	= "%i %i %i %i",
+	[SOCKCMD_REPLY_INOTIFYSTATS]	= "%lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+	[SOCKCMD_REPLY_RULESSTATS]	= "%lu %lu %lu %lu %lu %lu",
 	[SOCKCMD_REPLY_UNKNOWNCMD]	= "%u %lu",
 	[SOCKCMD_REPLY_INVALIDCMDID]	= "%lu",
 	[SOCKCMD_REPLY_EEXIST]		= "%s\003/",
@@ -96,6 +99,9 @@ const char *const textmessage_descr[SOCKCMD_MAXID] = {
 	[SOCKCMD_REPLY_INFO]		= "config_block == \"%s\"; label == \"%s\"; flags == %x; flags_set == %x.",
 	[SOCKCMD_REPLY_SET]		= "Set",
 	[SOCKCMD_REPLY_DUMP]		= "Ready",
+	[SOCKCMD_REPLY_CONCURRENCY]	= "running == %i; queued == %i; limit == %i; max == %i.",
+	[SOCKCMD_REPLY_INOTIFYSTATS]	= "overflows == %lu; ring_fill == %lu; ring_size == %lu; ring_fill_max == %lu; ring_stalls == %lu; events_per_sec == %lu; events == %lu; collapsed == %lu; drains == %lu; interval == %lu.",
+	[SOCKCMD_REPLY_RULESSTATS]	= "lookups == %lu; hits == %lu; analyzed == %lu; uniform == %lu; cached == %lu; dropped == %lu.",
 	[SOCKCMD_REPLY_UNKNOWNCMD]	= "Unknown command.",
 	[SOCKCMD_REPLY_INVALIDCMDID]	= "Invalid command id. Required: 0 <= cmd_id < 1000.",
 	[SOCKCMD_REPLY_EEXIST]		= "File exists: \"%s\".",
@@ -460,6 +466,16 @@ static inline int parse_text_data(sockcmd_t *sockcmd_p, char *args, size_t args_
 				args[args_len=1<<8] = 0;
 			PARSE_TEXT_DATA_SSCANF(sockcmd_dat_info_t, &d->config_block, &d->label, &d->flags, &d->flags_set);
 			break;
+		case SOCKCMD_REPLY_CONCURRENCY:
+			PARSE_TEXT_DATA_SSCANF(sockcmd_dat_concurrency_t, &d->running, &d->queued, &d->limit, &d->max);
+			break;
+		case SOCKCMD_REPLY_INOTIFYSTATS:
+			PARSE_TEXT_DATA_SSCANF(sockcmd_dat_inotifystats_t, &d->overflows, &d->ring_fill, &d->ring_size, &d->ring_fill_max, &d->ring_stalls,
+				&d->events_per_sec, &d->events, &d->collapsed, &d->drains, &d->interval);
+			break;
+		case SOCKCMD_REPLY_RULESSTATS:
+			PARSE_TEXT_DATA_SSCANF(sockcmd_dat_rulesstats_t, &d->lookups, &d->hits, &d->analyzed, &d->uniform, &d->cached, &d->dropped);
+			break;
 		case SOCKCMD_REPLY_UNKNOWNCMD:
 			PARSE_TEXT_DATA_SSCANF(sockcmd_dat_unknowncmd_t, &d->cmd_id, &d->cmd_num);
 			break;
@@ -109,6 +109,9 @@ enum sockcmd_id {
 	SOCKCMD_REQUEST_VERSION		= 200,
 	SOCKCMD_REQUEST_INFO		= 201,
 	SOCKCMD_REQUEST_DUMP		= 202,
+	SOCKCMD_REQUEST_CONCURRENCY	= 203,
+	SOCKCMD_REQUEST_INOTIFYSTATS	= 204,
+	SOCKCMD_REQUEST_RULESSTATS	= 205,
 	SOCKCMD_REQUEST_LOGIN		= 210,
 	SOCKCMD_REQUEST_SET		= 211,
 	SOCKCMD_REQUEST_DIE		= 240,
@@ -116,6 +119,9 @@ enum sockcmd_id {
 	SOCKCMD_REPLY_VERSION		= 300,
 	SOCKCMD_REPLY_INFO		= 301,
 	SOCKCMD_REPLY_DUMP		= 302,
+	SOCKCMD_REPLY_CONCURRENCY	= 303,
+	SOCKCMD_REPLY_INOTIFYSTATS	= 304,
+	SOCKCMD_REPLY_RULESSTATS	= 305,
 	SOCKCMD_REPLY_LOGIN		= 310,
 	SOCKCMD_REPLY_SET		= 311,
 	SOCKCMD_REPLY_DIE		= 340,
@@ -166,6 +172,38 @@ struct sockcmd_dat_dump {
 };
 typedef struct sockcmd_dat_dump sockcmd_dat_dump_t;
 
+struct sockcmd_dat_concurrency {
+	int		running;
+	int		queued;
+	int		limit;
+	int		max;
+};
+typedef struct sockcmd_dat_concurrency sockcmd_dat_concurrency_t;
+
+struct sockcmd_dat_inotifystats {
+	unsigned long	overflows;
+	unsigned long	ring_fill;
+	unsigned long	ring_size;
+	unsigned long	ring_fill_max;
+	unsigned long	ring_stalls;
+	unsigned long	events_per_sec;
+	unsigned long	events;
+	unsigned long	collapsed;
+	unsigned long	drains;
+	unsigned long	interval;
+};
+typedef struct sockcmd_dat_inotifystats sockcmd_dat_inotifystats_t;
+
+struct sockcmd_dat_rulesstats {
+	unsigned long	lookups;
+	unsigned long	hits;
+	unsigned long	analyzed;
+	unsigned long	uniform;
+	unsigned long	cached;
+	unsigned long	dropped;
+};
+typedef struct sockcmd_dat_rulesstats sockcmd_dat_rulesstats_t;
+
 struct sockcmd_dat_eexist {
 	char		file_path[PATH_MAX];
 };
@@ -48,12 +48,20 @@
 #include "indexes.h"
 #include "privileged.h"
 #include "rules.h"
+#include "walker.h"
+#include "coprocess.h"
 #if CGROUP_SUPPORT
 #	include "cgroup.h"
 #endif
 
 #include <stdio.h>
 #include <dlfcn.h>
+#ifdef __linux__
+#	include <sys/eventfd.h>
+#endif
+#ifdef IOURING_SUPPORT
+#	include <liburing.h>
+#endif
 
 
 pthread_t pthread_sighandler;
@@ -110,13 +118,16 @@ static inline void evinfo_merge(ctx_t *ctx_p, eventinfo_t *evinfo_dst, eventinfo
 			evinfo_src->seqid_min, evinfo_src->seqid_max, evinfo_src->objtype_old, evinfo_src->objtype_new
 		);
 
-#if KQUEUE_SUPPORT | INOTIFY_SUPPORT
+#if KQUEUE_SUPPORT | INOTIFY_SUPPORT | FANOTIFY_SUPPORT
 	switch(ctx_p->flags[MONITOR]) {
 #ifdef KQUEUE_SUPPORT
 		case NE_KQUEUE:
 #endif
 #ifdef INOTIFY_SUPPORT
 		case NE_INOTIFY:
+#endif
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
 #endif
 			evinfo_dst->evmask |= evinfo_src->evmask;
 			break;
@@ -125,6 +136,9 @@ static inline void evinfo_merge(ctx_t *ctx_p, eventinfo_t *evinfo_dst, eventinfo
 
 	evinfo_dst->flags  |= evinfo_src->flags;
 
+	if (evinfo_src->try_n > evinfo_dst->try_n)
+		evinfo_dst->try_n = evinfo_src->try_n;
+
 	if(SEQID_LE(evinfo_src->seqid_min, evinfo_dst->seqid_min)) {
 		evinfo_dst->objtype_old = evinfo_src->objtype_old;
 		evinfo_dst->seqid_min   = evinfo_src->seqid_min;
@@ -192,6 +206,13 @@ threadsinfo_t *thread_info() {	// TODO: optimize this
 			}
 			i++;
 		}
+#ifdef __linux__
+		threadsinfo.done_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (threadsinfo.done_fd == -1)
+			warning("Cannot eventfd(). Finished syncs will be collected by signals.");
+#else
+		threadsinfo.done_fd = -1;
+#endif
 		threadsinfo.mutex_init++;
 	}
 
@@ -229,7 +250,7 @@ int threads_foreach(int (*funct)(threadinfo_t *, void *), state_t state, void *a
 	rc = 0;
 	i  = 0;
 	while (i < threadsinfo_p->used) {
-		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[i++];
+		threadinfo_t *threadinfo_p = threadsinfo_p->threads[i++];
 		if ((state == STATE_UNKNOWN) || (threadinfo_p->state == state)) {
 			if((rc=funct(threadinfo_p, arg)))
 				break;
@@ -250,8 +271,8 @@ time_t thread_nextexpiretime() {
 	int thread_num = threadsinfo_p->used;
 
 	while(thread_num--) {
-		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[thread_num];
-		debug(3, "threadsinfo_p->threads[%i].state == %i;\tthreadsinfo_p->threads[%i].pthread == %p;\tthreadsinfo_p->threads[%i].expiretime == %i", 
+		threadinfo_t *threadinfo_p = threadsinfo_p->threads[thread_num];
+		debug(3, "threadsinfo_p->threads[%i]->state == %i;\tthreadsinfo_p->threads[%i]->pthread == %p;\tthreadsinfo_p->threads[%i]->expiretime == %i", 
 			thread_num, threadinfo_p->state,thread_num, threadinfo_p->pthread, thread_num, threadinfo_p->expiretime);
 
 		if(threadinfo_p->state == STATE_EXIT)
@@ -270,6 +291,20 @@ time_t thread_nextexpiretime() {
 	return nextexpiretime;
 }
 
+/*
+ * The eventfd to be polled by the main loop (in notifyenginefunct.wait())
+ * to collect finished syncs. After the first call the workers stop
+ * sending SIGUSR_THREAD_GC.
+ */
+int thread_done_fd_watch() {
+	threadsinfo_t *threadsinfo_p = thread_info();
+	if (threadsinfo_p == NULL)
+		return -1;
+
+	threadsinfo_p->done_fd_watched = (threadsinfo_p->done_fd != -1);
+	return threadsinfo_p->done_fd;
+}
+
 threadinfo_t *thread_new() {
 	threadsinfo_t *threadsinfo_p = thread_info_lock();
 #ifdef PARANOID
@@ -282,30 +317,18 @@ threadinfo_t *thread_new() {
 	int thread_num;
 	threadinfo_t *threadinfo_p;
 
-	if(threadsinfo_p->stacklen) {
-		threadinfo_p = threadsinfo_p->threadsstack[--threadsinfo_p->stacklen];
-		thread_num   =  threadinfo_p->thread_num;
-	} else {
-		if(threadsinfo_p->used >= threadsinfo_p->allocated) {
-			threadsinfo_p->allocated += ALLOC_PORTION;
-			debug(2, "Reallocated memory for threadsinfo -> %i.", threadsinfo_p->allocated);
-			threadsinfo_p->threads      = (threadinfo_t *) xrealloc((char *)threadsinfo_p->threads, 
-											sizeof(*threadsinfo_p->threads)     *(threadsinfo_p->allocated+2));
-			threadsinfo_p->threadsstack = (threadinfo_t **)xrealloc((char *)threadsinfo_p->threadsstack,
-											sizeof(*threadsinfo_p->threadsstack)*(threadsinfo_p->allocated+2));
-		}
-
-		thread_num = threadsinfo_p->used++;
-		threadinfo_p = &threadsinfo_p->threads[thread_num];
+	if(threadsinfo_p->used >= threadsinfo_p->allocated) {
+		threadsinfo_p->allocated += ALLOC_PORTION;
+		debug(2, "Reallocated memory for threadsinfo -> %i.", threadsinfo_p->allocated);
+		threadsinfo_p->threads = (threadinfo_t **)xrealloc((char *)threadsinfo_p->threads, 
+								sizeof(*threadsinfo_p->threads)*(threadsinfo_p->allocated+2));
 	}
 
-#ifdef PARANOID
-	memset(threadinfo_p, 0, sizeof(*threadinfo_p));
-#else
-	threadinfo_p->expiretime = 0;
-	threadinfo_p->errcode    = 0;
-	threadinfo_p->exitcode   = 0;
-#endif
+	// The structure is referenced by a worker, so it shouldn't be moved on xrealloc()
+	thread_num   = threadsinfo_p->used++;
+	threadinfo_p = xcalloc(1, sizeof(*threadinfo_p));
+	threadsinfo_p->threads[thread_num] = threadinfo_p;
+
 	threadinfo_p->thread_num = thread_num;
 	threadinfo_p->state	 = STATE_RUNNING;
 
@@ -326,8 +349,7 @@ int thread_del_bynum(int thread_num) {
 	if(thread_num >= threadsinfo_p->used)
 		return thread_info_unlock(EINVAL);
 
-	threadinfo_t *threadinfo_p = &threadsinfo_p->threads[thread_num];
-	threadinfo_p->state = STATE_EXIT;
+	threadinfo_t *threadinfo_p = threadsinfo_p->threads[thread_num];
 
 	char **ptr = threadinfo_p->argv;
 	if(ptr != NULL) {
@@ -335,33 +357,430 @@ int thread_del_bynum(int thread_num) {
 			free(*(ptr++));
 		free(threadinfo_p->argv);
 	}
+	free(threadinfo_p);
 
-	if(thread_num == (threadsinfo_p->used-1)) {
-		threadsinfo_p->used--;
-		debug(3, "thread_del_bynum(%i): there're %i threads left (#0).", thread_num, threadsinfo_p->used - threadsinfo_p->stacklen);
-		return thread_info_unlock(0);
+	// Moving the last one to the released place
+	if (thread_num != --threadsinfo_p->used) {
+		threadinfo_t *t = threadsinfo_p->threads[threadsinfo_p->used];
+		threadsinfo_p->threads[thread_num] = t;
+		t->thread_num = thread_num;
 	}
-	
-	threadinfo_t *t = &threadsinfo_p->threads[threadsinfo_p->used-1];
-	if(t->state == STATE_EXIT) {
-		threadsinfo_p->used--;
-		debug(3, "%i [%p] -> %i [%p]; left: %i", 
-			threadsinfo_p->used, t->pthread, thread_num, threadinfo_p->pthread, threadsinfo_p->used - threadsinfo_p->stacklen);
-		memcpy(threadinfo_p, t, sizeof(*threadinfo_p));
-	} else {
+
+	debug(3, "thread_del_bynum(%i): there're %i threads left.", thread_num, threadsinfo_p->used);
+	return thread_info_unlock(0);
+}
+
+static void *thread_worker(void *arg) {
+	threadsinfo_t *threadsinfo_p = thread_info_lock();
+	debug(3, "worker %p started", pthread_self());
+
+	while (1) {
+		threadinfo_t *threadinfo_p;
+
+		while ((threadsinfo_p->queue_head == NULL) && !threadsinfo_p->workers_stop) {
+			threadsinfo_p->workers_idle++;
+			pthread_cond_wait(&threadsinfo_p->cond[PTHREAD_MUTEX_THREADSINFO], &threadsinfo_p->mutex[PTHREAD_MUTEX_THREADSINFO]);
+			threadsinfo_p->workers_idle--;
+		}
+
+		if (threadsinfo_p->workers_stop)
+			break;
+
+		threadinfo_p = threadsinfo_p->queue_head;
+		threadsinfo_p->queue_head = threadinfo_p->queue_next;
+		if (threadsinfo_p->queue_head == NULL)
+			threadsinfo_p->queue_tail = NULL;
+
+		threadinfo_p->pthread    = pthread_self();
+		threadinfo_p->starttime  = time(NULL);
+		threadinfo_p->pickuptime = clock_monotonic_ms();
+		if (threadinfo_p->ctx_p->synctimeout)
+			threadinfo_p->expiretime = threadinfo_p->starttime + threadinfo_p->ctx_p->synctimeout;
+		thread_info_unlock(0);
+
+		threadinfo_p->funct(threadinfo_p);
+
+		// Notifying the parent-thread, that it's time to collect garbage threads
+		thread_info_lock();
+		threadinfo_p->runtime = clock_monotonic_ms() - threadinfo_p->pickuptime;
+		threadinfo_p->state   = STATE_TERM;
+		if (threadsinfo_p->done_fd_watched) {
+			uint64_t one = 1;
+			debug(3, "worker %p is notifying the main loop via eventfd", pthread_self());
+			if (write(threadsinfo_p->done_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+				error("Cannot write() to the eventfd.");
+		} else {
+			debug(3, "worker %p is sending signal to sighandler to call GC", pthread_self());
+			pthread_kill(pthread_sighandler, SIGUSR_THREAD_GC);
+		}
+	}
+
+	debug(3, "worker %p finished", pthread_self());
+	thread_info_unlock(0);
+	return arg;
+}
+
+static void thread_task_drop(threadinfo_t *threadinfo_p);
+
+/*
+ * Queues the task to the workers pool. Starts a new worker if there's no
+ * idle one and the limit ("--sync-workers") is not reached.
+ */
+static int thread_submit(threadinfo_t *threadinfo_p, int (*funct)(threadinfo_t *)) {
+	ctx_t *ctx_p = threadinfo_p->ctx_p;
+	threadsinfo_t *threadsinfo_p = thread_info_lock();
 #ifdef PARANOID
-		if(threadsinfo_p->stacklen >= threadsinfo_p->allocated) {
-			error("Threads metadata structures pointers stack overflowed!");
-			return thread_info_unlock(EINVAL);
+	if(threadsinfo_p == NULL)
+		return thread_info_unlock(errno);
+#endif
+
+	threadinfo_p->funct      = funct;
+	threadinfo_p->queue_next = NULL;
+	if (threadsinfo_p->queue_tail == NULL)
+		threadsinfo_p->queue_head = threadinfo_p;
+	else
+		threadsinfo_p->queue_tail->queue_next = threadinfo_p;
+	threadsinfo_p->queue_tail = threadinfo_p;
+
+	if (!threadsinfo_p->workers_idle && (threadsinfo_p->workers_count < ctx_p->flags[SYNCWORKERS])) {
+		if (threadsinfo_p->workers == NULL)
+			threadsinfo_p->workers = xcalloc(ctx_p->flags[SYNCWORKERS], sizeof(*threadsinfo_p->workers));
+
+		int rc = pthread_create(&threadsinfo_p->workers[threadsinfo_p->workers_count], NULL, thread_worker, NULL);
+		if (rc) {
+			errno = rc;
+			error("Cannot pthread_create().");
+			if (!threadsinfo_p->workers_count) {
+				// Nobody would run the task, unqueueing it (it's the last one)
+				threadinfo_t **next_pp = &threadsinfo_p->queue_head;
+				threadsinfo_p->queue_tail = NULL;
+				while (*next_pp != threadinfo_p) {
+					threadsinfo_p->queue_tail = *next_pp;
+					next_pp = &(*next_pp)->queue_next;
+				}
+				*next_pp = NULL;
+				thread_info_unlock(0);
+
+				thread_task_drop(threadinfo_p);
+				thread_del_bynum(threadinfo_p->thread_num);
+				errno = rc;
+				return rc;
+			}
+		} else {
+			debug(2, "started sync worker #%i", threadsinfo_p->workers_count);
+			threadsinfo_p->workers_count++;
+		}
+	}
+
+	pthread_cond_signal(&threadsinfo_p->cond[PTHREAD_MUTEX_THREADSINFO]);
+	return thread_info_unlock(0);
+}
+
+// === SYNC_RETRY() === {
+// A failed batch is not re-run in place: its events are put to QUEUE_RETRY and
+// are synced again by the main loop after an exponential back-off. Meanwhile
+// new events are collected as usual and get merged into the pending retry.
+
+static int sync_queuesync(const char *fpath_rel, eventinfo_t *evinfo, ctx_t *ctx_p, indexes_t *indexes_p, queue_id_t queue_id);
+
+struct sync_retry_arg {
+	ctx_t		*ctx_p;
+	indexes_t	*indexes_p;
+	int		 try_n_max;
+	int		 givenup;
+};
+
+// The initial sync and the "simple" mode syncs are not made of collected events,
+// so there's nothing to requeue and they're retried in place as before.
+static inline int sync_retry_isrequeueable(ctx_t *ctx_p, indexes_t *indexes_p) {
+	return !ctx_p->flags[EXITONNOEVENTS] && g_hash_table_size(indexes_p->fpath2ei_ht);
+}
+
+static inline void sync_retry_schedule(ctx_t *ctx_p, int try_n) {
+	queueinfo_t *queueinfo = &ctx_p->_queues[QUEUE_RETRY];
+	unsigned long delay = ctx_p->syncdelay;
+	uint64_t tm = clock_monotonic_ms();
+
+	while ((--try_n > 0) && ((delay << 1) <= RETRY_DELAY_MAX))
+		delay <<= 1;
+	delay += rand() % (delay/2 + 1);	// jitter, to not retry simultaneously with other instances
+
+	// Not postponing an already scheduled retry
+	if (queueinfo->stime && (queueinfo->stime + queueinfo->collectdelay <= tm + delay))
+		return;
+
+	debug(2, "Retrying in %lu ms.", delay);
+	queueinfo->stime        = tm;
+	queueinfo->collectdelay = delay;
+
+	return;
+}
+
+// The tries are counted per event: the events synced together with retried
+// ones are not given up earlier than their own "--retries" tries
+static void _sync_retry_requeue(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp) {
+	struct sync_retry_arg *arg_p = (struct sync_retry_arg *)arg_gp;
+	ctx_t *ctx_p = arg_p->ctx_p;
+	eventinfo_t evinfo;
+
+	memcpy(&evinfo, evinfo_gp, sizeof(evinfo));
+	evinfo.try_n++;
+
+	if (ctx_p->retries && (evinfo.try_n >= ctx_p->retries)) {
+		warning("Give up syncing \"%s\" after %i tries.", (char *)fpath_gp, evinfo.try_n);
+		arg_p->givenup++;
+		return;
+	}
+
+	if (evinfo.try_n > arg_p->try_n_max)
+		arg_p->try_n_max = evinfo.try_n;
+
+	sync_queuesync((char *)fpath_gp, &evinfo, ctx_p, arg_p->indexes_p, QUEUE_RETRY);
+	return;
+}
+
+// Puts the events of a failed batch to QUEUE_RETRY: from "fpath2ei_ht" or
+// (if NULL) from "fpath2ei_tree" of a thread. Returns the number of events
+// that are given up (ran out of tries).
+static int sync_retry(ctx_t *ctx_p, indexes_t *indexes_p, GHashTable *fpath2ei_ht, fpathtree_t *fpath2ei_tree) {
+	struct sync_retry_arg arg;
+
+	arg.ctx_p     = ctx_p;
+	arg.indexes_p = indexes_p;
+	arg.try_n_max = 0;
+	arg.givenup   = 0;
+
+	if (fpath2ei_ht != NULL)
+		g_hash_table_foreach(fpath2ei_ht, _sync_retry_requeue, &arg);
+	else
+		fpathtree_foreach(fpath2ei_tree, "", _sync_retry_requeue, &arg);
+
+	if (arg.try_n_max)
+		sync_retry_schedule(ctx_p, arg.try_n_max);
+
+	return arg.givenup;
+}
+
+// A sync-handler may report which paths are failed (see EVIF_SYNCFAILED and
+// %FAILED-LIST-PATH%), then only they are retried.
+
+static inline eventinfo_t *sync_retry_lookup(GHashTable *fpath2ei_ht, fpathtree_t *fpath2ei_tree, const char *fpath) {
+	return fpath2ei_ht != NULL ? g_hash_table_lookup(fpath2ei_ht, fpath) : fpathtree_lookup(fpath2ei_tree, fpath);
+}
+
+// Adds the event of "path" from the batch to "failed_ht". If there's no such
+// event, the event of the parent dir (or of a recursively synced ancestor) is added.
+static int sync_retry_failed_add(ctx_t *ctx_p, GHashTable *failed_ht, GHashTable *fpath2ei_ht, fpathtree_t *fpath2ei_tree, const char *path) {
+	size_t watchdirwslash_len = strlen(ctx_p->watchdirwslash);
+	eventinfo_t *evinfo;
+	char *fpath, *end;
+	int level = 0;
+
+	// Absolute paths and the paths of rsync's lists ("/dir/file") are accepted, too
+	if (!strncmp(path, ctx_p->watchdirwslash, watchdirwslash_len))
+		path += watchdirwslash_len;
+	while (*path == '/')
+		path++;
+
+	fpath = strdup(path);
+	end   = &fpath[strlen(fpath)];
+	while ((end > fpath) && (end[-1] == '/'))
+		*(--end) = 0;
+
+	while (1) {
+		evinfo = sync_retry_lookup(fpath2ei_ht, fpath2ei_tree, fpath);
+		if ((evinfo != NULL) && ((level < 2) || (evinfo->flags & EVIF_RECURSIVELY)))
+			break;
+
+		if (!*fpath) {
+			debug(1, "\"%s\" is not in the failed batch, skipping.", path);
+			free(fpath);
+			return ENOENT;
 		}
+
+		end = strrchr(fpath, '/');
+		if (end == NULL)
+			end = fpath;
+		*end = 0;
+		level++;
+	}
+
+	debug(3, "\"%s\" -> \"%s\"", path, fpath);
+	if (g_hash_table_lookup(failed_ht, fpath) != NULL) {
+		free(fpath);
+		return 0;
+	}
+
+	g_hash_table_insert(failed_ht, fpath, eidup(evinfo));
+	return 0;
+}
+
+// Returns the failed part of the batch by EVIF_SYNCFAILED flags of "ei", NULL if none
+static GHashTable *sync_retry_failed_byei(ctx_t *ctx_p, GHashTable *fpath2ei_ht, fpathtree_t *fpath2ei_tree, int n, api_eventinfo_t *ei) {
+	GHashTable *failed_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	int i = 0, added = 0;
+
+	while (i < n) {
+		if ((ei[i].flags & EVIF_SYNCFAILED) && (ei[i].path != NULL))
+			if (!sync_retry_failed_add(ctx_p, failed_ht, fpath2ei_ht, fpath2ei_tree, ei[i].path))
+				added++;
+		i++;
+	}
+
+	if (!added) {
+		g_hash_table_destroy(failed_ht);
+		return NULL;
+	}
+
+	debug(2, "%i of %i records are failed.", added, n);
+	return failed_ht;
+}
+
+// Returns the failed part of the batch by the paths listed in the file, NULL if none
+static GHashTable *sync_retry_failed_byfile(ctx_t *ctx_p, GHashTable *fpath2ei_ht, fpathtree_t *fpath2ei_tree, const char *failfpath) {
+	GHashTable *failed_ht;
+	char   *line = NULL;
+	size_t  line_size = 0;
+	ssize_t line_len;
+	int added = 0;
+
+	FILE *failf = fopen(failfpath, "r");
+	if (failf == NULL) {
+		if (errno != ENOENT)
+			error("Cannot open the failed-list file \"%s\".", failfpath);
+		return NULL;
+	}
+
+	failed_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+
+	while ((line_len = getline(&line, &line_size, failf)) != -1) {
+		if (line_len && (line[line_len-1] == '\n'))
+			line[--line_len] = 0;
+		if (!line_len)
+			continue;
+
+		if (!sync_retry_failed_add(ctx_p, failed_ht, fpath2ei_ht, fpath2ei_tree, line))
+			added++;
+	}
+
+	free(line);
+	fclose(failf);
+
+	if (!added) {
+		g_hash_table_destroy(failed_ht);
+		return NULL;
+	}
+
+	debug(2, "%i paths are failed (by \"%s\").", added, failfpath);
+	return failed_ht;
+}
+
+// } === SYNC_RETRY() ===
+
+// Adjusts the limit of syncs in flight by a finished sync: additive increase,
+// multiplicative decrease. Is called with the threadsinfo mutex locked.
+static inline void thread_concurrency_update(ctx_t *ctx_p, threadsinfo_t *threadsinfo_p, threadinfo_t *threadinfo_p) {
+	uint64_t runtime_perevent;
+	int failed, slow;
+
+	if (!ctx_p->flags[ADAPTIVECONCURRENCY])
+		return;
+
+	runtime_perevent = threadinfo_p->runtime * 1000 / (threadinfo_p->evcount > 0 ? threadinfo_p->evcount : 1);
+	failed = threadinfo_p->errcode || threadinfo_p->requeue;
+	slow   = (threadinfo_p->runtime >= CONCURRENCY_SLOW_RUNTIME_MIN) && threadsinfo_p->runtime_avg &&
+		 (runtime_perevent > threadsinfo_p->runtime_avg * CONCURRENCY_SLOW_FACTOR);
+
+	if (!failed)
+		threadsinfo_p->runtime_avg = threadsinfo_p->runtime_avg ?
+			threadsinfo_p->runtime_avg - threadsinfo_p->runtime_avg/CONCURRENCY_AVG_WEIGHT + runtime_perevent/CONCURRENCY_AVG_WEIGHT :
+			runtime_perevent;
+
+	debug(3, "runtime: %lu ms (%lu us per event; average: %lu us), failed: %i, slow: %i",
+		threadinfo_p->runtime, runtime_perevent, threadsinfo_p->runtime_avg, failed, slow);
+
+	if (failed || slow) {
+		// The syncs started before the last decrease were run with the old limit
+		if (threadinfo_p->pickuptime < threadsinfo_p->concurrency_decreasetime)
+			return;
+
+		threadsinfo_p->concurrency_limit        = MAX(1, threadsinfo_p->concurrency_limit / CONCURRENCY_DECREASE_DIVISOR);
+		threadsinfo_p->concurrency_succeeded    = 0;
+		threadsinfo_p->concurrency_decreasetime = clock_monotonic_ms();
+		debug(1, "Got a %s sync, decreased the limit of concurrent syncs to %i.", failed ? "failed" : "slow", threadsinfo_p->concurrency_limit);
+		return;
+	}
+
+	if (++threadsinfo_p->concurrency_succeeded < threadsinfo_p->concurrency_limit)
+		return;
+
+	threadsinfo_p->concurrency_succeeded = 0;
+	if (threadsinfo_p->concurrency_limit < ctx_p->flags[SYNCWORKERS]) {
+		threadsinfo_p->concurrency_limit++;
+		debug(2, "Increased the limit of concurrent syncs to %i.", threadsinfo_p->concurrency_limit);
+	}
+
+	return;
+}
+
+static inline int thread_concurrency_limit(ctx_t *ctx_p, threadsinfo_t *threadsinfo_p) {
+	if (!ctx_p->flags[ADAPTIVECONCURRENCY])
+		return ctx_p->flags[SYNCWORKERS];
+
+	// Starting with the static limit
+	if (!threadsinfo_p->concurrency_limit)
+		threadsinfo_p->concurrency_limit = ctx_p->flags[SYNCWORKERS];
+
+	return threadsinfo_p->concurrency_limit;
+}
+
+// Counts the syncs being run by workers and the syncs waiting for a worker
+// (the finished ones that are not collected by thread_gc() yet are skipped)
+int thread_concurrency_get(ctx_t *ctx_p, int *running_p, int *queued_p, int *limit_p) {
+	int thread_num;
+	threadsinfo_t *threadsinfo_p = thread_info_lock();
+#ifdef PARANOID
+	if (threadsinfo_p == NULL)
+		return thread_info_unlock(errno);
 #endif
-		threadsinfo_p->threadsstack[threadsinfo_p->stacklen++] = threadinfo_p;
+
+	*running_p = *queued_p = 0;
+	thread_num = 0;
+	while (thread_num < threadsinfo_p->used) {
+		threadinfo_t *threadinfo_p = threadsinfo_p->threads[thread_num++];
+
+		if (threadinfo_p->state == STATE_TERM)
+			continue;
+
+		if (threadinfo_p->pickuptime)
+			(*running_p)++;
+		else
+			(*queued_p)++;
 	}
+	*limit_p = thread_concurrency_limit(ctx_p, threadsinfo_p);
 
-	debug(3, "thread_del_bynum(%i): there're %i threads left (#1).", thread_num, threadsinfo_p->used - threadsinfo_p->stacklen);
 	return thread_info_unlock(0);
 }
 
+// Returns non-zero if new syncs should be held, so the collected events are
+// merged in the queues till a sync is finished. The syncs are never held on
+// exit (and with "--exit-on-no-events"), otherwise the last collected events
+// would never be synced.
+static inline int thread_concurrency_isheld(ctx_t *ctx_p) {
+	int running, queued, limit;
+
+	if (!ctx_p->flags[ADAPTIVECONCURRENCY] || (ctx_p->flags[THREADING] == PM_OFF))
+		return 0;
+
+	if (ctx_p->flags[EXITONNOEVENTS] || (ctx_p->state == STATE_PREEXIT) || (ctx_p->state == STATE_TERM) || (ctx_p->state == STATE_EXIT))
+		return 0;
+
+	if (thread_concurrency_get(ctx_p, &running, &queued, &limit))
+		return 0;
+
+	return running + queued >= limit;
+}
+
 int thread_gc(ctx_t *ctx_p) {
 	int thread_num;
 	time_t tm = time(NULL);
@@ -375,70 +794,62 @@ int thread_gc(ctx_t *ctx_p) {
 		return thread_info_unlock(errno);
 #endif
 
+	if (threadsinfo_p->done_fd_watched) {
+		// Resetting the eventfd counter; all the finished syncs are collected below
+		uint64_t value;
+		if (read(threadsinfo_p->done_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+			error("Cannot read() from the eventfd.");
+	}
+
 	debug(2, "There're %i threads.", threadsinfo_p->used);
 	thread_num=-1;
 	while (++thread_num < threadsinfo_p->used) {
-		int err;
-		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[thread_num];
+		threadinfo_t *threadinfo_p = threadsinfo_p->threads[thread_num];
 
 		debug(3, "Trying thread #%i (==%i) (state: %i; expire at: %i, now: %i, exitcode: %i, errcode: %i; i_p: %p; p: %p).", 
 			thread_num, threadinfo_p->thread_num, threadinfo_p->state, threadinfo_p->expiretime, tm, threadinfo_p->exitcode, 
 			threadinfo_p->errcode, threadinfo_p, threadinfo_p->pthread);
 
-		if (threadinfo_p->state == STATE_EXIT)
-			continue;
-
-		if (threadinfo_p->expiretime && (threadinfo_p->expiretime <= tm)) {
-			if(pthread_tryjoin_np(threadinfo_p->pthread, NULL)) {	// TODO: check this pthread_tryjoin_np() on error returnings
+		if (threadinfo_p->state != STATE_TERM) {
+			if (threadinfo_p->expiretime && (threadinfo_p->expiretime <= tm)) {
 				error("Debug3: thread_gc(): Thread #%i is alive too long: %lu <= %lu (started at %lu)", thread_num, threadinfo_p->expiretime, tm, threadinfo_p->starttime);
 				return thread_info_unlock(ETIME);
 			}
-		}
 
-#ifndef VERYPARANOID
-		if (threadinfo_p->state != STATE_TERM) {
-			debug(3, "Thread #%i is busy, skipping (#0).", thread_num);
+			debug(3, "Thread #%i is busy, skipping.", thread_num);
 			continue;
 		}
-#endif
-
 
-		debug(3, "Trying to join thread #%i: %p", thread_num, threadinfo_p->pthread);
+		debug(3, "Thread #%i is finished with exitcode %i (errcode %i), deleting. threadinfo_p == %p",
+			thread_num, threadinfo_p->exitcode, threadinfo_p->errcode, threadinfo_p);
 
-#ifndef VERYPARANOID
-		switch ((err=pthread_join(threadinfo_p->pthread, NULL))) {
-#else
-		switch ((err=pthread_tryjoin_np(threadinfo_p->pthread, NULL))) {
-			case EBUSY:
-				debug(3, "Thread #%i is busy, skipping (#1).", thread_num);
-				continue;
-#endif
-			case EDEADLK:
-			case EINVAL:
-			case 0:
-				debug(3, "Thread #%i is finished with exitcode %i (errcode %i), deleting. threadinfo_p == %p",
-					thread_num, threadinfo_p->exitcode, threadinfo_p->errcode, threadinfo_p);
-				break;
-			default:
-				error("Got error while pthread_join() or pthread_tryjoin_np().", strerror(err), err);
-				return thread_info_unlock(errno);
+		int errcode = threadinfo_p->errcode;
+		if (errcode)
+			error("Got error from thread #%i: errcode %i.", thread_num, errcode);
 
-		}
+		thread_concurrency_update(ctx_p, threadsinfo_p, threadinfo_p);
 
-		if (threadinfo_p->errcode) {
-			error("Got error from thread #%i: errcode %i.", thread_num, threadinfo_p->errcode);
-			thread_info_unlock(0);
-			thread_del_bynum(thread_num);
-			return threadinfo_p->errcode;
+		if (threadinfo_p->requeue) {
+			if (sync_retry(ctx_p, ctx_p->indexes_p, threadinfo_p->failed_ht, threadinfo_p->fpath2ei_tree) && !ctx_p->flags[IGNOREFAILURES]) {
+				error("Bad exitcode %i, gave up syncing some of the events of thread #%i.", threadinfo_p->exitcode, thread_num);
+				errcode = threadinfo_p->exitcode ? threadinfo_p->exitcode : EIO;
+			}
+			if (threadinfo_p->failed_ht != NULL)
+				g_hash_table_destroy(threadinfo_p->failed_ht);
+			fpathtree_free(threadinfo_p->fpath2ei_tree);
 		}
 
 		thread_info_unlock(0);
 		if (thread_del_bynum(thread_num))
 			return errno;
+		if (errcode)
+			return errcode;
 		thread_info_lock();
+
+		thread_num--;	// the last thread is moved to the place of the deleted one
 	}
 
-	debug(3, "There're %i threads left.", threadsinfo_p->used - threadsinfo_p->stacklen);
+	debug(3, "There're %i threads left.", threadsinfo_p->used);
 	return thread_info_unlock(0);
 }
 
@@ -451,36 +862,57 @@ int thread_cleanup(ctx_t *ctx_p) {
 		return thread_info_unlock(errno);
 #endif
 
-	// Waiting for threads:
-	debug(1, "There're %i opened threads. Waiting.", threadsinfo_p->used);
-	while (threadsinfo_p->used) {
-//		int err;
-		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[--threadsinfo_p->used];
-		if (threadinfo_p->state == STATE_EXIT)
+	// Dropping the queued syncs and stopping the workers:
+	while (threadsinfo_p->queue_head != NULL) {
+		threadinfo_t *threadinfo_p = threadsinfo_p->queue_head;
+		threadsinfo_p->queue_head = threadinfo_p->queue_next;
+
+		warning("Dropping the queued sync #%i of %i events (the iteration #%u).", threadinfo_p->thread_num, threadinfo_p->evcount, threadinfo_p->iteration);
+		thread_task_drop(threadinfo_p);
+		threadinfo_p->state = STATE_TERM;
+	}
+	threadsinfo_p->queue_tail   = NULL;
+	threadsinfo_p->workers_stop = 1;
+	pthread_cond_broadcast(&threadsinfo_p->cond[PTHREAD_MUTEX_THREADSINFO]);
+
+	int thread_num = threadsinfo_p->used;
+	while (thread_num--) {
+		threadinfo_t *threadinfo_p = threadsinfo_p->threads[thread_num];
+		if ((threadinfo_p->state == STATE_TERM) || (threadinfo_p->child_pid <= 0))
 			continue;
-		//pthread_kill(threadinfo_p->pthread, SIGTERM);
 		debug(1, "killing pid %i with SIGTERM", threadinfo_p->child_pid);
 		kill(threadinfo_p->child_pid, SIGTERM);
-		pthread_join(threadinfo_p->pthread, NULL);
-		debug(2, "thread #%i exitcode: %i", threadsinfo_p->used, threadinfo_p->exitcode);
-/*
-		if(threadinfo_p->callback)
-			if((err=threadinfo_p->callback(ctx_p, threadinfo_p->argv)))
-				warning("Got error from callback function.", strerror(err), err);
-*/
-		char **ptr = threadinfo_p->argv;
-		while (*ptr)
-			free(*(ptr++));
-		free(threadinfo_p->argv);
 	}
+
+	// Waiting for workers:
+	debug(1, "There're %i sync workers. Waiting.", threadsinfo_p->workers_count);
+	thread_info_unlock(0);
+	while (threadsinfo_p->workers_count)
+		pthread_join(threadsinfo_p->workers[--threadsinfo_p->workers_count], NULL);
+	thread_info_lock();
 	debug(3, "All threads are closed.");
 
 	// Freeing
-	if (threadsinfo_p->allocated) {
-		free(threadsinfo_p->threads);
-		free(threadsinfo_p->threadsstack);
+	while (threadsinfo_p->used) {
+		threadinfo_t *threadinfo_p = threadsinfo_p->threads[--threadsinfo_p->used];
+		debug(2, "thread #%i exitcode: %i", threadsinfo_p->used, threadinfo_p->exitcode);
+		char **ptr = threadinfo_p->argv;
+		if (ptr != NULL) {
+			while (*ptr)
+				free(*(ptr++));
+			free(threadinfo_p->argv);
+		}
+		free(threadinfo_p);
 	}
 
+	if (threadsinfo_p->allocated)
+		free(threadsinfo_p->threads);
+	free(threadsinfo_p->workers);
+
+	if (threadsinfo_p->done_fd != -1)
+		close(threadsinfo_p->done_fd);
+
+	thread_info_unlock(0);
 	if (threadsinfo_p->mutex_init) {
 		int i=0;
 		while(i < PTHREAD_MUTEX_MAX) {
@@ -496,12 +928,14 @@ int thread_cleanup(ctx_t *ctx_p) {
 #endif
 
 	debug(3, "done.");
-	return thread_info_unlock(0);
+	return 0;
 }
 
 volatile state_t *state_p = NULL;
 volatile int exitcode = 0;
 #define SHOULD_THREAD(ctx_p) ((ctx_p->flags[THREADING] != PM_OFF) && (ctx_p->flags[THREADING] != PM_SAFE || ctx_p->iteration_num))
+// The sync-handler gets api_eventinfo_t records: a shared object or a co-process
+#define ISAPIMODE(ctx_p) ((ctx_p->flags[MODE] == MODE_SO) || (ctx_p->flags[MODE] == MODE_COPROCESS))
 
 int exec_argv(char **argv, int *child_pid) {
 	debug(3, "Thread %p.", pthread_self());
@@ -575,10 +1009,8 @@ static inline int thread_exit(threadinfo_t *threadinfo_p, int exitcode ) {
 		}
 	}
 
-	// Notifying the parent-thread, that it's time to collect garbage threads
-	threadinfo_p->state    = STATE_TERM;
-	debug(3, "thread %p is sending signal to sighandler to call GC", threadinfo_p->pthread);
-	return pthread_kill(pthread_sighandler, SIGUSR_THREAD_GC);
+	// The parent-thread is notified by the worker (see thread_worker())
+	return 0;
 }
 
 static inline void so_call_sync_finished(int n, api_eventinfo_t *ei) {
@@ -621,18 +1053,25 @@ int so_call_sync_thread(threadinfo_t *threadinfo_p) {
 			try_again = ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				if (threadinfo_p->requeue_onfail) {
+					threadinfo_p->requeue = 1;	// see thread_gc()
+					break;
+				}
+				debug(2, "Sleeping for %lu ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 
 	} while (err && ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT));
 
-	if (err && !ctx_p->flags[IGNOREFAILURES]) {
+	if (err && !threadinfo_p->requeue && !ctx_p->flags[IGNOREFAILURES]) {
 		error("Bad exitcode %i (errcode %i)", rc, err);
 		threadinfo_p->errcode = err;
 	}
 
+	if (threadinfo_p->requeue)
+		threadinfo_p->failed_ht = sync_retry_failed_byei(ctx_p, NULL, threadinfo_p->fpath2ei_tree, n, ei);
+
 	so_call_sync_finished(n, ei);
 
 	if ((err=thread_exit(threadinfo_p, rc))) {
@@ -649,6 +1088,7 @@ static inline int so_call_sync(ctx_t *ctx_p, indexes_t *indexes_p, int n, api_ev
 	if (!SHOULD_THREAD(ctx_p)) {
 		int rc=0, ret=0, err=0;
 		int try_n=0, try_again;
+		int requeue_onfail = sync_retry_isrequeueable(ctx_p, indexes_p);
 		state_t status = STATE_UNKNOWN;
 
 //		indexes_p->nonthreaded_syncing_fpath2ei_ht = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
@@ -663,7 +1103,7 @@ static inline int so_call_sync(ctx_t *ctx_p, indexes_t *indexes_p, int n, api_ev
 			alarm(0);
 
 			if ((err=exitcode_process(ctx_p, rc))) {
-				if ((try_n == 1) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT)) {
+				if ((status == STATE_UNKNOWN) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT)) {
 					status = ctx_p->state;
 					ctx_p->state = STATE_SYNCHANDLER_ERR;
 					main_status_update(ctx_p);
@@ -672,11 +1112,20 @@ static inline int so_call_sync(ctx_t *ctx_p, indexes_t *indexes_p, int n, api_ev
 				try_again = ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 				warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 				if (try_again) {
-					debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-					sleep(ctx_p->syncdelay);
+					if (requeue_onfail)
+						break;
+					debug(2, "Sleeping for %lu ms before the retry.", ctx_p->syncdelay);
+					sleep_ms(ctx_p->syncdelay);
 				}
 			}
 		} while (err && ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT));
+		if (err && try_again) {
+			GHashTable *failed_ht = sync_retry_failed_byei(ctx_p, indexes_p->fpath2ei_ht, NULL, n, ei);
+			if (!sync_retry(ctx_p, indexes_p, failed_ht != NULL ? failed_ht : indexes_p->fpath2ei_ht, NULL))
+				err = 0;
+			if (failed_ht != NULL)
+				g_hash_table_destroy(failed_ht);
+		}
 		if (err && !ctx_p->flags[IGNOREFAILURES]) {
 			error("Bad exitcode %i (errcode %i)", rc, err);
 			ret = err;
@@ -698,23 +1147,19 @@ static inline int so_call_sync(ctx_t *ctx_p, indexes_t *indexes_p, int n, api_ev
 		return errno;
 
 	threadinfo_p->try_n       = 0;
+	threadinfo_p->requeue_onfail = sync_retry_isrequeueable(ctx_p, indexes_p);
+	threadinfo_p->evcount     = n;
 	threadinfo_p->callback    = NULL;
 	threadinfo_p->argv        = NULL;
 	threadinfo_p->ctx_p       = ctx_p;
-	threadinfo_p->starttime	  = time(NULL);
-	threadinfo_p->fpath2ei_ht = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
+	threadinfo_p->fpath2ei_tree = fpathtree_new_fromht(indexes_p->fpath2ei_ht, eidup, free);
 	threadinfo_p->n           = n;
 	threadinfo_p->ei          = ei;
 	threadinfo_p->iteration   = ctx_p->iteration_num;
 
-	if (ctx_p->synctimeout)
-		threadinfo_p->expiretime = threadinfo_p->starttime + ctx_p->synctimeout;
-
-	if (pthread_create(&threadinfo_p->pthread, NULL, (void *(*)(void *))so_call_sync_thread, threadinfo_p)) {
-		error("Cannot pthread_create().");
+	if (thread_submit(threadinfo_p, so_call_sync_thread))
 		return errno;
-	}
-	debug(3, "thread %p", threadinfo_p->pthread);
+	debug(3, "queued thread #%i", threadinfo_p->thread_num);
 	return 0;
 
 }
@@ -764,13 +1209,17 @@ int so_call_rsync_thread(threadinfo_t *threadinfo_p) {
 			try_again = ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				if (threadinfo_p->requeue_onfail) {
+					threadinfo_p->requeue = 1;	// see thread_gc()
+					break;
+				}
+				debug(2, "Sleeping for %lu ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 	} while (try_again);
 
-	if (err && !ctx_p->flags[IGNOREFAILURES]) {
+	if (err && !threadinfo_p->requeue && !ctx_p->flags[IGNOREFAILURES]) {
 		error("Bad exitcode %i (errcode %i)", rc, err);
 		threadinfo_p->errcode = err;
 	}
@@ -783,6 +1232,7 @@ int so_call_rsync_thread(threadinfo_t *threadinfo_p) {
 	free(argv[0]);
 	free(argv[1]);
 	free(argv);
+	threadinfo_p->argv = NULL;
 
 	if ((err=thread_exit(threadinfo_p, rc))) {
 		exitcode = err;	// This's global variable "exitcode"
@@ -803,6 +1253,7 @@ static inline int so_call_rsync(ctx_t *ctx_p, indexes_t *indexes_p, const char *
 
 		int rc=0, err=0;
 		int try_n=0, try_again;
+		int requeue_onfail = sync_retry_isrequeueable(ctx_p, indexes_p);
 		state_t status = STATE_UNKNOWN;
 		do {
 			try_again = 0;
@@ -813,7 +1264,7 @@ static inline int so_call_rsync(ctx_t *ctx_p, indexes_t *indexes_p, const char *
 			alarm(0);
 
 			if ((err=exitcode_process(ctx_p, rc))) {
-				if ((try_n == 1) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT)) {
+				if ((status == STATE_UNKNOWN) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT)) {
 					status = ctx_p->state;
 					ctx_p->state = STATE_SYNCHANDLER_ERR;
 					main_status_update(ctx_p);
@@ -821,11 +1272,15 @@ static inline int so_call_rsync(ctx_t *ctx_p, indexes_t *indexes_p, const char *
 				try_again = ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 				warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 				if (try_again) {
-					debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-					sleep(ctx_p->syncdelay);
+					if (requeue_onfail)
+						break;
+					debug(2, "Sleeping for %lu ms before the retry.", ctx_p->syncdelay);
+					sleep_ms(ctx_p->syncdelay);
 				}
 			}
 		} while (try_again);
+		if (err && try_again && !sync_retry(ctx_p, indexes_p, indexes_p->fpath2ei_ht, NULL))
+			err = rc = 0;
 		if (err && !ctx_p->flags[IGNOREFAILURES]) {
 			error("Bad exitcode %i (errcode %i)", rc, err);
 			rc = err;
@@ -849,28 +1304,46 @@ static inline int so_call_rsync(ctx_t *ctx_p, indexes_t *indexes_p, const char *
 		return errno;
 
 	threadinfo_p->try_n       = 0;
+	threadinfo_p->requeue_onfail = sync_retry_isrequeueable(ctx_p, indexes_p);
+	threadinfo_p->evcount     = g_hash_table_size(indexes_p->fpath2ei_ht);
 	threadinfo_p->callback    = NULL;
 	threadinfo_p->argv        = xmalloc(sizeof(char *) * 3);
 	threadinfo_p->ctx_p       = ctx_p;
-	threadinfo_p->starttime	  = time(NULL);
-	threadinfo_p->fpath2ei_ht = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
+	threadinfo_p->fpath2ei_tree = fpathtree_new_fromht(indexes_p->fpath2ei_ht, eidup, free);
 	threadinfo_p->iteration   = ctx_p->iteration_num;
 
 	threadinfo_p->argv[0]	  = strdup(inclistfile);
 	threadinfo_p->argv[1]	  = strdup(exclistfile);
+	threadinfo_p->argv[2]	  = NULL;
 
-	if(ctx_p->synctimeout)
-		threadinfo_p->expiretime = threadinfo_p->starttime + ctx_p->synctimeout;
-
-	if(pthread_create(&threadinfo_p->pthread, NULL, (void *(*)(void *))so_call_rsync_thread, threadinfo_p)) {
-		error("Cannot pthread_create().");
+	if (thread_submit(threadinfo_p, so_call_rsync_thread))
 		return errno;
-	}
-	debug(3, "thread %p", threadinfo_p->pthread);
+	debug(3, "queued thread #%i", threadinfo_p->thread_num);
 	return 0;
 
 }
 
+// Releases what a task would release on its finish if it's never run
+static void thread_task_drop(threadinfo_t *threadinfo_p) {
+	debug(3, "thread_num == %i", threadinfo_p->thread_num);
+
+	if (threadinfo_p->fpath2ei_tree != NULL) {
+		fpathtree_free(threadinfo_p->fpath2ei_tree);
+		threadinfo_p->fpath2ei_tree = NULL;
+	}
+
+	if (threadinfo_p->funct == so_call_sync_thread)
+		so_call_sync_finished(threadinfo_p->n, threadinfo_p->ei);
+	else
+	if (threadinfo_p->funct == so_call_rsync_thread)
+		so_call_rsync_finished(threadinfo_p->ctx_p, threadinfo_p->argv[0], threadinfo_p->argv[1]);
+
+	if (threadinfo_p->callback != NULL)
+		threadinfo_p->callback(threadinfo_p->ctx_p, threadinfo_p->callback_arg);
+
+	return;
+}
+
 // === SYNC_EXEC() === {
 
 //#define SYNC_EXEC(...)      (SHOULD_THREAD(ctx_p) ? sync_exec_thread      : sync_exec     )(__VA_ARGS__)
@@ -1018,6 +1491,7 @@ int sync_exec_argv(ctx_t *ctx_p, indexes_t *indexes_p, thread_callbackfunct_t ca
 
 	int exitcode=0, ret=0, err=0;
 	int try_n=0, try_again;
+	int requeue_onfail = sync_retry_isrequeueable(ctx_p, indexes_p);
 	state_t status = STATE_UNKNOWN;
 	do {
 		try_again = 0;
@@ -1031,7 +1505,7 @@ int sync_exec_argv(ctx_t *ctx_p, indexes_t *indexes_p, thread_callbackfunct_t ca
 		alarm(0);
 
 		if ((err=exitcode_process(ctx_p, exitcode))) {
-			if ((try_n == 1) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT)) {
+			if ((status == STATE_UNKNOWN) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT)) {
 				status = ctx_p->state;
 				ctx_p->state = STATE_SYNCHANDLER_ERR;
 				main_status_update(ctx_p);
@@ -1039,12 +1513,23 @@ int sync_exec_argv(ctx_t *ctx_p, indexes_t *indexes_p, thread_callbackfunct_t ca
 			try_again = ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("Bad exitcode %i (errcode %i). %s.", exitcode, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				if (requeue_onfail)
+					break;
+				debug(2, "Sleeping for %lu ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 	} while(try_again);
 
+	if (err && try_again) {
+		GHashTable *failed_ht = (callback_arg_p != NULL) && (callback_arg_p->failfpath != NULL) ?
+			sync_retry_failed_byfile(ctx_p, indexes_p->fpath2ei_ht, NULL, callback_arg_p->failfpath) : NULL;
+		if (!sync_retry(ctx_p, indexes_p, failed_ht != NULL ? failed_ht : indexes_p->fpath2ei_ht, NULL))
+			err = 0;
+		if (failed_ht != NULL)
+			g_hash_table_destroy(failed_ht);
+	}
+
 	if (err && !ctx_p->flags[IGNOREFAILURES]) {
 		error("Bad exitcode %i (errcode %i)", exitcode, err);
 		ret = err;
@@ -1101,19 +1586,27 @@ int __sync_exec_thread(threadinfo_t *threadinfo_p) {
 			try_again = ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("__sync_exec_thread(): Bad exitcode %i (errcode %i). %s.", exec_exitcode, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				if (threadinfo_p->requeue_onfail) {
+					threadinfo_p->requeue = 1;	// see thread_gc()
+					break;
+				}
+				debug(2, "Sleeping for %lu ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 
 	} while (try_again);
 
-	if (err && !ctx_p->flags[IGNOREFAILURES]) {
+	if (err && !threadinfo_p->requeue && !ctx_p->flags[IGNOREFAILURES]) {
 		error("Bad exitcode %i (errcode %i)", exec_exitcode, err);
 		threadinfo_p->errcode = err;
 	}
 
-	g_hash_table_destroy(threadinfo_p->fpath2ei_ht);
+	if (!threadinfo_p->requeue)	// otherwise it's requeued and freed by thread_gc()
+		fpathtree_free(threadinfo_p->fpath2ei_tree);
+	else
+	if ((threadinfo_p->callback_arg != NULL) && (threadinfo_p->callback_arg->failfpath != NULL))
+		threadinfo_p->failed_ht = sync_retry_failed_byfile(ctx_p, NULL, threadinfo_p->fpath2ei_tree, threadinfo_p->callback_arg->failfpath);
 
 	if ((err=thread_exit(threadinfo_p, exec_exitcode))) {
 		exitcode = err;	// This's global variable "exitcode"
@@ -1135,22 +1628,18 @@ static inline int sync_exec_argv_thread(ctx_t *ctx_p, indexes_t *indexes_p, thre
 		return errno;
 
 	threadinfo_p->try_n        = 0;
+	threadinfo_p->requeue_onfail = sync_retry_isrequeueable(ctx_p, indexes_p);
+	threadinfo_p->evcount      = g_hash_table_size(indexes_p->fpath2ei_ht);
 	threadinfo_p->callback     = callback;
 	threadinfo_p->callback_arg = callback_arg_p;
 	threadinfo_p->argv         = argv;
 	threadinfo_p->ctx_p        = ctx_p;
-	threadinfo_p->starttime	   = time(NULL);
-	threadinfo_p->fpath2ei_ht  = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
+	threadinfo_p->fpath2ei_tree = fpathtree_new_fromht(indexes_p->fpath2ei_ht, eidup, free);
 	threadinfo_p->iteration    = ctx_p->iteration_num;
 
-	if (ctx_p->synctimeout)
-		threadinfo_p->expiretime = threadinfo_p->starttime + ctx_p->synctimeout;
-
-	if (pthread_create(&threadinfo_p->pthread, NULL, (void *(*)(void *))__sync_exec_thread, threadinfo_p)) {
-		error("Cannot pthread_create().");
+	if (thread_submit(threadinfo_p, __sync_exec_thread))
 		return errno;
-	}
-	debug(3, "thread %p", threadinfo_p->pthread);
+	debug(3, "queued thread #%i", threadinfo_p->thread_num);
 	return 0;
 }
 
@@ -1172,13 +1661,18 @@ static inline int sync_exec_thread(ctx_t *ctx_p, indexes_t *indexes_p, thread_ca
 static int sync_queuesync(const char *fpath_rel, eventinfo_t *evinfo, ctx_t *ctx_p, indexes_t *indexes_p, queue_id_t queue_id) {
 
 	debug(3, "sync_queuesync(\"%s\", ...): fsize == %lu; tres == %lu, queue_id == %u", fpath_rel, evinfo->fsize, ctx_p->bfilethreshold, queue_id);
-	if(queue_id == QUEUE_AUTO)
-		queue_id = (evinfo->fsize > ctx_p->bfilethreshold) ? QUEUE_BIGFILE : QUEUE_NORMAL;
+	if(queue_id == QUEUE_AUTO) {
+		// Merging into the pending retry of the path, if any (see sync_retry())
+		if (indexes_lookupinqueue(indexes_p, fpath_rel, QUEUE_RETRY) != NULL)
+			queue_id = QUEUE_RETRY;
+		else
+			queue_id = (evinfo->fsize > ctx_p->bfilethreshold) ? QUEUE_BIGFILE : QUEUE_NORMAL;
+	}
 
 	queueinfo_t *queueinfo = &ctx_p->_queues[queue_id];
 
 	if(!queueinfo->stime)
-		queueinfo->stime = time(NULL);
+		queueinfo->stime = clock_monotonic_ms();
 
 //	char *fpath_rel = sync_path_abs2rel(ctx_p, fpath, -1, NULL, NULL);
 
@@ -1210,7 +1704,9 @@ static inline void evinfo_initialevmask(ctx_t *ctx_p, eventinfo_t *evinfo_p, int
 	switch(ctx_p->flags[MONITOR]) {
 #ifdef FANOTIFY_SUPPORT
 		case NE_FANOTIFY:
-			critical("fanotify is not supported");
+			evinfo_p->evmask = FAN_CREATE;
+			if (isdir)
+				evinfo_p->evmask |= FAN_ONDIR;
 			break;
 #endif
 #if INOTIFY_SUPPORT | KQUEUE_SUPPORT
@@ -1244,6 +1740,46 @@ static inline void evinfo_initialevmask(ctx_t *ctx_p, eventinfo_t *evinfo_p, int
 	return;
 }
 
+static inline void evinfo_deletedevmask(ctx_t *ctx_p, eventinfo_t *evinfo_p, int isdir) {
+	switch(ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
+			evinfo_p->evmask = FAN_DELETE;
+			if (isdir)
+				evinfo_p->evmask |= FAN_ONDIR;
+			break;
+#endif
+#if INOTIFY_SUPPORT | KQUEUE_SUPPORT
+#ifdef INOTIFY_SUPPORT
+		case NE_INOTIFY:
+#endif
+#ifdef KQUEUE_SUPPORT
+		case NE_KQUEUE:
+#endif
+			evinfo_p->evmask = IN_DELETE;
+			if (isdir)
+				evinfo_p->evmask |= IN_ISDIR;
+			break;
+#endif
+#ifdef BSM_SUPPORT
+		case NE_BSM:
+		case NE_BSM_PREFETCH:
+			evinfo_p->evmask = (isdir ? AUE_RMDIR : AUE_UNLINK);
+			break;
+#endif
+#ifdef GIO_SUPPORT
+		case NE_GIO:
+			evinfo_p->evmask = G_FILE_MONITOR_EVENT_DELETED;
+			break;
+#endif
+#ifdef VERYPARANOID
+		default:
+			critical("Unknown monitor subsystem: %u", ctx_p->flags[MONITOR]);
+#endif
+	}
+	return;
+}
+
 static inline void api_evinfo_initialevmask(ctx_t *ctx_p, api_eventinfo_t *evinfo_p, int isdir) {
 	eventinfo_t evinfo = {0};
 	evinfo_initialevmask(ctx_p, &evinfo, isdir);
@@ -1252,12 +1788,186 @@ static inline void api_evinfo_initialevmask(ctx_t *ctx_p, api_eventinfo_t *evinf
 }
 
 int sync_dosync(const char *fpath, uint32_t evmask, ctx_t *ctx_p, indexes_t *indexes_p);
+int sync_notify_mark(ctx_t *ctx_p, const char *accpath, const char *path, size_t pathlen, indexes_t *indexes_p);
+int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p);
+
+// The tree is marked by the first full initial sync walk instead of a separate walk, see sync_run()
+static int sync_mark_deferred = 0;
+
+enum sync_initialsync_walk_state {
+	SIWS_SYNC	= 0x01,		/* the directory content is to be synced */
+	SIWS_MARK	= 0x02,		/* the directory content is to be marked */
+};
+
+struct sync_initialsync_walk_arg {
+	ctx_t		*ctx_p;
+	indexes_t	*indexes_p;
+	queue_id_t	 queue_id;
+	char		 skip_rules;
+	char		 rsync_and_prefer_excludes;
+	char		 fts_no_stat;
+	char		 mark;
+};
+
+// Lets the privileged helper set watches on directories while reading the tree, see privileged_fts_read()
+static inline void sync_fts_premark(ctx_t *ctx_p, FTS *tree) {
+#ifdef INOTIFY_SUPPORT
+	if (ctx_p->flags[MONITOR] == NE_INOTIFY)
+		privileged_fts_premark(tree, (int)(long)ctx_p->fsmondata, INOTIFY_MARKMASK);
+#endif
+	return;
+}
+
+static inline size_t sync_walker_path_rel_off(ctx_t *ctx_p) {
+	// See sync_path_abs2rel()
+	return ((ctx_p->watchdir == ctx_p->watchdirwslash) ? 0 : ctx_p->watchdirlen) + 1;
+}
+
+// Returns how many threads should walk the tree, 0 means privileged_fts_*()
+static inline int sync_walker_threads(ctx_t *ctx_p) {
+	if (ctx_p->flags[WALKTHREADS] > 1)
+		return ctx_p->flags[WALKTHREADS];
+
+	// Directories are read here with "--pass-dirfds", not through the privileged thread/process
+	if (ctx_p->flags[PASS_DIRFDS])
+		return 1;
+
+	return 0;
+}
+
+static int sync_initialsync_walk_filter(walker_entry_t *entry_p, void *_arg_p) {
+	struct sync_initialsync_walk_arg *arg_p = _arg_p;
+	ctx_t *ctx_p = arg_p->ctx_p;
+	int decision = 0;
+
+	if (arg_p->fts_no_stat)
+		entry_p->st_mode = S_ISDIR(entry_p->st_mode) ? S_IFDIR : S_IFREG;
+
+	entry_p->walk_state = 0;
+
+	// The same rules as in sync_mark_walk()
+	if (arg_p->mark && (entry_p->parent_walk_state & SIWS_MARK) && S_ISDIR(entry_p->st_mode)) {
+		if (rules_search_getperm(entry_p->path_rel, S_IFDIR, ctx_p->rules, RA_WALK, NULL) & RA_WALK) {
+			entry_p->walk_state |= SIWS_MARK;
+			decision = WD_REPORT|WD_DESCEND;
+		}
+	}
+
+	if (!(entry_p->parent_walk_state & SIWS_SYNC))
+		return decision;
+
+	decision |= WD_REPORT;
+
+	if (arg_p->skip_rules) {
+		entry_p->perm = RA_ALL;
+
+		/* "FTS optimization" */
+		if (
+			arg_p->rsync_and_prefer_excludes		&&
+			S_ISDIR(entry_p->st_mode)			&&
+			!ctx_p->flags[EXCLUDEMOUNTPOINTS]
+		) {
+			debug(4, "\"FTS optimizator\"");
+			return decision;
+		}
+	} else {
+		entry_p->perm = rules_getperm(entry_p->path_rel, entry_p->st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+
+		if (!(entry_p->perm&RA_WALK)) {
+			debug(3, "Rejecting to walk into \"%s\".", entry_p->path_rel);
+			return decision;
+		}
+	}
+
+	entry_p->walk_state |= SIWS_SYNC;
+	return decision|WD_DESCEND;
+}
+
+static int sync_initialsync_walk_commit(walker_entry_t *entry_p, void *_arg_p) {
+	struct sync_initialsync_walk_arg *arg_p = _arg_p;
+	ctx_t		*ctx_p		= arg_p->ctx_p;
+	indexes_t	*indexes_p	= arg_p->indexes_p;
+	queue_id_t	 queue_id	= arg_p->queue_id;
+	const char	*path_rel	= entry_p->path_rel;
+	int		 isdir		= S_ISDIR(entry_p->st_mode);
+	eventinfo_t	 evinfo;
+
+	debug(3, "Pointing to \"%s\" (isdir == %i)", path_rel, isdir);
+
+	// Marking before the directory is listed to not miss anything created meanwhile
+	if (entry_p->walk_state & SIWS_MARK) {
+		debug(2, "marking \"%s\" (depth %u)", entry_p->path, entry_p->level);
+		if (sync_notify_mark(ctx_p, entry_p->path, entry_p->path, entry_p->path_len, indexes_p) == -1) {
+			error("Got error while notify-marking \"%s\".", entry_p->path);
+			return errno ? errno : EINVAL;
+		}
+	}
+
+	if (!(entry_p->parent_walk_state & SIWS_SYNC))
+		return 0;
+
+	if (ctx_p->flags[EXCLUDEMOUNTPOINTS] && isdir) {
+		if (arg_p->rsync_and_prefer_excludes) {
+			if (entry_p->st_dev != ctx_p->st_dev) {
+				if (queue_id == QUEUE_AUTO) {
+					int i=0;
+					while (i<QUEUE_MAX)
+						indexes_addexclude(indexes_p, strdup(path_rel), EVIF_CONTENTRECURSIVELY, i++);
+				} else
+					indexes_addexclude(indexes_p, strdup(path_rel), EVIF_CONTENTRECURSIVELY, queue_id);
+			}
+		} else
+		if (!ctx_p->flags[RSYNCPREFERINCLUDE])
+			error("Excluding mount points is not implentemted for non \"rsync*\" modes.");
+	}
+
+	if (!(entry_p->perm&RA_MONITOR)) {
+		debug(3, "Excluding \"%s\".", path_rel);
+		if (arg_p->rsync_and_prefer_excludes) {
+			if (queue_id == QUEUE_AUTO) {
+				int i=0;
+				while (i<QUEUE_MAX)
+					indexes_addexclude(indexes_p, strdup(path_rel), EVIF_NONE, i++);
+			} else
+				indexes_addexclude(indexes_p, strdup(path_rel), EVIF_NONE, queue_id);
+		}
+		return 0;
+	}
+
+	if (arg_p->rsync_and_prefer_excludes)
+		return 0;
+
+	memset(&evinfo, 0, sizeof(evinfo));
+	evinfo_initialevmask(ctx_p, &evinfo, isdir);
+
+	switch (ctx_p->flags[MODE]) {
+		case MODE_SIMPLE:
+			SAFE(sync_dosync(entry_p->path, evinfo.evmask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", entry_p->path, evinfo.evmask); return -1;);
+			return 0;
+		default:
+			break;
+	}
+
+	evinfo.seqid_min    = sync_seqid();
+	evinfo.seqid_max    = evinfo.seqid_min;
+	evinfo.objtype_old  = EOT_DOESNTEXIST;
+	evinfo.objtype_new  = isdir ? EOT_DIR : EOT_FILE;
+	evinfo.fsize        = arg_p->fts_no_stat ? 0 : entry_p->st_size;
+	debug(3, "queueing \"%s\" (depth: %i) with int-flags %p", entry_p->path, entry_p->level, (void *)(unsigned long)evinfo.flags);
+
+	if (sync_queuesync(path_rel, &evinfo, ctx_p, indexes_p, queue_id)) {
+		error("Got error while queueing \"%s\".", entry_p->path);
+		return errno ? errno : EINVAL;
+	}
+
+	return 0;
+}
+
 int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p, queue_id_t queue_id, initsync_t initsync) {
 	int ret = 0;
 	const char *rootpaths[] = {dirpath, NULL};
-	eventinfo_t evinfo;
+	struct sync_initialsync_walk_arg arg;
 	FTS *tree;
-	rule_t *rules_p = ctx_p->rules;
 	debug(2, "(ctx_p, \"%s\", indexes_p, %i, %i).", dirpath, queue_id, initsync);
 
 	char skip_rules = (initsync==INITSYNC_FULL) && ctx_p->flags[INITFULL];
@@ -1270,8 +1980,11 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 			) && 
 			!ctx_p->flags[RSYNCPREFERINCLUDE];
 
+	char mark = (initsync == INITSYNC_FULL) && sync_mark_deferred;
+	sync_mark_deferred = 0;
+
 	if ((!ctx_p->flags[RSYNCPREFERINCLUDE]) && skip_rules)
-		return 0;
+		return mark ? sync_mark_walk(ctx_p, dirpath, indexes_p) : 0;
 
 	skip_rules |= (ctx_p->rules_count == 0);
 
@@ -1289,26 +2002,52 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 			)
 		) && !(ctx_p->flags[EXCLUDEMOUNTPOINTS]);
 
+	arg.ctx_p			= ctx_p;
+	arg.indexes_p			= indexes_p;
+	arg.queue_id			= queue_id;
+	arg.skip_rules			= skip_rules;
+	arg.rsync_and_prefer_excludes	= rsync_and_prefer_excludes;
+	arg.fts_no_stat			= fts_no_stat;
+	arg.mark			= mark;
+
+	if (mark)
+		debug(1, "Marking the tree while walking it for the initial sync.");
+
+	// Newly created directories are usually small, it's not worth to start threads for them
+	if (sync_walker_threads(ctx_p) && initsync != INITSYNC_SUBDIR) {
+		int walker_flags = 
+			(fts_no_stat			? 0		: WF_STAT) |
+			(ctx_p->flags[ONEFILESYSTEM]	? WF_XDEV	: 0);
+
+		ret = walker_walk(dirpath, sync_walker_path_rel_off(ctx_p), walker_flags, sync_walker_threads(ctx_p), sync_initialsync_walk_filter, sync_initialsync_walk_commit, &arg);
+		if (ret)
+			error("Got error while walking \"%s\".", dirpath);
+		return ret;
+	}
+
 	int fts_opts =  FTS_NOCHDIR | FTS_PHYSICAL | 
 			(fts_no_stat			? FTS_NOSTAT	: 0) | 
 			(ctx_p->flags[ONEFILESYSTEM] 	? FTS_XDEV	: 0); 
 
         debug(3, "fts_opts == %p", (void *)(long)fts_opts);
 
-	tree = privileged_fts_open((char *const *)&rootpaths, fts_opts, NULL, PC_SYNC_INIIALSYNC_WALK_FTS_OPEN);
+	tree = privileged_fts_open((char *const *)&rootpaths, fts_opts, NULL);
 
 	if (tree == NULL) {
 		error("Cannot privileged_fts_open() on \"%s\".", dirpath);
 		return errno;
 	}
 
-	memset(&evinfo, 0, sizeof(evinfo));
+	if (mark)
+		sync_fts_premark(ctx_p, tree);
 
 	FTSENT *node;
 	char  *path_rel		= NULL;
 	size_t path_rel_len	= 0;
+	int   *walk_states	= NULL;	// by fts_level
+	int    walk_states_size	= 0;
 
-	while ((node = privileged_fts_read(tree, PC_SYNC_INIIALSYNC_WALK_FTS_READ))) {
+	while ((node = privileged_fts_read(tree))) {
 		switch (node->fts_info) {
 			// Duplicates:
 			case FTS_DP:
@@ -1346,83 +2085,34 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 		}
 		path_rel = sync_path_abs2rel(ctx_p, node->fts_path, -1, &path_rel_len, path_rel);
 
-		debug(3, "Pointing to \"%s\" (node->fts_info == %i)", path_rel, node->fts_info);
-
-		if (ctx_p->flags[EXCLUDEMOUNTPOINTS] && node->fts_info==FTS_D) {
-			if (rsync_and_prefer_excludes) {
-				if (node->fts_statp->st_dev != ctx_p->st_dev) {
-					if (queue_id == QUEUE_AUTO) {
-						int i=0;
-						while (i<QUEUE_MAX)
-							indexes_addexclude(indexes_p, strdup(path_rel), EVIF_CONTENTRECURSIVELY, i++);
-					} else
-						indexes_addexclude(indexes_p, strdup(path_rel), EVIF_CONTENTRECURSIVELY, queue_id);
-				}
-			} else
-			if (!ctx_p->flags[RSYNCPREFERINCLUDE])
-				error("Excluding mount points is not implentemted for non \"rsync*\" modes.");
-		}
-
-		mode_t st_mode = fts_no_stat ? (node->fts_info==FTS_D ? S_IFDIR : S_IFREG) : node->fts_statp->st_mode;
-
-		if (!skip_rules) {
-			ruleaction_t perm = rules_getperm(path_rel, st_mode, rules_p, RA_WALK|RA_MONITOR);
+		walker_entry_t entry;
+		entry.path	= node->fts_path;
+		entry.path_len	= node->fts_pathlen;
+		entry.path_rel	= path_rel;
+		entry.st_mode	= fts_no_stat ? (node->fts_info==FTS_D ? S_IFDIR : S_IFREG) : node->fts_statp->st_mode;
+		entry.st_size	= fts_no_stat ? 0 : node->fts_statp->st_size;
+		entry.st_dev	= fts_no_stat ? 0 : node->fts_statp->st_dev;
+		entry.level	= node->fts_level;
+		entry.parent_walk_state = node->fts_level ? walk_states[node->fts_level-1] : ~0;
 
-			if (!(perm&RA_WALK)) {
-				debug(3, "Rejecting to walk into \"%s\".", path_rel);
-				fts_set(tree, node, FTS_SKIP);
-			}
+		int decision = sync_initialsync_walk_filter(&entry, &arg);
 
-			if (!(perm&RA_MONITOR)) {
-				debug(3, "Excluding \"%s\".", path_rel);
-				if (rsync_and_prefer_excludes) {
-					if (queue_id == QUEUE_AUTO) {
-						int i=0;
-						while (i<QUEUE_MAX)
-							indexes_addexclude(indexes_p, strdup(path_rel), EVIF_NONE, i++);
-					} else
-						indexes_addexclude(indexes_p, strdup(path_rel), EVIF_NONE, queue_id);
-				}
-				continue;
+		if (!(decision & WD_DESCEND))
+			privileged_fts_set(tree, node, FTS_SKIP);
+		else
+		if (S_ISDIR(entry.st_mode)) {
+			if (node->fts_level >= walk_states_size) {
+				walk_states_size = node->fts_level + ALLOC_PORTION;
+				walk_states      = xrealloc(walk_states, walk_states_size * sizeof(*walk_states));
 			}
+			walk_states[node->fts_level] = entry.walk_state;
 		}
 
-		if (!rsync_and_prefer_excludes) {
-			evinfo_initialevmask(ctx_p, &evinfo, node->fts_info==FTS_D);
-
-			switch (ctx_p->flags[MODE]) {
-				case MODE_SIMPLE:
-					SAFE(sync_dosync(node->fts_path, evinfo.evmask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", node->fts_path, evinfo.evmask); return -1;);
-					continue;
-				default:
-					break;
-			}
-
-			evinfo.seqid_min    = sync_seqid();
-			evinfo.seqid_max    = evinfo.seqid_min;
-			evinfo.objtype_old  = EOT_DOESNTEXIST;
-			evinfo.objtype_new  = node->fts_info==FTS_D ? EOT_DIR : EOT_FILE;
-			evinfo.fsize        = fts_no_stat ? 0 : node->fts_statp->st_size;
-			debug(3, "queueing \"%s\" (depth: %i) with int-flags %p", node->fts_path, node->fts_level, (void *)(unsigned long)evinfo.flags);
-			int _ret = sync_queuesync(path_rel, &evinfo, ctx_p, indexes_p, queue_id);
-
-			if (_ret) {
-				error("Got error while queueing \"%s\".", node->fts_path);
-				ret = errno;
-				goto l_sync_initialsync_walk_end;
-			}
+		if (!(decision & WD_REPORT))
 			continue;
-		}
 
-		/* "FTS optimization" */
-		if (
-			skip_rules					&&
-			node->fts_info == FTS_D				&&
-			!ctx_p->flags[EXCLUDEMOUNTPOINTS]
-		) {
-			debug(4, "\"FTS optimizator\"");
-			fts_set(tree, node, FTS_SKIP);
-		}
+		if ((ret = sync_initialsync_walk_commit(&entry, &arg)))
+			goto l_sync_initialsync_walk_end;
 	}
 	if (errno) {
 		error("Got error while privileged_fts_read() and related routines.");
@@ -1430,7 +2120,7 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 		goto l_sync_initialsync_walk_end;
 	}
 
-	if (privileged_fts_close(tree, PC_SYNC_INIIALSYNC_WALK_FTS_CLOSE)) {
+	if (privileged_fts_close(tree)) {
 		error("Got error while privileged_fts_close().");
 		ret = errno;
 		goto l_sync_initialsync_walk_end;
@@ -1439,6 +2129,7 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 l_sync_initialsync_walk_end:
 	if (path_rel != NULL)
 		free(path_rel);
+	free(walk_states);
 	return ret;
 }
 
@@ -1456,6 +2147,9 @@ const char *sync_parameter_get(const char *variable_name, void *_dosync_arg_p) {
 	if ((ctx_p == NULL || (ctx_p->synchandler_argf & SHFL_EXCLUDE_LIST_PATH)) && !strcmp(variable_name, "EXCLUDE-LIST-PATH"))
 		return dosync_arg_p->excf_path;
 	else
+	if ((ctx_p == NULL || (ctx_p->synchandler_argf & SHFL_FAILED_LIST_PATH)) && !strcmp(variable_name, "FAILED-LIST-PATH"))
+		return dosync_arg_p->failf_path;
+	else
 	if (!strcmp(variable_name, "TYPE"))
 		return dosync_arg_p->list_type_str;
 	else
@@ -1466,7 +2160,7 @@ const char *sync_parameter_get(const char *variable_name, void *_dosync_arg_p) {
 	return NULL;
 }
 
-static char **sync_customargv(ctx_t *ctx_p, struct dosync_arg *dosync_arg_p, synchandler_args_t *args_p) {
+char **sync_customargv(ctx_t *ctx_p, struct dosync_arg *dosync_arg_p, synchandler_args_t *args_p) {
 	int d, s;
 	char **argv = (char **)xcalloc(sizeof(char *), MAXARGUMENTS+2);
 
@@ -1531,7 +2225,7 @@ static char **sync_customargv(ctx_t *ctx_p, struct dosync_arg *dosync_arg_p, syn
 	return argv;
 }
 
-static void argv_free(char **argv) {
+void argv_free(char **argv) {
 	char **argv_p;
 #ifdef _DEBUG_FORCE
 	debug(18, "(%p)", argv);
@@ -1585,7 +2279,7 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 		debug(3, "syncing \"%s\"", path);
 
 		if(ctx_p->flags[HAVERECURSIVESYNC]) {
-			if(ctx_p->flags[MODE] == MODE_SO) {
+			if(ISAPIMODE(ctx_p)) {
 				api_eventinfo_t *ei = (api_eventinfo_t *)xmalloc(sizeof(*ei));
 #ifdef PARANIOD
 				memset(ei, 0, sizeof(*ei));
@@ -1613,6 +2307,7 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 				*dosync_arg.include_list       = path;
 				 dosync_arg.include_list_count = 1;
 				 dosync_arg.list_type_str      = "initialsync";
+				*dosync_arg.failf_path         = 0;
 				char **argv = sync_customargv(ctx_p, &dosync_arg, args_p);
 				ret = SYNC_EXEC_ARGV(
 					ctx_p,
@@ -1644,7 +2339,7 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 		queueinfo_t *queueinfo = &ctx_p->_queues[queue_id];
 
 		if(!queueinfo->stime)
-			queueinfo->stime = time(NULL); // Useful for debugging
+			queueinfo->stime = clock_monotonic_ms(); // Useful for debugging
 
 
 		eventinfo_t *evinfo = (eventinfo_t *)xmalloc(sizeof(*evinfo));
@@ -1709,6 +2404,61 @@ static inline int sync_mark_walk_cluster_modtime_update(ctx_t *ctx_p, const char
 }
 #endif
 
+struct sync_mark_walk_arg {
+	ctx_t		*ctx_p;
+	indexes_t	*indexes_p;
+};
+
+static int sync_mark_walk_filter(walker_entry_t *entry_p, void *_arg_p) {
+	struct sync_mark_walk_arg *arg_p = _arg_p;
+	ctx_t *ctx_p = arg_p->ctx_p;
+
+	if (!S_ISDIR(entry_p->st_mode)) {
+#ifdef CLUSTER_SUPPORT
+		if (ctx_p->cluster_iface)
+			return WD_REPORT;
+#endif
+		return 0;
+	}
+
+	entry_p->perm = rules_search_getperm(entry_p->path_rel, S_IFDIR, ctx_p->rules, RA_WALK, NULL);
+
+	if (!(entry_p->perm&RA_WALK)) {
+#ifdef CLUSTER_SUPPORT
+		if (ctx_p->cluster_iface)
+			return WD_REPORT;
+#endif
+		return 0;
+	}
+
+	return WD_REPORT|WD_DESCEND;
+}
+
+static int sync_mark_walk_commit(walker_entry_t *entry_p, void *_arg_p) {
+	struct sync_mark_walk_arg *arg_p = _arg_p;
+	ctx_t *ctx_p = arg_p->ctx_p;
+	int isdir = S_ISDIR(entry_p->st_mode);
+
+#ifdef CLUSTER_SUPPORT
+	int ret;
+	if ((ret=sync_mark_walk_cluster_modtime_update(ctx_p, entry_p->path, entry_p->level, isdir ? S_IFDIR : S_IFREG)))
+		return ret;
+#endif
+
+	if (!isdir || !(entry_p->perm&RA_WALK))
+		return 0;
+
+	debug(2, "marking \"%s\" (depth %u)", entry_p->path, entry_p->level);
+	int wd = sync_notify_mark(ctx_p, entry_p->path, entry_p->path, entry_p->path_len, arg_p->indexes_p);
+	if (wd == -1) {
+		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while notify-marking \"%s\".", entry_p->path);
+		return errno ? errno : EINVAL;
+	}
+	debug(2, "watching descriptor is %i.", wd);
+
+	return 0;
+}
+
 int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p) {
 	int ret = 0;
 	const char *rootpaths[] = {dirpath, NULL};
@@ -1716,21 +2466,46 @@ int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p) {
 	rule_t *rules_p = ctx_p->rules;
 	debug(2, "(ctx_p, \"%s\", indexes_p).", dirpath);
 
+#ifdef FANOTIFY_SUPPORT
+	// The whole filesystem is marked at once (see fanotify_init_engine()), there's nothing to walk
+	if (ctx_p->flags[MONITOR] == NE_FANOTIFY) {
+		if (strcmp(dirpath, ctx_p->watchdir))
+			return 0;
+
+		if (sync_notify_mark(ctx_p, dirpath, dirpath, ctx_p->watchdirlen, indexes_p) == -1)
+			return errno;
+
+		return 0;
+	}
+#endif
+
+	// Only the whole tree is walked in parallel, see sync_initialsync_walk()
+	if (sync_walker_threads(ctx_p) && !strcmp(dirpath, ctx_p->watchdir)) {
+		struct sync_mark_walk_arg arg = {ctx_p, indexes_p};
+
+		ret = walker_walk(dirpath, sync_walker_path_rel_off(ctx_p), ctx_p->flags[ONEFILESYSTEM] ? WF_XDEV : 0, sync_walker_threads(ctx_p), sync_mark_walk_filter, sync_mark_walk_commit, &arg);
+		if (ret)
+			error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while walking \"%s\".", dirpath);
+		return ret;
+	}
+
 	int fts_opts = FTS_NOCHDIR|FTS_PHYSICAL|FTS_NOSTAT|(ctx_p->flags[ONEFILESYSTEM]?FTS_XDEV:0);
 
         debug(3, "fts_opts == %p", (void *)(long)fts_opts);
-	tree = privileged_fts_open((char *const *)rootpaths, fts_opts, NULL, PC_SYNC_MARK_WALK_FTS_OPEN);
+	tree = privileged_fts_open((char *const *)rootpaths, fts_opts, NULL);
 
 	if (tree == NULL) {
 		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Cannot privileged_fts_open() on \"%s\".", dirpath);
 		return errno;
 	}
 
+	sync_fts_premark(ctx_p, tree);
+
 	FTSENT *node;
 	char  *path_rel		= NULL;
 	size_t path_rel_len	= 0;
 
-	while ((node = privileged_fts_read(tree, PC_SYNC_MARK_WALK_FTS_READ))) {
+	while ((node = privileged_fts_read(tree))) {
 #ifdef CLUSTER_SUPPORT
 		int ret;
 #endif
@@ -1782,7 +2557,7 @@ int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p) {
 		ruleaction_t perm = rules_search_getperm(path_rel, S_IFDIR, rules_p, RA_WALK, NULL);
 
 		if (!(perm&RA_WALK)) {
-			fts_set(tree, node, FTS_SKIP);
+			privileged_fts_set(tree, node, FTS_SKIP);
 			continue;
 		}
 
@@ -1801,7 +2576,7 @@ int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p) {
 		goto l_sync_mark_walk_end;
 	}
 
-	if (privileged_fts_close(tree, PC_SYNC_MARK_WALK_FTS_CLOSE)) {
+	if (privileged_fts_close(tree)) {
 		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_close().");
 		ret = errno;
 		goto l_sync_mark_walk_end;
@@ -1817,9 +2592,9 @@ int sync_notify_init(ctx_t *ctx_p) {
 	switch (ctx_p->flags[MONITOR]) {
 #ifdef FANOTIFY_SUPPORT
 		case NE_FANOTIFY: {
-			ctx_p->fsmondata = (long)fanotify_init(FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
-			if((long)ctx_p->fsmondata == -1) {
-				error("cannot fanotify_init(%i, %i).", FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
+			int fanotify_d = fanotify_init_engine(ctx_p);
+			if (fanotify_d == -1) {
+				error("cannot fanotify_init_engine(ctx_p).");
 				return -1;
 			}
 
@@ -1833,6 +2608,9 @@ int sync_notify_init(ctx_t *ctx_p) {
 #  if INOTIFY_FLAGS != 0
 #   warning Do not know how to set inotify flags (too old system)
 #  endif
+			// inotify_handle() drains the queue until EAGAIN
+			if ((long)ctx_p->fsmondata != -1)
+				fcntl((int)(long)ctx_p->fsmondata, F_SETFL, O_NONBLOCK);
 # else
 			ctx_p->fsmondata = (void *)(long)inotify_init1(INOTIFY_FLAGS);
 # endif
@@ -1841,6 +2619,9 @@ int sync_notify_init(ctx_t *ctx_p) {
 				return -1;
 			}
 
+			if (ctx_p->flags[READERTHREAD])
+				return inotify_reader_start(ctx_p);
+
 			return 0;
 		}
 #endif
@@ -1889,6 +2670,7 @@ static inline int sync_dosync_exec(ctx_t *ctx_p, indexes_t *indexes_p, const cha
 	 dosync_arg.include_list_count = 1;
 	 dosync_arg.list_type_str      = "sync";
 	 dosync_arg.evmask_str         = evmask_str;
+	*dosync_arg.failf_path         = 0;	// only collected events can be retried partially
 
 	char **argv = sync_customargv(ctx_p, &dosync_arg, &ctx_p->synchandler_args[SHARGS_PRIMARY]);
 	rc = SYNC_EXEC_ARGV(
@@ -1942,8 +2724,7 @@ int fileischanged(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_rel, stat
 
 		if (is_deleted) {
 			debug(8, "Modification signature: Deleting information about \"%s\"", path_rel);
-			indexes_fileinfo_add(indexes_p, path_rel, NULL);
-			free(finfo);
+			indexes_fileinfo_remove(indexes_p, path_rel);
 		} else {
 			debug(8, "Modification signature: Updating information about \"%s\"", path_rel);
 			memcpy(&finfo->lstat, lstat_p, sizeof(finfo->lstat));
@@ -2071,83 +2852,340 @@ int sync_prequeue_loadmark
 		if (is_deleted) {
 			debug(2, "Disappeared \".../%s\".", path_rel);
 		}
-	}
+	}
+
+	if (!(perm&RA_WALK)) {
+		return 0;
+	}
+
+	if (!fileischanged(ctx_p, indexes_p, path_rel, lstat_p, is_deleted)) {
+		debug(4, "The file is not changed. Returning.");
+		return 0;
+	}
+
+	switch (ctx_p->flags[MODE]) {
+		case MODE_SIMPLE:
+			return SAFE(sync_dosync(path_rel, event_mask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", path_rel, event_mask); return -1;);
+		default:
+			break;
+	}
+
+	// Locally queueing the event
+
+	int isnew = 0;
+	// The object wasn't lstat()-ed by the monitor, it will be done once on sync_prequeue_unload()
+	char statpending = monitored && (lstat_p == NULL) && ctx_p->stat_deferred && (objtype_new == EOT_FILE);
+
+	if (evinfo == NULL)
+		evinfo = indexes_fpath2ei(indexes_p, path_rel);
+	else
+		isnew++;	// It's new for prequeue (but old for lockwait queue)
+
+	if (evinfo == NULL) {
+		evinfo = (eventinfo_t *)xmalloc(sizeof(*evinfo));
+		memset(evinfo, 0, sizeof(*evinfo));
+		evinfo->fsize        = st_size;
+		evinfo->wd           = event_wd;
+		evinfo->seqid_min    = sync_seqid();
+		evinfo->seqid_max    = evinfo->seqid_min;
+		evinfo->objtype_old  = objtype_old;
+		evinfo->statpending  = statpending;
+		isnew++;
+		debug(3, "new event: fsize == %i; wd == %i", evinfo->fsize, evinfo->wd);
+	} else {
+		evinfo->seqid_max    = sync_seqid();
+		evinfo->statpending &= statpending;	// Already known as changed if there was a real lstat()
+	}
+
+	switch(ctx_p->flags[MONITOR]) {
+#ifdef KQUEUE_SUPPORT
+		case NE_KQUEUE:
+#endif
+#ifdef INOTIFY_SUPPORT
+		case NE_INOTIFY:
+#endif
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
+#endif
+#if KQUEUE_SUPPORT | INOTIFY_SUPPORT | FANOTIFY_SUPPORT
+			evinfo->evmask |= event_mask;
+			break;
+#endif
+#ifdef BSM_SUPPORT
+		case NE_BSM:
+		case NE_BSM_PREFETCH:
+			evinfo->evmask  = event_mask;
+			break;
+#endif
+#ifdef GIO_SUPPORT
+		case NE_GIO:
+			evinfo->evmask  = event_mask;
+			break;
+#endif
+	}
+
+	evinfo->objtype_new = objtype_new;
+
+	debug(2, "path_rel == \"%s\"; evinfo->objtype_old == %i; evinfo->objtype_new == %i; "
+		 "evinfo->seqid_min == %u; evinfo->seqid_max == %u", 
+		 path_rel, evinfo->objtype_old, evinfo->objtype_new,
+		 evinfo->seqid_min, evinfo->seqid_max
+	     );
+
+	if (isnew)
+		indexes_fpath2ei_add(indexes_p, strdup(path_rel), evinfo);
+
+	return 0;
+}
+
+/**
+ * @brief 			Rescans the watched tree after a monitor queue overflow (some events are lost)
+ *
+ * @param[in] 	ctx_p		Pointer to the context
+ * @param[in] 	indexes_p	Pointer to the indexes
+ * @param[in] 	since		Events could be lost since this time (the monitor queue was empty at this moment)
+ *
+ * @retval	zero		On success
+ * @retval	non-zero	On error (see errno)
+ *
+ */
+// Only changed objects are loaded to the prequeue: if there's a remembered modification
+// signature (see "--modification-signature") it's checked by fileischanged(), otherwise
+// the object is considered as changed if it's ctime is not older than "since".
+//
+// Directory ctime cannot be used to prune the walk: writing into an existing file doesn't
+// change ctime of it's parent directory. So every object is lstat()-ed, but only changes
+// are synced. New directories are marked on the way.
+//
+// Deletions leave no trace to walk over, so after the walk the indexed objects (wd-s and
+// modification signatures) that weren't met are checked: the disappeared ones are queued as
+// deleted and forgotten.
+
+struct sync_rescan_arg {
+	ctx_t      *ctx_p;
+	GHashTable *seen_ht;
+	GSList     *stale;
+	int         isfull;
+};
+
+// Remembers an indexed object met by the walk
+static inline void sync_rescan_see(indexes_t *indexes_p, GHashTable *seen_ht, const char *path_full, const char *path_rel) {
+	if (indexes_fpath2wd(indexes_p, path_full) == -1 && indexes_fileinfo(indexes_p, path_rel) == NULL)
+		return;
+
+	g_hash_table_replace(seen_ht, strdup(path_rel), GINT_TO_POINTER(1));
+	return;
+}
+
+// Collects the indexed paths, that weren't met by the walk (the deepest ones go first)
+static void sync_rescan_collectstale(gpointer path_gp, gpointer value_gp, gpointer arg_gp) {
+	struct sync_rescan_arg *arg_p = arg_gp;
+	char *path_rel;
+
+	if (arg_p->isfull)
+		path_rel = sync_path_abs2rel(arg_p->ctx_p, path_gp, -1, NULL, NULL);
+	else
+		path_rel = strdup(path_gp);
+
+	if (*path_rel == 0 || g_hash_table_lookup(arg_p->seen_ht, path_rel) != NULL) {
+		free(path_rel);
+		return;
+	}
+
+	arg_p->stale = g_slist_prepend(arg_p->stale, path_rel);
+	return;
+}
+
+// Queues the disappeared objects as deleted and forgets them
+static int sync_rescan_forgetstale(ctx_t *ctx_p, indexes_t *indexes_p, GSList *stale, int isdir, char **path_buf_p, size_t *path_buf_len_p, unsigned long *deleted_p) {
+	int ret = 0;
+
+	while (stale != NULL) {
+		const char *path_rel = stale->data;
+		stat64_t st;
+		mode_t st_mode = S_IFDIR;
+		int wd = -1;
+
+		stale = g_slist_next(stale);
+
+		char *path_full = sync_path_rel2abs(ctx_p, path_rel, -1, NULL, NULL);
+
+		if (!lstat64(path_full, &st) || errno != ENOENT) {
+			debug(3, "\"%s\" is still there, it just wasn't walked.", path_full);
+			free(path_full);
+			continue;
+		}
+
+		if (isdir) {
+			wd = indexes_fpath2wd(indexes_p, path_full);
+			if (wd == -1) {
+				free(path_full);
+				continue;
+			}
+			indexes_remove_bywd(indexes_p, wd);
+		} else {
+			fileinfo_t *finfo = indexes_fileinfo(indexes_p, path_rel);
+			if (finfo == NULL) {
+				free(path_full);
+				continue;
+			}
+			st_mode = finfo->lstat.st_mode;
+			indexes_fileinfo_remove(indexes_p, path_rel);
+		}
+
+		debug(2, "\"%s\" was deleted while the events were lost.", path_full);
+
+		eventinfo_t evinfo = {0};
+		evinfo_deletedevmask(ctx_p, &evinfo, S_ISDIR(st_mode));
+
+		eventobjtype_t objtype = S_ISDIR(st_mode) ? EOT_DIR : EOT_FILE;
+		if (sync_prequeue_loadmark(0, ctx_p, indexes_p, path_full, path_rel, NULL, objtype, EOT_DOESNTEXIST, evinfo.evmask, wd, st_mode, 0, path_buf_p, path_buf_len_p, NULL)) {
+			ret = errno ? errno : -1;
+			free(path_full);
+			break;
+		}
+		(*deleted_p)++;
+		free(path_full);
+	}
+
+	return ret;
+}
+
+int sync_rescan(ctx_t *ctx_p, indexes_t *indexes_p, time_t since) {
+	int ret = 0;
+	const char *rootpaths[] = {ctx_p->watchdir, NULL};
+	FTS *tree;
+	FTSENT *node;
+	char  *path_rel		= NULL;
+	size_t path_rel_len	= 0;
+	char  *path_buf		= NULL;
+	size_t path_buf_len	= 0;
+	unsigned long scanned = 0, changed = 0, deleted = 0;
+	GHashTable *seen_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+	struct sync_rescan_arg arg = {ctx_p, seen_ht, NULL, 1};
+
+	warning("Rescanning \"%s\" for changes since %li (some events are lost).", ctx_p->watchdir, (long)since);
+
+	int fts_opts = FTS_NOCHDIR|FTS_PHYSICAL|(ctx_p->flags[ONEFILESYSTEM]?FTS_XDEV:0);
+
+	tree = privileged_fts_open((char *const *)rootpaths, fts_opts, NULL);
+	if (tree == NULL) {
+		error("Cannot privileged_fts_open() on \"%s\".", ctx_p->watchdir);
+		g_hash_table_destroy(seen_ht);
+		return errno;
+	}
+
+	sync_fts_premark(ctx_p, tree);
+
+	while ((node = privileged_fts_read(tree))) {
+		int is_dir;
+
+		switch (node->fts_info) {
+			// Duplicates:
+			case FTS_DP:
+				continue;
+			case FTS_DEFAULT:
+			case FTS_SL:
+			case FTS_SLNONE:
+			case FTS_F:
+				is_dir = 0;
+				break;
+			case FTS_D:
+			case FTS_DC:
+			case FTS_DOT:
+				is_dir = 1;
+				break;
+			// Error cases:
+			case FTS_ERR:
+			case FTS_NS:
+			case FTS_DNR:
+				if (node->fts_errno == ENOENT) {
+					debug(1, "Got error while privileged_fts_read(): %s (fts_info: %i).", strerror(node->fts_errno), node->fts_info);
+					continue;
+				}
+				error("Got error while privileged_fts_read(): %s (fts_info: %i).", strerror(node->fts_errno), node->fts_info);
+				ret = node->fts_errno;
+				goto l_sync_rescan_end;
+			default:
+				error("Got unknown fts_info vlaue while privileged_fts_read(): %i.", node->fts_info);
+				ret = EINVAL;
+				goto l_sync_rescan_end;
+		}
+		scanned++;
 
-	if (!(perm&RA_WALK)) {
-		return 0;
-	}
+		stat64_t st, *st_p = &st;
+		stat2stat64(st_p, node->fts_statp);
+		path_rel = sync_path_abs2rel(ctx_p, node->fts_path, -1, &path_rel_len, path_rel);
+		sync_rescan_see(indexes_p, seen_ht, node->fts_path, path_rel);
 
-	if (!fileischanged(ctx_p, indexes_p, path_rel, lstat_p, is_deleted)) {
-		debug(4, "The file is not changed. Returning.");
-		return 0;
-	}
+		ruleaction_t perm = rules_getperm(path_rel, st_p->st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+		if (!(perm&RA_WALK)) {
+			if (is_dir)
+				privileged_fts_set(tree, node, FTS_SKIP);
+			continue;
+		}
 
-	switch (ctx_p->flags[MODE]) {
-		case MODE_SIMPLE:
-			return SAFE(sync_dosync(path_rel, event_mask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", path_rel, event_mask); return -1;);
-		default:
-			break;
-	}
+		if (is_dir && ctx_p->flags[MONITOR] != NE_FANOTIFY && indexes_fpath2wd(indexes_p, node->fts_path) == -1) {
+			debug(2, "marking new directory \"%s\"", node->fts_path);
+			if (sync_notify_mark(ctx_p, node->fts_accpath, node->fts_path, node->fts_pathlen, indexes_p) == -1) {
+				error("Got error while notify-marking \"%s\".", node->fts_path);
+				ret = errno;
+				goto l_sync_rescan_end;
+			}
+		}
 
-	// Locally queueing the event
+		if (!(perm&RA_MONITOR))
+			continue;
 
-	int isnew = 0;
+		if (!(ctx_p->flags[MODSIGN] && indexes_fileinfo(indexes_p, path_rel) != NULL))
+			if (st_p->st_ctime < since)
+				continue;
 
-	if (evinfo == NULL)
-		evinfo = indexes_fpath2ei(indexes_p, path_rel);
-	else
-		isnew++;	// It's new for prequeue (but old for lockwait queue)
+		eventinfo_t evinfo = {0};
+		evinfo_initialevmask(ctx_p, &evinfo, is_dir);
 
-	if (evinfo == NULL) {
-		evinfo = (eventinfo_t *)xmalloc(sizeof(*evinfo));
-		memset(evinfo, 0, sizeof(*evinfo));
-		evinfo->fsize        = st_size;
-		evinfo->wd           = event_wd;
-		evinfo->seqid_min    = sync_seqid();
-		evinfo->seqid_max    = evinfo->seqid_min;
-		evinfo->objtype_old  = objtype_old;
-		isnew++;
-		debug(3, "new event: fsize == %i; wd == %i", evinfo->fsize, evinfo->wd);
-	} else {
-		evinfo->seqid_max    = sync_seqid();
+		eventobjtype_t objtype = is_dir ? EOT_DIR : EOT_FILE;
+		if (sync_prequeue_loadmark(0, ctx_p, indexes_p, node->fts_path, path_rel, st_p, objtype, objtype, evinfo.evmask, -1, st_p->st_mode, st_p->st_size, &path_buf, &path_buf_len, NULL)) {
+			ret = errno ? errno : -1;
+			goto l_sync_rescan_end;
+		}
+		changed++;
 	}
-
-	switch(ctx_p->flags[MONITOR]) {
-#ifdef KQUEUE_SUPPORT
-		case NE_KQUEUE:
-#endif
-#ifdef INOTIFY_SUPPORT
-		case NE_INOTIFY:
-#endif
-#if KQUEUE_SUPPORT | INOTIFY_SUPPORT
-			evinfo->evmask |= event_mask;
-			break;
-#endif
-#ifdef BSM_SUPPORT
-		case NE_BSM:
-		case NE_BSM_PREFETCH:
-			evinfo->evmask  = event_mask;
-			break;
-#endif
-#ifdef GIO_SUPPORT
-		case NE_GIO:
-			evinfo->evmask  = event_mask;
-			break;
-#endif
+	if (errno) {
+		error("Got error while privileged_fts_read() and related routines.");
+		ret = errno;
+		goto l_sync_rescan_end;
 	}
 
-	evinfo->objtype_new = objtype_new;
+	// Directories are before files to forget their wd-s even if there're no modification signatures
+	if (ctx_p->flags[MONITOR] != NE_FANOTIFY) {
+		fpathtree_foreach(indexes_p->wd_tree, ctx_p->watchdir, sync_rescan_collectstale, &arg);
+		ret = sync_rescan_forgetstale(ctx_p, indexes_p, arg.stale, 1, &path_buf, &path_buf_len, &deleted);
+		g_slist_free_full(arg.stale, free);
+		arg.stale = NULL;
+		if (ret)
+			goto l_sync_rescan_end;
+	}
 
-	debug(2, "path_rel == \"%s\"; evinfo->objtype_old == %i; evinfo->objtype_new == %i; "
-		 "evinfo->seqid_min == %u; evinfo->seqid_max == %u", 
-		 path_rel, evinfo->objtype_old, evinfo->objtype_new,
-		 evinfo->seqid_min, evinfo->seqid_max
-	     );
+	arg.isfull = 0;
+	fpathtree_foreach(indexes_p->fileinfo_tree, "", sync_rescan_collectstale, &arg);
+	ret = sync_rescan_forgetstale(ctx_p, indexes_p, arg.stale, 0, &path_buf, &path_buf_len, &deleted);
+	g_slist_free_full(arg.stale, free);
+	if (ret)
+		goto l_sync_rescan_end;
 
-	if (isnew)
-		indexes_fpath2ei_add(indexes_p, strdup(path_rel), evinfo);
+	debug(1, "Rescanned %lu objects, %lu of them are probably changed, %lu are deleted.", scanned, changed, deleted);
 
-	return 0;
+l_sync_rescan_end:
+	if (privileged_fts_close(tree)) {
+		error("Got error while privileged_fts_close().");
+		if (!ret)
+			ret = errno;
+	}
+	free(path_rel);
+	free(path_buf);
+	g_hash_table_destroy(seen_ht);
+	return ret;
 }
 
 void _sync_idle_dosync_collectedexcludes(gpointer fpath_gp, gpointer flags_gp, gpointer arg_gp) {
@@ -2161,54 +3199,48 @@ void _sync_idle_dosync_collectedexcludes(gpointer fpath_gp, gpointer flags_gp, g
 	return;
 }
 
-// Is not a thread-save function!
-eventinfo_t *ht_fpath_isincluded(GHashTable *ht, const char *const fpath) {
-	static char buf[PATH_MAX+2]={0};
-	char *ptr, *end;
-	eventinfo_t *evinfo = g_hash_table_lookup(ht, fpath);
-	debug(5, "looking up for \"%s\": %p", fpath, evinfo);
-	if (evinfo != NULL)
-		return evinfo;
-
-	if (!*fpath)
-		return NULL;
+struct fpath_isincluded_arg {
+	size_t		 parent_len;
+	eventinfo_t	*evinfo;
+};
 
-	evinfo = g_hash_table_lookup(ht, "");
+static int _fpath_isincluded(size_t prefix_len, gpointer evinfo_gp, gpointer arg_gp) {
+	eventinfo_t *evinfo = evinfo_gp;
+	struct fpath_isincluded_arg *arg_p = arg_gp;
 
-	if (evinfo != NULL) {
-		debug(5, "recursive looking up for \"\": %p (%x: recusively: %x)", evinfo, evinfo->flags, evinfo->flags & EVIF_RECURSIVELY);
-		if (evinfo->flags & EVIF_RECURSIVELY)
-			return evinfo;
+	debug(5, "recursive looking up for prefix of length %u: %p (%x: recusively: %x)", prefix_len, evinfo, evinfo->flags, evinfo->flags & EVIF_RECURSIVELY);
+	if (evinfo->flags & EVIF_RECURSIVELY) {
+		arg_p->evinfo = evinfo;
+		return 1;
 	}
 
-	size_t fpath_len = strlen(fpath);
-	memcpy(buf, fpath, fpath_len+1);
-	ptr  =  buf;
-	end  = &buf[fpath_len];
-
-	while(ptr < end) {
-		if (*ptr == '/') {
-			*ptr = 0;
-			evinfo = g_hash_table_lookup(ht, buf);
-
-			if (evinfo != NULL) {
-				debug(5, "recursive looking up for \"%s\": %p (%x: recusively: %x)", buf, evinfo, evinfo->flags, evinfo->flags & EVIF_RECURSIVELY);
-				*ptr = '/';
-				if (evinfo->flags & EVIF_RECURSIVELY)
-					return evinfo;
-			}
-		}
+	// A non-recursive event of the parent dir includes the path, too
+	if (prefix_len == arg_p->parent_len)
+		arg_p->evinfo = evinfo;
 
-		ptr++;
-	}
+	return 0;
+}
+
+eventinfo_t *fpath_isincluded(fpathtree_t *tree_p, const char *const fpath) {
+	struct fpath_isincluded_arg arg;
+	eventinfo_t *evinfo = fpathtree_lookup(tree_p, fpath);
+	debug(5, "looking up for \"%s\": %p", fpath, evinfo);
+	if (evinfo != NULL)
+		return evinfo;
+
+	const char *parent_end = strrchr(fpath, '/');
+	arg.parent_len = parent_end == NULL ? 0 : parent_end - fpath;
+	arg.evinfo     = NULL;
 
-	return evinfo;
+	fpathtree_foreach_ancestor(tree_p, fpath, _fpath_isincluded, &arg);
+
+	return arg.evinfo;
 }
 
 int _sync_islocked(threadinfo_t *threadinfo_p, void *_fpath) {
 	char *fpath = _fpath;
 
-	eventinfo_t *evinfo = ht_fpath_isincluded(threadinfo_p->fpath2ei_ht, fpath);
+	eventinfo_t *evinfo = fpath_isincluded(threadinfo_p->fpath2ei_tree, fpath);
 	debug(4, "scanning thread %p: fpath<%s> -> evinfo<%p>", threadinfo_p->pthread, fpath, evinfo);
 	if (evinfo != NULL)
 		return 1;
@@ -2243,7 +3275,7 @@ void _sync_idle_dosync_collectedevents(gpointer fpath_gp, gpointer evinfo_gp, gp
 			return;
 		}
 
-	if ((ctx_p->listoutdir == NULL) && (!(ctx_p->synchandler_argf & SHFL_INCLUDE_LIST)) && (!(ctx_p->flags[MODE]==MODE_SO))) {
+	if ((ctx_p->listoutdir == NULL) && (!(ctx_p->synchandler_argf & SHFL_INCLUDE_LIST)) && (!ISAPIMODE(ctx_p))) {
 		debug(3, "calling sync_dosync()");
 		SAFE(sync_dosync(fpath, evinfo->evmask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", fpath, evinfo->evmask); exit(errno ? errno : -1));	// TODO: remove exit() from here
 		return;
@@ -2264,6 +3296,7 @@ void _sync_idle_dosync_collectedevents(gpointer fpath_gp, gpointer evinfo_gp, gp
 		evinfo_idx->objtype_new  = evinfo->objtype_new;
 		evinfo_idx->seqid_min    = evinfo->seqid_min;
 		evinfo_idx->seqid_max    = evinfo->seqid_max;
+		evinfo_idx->try_n        = evinfo->try_n;
 	} else
 		evinfo_merge(ctx_p, evinfo_idx, evinfo);
 
@@ -2343,6 +3376,14 @@ int sync_idle_dosync_collectedevents_cleanup(ctx_t *ctx_p, thread_callbackfunct_
 		free(arg_p->incfpath);
 	}
 
+	if (arg_p->failfpath != NULL) {
+		// The sync-handler creates the file only if there're failed paths
+		debug(3, "unlink()-ing failed-list file: \"%s\"", arg_p->failfpath);
+		if (unlink(arg_p->failfpath) && (errno != ENOENT) && !ret1)
+			ret1 = errno;
+		free(arg_p->failfpath);
+	}
+
 	free(arg_p);
 	return ret0 ? ret0 : ret1;
 }
@@ -2358,11 +3399,229 @@ void sync_queuesync_wrapper(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_
 	return;
 }
 
+// === SYNC_PREQUEUE_STAT() === {
+
+struct prequeue_stat_item {
+	char		*path_rel;
+	char		*path_full;
+	size_t		 path_full_len;
+	eventinfo_t	*evinfo;
+	int		 rc;		// 0 or -errno
+	stat64_t	 st;
+#ifdef STATX_BASIC_STATS
+	struct statx	 stx;
+#endif
+};
+
+static struct prequeue_stat_item *prequeue_stat_items      = NULL;
+static size_t                     prequeue_stat_items_size = 0;
+
+#ifdef IOURING_SUPPORT
+static struct io_uring prequeue_stat_ring;
+static int             prequeue_stat_ring_initialized = 0;
+#endif
+
+static int sync_prequeue_stat_init(ctx_t *ctx_p) {
+#ifdef IOURING_SUPPORT
+	int rc;
+
+	if (!ctx_p->stat_deferred)
+		return 0;
+
+	// io_uring operations don't pass through the seccomp filter, so the ring
+	// is created disabled and is allowed to do nothing but statx() before
+	// it is enabled. No register operations are allowed afterwards as well.
+	rc = io_uring_queue_init(IOURING_ENTRIES, &prequeue_stat_ring, IORING_SETUP_R_DISABLED);
+	if (rc < 0) {
+		errno = -rc;
+		warning("Cannot io_uring_queue_init(%u, ...). Falling back to a statx() per path.", IOURING_ENTRIES);
+		errno = 0;
+		return 0;
+	}
+
+	{
+		struct io_uring_restriction restriction;
+
+		memset(&restriction, 0, sizeof(restriction));
+		restriction.opcode = IORING_RESTRICTION_SQE_OP;
+		restriction.sqe_op = IORING_OP_STATX;
+
+		if ((rc = io_uring_register_restrictions(&prequeue_stat_ring, &restriction, 1)) < 0) {
+			errno = -rc;
+			warning("Cannot io_uring_register_restrictions(). Falling back to a statx() per path.");
+			goto l_sync_prequeue_stat_init_fallback;
+		}
+
+		if ((rc = io_uring_enable_rings(&prequeue_stat_ring)) < 0) {
+			errno = -rc;
+			warning("Cannot io_uring_enable_rings(). Falling back to a statx() per path.");
+			goto l_sync_prequeue_stat_init_fallback;
+		}
+	}
+
+	prequeue_stat_ring_initialized = 1;
+	return 0;
+
+l_sync_prequeue_stat_init_fallback:
+	io_uring_queue_exit(&prequeue_stat_ring);
+	errno = 0;
+#endif
+	return 0;
+}
+
+static void sync_prequeue_stat_deinit() {
+	size_t i = 0;
+	while (i < prequeue_stat_items_size)
+		free(prequeue_stat_items[i++].path_full);
+
+	free(prequeue_stat_items);
+	prequeue_stat_items      = NULL;
+	prequeue_stat_items_size = 0;
+
+#ifdef IOURING_SUPPORT
+	if (prequeue_stat_ring_initialized)
+		io_uring_queue_exit(&prequeue_stat_ring);
+	prequeue_stat_ring_initialized = 0;
+#endif
+	return;
+}
+
+static inline void sync_prequeue_stat_item(struct prequeue_stat_item *item_p, uint32_t stat_fields) {
+	item_p->rc = lstat64_fields(item_p->path_full, &item_p->st, stat_fields) ? -errno : 0;
+	return;
+}
+
+#ifdef IOURING_SUPPORT
+// Submits the whole batch to io_uring at once. Returns the number of completed items.
+static size_t sync_prequeue_stat_uring(struct prequeue_stat_item *items, size_t items_count, uint32_t stat_fields) {
+	unsigned int mask = stat_fields2statxmask(stat_fields);
+	size_t done = 0;
+
+	while (done < items_count) {
+		size_t queued = 0;
+
+		while (done + queued < items_count) {
+			struct prequeue_stat_item *item_p = &items[done + queued];
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&prequeue_stat_ring);
+			if (sqe == NULL)
+				break;
+
+			io_uring_prep_statx(sqe, AT_FDCWD, item_p->path_full, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC, mask, &item_p->stx);
+			io_uring_sqe_set_data(sqe, item_p);
+			queued++;
+		}
+
+		int rc = io_uring_submit_and_wait(&prequeue_stat_ring, queued);
+		if (rc < 0) {
+			errno = -rc;
+			error("Got error from io_uring_submit_and_wait().");
+			return done;
+		}
+
+		while (queued--) {
+			struct io_uring_cqe *cqe;
+			struct prequeue_stat_item *item_p;
+
+			rc = io_uring_wait_cqe(&prequeue_stat_ring, &cqe);
+			if (rc < 0) {
+				errno = -rc;
+				error("Got error from io_uring_wait_cqe().");
+				return done;
+			}
+
+			item_p = io_uring_cqe_get_data(cqe);
+			item_p->rc = cqe->res;
+			io_uring_cqe_seen(&prequeue_stat_ring, cqe);
+
+			if (item_p->rc == -EINVAL)	// IORING_OP_STATX is not supported by the kernel
+				sync_prequeue_stat_item(item_p, stat_fields);
+			else
+			if (!item_p->rc)
+				statx2stat64(&item_p->st, &item_p->stx);
+
+			done++;
+		}
+	}
+
+	return done;
+}
+#endif
+
+// lstat()-s every path that is marked by "statpending" in the prequeue (once per path)
+// and drops the paths that are not changed according to "--modification-signature"
+static int sync_prequeue_stat(ctx_t *ctx_p, indexes_t *indexes_p) {
+	GHashTableIter iter;
+	gpointer key, value;
+	size_t items_count = 0, i;
+	uint32_t stat_fields;
+
+	if (!ctx_p->stat_deferred)
+		return 0;
+
+	g_hash_table_iter_init(&iter, indexes_p->fpath2ei_ht);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct prequeue_stat_item *item_p;
+		eventinfo_t *evinfo = value;
+
+		if (!evinfo->statpending)
+			continue;
+		evinfo->statpending = 0;
+
+		if (items_count >= prequeue_stat_items_size) {
+			prequeue_stat_items = xrealloc(prequeue_stat_items, (prequeue_stat_items_size+ALLOC_PORTION) * sizeof(*prequeue_stat_items));
+			memset(&prequeue_stat_items[prequeue_stat_items_size], 0, ALLOC_PORTION * sizeof(*prequeue_stat_items));
+			prequeue_stat_items_size += ALLOC_PORTION;
+		}
+
+		item_p = &prequeue_stat_items[items_count++];
+		item_p->path_rel  = key;
+		item_p->evinfo    = evinfo;
+		item_p->path_full = sync_path_rel2abs(ctx_p, key, -1, &item_p->path_full_len, item_p->path_full);
+	}
+
+	if (!items_count)
+		return 0;
+
+	debug(3, "lstat()-ing %u paths.", items_count);
+
+	stat_fields = ctx_p->flags[MODSIGN];
+	i = 0;
+#ifdef IOURING_SUPPORT
+	if (prequeue_stat_ring_initialized)
+		i = sync_prequeue_stat_uring(prequeue_stat_items, items_count, stat_fields);
+#endif
+	while (i < items_count)
+		sync_prequeue_stat_item(&prequeue_stat_items[i++], stat_fields);
+
+	i = 0;
+	while (i < items_count) {
+		struct prequeue_stat_item *item_p = &prequeue_stat_items[i++];
+
+		if (item_p->rc) {
+			debug(2, "Cannot lstat64(\"%s\", lstat): %s. Seems, that the object had been deleted.", item_p->path_full, strerror(-item_p->rc));
+			continue;
+		}
+
+		item_p->evinfo->fsize = item_p->st.st_size;
+
+		if (!fileischanged(ctx_p, indexes_p, item_p->path_rel, &item_p->st, 0)) {
+			debug(4, "The file \"%s\" is not changed. Dropping the event.", item_p->path_rel);
+			g_hash_table_remove(indexes_p->fpath2ei_ht, item_p->path_rel);
+		}
+	}
+
+	return 0;
+}
+
+// } === SYNC_PREQUEUE_STAT() ===
+
 int sync_prequeue_unload(ctx_t *ctx_p, indexes_t *indexes_p) {
 	struct dosync_arg dosync_arg;
 	dosync_arg.ctx_p 	= ctx_p;
 	dosync_arg.indexes_p	= indexes_p;
 
+	sync_prequeue_stat(ctx_p, indexes_p);
+
 	debug(3, "collected %i events per this time.", g_hash_table_size(indexes_p->fpath2ei_ht));
 
 	g_hash_table_foreach(indexes_p->fpath2ei_ht, sync_queuesync_wrapper, &dosync_arg);
@@ -2372,12 +3631,12 @@ int sync_prequeue_unload(ctx_t *ctx_p, indexes_t *indexes_p) {
 }
 
 int sync_idle_dosync_collectedevents_aggrqueue(queue_id_t queue_id, ctx_t *ctx_p, indexes_t *indexes_p, struct dosync_arg *dosync_arg) {
-	time_t tm = time(NULL);
+	uint64_t tm = clock_monotonic_ms();
 
 	queueinfo_t *queueinfo = &ctx_p->_queues[queue_id];
 
 	if ((queueinfo->stime + queueinfo->collectdelay > tm) && (queueinfo->collectdelay != COLLECTDELAY_INSTANT) && (!ctx_p->flags[EXITONNOEVENTS])) {
-		debug(3, "(%i, ...): too early (%i + %i > %i).", queue_id, queueinfo->stime, queueinfo->collectdelay, tm);
+		debug(3, "(%i, ...): too early (%lu + %lu > %lu).", queue_id, queueinfo->stime, queueinfo->collectdelay, tm);
 		return 0;
 	}
 	queueinfo->stime = 0;
@@ -2661,7 +3920,7 @@ int sync_idle_dosync_collectedevents_commitpart(struct dosync_arg *dosync_arg_p)
 		debug(3, "%s [%s] (%p) -> %s [%s]", ctx_p->watchdir, ctx_p->watchdirwslash, ctx_p->watchdirwslash, 
 								ctx_p->destdir?ctx_p->destdir:"", ctx_p->destdirwslash?ctx_p->destdirwslash:"");
 
-		if (ctx_p->flags[MODE] == MODE_SO) {
+		if (ISAPIMODE(ctx_p)) {
 			api_eventinfo_t *ei = dosync_arg_p->api_ei;
 			return so_call_sync(ctx_p, indexes_p, dosync_arg_p->evcount, ei);
 		}
@@ -2681,6 +3940,15 @@ int sync_idle_dosync_collectedevents_commitpart(struct dosync_arg *dosync_arg_p)
 		if (ctx_p->synchandler_argf & SHFL_EXCLUDE_LIST_PATH)
 			callback_arg_p->excfpath = strdup(dosync_arg_p->excf_path);
 
+		if (ctx_p->synchandler_argf & SHFL_FAILED_LIST_PATH) {
+			int rc;
+			if ((rc=sync_idle_dosync_collectedevents_uniqfname(ctx_p, dosync_arg_p->failf_path, "failedlist"))) {
+				free(callback_arg_p);
+				return rc;
+			}
+			callback_arg_p->failfpath = strdup(dosync_arg_p->failf_path);
+		}
+
 		{
 			int rc;
 			dosync_arg_p->list_type_str =
@@ -2772,8 +4040,8 @@ void sync_idle_dosync_collectedevents_listpush(gpointer fpath_gp, gpointer evinf
 			evinfo->objtype_old, evinfo->objtype_new
 		);
 
-	// so-module case:
-	if (ctx_p->flags[MODE] == MODE_SO) {
+	// so-module and co-process case:
+	if (ISAPIMODE(ctx_p)) {
 		api_eventinfo_t *ei = &(*api_ei_p)[(*api_ei_count_p)++];
 		ei->evmask      = evinfo->evmask;
 		ei->flags       = evinfo->flags;
@@ -2855,8 +4123,8 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 #endif
 
 	// Setting the time to sync not before it:
-	ctx_p->synctime = time(NULL) + ctx_p->syncdelay;
-	debug(3, "Next sync will be not before: %u", ctx_p->synctime);
+	ctx_p->synctime = clock_monotonic_ms() + ctx_p->syncdelay;
+	debug(3, "Next sync will be not before: %lu", ctx_p->synctime);
 
 	int queue_id=0;
 	while (queue_id < QUEUE_MAX) {
@@ -2886,7 +4154,7 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 		return 0;
 	}
 
-	if (ctx_p->flags[MODE] == MODE_SO) {
+	if (ISAPIMODE(ctx_p)) {
 		//dosync_arg.evcount = g_hash_table_size(indexes_p->fpath2ei_ht);
 		debug(3, "There's %i events. Processing.", dosync_arg.evcount);
 		dosync_arg.api_ei = (api_eventinfo_t *)xmalloc(dosync_arg.evcount * sizeof(*dosync_arg.api_ei));
@@ -2894,8 +4162,8 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 
 	{
 		int ret;
-		if ((ctx_p->listoutdir != NULL) || (ctx_p->flags[MODE] == MODE_SO)) {
-			if (!(ctx_p->flags[MODE]==MODE_SO)) {
+		if ((ctx_p->listoutdir != NULL) || ISAPIMODE(ctx_p)) {
+			if (!ISAPIMODE(ctx_p)) {
 				*(dosync_arg.excf_path) = 0x00;
 				if (isrsyncpreferexclude) {
 					if ((ret=sync_idle_dosync_collectedevents_listcreate(&dosync_arg, "exclist"))) {
@@ -2923,7 +4191,7 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 		}
 
 
-		if ((ctx_p->listoutdir != NULL) || (ctx_p->flags[MODE] == MODE_SO) || (ctx_p->synchandler_argf & SHFL_INCLUDE_LIST)) {
+		if ((ctx_p->listoutdir != NULL) || ISAPIMODE(ctx_p) || (ctx_p->synchandler_argf & SHFL_INCLUDE_LIST)) {
 
 #ifdef PARANOID
 			g_hash_table_remove_all(indexes_p->out_lines_aggr_ht);
@@ -2977,6 +4245,11 @@ int sync_idle(ctx_t *ctx_p, indexes_t *indexes_p) {
 
 	// Checking if we can sync
 
+	if (thread_concurrency_isheld(ctx_p)) {
+		debug(2, "The limit of concurrent syncs is reached. Holding the events.");
+		return 0;
+	}
+
 	if(ctx_p->flags[STANDBYFILE]) {
 		struct stat st;
 		if(!stat(ctx_p->standbyfile, &st)) {
@@ -3008,8 +4281,8 @@ int sync_idle(ctx_t *ctx_p, indexes_t *indexes_p) {
 
 int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 	static struct timeval tv;
-	time_t tm = time(NULL);
-	long delay = ((unsigned long)~0 >> 1);
+	uint64_t tm = clock_monotonic_ms();
+	long delay = ((unsigned long)~0 >> 1);	// in milliseconds
 
 	threadsinfo_t *threadsinfo_p = thread_info();
 
@@ -3017,7 +4290,8 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 	pthread_cond_broadcast(&threadsinfo_p->cond[PTHREAD_MUTEX_STATE]);
 	pthread_mutex_unlock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE]);
 
-	long queue_id = 0;
+	// Only an event or a finished sync can wake up while the syncs are held
+	long queue_id = thread_concurrency_isheld(ctx_p) ? QUEUE_MAX : 0;
 	while (queue_id < QUEUE_MAX) {
 		queueinfo_t *queueinfo = &ctx_p->_queues[queue_id++];
 
@@ -3029,15 +4303,15 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 			return 0;
 		}
 
-		int qdelay = queueinfo->stime + queueinfo->collectdelay - tm;
-		debug(3, "queue #%i: %i %i %i -> %i", queue_id-1, queueinfo->stime, queueinfo->collectdelay, tm, qdelay);
+		long qdelay = (long)(queueinfo->stime + queueinfo->collectdelay - tm);
+		debug(3, "queue #%i: %lu %lu %lu -> %li", queue_id-1, queueinfo->stime, queueinfo->collectdelay, tm, qdelay);
 		if (qdelay < -(long)ctx_p->syncdelay)
 			qdelay = -(long)ctx_p->syncdelay;
 
 		delay = MIN(delay, qdelay);
 	}
 
-	long synctime_delay = ((long)ctx_p->synctime) - ((long)tm);
+	long synctime_delay = (long)(ctx_p->synctime - tm);
 	synctime_delay = synctime_delay > 0 ? synctime_delay : 0;
 
 	debug(3, "delay = MAX(%li, %li)", delay, synctime_delay);
@@ -3048,8 +4322,9 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 		time_t _thread_nextexpiretime = thread_nextexpiretime();
 		debug(3, "thread_nextexpiretime == %i", _thread_nextexpiretime);
 		if(_thread_nextexpiretime) {
-			long thread_expiredelay = (long)thread_nextexpiretime() - (long)tm + 1; // +1 is to make "tm>threadinfo_p->expiretime" after select() definitely TRUE
-			debug(3, "thread_expiredelay == %i", thread_expiredelay);
+			// expiretime is in seconds of wall-clock time (see "synctimeout")
+			long thread_expiredelay = ((long)_thread_nextexpiretime - (long)time(NULL) + 1) * 1000; // +1 is to make "tm>threadinfo_p->expiretime" after select() definitely TRUE
+			debug(3, "thread_expiredelay == %li", thread_expiredelay);
 			thread_expiredelay = thread_expiredelay > 0 ? thread_expiredelay : 0;
 			debug(3, "delay = MIN(%li, %li)", delay, thread_expiredelay);
 			delay = MIN(delay, thread_expiredelay);
@@ -3063,12 +4338,10 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 		tv.tv_sec  = 0;
 		tv.tv_usec = 0;
 	} else {
-		debug(3, "sleeping for %li second(s).", SLEEP_SECONDS);
-		sleep(SLEEP_SECONDS);
-		delay = ((long)delay)>SLEEP_SECONDS ? delay-SLEEP_SECONDS : 0;
-
-		tv.tv_sec  = delay;
-		tv.tv_usec = 0;
+		// Waking up exactly on the nearest deadline (or on a new event)
+		debug(3, "waiting for %li ms.", delay);
+		tv.tv_sec  =  delay / 1000;
+		tv.tv_usec = (delay % 1000) * 1000;
 	}
 
 	debug(4, "pthread_mutex_lock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE])");
@@ -3464,7 +4737,7 @@ int sync_dump_thread(threadinfo_t *threadinfo_p, void *_arg) {
 	}
 
 	arg->data = DUMP_LTYPE_EVINFO;
-	g_hash_table_foreach(threadinfo_p->fpath2ei_ht, sync_dump_liststep, arg);
+	fpathtree_foreach(threadinfo_p->fpath2ei_tree, "", sync_dump_liststep, arg);
 
 	close(arg->fd_out);
 
@@ -3681,6 +4954,37 @@ int sync_term(int exitcode) {
 }
 
 
+/* Checks if the first full initial sync walks the whole tree by itself, so it can mark it meanwhile */
+static int sync_mark_deferrable(ctx_t *ctx_p) {
+	if (ctx_p->flags[SKIPINITSYNC])
+		return 0;
+
+	switch (ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:	// nothing to walk, see sync_mark_walk()
+			return 0;
+#endif
+		default:
+			break;
+	}
+
+#ifdef CLUSTER_SUPPORT
+	if (ctx_p->cluster_iface)
+		return 0;
+#endif
+
+	switch (ctx_p->flags[MODE]) {
+		case MODE_RSYNCDIRECT:
+		case MODE_RSYNCSHELL:
+		case MODE_RSYNCSO:
+			break;
+		default:
+			return !ctx_p->flags[HAVERECURSIVESYNC];
+	}
+
+	return 1;
+}
+
 int sync_run(ctx_t *ctx_p) {
 	int ret;
 	sighandler_arg_t sighandler_arg = {0};
@@ -3737,12 +5041,11 @@ int sync_run(ctx_t *ctx_p) {
 
 		ctx_p->indexes_p	  = &indexes;
 
-		indexes.wd2fpath_ht	  = g_hash_table_new_full(g_direct_hash, g_direct_equal, 0,    0);
-		indexes.fpath2wd_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, 0);
+		indexes.wd_tree		  = fpathtree_new(NULL);
 		indexes.fpath2ei_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, free);
 		indexes.exc_fpath_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, 0);
 		indexes.out_lines_aggr_ht = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, 0);
-		indexes.fileinfo_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, free);
+		indexes.fileinfo_tree	  = fpathtree_new(free);
 		i=0;
 		while (i<QUEUE_MAX) {
 			switch (i) {
@@ -3832,12 +5135,34 @@ int sync_run(ctx_t *ctx_p) {
 			}
 	}
 
+	if (ctx_p->flags[MODE] == MODE_COPROCESS) {
+		ctx_p->handler_funct.init   = coprocess_init;
+		ctx_p->handler_funct.sync   = coprocess_sync;
+		ctx_p->handler_funct.deinit = coprocess_deinit;
+
+		if ((ret = ctx_p->handler_funct.init(ctx_p, &indexes))) {
+			error("Cannot init the sync-handler co-process.");
+			return ret;
+		}
+	}
+
 	// Initializing rand-generator if it's required
 
 	if (ctx_p->listoutdir)
 		srand(time(NULL));
 
 	if (!ctx_p->flags[ONLYINITSYNC]) {
+		// If rules don't distinguish non-directory object types, the monitor may
+		// postpone lstat() of events till the prequeue is unloaded
+		ctx_p->stat_deferred =
+			(ctx_p->flags[MODE] != MODE_SIMPLE) &&
+			!(ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT) &&
+			!rules_needftype(ctx_p->rules);
+		debug(9, "stat_deferred == %i", ctx_p->stat_deferred);
+
+		if ((ret=sync_prequeue_stat_init(ctx_p)))
+			return ret;
+
 		debug(9, "Initializing FS monitor kernel subsystem in this userspace application");
 		if (sync_notify_init(ctx_p))
 			return errno;
@@ -3846,9 +5171,24 @@ int sync_run(ctx_t *ctx_p) {
 	if ((ret=privileged_init(ctx_p)))
 		return ret;
 
+#ifdef CAPABILITIES_SUPPORT
+	if (ctx_p->flags[PRIVILEGED_BENCHMARK]) {
+		ret  = privileged_benchmark(ctx_p, ctx_p->flags[PRIVILEGED_BENCHMARK]);
+		ret |= privileged_deinit(ctx_p);
+		return ret;
+	}
+#endif
+
 	{
 		// Preparing monitor subsystem context function pointers
 		switch (ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+			case NE_FANOTIFY:
+				ctx_p->notifyenginefunct.add_watch_dir = fanotify_add_watch_dir;
+				ctx_p->notifyenginefunct.wait          = fanotify_wait;
+				ctx_p->notifyenginefunct.handle        = fanotify_handle;
+				break;
+#endif
 #ifdef INOTIFY_SUPPORT
 			case NE_INOTIFY:
 				ctx_p->notifyenginefunct.add_watch_dir = inotify_add_watch_dir;
@@ -3912,10 +5252,16 @@ int sync_run(ctx_t *ctx_p) {
 #endif
 
 	if (!ctx_p->flags[ONLYINITSYNC]) {
-		// Marking file tree for FS monitor
-		debug(30, "Running recursive notify marking function");
-		ret = sync_mark_walk(ctx_p, ctx_p->watchdir, &indexes);
-		if (ret) return ret;
+		if (sync_mark_deferrable(ctx_p)) {
+			// Marking file tree for FS monitor while walking it for the initial sync
+			debug(3, "The notify marking is deferred to the initial sync");
+			sync_mark_deferred = 1;
+		} else {
+			// Marking file tree for FS monitor
+			debug(30, "Running recursive notify marking function");
+			ret = sync_mark_walk(ctx_p, ctx_p->watchdir, &indexes);
+			if (ret) return ret;
+		}
 	}
 
 	// "Infinite" loop of processling the events
@@ -3940,8 +5286,15 @@ int sync_run(ctx_t *ctx_p) {
 
 	thread_cleanup(ctx_p);
 
+	sync_prequeue_stat_deinit();
+
 	debug(2, "Deinitializing the FS monitor subsystem");
 	switch (ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
+			fanotify_deinit(ctx_p);
+			break;
+#endif
 #ifdef INOTIFY_SUPPORT
 		case NE_INOTIFY:
 			inotify_deinit(ctx_p);
@@ -3986,6 +5339,9 @@ int sync_run(ctx_t *ctx_p) {
 		}
 	}
 
+	if (ctx_p->flags[MODE] == MODE_COPROCESS)
+		ctx_p->handler_funct.deinit();
+
 	// Cleaning up run-time routines
 	rsync_escape_cleanup();
 
@@ -3994,12 +5350,13 @@ int sync_run(ctx_t *ctx_p) {
 		int i;
 
 		debug(3, "Closing hash tables");
-		g_hash_table_destroy(indexes.wd2fpath_ht);
-		g_hash_table_destroy(indexes.fpath2wd_ht);
+		fpathtree_free(indexes.wd_tree);
+		free(indexes.wd2node);
+		free(indexes.wd2fpath_buf);
 		g_hash_table_destroy(indexes.fpath2ei_ht);
 		g_hash_table_destroy(indexes.exc_fpath_ht);
 		g_hash_table_destroy(indexes.out_lines_aggr_ht);
-		g_hash_table_destroy(indexes.fileinfo_ht);
+		fpathtree_free(indexes.fileinfo_tree);
 		i = 0;
 		while (i<QUEUE_MAX) {
 			switch (i) {
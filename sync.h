@@ -23,6 +23,7 @@
 struct thread_callbackfunct_arg {
 	char *excfpath;
 	char *incfpath;
+	char *failfpath;
 };
 typedef struct thread_callbackfunct_arg thread_callbackfunct_arg_t;
 
@@ -42,13 +43,23 @@ struct threadinfo {
 	time_t				  expiretime;
 	int				  child_pid;
 
-	GHashTable			 *fpath2ei_ht;		// file path -> event information
+	struct fpathtree		 *fpath2ei_tree;	// file path -> event information
 
 	int				  try_n;
+	char				  requeue_onfail;	// a failed sync may be put to QUEUE_RETRY (see sync_retry())
+	char				  requeue;		// ... and it should be
+	GHashTable			 *failed_ht;		// the part of "fpath2ei_tree" to be requeued (NULL if all)
 
 	// for so-synchandler
 	int				  n;
 	api_eventinfo_t			 *ei;
+
+	int				(*funct)(struct threadinfo *);	// the task to be run by a worker
+	struct threadinfo		 *queue_next;
+
+	int				  evcount;	// events in the batch
+	uint64_t			  pickuptime;	// CLOCK_MONOTONIC, in milliseconds
+	uint64_t			  runtime;	// in milliseconds
 };
 typedef struct threadinfo threadinfo_t;
 
@@ -58,9 +69,23 @@ struct threadsinfo {
 	char			  mutex_init;
 	int			  allocated;
 	int			  used;
-	threadinfo_t 		 *threads;
-	threadinfo_t 		**threadsstack;	// stack of threadinfo_t to be used on thread_new()
-	int			  stacklen;
+	threadinfo_t 		**threads;
+
+	// the pool of sync workers
+	pthread_t		 *workers;
+	int			  workers_count;
+	int			  workers_idle;
+	char			  workers_stop;
+	threadinfo_t		 *queue_head;	// tasks not picked up by a worker yet
+	threadinfo_t		 *queue_tail;
+	int			  done_fd;	// eventfd: a task is finished (or -1)
+	char			  done_fd_watched;
+
+	// the adaptive limit of syncs in flight (see thread_concurrency_update())
+	int			  concurrency_limit;
+	int			  concurrency_succeeded;	// syncs succeeded in a row since the last change
+	uint64_t		  concurrency_decreasetime;	// CLOCK_MONOTONIC, in milliseconds
+	uint64_t		  runtime_avg;			// per event, in microseconds
 };
 typedef struct threadsinfo threadsinfo_t;
 
@@ -71,6 +96,8 @@ extern int sync_term(int exitcode);
 extern int threads_foreach(int (*funct)(threadinfo_t *, void *), state_t state, void *arg);
 extern threadsinfo_t *thread_info();
 extern time_t thread_nextexpiretime();
+extern int thread_done_fd_watch();
+extern int thread_concurrency_get(struct ctx *ctx_p, int *running_p, int *queued_p, int *limit_p);
 extern int sync_prequeue_loadmark
 	(
 		int fsmon_d,
@@ -97,6 +124,9 @@ extern int sync_prequeue_loadmark
 		struct eventinfo *evinfo
 	);
 extern int sync_prequeue_unload(struct ctx *ctx_p, struct indexes *indexes_p);
+extern int sync_rescan(struct ctx *ctx_p, struct indexes *indexes_p, time_t since);
 extern const char *sync_parameter_get(const char *variable_name, void *_dosync_arg_p);
+extern char **sync_customargv(struct ctx *ctx_p, struct dosync_arg *dosync_arg_p, struct synchandler_args *args_p);
+extern void argv_free(char **argv);
 extern pthread_t pthread_sighandler;
 
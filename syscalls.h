@@ -19,6 +19,21 @@
 
 extern int pivot_root(const char *new_root, const char *old_root);
 
+#ifdef __linux__
+# include <unistd.h>			// syscall()
+# include <sys/syscall.h>		// SYS_futex
+# include <linux/futex.h>		// FUTEX_WAIT
+# include <time.h>			// struct timespec
+
+// Not process-private: works on the shared memory between the processes
+static inline long futex_timed(volatile int *uaddr, int op, int val, const struct timespec *timeout) {
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+static inline long futex(volatile int *uaddr, int op, int val) {
+	return futex_timed(uaddr, op, val, NULL);
+}
+#endif
+
 static inline ssize_t read_inf(int fd, void *buf, size_t count) {
 	ssize_t ret;
 
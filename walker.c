@@ -0,0 +1,648 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A parallel directory walker. Every thread owns a deque of directories to
+ * read: it takes the last pushed one (depth-first, keeps the deque short)
+ * while idle threads steal the oldest ones (usually the biggest subtrees).
+ *
+ * Directories are kept as paths (not as descriptors) to not run out of
+ * RLIMIT_NOFILE on wide trees; the only descriptor a thread holds is the
+ * directory being read.
+ *
+ * Entries accepted by the filter function are passed to the calling thread
+ * in per-directory batches. Subdirectories found are attached to the batch
+ * and are pushed to the deque only after the batch is committed, so a
+ * directory is always committed before it's read (e.g. a watch is set before
+ * the directory is listed).
+ */
+
+#include "common.h"
+
+#ifdef __linux__
+#	include <sys/syscall.h>
+#endif
+
+#include "error.h"
+#include "malloc.h"
+#include "privileged.h"
+#include "walker.h"
+
+struct walker_dir {
+	char	*path;
+	size_t	 path_len;
+	short	 level;
+	int	 walk_state;
+};
+
+struct walker_deque {
+	pthread_mutex_t		 mutex;
+	struct walker_dir	*dirs;
+	size_t			 head;		/* stealing side */
+	size_t			 tail;		/* owner side */
+	size_t			 size;
+};
+
+struct walker_batch {
+	struct walker_batch	*next;
+	walker_entry_t		*entries;
+	int			 count;
+	int			 size;
+	struct walker_dir	*subdirs;	/* to be pushed after the commit */
+	int			 subdirs_count;
+	int			 subdirs_size;
+	int			 thread_num;
+};
+
+struct walker;
+struct walker_thread {
+	pthread_t		 pthread;
+	int			 num;
+	struct walker		*walker_p;
+	struct walker_deque	 deque;
+	char			*buf;
+	unsigned long		 steals;
+	unsigned long		 dirs;
+	unsigned long		 entries;
+};
+
+struct walker {
+	int			 flags;
+	size_t			 path_rel_off;
+	dev_t			 st_dev;
+	walker_filter_funct_t	 filter_funct;
+	void			*arg;
+
+	int			 threads_count;
+	struct walker_thread	*threads;
+
+	pthread_mutex_t		 mutex;
+	pthread_cond_t		 work_cond;	/* new directories are pushed or the walk is finished */
+	pthread_cond_t		 results_cond;	/* a batch is queued or the walk is finished */
+	pthread_cond_t		 space_cond;	/* a batch is dequeued */
+	long			 pending;	/* directories found but not read yet */
+	unsigned long		 pushes;
+	int			 idle;
+	int			 error;
+	volatile int		 stop;
+
+	struct walker_batch	*results_head;
+	struct walker_batch	*results_tail;
+	int			 results_count;
+};
+
+static inline const char *walker_path_rel(struct walker *walker_p, const char *path, size_t path_len) {
+	return (path_len >= walker_p->path_rel_off) ? &path[walker_p->path_rel_off] : "";
+}
+
+static void walker_deque_push(struct walker_deque *deque_p, struct walker_dir *dir_p) {
+	pthread_mutex_lock(&deque_p->mutex);
+	if (deque_p->tail >= deque_p->size) {
+		if (deque_p->head) {
+			memmove(deque_p->dirs, &deque_p->dirs[deque_p->head], (deque_p->tail - deque_p->head) * sizeof(*deque_p->dirs));
+			deque_p->tail -= deque_p->head;
+			deque_p->head  = 0;
+		}
+		if (deque_p->tail >= deque_p->size) {
+			deque_p->size  = deque_p->size ? deque_p->size << 1 : WALKER_DEQUE_SIZE;
+			deque_p->dirs  = xrealloc(deque_p->dirs, deque_p->size * sizeof(*deque_p->dirs));
+		}
+	}
+	deque_p->dirs[deque_p->tail++] = *dir_p;
+	pthread_mutex_unlock(&deque_p->mutex);
+	return;
+}
+
+static int walker_deque_pop(struct walker_deque *deque_p, struct walker_dir *dir_p) {
+	int rc = 0;
+	pthread_mutex_lock(&deque_p->mutex);
+	if (deque_p->tail > deque_p->head) {
+		*dir_p = deque_p->dirs[--deque_p->tail];
+		if (deque_p->tail == deque_p->head)
+			deque_p->tail = deque_p->head = 0;
+		rc = 1;
+	}
+	pthread_mutex_unlock(&deque_p->mutex);
+	return rc;
+}
+
+static int walker_deque_steal(struct walker_deque *deque_p, struct walker_dir *dir_p) {
+	int rc = 0;
+	pthread_mutex_lock(&deque_p->mutex);
+	if (deque_p->tail > deque_p->head) {
+		*dir_p = deque_p->dirs[deque_p->head++];
+		if (deque_p->tail == deque_p->head)
+			deque_p->tail = deque_p->head = 0;
+		rc = 1;
+	}
+	pthread_mutex_unlock(&deque_p->mutex);
+	return rc;
+}
+
+static int walker_steal(struct walker_thread *thread_p, struct walker_dir *dir_p) {
+	struct walker *walker_p = thread_p->walker_p;
+	int i = 1;
+
+	while (i < walker_p->threads_count) {
+		struct walker_thread *victim_p = &walker_p->threads[(thread_p->num + i) % walker_p->threads_count];
+		if (walker_deque_steal(&victim_p->deque, dir_p)) {
+			thread_p->steals++;
+			return 1;
+		}
+		i++;
+	}
+
+	return 0;
+}
+
+static void walker_seterror(struct walker *walker_p, int error) {
+	pthread_mutex_lock(&walker_p->mutex);
+	if (!walker_p->error)
+		walker_p->error = error;
+	walker_p->stop = 1;
+	pthread_cond_broadcast(&walker_p->work_cond);
+	pthread_cond_broadcast(&walker_p->results_cond);
+	pthread_cond_broadcast(&walker_p->space_cond);
+	pthread_mutex_unlock(&walker_p->mutex);
+	return;
+}
+
+static void walker_batch_free(struct walker_batch *batch_p) {
+	int i;
+
+	i = 0;
+	while (i < batch_p->count)
+		free(batch_p->entries[i++].path);
+	i = 0;
+	while (i < batch_p->subdirs_count)
+		free(batch_p->subdirs[i++].path);
+
+	free(batch_p->entries);
+	free(batch_p->subdirs);
+	free(batch_p);
+	return;
+}
+
+static inline struct walker_batch *walker_batch_get(struct walker_batch **batch_pp, int thread_num) {
+	if (*batch_pp == NULL) {
+		*batch_pp = xcalloc(1, sizeof(**batch_pp));
+		(*batch_pp)->thread_num = thread_num;
+	}
+
+	return *batch_pp;
+}
+
+static walker_entry_t *walker_batch_add(struct walker_batch *batch_p) {
+	if (batch_p->count >= batch_p->size) {
+		batch_p->size    = batch_p->size ? batch_p->size << 1 : WALKER_BATCH_SIZE;
+		batch_p->entries = xrealloc(batch_p->entries, batch_p->size * sizeof(*batch_p->entries));
+	}
+
+	return &batch_p->entries[batch_p->count++];
+}
+
+static struct walker_dir *walker_batch_addsubdir(struct walker_batch *batch_p) {
+	if (batch_p->subdirs_count >= batch_p->subdirs_size) {
+		batch_p->subdirs_size = batch_p->subdirs_size ? batch_p->subdirs_size << 1 : WALKER_DEQUE_SIZE;
+		batch_p->subdirs      = xrealloc(batch_p->subdirs, batch_p->subdirs_size * sizeof(*batch_p->subdirs));
+	}
+
+	return &batch_p->subdirs[batch_p->subdirs_count++];
+}
+
+static void walker_results_put(struct walker *walker_p, struct walker_batch *batch_p) {
+	pthread_mutex_lock(&walker_p->mutex);
+	while (walker_p->results_count >= WALKER_RESULTS_MAX && !walker_p->stop)
+		pthread_cond_wait(&walker_p->space_cond, &walker_p->mutex);
+
+	if (walker_p->stop) {
+		pthread_mutex_unlock(&walker_p->mutex);
+		walker_batch_free(batch_p);
+		return;
+	}
+
+	if (walker_p->results_tail == NULL)
+		walker_p->results_head = batch_p;
+	else
+		walker_p->results_tail->next = batch_p;
+	walker_p->results_tail = batch_p;
+	walker_p->results_count++;
+	// Counting the subdirectories right now, otherwise the threads may finish before they're pushed
+	walker_p->pending += batch_p->subdirs_count;
+
+	pthread_cond_signal(&walker_p->results_cond);
+	pthread_mutex_unlock(&walker_p->mutex);
+	return;
+}
+
+/* Fills path, path_len, path_rel, level and the file type; returns -1 if the entry disappeared */
+static int walker_entry_fill(struct walker *walker_p, walker_entry_t *entry_p, int fd, struct walker_dir *dir_p, const char *name, unsigned char d_type) {
+	size_t name_len = strlen(name);
+	int    slash    = (dir_p->path_len && dir_p->path[dir_p->path_len-1] == '/') ? 0 : 1;
+
+	entry_p->path_len = dir_p->path_len + slash + name_len;
+	entry_p->path     = xmalloc(entry_p->path_len + 1);
+	memcpy(entry_p->path, dir_p->path, dir_p->path_len);
+	if (slash)
+		entry_p->path[dir_p->path_len] = '/';
+	memcpy(&entry_p->path[dir_p->path_len + slash], name, name_len + 1);
+
+	entry_p->path_rel = walker_path_rel(walker_p, entry_p->path, entry_p->path_len);
+	entry_p->level    = dir_p->level + 1;
+	entry_p->perm     = 0;
+	entry_p->walk_state        = 0;
+	entry_p->parent_walk_state = dir_p->walk_state;
+	entry_p->st_size  = 0;
+	entry_p->st_dev   = walker_p->st_dev;
+	entry_p->st_mode  = (d_type == DT_UNKNOWN) ? 0 : DTTOIF(d_type);
+
+	if (
+		(walker_p->flags & WF_STAT)				||
+		d_type == DT_UNKNOWN					||
+		((walker_p->flags & WF_XDEV) && d_type == DT_DIR)
+	) {
+		struct stat st;
+
+		// A directory opened by the privileged thread/process may be not searchable for us
+		if (
+			fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)	&&
+			(errno != EACCES || privileged_lstat(entry_p->path, &st))
+		) {
+			int error = errno;
+			if (error == ENOENT)
+				debug(3, "\"%s\" disappeared", entry_p->path);
+			free(entry_p->path);
+			entry_p->path = NULL;
+			errno = error;
+			return (error == ENOENT) ? -1 : error;
+		}
+
+		entry_p->st_mode = st.st_mode;
+		entry_p->st_size = st.st_size;
+		entry_p->st_dev  = st.st_dev;
+	}
+
+	return 0;
+}
+
+static int walker_readdir(struct walker_thread *thread_p, struct walker_dir *dir_p) {
+	struct walker *walker_p = thread_p->walker_p;
+	struct walker_batch *batch_p = NULL;
+	int rc = 0;
+
+	debug(5, "Reading \"%s\" (depth %i)", dir_p->path, dir_p->level);
+
+	int fd = privileged_opendir(dir_p->path);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			debug(1, "Directory \"%s\" disappeared", dir_p->path);
+			return 0;
+		}
+		error("Cannot open directory \"%s\".", dir_p->path);
+		return errno;
+	}
+
+#ifdef __linux__
+	while (!walker_p->stop) {
+		long nread = syscall(SYS_getdents64, fd, thread_p->buf, WALKER_BUFSIZE);
+		if (nread == -1) {
+			if (errno == ENOENT)
+				break;
+			rc = errno;
+			error("Cannot read directory \"%s\".", dir_p->path);
+			goto l_walker_readdir_end;
+		}
+		if (nread == 0)
+			break;
+
+		long pos = 0;
+		while (pos < nread) {
+			struct {
+				uint64_t	d_ino;
+				int64_t		d_off;
+				unsigned short	d_reclen;
+				unsigned char	d_type;
+				char		d_name[];
+			} *dirent_p = (void *)&thread_p->buf[pos];
+			const char    *d_name = dirent_p->d_name;
+			unsigned char  d_type = dirent_p->d_type;
+			pos += dirent_p->d_reclen;
+#else
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL) {
+		rc = errno;
+		error("Cannot fdopendir() on \"%s\".", dir_p->path);
+		close(fd);
+		return rc;
+	}
+	while (!walker_p->stop) {
+		struct dirent *dirent_p;
+		errno = 0;
+		if ((dirent_p = readdir(dir)) == NULL) {
+			if (errno && errno != ENOENT) {
+				rc = errno;
+				error("Cannot read directory \"%s\".", dir_p->path);
+				goto l_walker_readdir_end;
+			}
+			break;
+		}
+		{
+			const char    *d_name = dirent_p->d_name;
+			unsigned char  d_type = dirent_p->d_type;
+#endif
+			if (d_name[0] == '.' && (d_name[1] == 0 || (d_name[1] == '.' && d_name[2] == 0)))
+				continue;
+
+			walker_entry_t entry;
+			switch (walker_entry_fill(walker_p, &entry, fd, dir_p, d_name, d_type)) {
+				case 0:
+					break;
+				case -1:
+					continue;
+				default:
+					rc = errno;
+					error("Cannot stat \"%s/%s\".", dir_p->path, d_name);
+					goto l_walker_readdir_end;
+			}
+			thread_p->entries++;
+
+			int decision = walker_p->filter_funct(&entry, walker_p->arg);
+
+			if (
+				(decision & WD_DESCEND)			&&
+				S_ISDIR(entry.st_mode)			&&
+				(
+					!(walker_p->flags & WF_XDEV)	||
+					entry.st_dev == walker_p->st_dev
+				)
+			) {
+				struct walker_dir *subdir_p = walker_batch_addsubdir(walker_batch_get(&batch_p, thread_p->num));
+				subdir_p->path       = (decision & WD_REPORT) ? strdup(entry.path) : entry.path;
+				subdir_p->path_len   = entry.path_len;
+				subdir_p->level      = entry.level;
+				subdir_p->walk_state = entry.walk_state;
+				if (!(decision & WD_REPORT))
+					continue;
+			}
+
+			if (decision & WD_REPORT)
+				*walker_batch_add(walker_batch_get(&batch_p, thread_p->num)) = entry;
+			else
+				free(entry.path);
+		}
+	}
+
+	thread_p->dirs++;
+
+	if (batch_p != NULL) {
+		walker_results_put(walker_p, batch_p);
+		batch_p = NULL;
+	}
+
+l_walker_readdir_end:
+	if (batch_p != NULL)
+		walker_batch_free(batch_p);
+#ifdef __linux__
+	close(fd);
+#else
+	closedir(dir);
+#endif
+	return rc;
+}
+
+static void *walker_thread(void *_thread_p) {
+	struct walker_thread *thread_p = _thread_p;
+	struct walker *walker_p = thread_p->walker_p;
+
+	while (1) {
+		struct walker_dir dir;
+
+		pthread_mutex_lock(&walker_p->mutex);
+		unsigned long pushes = walker_p->pushes;
+		pthread_mutex_unlock(&walker_p->mutex);
+
+		if (walker_deque_pop(&thread_p->deque, &dir) || walker_steal(thread_p, &dir)) {
+			int rc = walker_p->stop ? 0 : walker_readdir(thread_p, &dir);
+			free(dir.path);
+
+			if (rc)
+				walker_seterror(walker_p, rc);
+
+			pthread_mutex_lock(&walker_p->mutex);
+			if (--walker_p->pending == 0) {
+				pthread_cond_broadcast(&walker_p->work_cond);
+				pthread_cond_broadcast(&walker_p->results_cond);
+			}
+			pthread_mutex_unlock(&walker_p->mutex);
+			continue;
+		}
+
+		pthread_mutex_lock(&walker_p->mutex);
+		if (walker_p->pending == 0 || walker_p->stop) {
+			pthread_mutex_unlock(&walker_p->mutex);
+			break;
+		}
+		// Nothing to steal, waiting for new directories if there were no pushes since the last try
+		if (walker_p->pushes == pushes) {
+			walker_p->idle++;
+			pthread_cond_wait(&walker_p->work_cond, &walker_p->mutex);
+			walker_p->idle--;
+		}
+		pthread_mutex_unlock(&walker_p->mutex);
+	}
+
+	return NULL;
+}
+
+static int walker_commit(struct walker *walker_p, walker_commit_funct_t commit_funct, void *arg) {
+	while (1) {
+		pthread_mutex_lock(&walker_p->mutex);
+		while (walker_p->results_head == NULL && walker_p->pending && !walker_p->stop)
+			pthread_cond_wait(&walker_p->results_cond, &walker_p->mutex);
+
+		struct walker_batch *batch_p = walker_p->results_head;
+		if (batch_p == NULL || walker_p->stop) {
+			int error = walker_p->error;
+			pthread_mutex_unlock(&walker_p->mutex);
+			return error;
+		}
+		if ((walker_p->results_head = batch_p->next) == NULL)
+			walker_p->results_tail = NULL;
+		walker_p->results_count--;
+		pthread_cond_signal(&walker_p->space_cond);
+		pthread_mutex_unlock(&walker_p->mutex);
+
+		int i = 0;
+		while (i < batch_p->count) {
+			walker_entry_t *entry_p = &batch_p->entries[i++];
+			int rc = commit_funct(entry_p, arg);
+			if (rc) {
+				walker_seterror(walker_p, rc);
+				walker_batch_free(batch_p);
+				return rc;
+			}
+		}
+
+		if (batch_p->subdirs_count) {
+			struct walker_deque *deque_p = &walker_p->threads[batch_p->thread_num].deque;
+
+			i = 0;
+			while (i < batch_p->subdirs_count)
+				walker_deque_push(deque_p, &batch_p->subdirs[i++]);
+			batch_p->subdirs_count = 0;
+
+			pthread_mutex_lock(&walker_p->mutex);
+			walker_p->pushes++;
+			if (walker_p->idle)
+				pthread_cond_broadcast(&walker_p->work_cond);
+			pthread_mutex_unlock(&walker_p->mutex);
+		}
+
+		walker_batch_free(batch_p);
+	}
+
+	return 0;
+}
+
+int walker_walk(const char *dirpath, size_t path_rel_off, int flags, int threads_count, walker_filter_funct_t filter_funct, walker_commit_funct_t commit_funct, void *arg) {
+	struct walker walker = {0}, *walker_p = &walker;
+	struct timespec started_at, finished_at;
+	walker_entry_t root;
+	struct stat st;
+	int rc, i, threads_started = 0;
+	debug(2, "(\"%s\", %zu, 0x%x, %i, ...)", dirpath, path_rel_off, flags, threads_count);
+
+	if (threads_count < 1)
+		threads_count = 1;
+
+	if (privileged_lstat(dirpath, &st)) {
+		error("Cannot lstat(\"%s\").", dirpath);
+		return errno;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started_at);
+
+	walker.flags		= flags;
+	walker.path_rel_off	= path_rel_off;
+	walker.st_dev		= st.st_dev;
+	walker.filter_funct	= filter_funct;
+	walker.arg		= arg;
+
+	root.path_len		= strlen(dirpath);
+	root.path		= strdup(dirpath);
+	root.path_rel		= walker_path_rel(walker_p, root.path, root.path_len);
+	root.st_mode		= st.st_mode;
+	root.st_size		= st.st_size;
+	root.st_dev		= st.st_dev;
+	root.level		= 0;
+	root.perm		= 0;
+	root.walk_state		= 0;
+	root.parent_walk_state	= ~0;
+
+	int decision = filter_funct(&root, arg);
+
+	if (decision & WD_REPORT) {
+		if ((rc = commit_funct(&root, arg))) {
+			free(root.path);
+			return rc;
+		}
+	}
+
+	if (!(decision & WD_DESCEND) || !S_ISDIR(st.st_mode)) {
+		free(root.path);
+		return 0;
+	}
+
+	pthread_mutex_init(&walker.mutex, NULL);
+	pthread_cond_init(&walker.work_cond, NULL);
+	pthread_cond_init(&walker.results_cond, NULL);
+	pthread_cond_init(&walker.space_cond, NULL);
+
+	walker.threads_count	= threads_count;
+	walker.threads		= xcalloc(threads_count, sizeof(*walker.threads));
+
+	i = 0;
+	while (i < threads_count) {
+		struct walker_thread *thread_p = &walker.threads[i];
+		thread_p->num		= i;
+		thread_p->walker_p	= walker_p;
+		thread_p->buf		= xmalloc(WALKER_BUFSIZE);
+		pthread_mutex_init(&thread_p->deque.mutex, NULL);
+		i++;
+	}
+
+	struct walker_dir rootdir = {root.path, root.path_len, 0, root.walk_state};
+	walker_deque_push(&walker.threads[0].deque, &rootdir);
+	walker.pending = 1;
+
+	while (threads_started < threads_count) {
+		if ((rc = pthread_create(&walker.threads[threads_started].pthread, NULL, walker_thread, &walker.threads[threads_started]))) {
+			error("Cannot pthread_create().");
+			walker_seterror(walker_p, rc);
+			break;
+		}
+		threads_started++;
+	}
+
+	rc = threads_started ? walker_commit(walker_p, commit_funct, arg) : walker.error;
+
+	walker_seterror(walker_p, 0);	// waking up everybody to finish
+	i = 0;
+	while (i < threads_started)
+		pthread_join(walker.threads[i++].pthread, NULL);
+
+	unsigned long dirs = 0, entries = 0, steals = 0;
+	i = 0;
+	while (i < threads_count) {
+		struct walker_thread *thread_p = &walker.threads[i++];
+		struct walker_dir dir;
+
+		while (walker_deque_pop(&thread_p->deque, &dir))
+			free(dir.path);
+		free(thread_p->deque.dirs);
+		free(thread_p->buf);
+		pthread_mutex_destroy(&thread_p->deque.mutex);
+
+		dirs	+= thread_p->dirs;
+		entries	+= thread_p->entries;
+		steals	+= thread_p->steals;
+	}
+	free(walker.threads);
+
+	while (walker.results_head != NULL) {
+		struct walker_batch *batch_p = walker.results_head;
+		walker.results_head = batch_p->next;
+		walker_batch_free(batch_p);
+	}
+
+	pthread_cond_destroy(&walker.space_cond);
+	pthread_cond_destroy(&walker.results_cond);
+	pthread_cond_destroy(&walker.work_cond);
+	pthread_mutex_destroy(&walker.mutex);
+
+	// Only the whole tree is walked by threads, so it's reported once per (re)scan
+	clock_gettime(CLOCK_MONOTONIC, &finished_at);
+	long elapsed_ms = (finished_at.tv_sec - started_at.tv_sec) * 1000 + (finished_at.tv_nsec - started_at.tv_nsec) / 1000000;
+	info("Walked \"%s\": %lu directories, %lu entries in %li ms (%lu entries/s) with %i threads, %lu steals.",
+		dirpath, dirs, entries, elapsed_ms, entries * 1000 / (elapsed_ms ? elapsed_ms : 1), threads_count, steals);
+
+	errno = rc;
+	return rc;
+}
+
@@ -0,0 +1,58 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLSYNC_WALKER_H
+#define __CLSYNC_WALKER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+enum walker_flags {
+	WF_STAT		= 0x01,		/* stat() every entry, otherwise only the file type is known (if the filesystem reports it) */
+	WF_XDEV		= 0x02,		/* don't descend into directories on other devices */
+};
+
+enum walker_decision {
+	WD_REPORT	= 0x01,		/* pass the entry to the commit function */
+	WD_DESCEND	= 0x02,		/* read the directory */
+};
+
+struct walker_entry {
+	char		*path;
+	size_t		 path_len;
+	const char	*path_rel;
+	mode_t		 st_mode;
+	off_t		 st_size;
+	dev_t		 st_dev;
+	short		 level;
+	int		 perm;		/* for the filter function to pass a result to the commit function */
+	int		 walk_state;	/* is set by the filter function, is passed to the directory content */
+	int		 parent_walk_state; /* "walk_state" of the parent directory, ~0 for the root */
+};
+typedef struct walker_entry walker_entry_t;
+
+/* Is called from the walker threads, returns a set of "enum walker_decision" */
+typedef int (*walker_filter_funct_t)(walker_entry_t *entry_p, void *arg);
+/* Is called from the calling thread, a directory is always committed before it's read */
+typedef int (*walker_commit_funct_t)(walker_entry_t *entry_p, void *arg);
+
+extern int walker_walk(const char *dirpath, size_t path_rel_off, int flags, int threads_count, walker_filter_funct_t filter_funct, walker_commit_funct_t commit_funct, void *arg);
+
+#endif
+